@@ -0,0 +1,104 @@
+#include <vector>
+#include <future>
+#include <chrono>
+#include <gtest/gtest.h>
+
+#include <Utilities/FairQueue.h>
+
+using namespace util;
+
+TEST(FairQueue, FifoWithoutKey) {
+	fair_queue<int> queue;
+
+	for (int i = 0; i < 5; i++)
+		queue.enqueue(i + 0);
+
+	for (int i = 0; i < 5; i++)
+		EXPECT_EQ(i, queue.dequeue());
+}
+
+TEST(FairQueue, RoundRobinAcrossFlows) {
+	fair_queue<int> queue([](const int& item) { return static_cast<uint64>(item / 100); });
+
+	for (int i = 0; i < 50; i++)
+		queue.enqueue(i + 0);
+
+	queue.enqueue(100);
+	queue.enqueue(101);
+
+	EXPECT_EQ(0, queue.dequeue());
+	EXPECT_EQ(100, queue.dequeue());
+	EXPECT_EQ(1, queue.dequeue());
+	EXPECT_EQ(101, queue.dequeue());
+	EXPECT_EQ(2, queue.dequeue());
+}
+
+TEST(FairQueue, WeightedFlows) {
+	fair_queue<int> queue([](const int& item) { return static_cast<uint64>(item / 100); }, [](uint64 key) { return key == 1 ? word(3) : word(1); });
+
+	for (int i = 0; i < 10; i++) {
+		queue.enqueue(i + 0);
+		queue.enqueue(i + 100);
+	}
+
+	std::vector<int> order;
+	for (int i = 0; i < 8; i++)
+		order.push_back(queue.dequeue());
+
+	EXPECT_EQ((std::vector<int>{ 0, 100, 101, 102, 1, 103, 104, 105 }), order);
+}
+
+TEST(FairQueue, DrainedFlowsRejoinAtTheBack) {
+	fair_queue<int> queue([](const int& item) { return static_cast<uint64>(item / 100); });
+
+	queue.enqueue(0);
+	EXPECT_EQ(0, queue.dequeue());
+
+	//Emptied flows start a fresh round behind the flows still waiting.
+	queue.enqueue(100);
+	queue.enqueue(1);
+	queue.enqueue(101);
+
+	EXPECT_EQ(100, queue.dequeue());
+	EXPECT_EQ(1, queue.dequeue());
+	EXPECT_EQ(101, queue.dequeue());
+
+	fair_queue<int> unkeyed;
+
+	for (int round = 0; round < 3; round++) {
+		unkeyed.enqueue(round * 2 + 0);
+		unkeyed.enqueue(round * 2 + 1);
+
+		EXPECT_EQ(round * 2, unkeyed.dequeue());
+		EXPECT_EQ(round * 2 + 1, unkeyed.dequeue());
+	}
+}
+
+TEST(FairQueue, KeyFunctionRunsWithoutTheLock) {
+	std::promise<void> entered, release;
+	auto released = release.get_future().share();
+
+	fair_queue<int> queue([&](const int& item) {
+		if (item == 1) {
+			entered.set_value();
+			released.wait();
+		}
+
+		return static_cast<uint64>(item);
+	});
+
+	queue.enqueue(0);
+
+	auto keying = std::async(std::launch::async, [&queue]() { queue.enqueue(1); });
+	entered.get_future().wait();
+
+	//Would wait for the key function forever if it held the lock.
+	auto dequeued = std::async(std::launch::async, [&queue]() { return queue.dequeue(); });
+	ASSERT_EQ(std::future_status::ready, dequeued.wait_for(std::chrono::seconds(5)));
+	EXPECT_EQ(0, dequeued.get());
+
+	release.set_value();
+	keying.get();
+
+	EXPECT_EQ(1, queue.dequeue());
+}
@@ -0,0 +1,174 @@
+#include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <stdexcept>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/RequestServer.h>
+#include <Utilities/Net/HTTPConnection.h>
+
+#ifdef POSIX
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+using namespace util;
+using namespace util::net;
+
+//Serves one end of a socket pair over HTTP and returns the other.
+static net::socket connect_http(request_server& server) {
+	int pair[2];
+	EXPECT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	server.adopt(make_unique<http_connection>(net::socket(pair[0])));
+
+	return net::socket(pair[1]);
+}
+
+static void send_text(net::socket& peer, const std::string& text) {
+	ASSERT_EQ(text.size(), peer.write(reinterpret_cast<const uint8*>(text.data()), static_cast<word>(text.size())));
+}
+
+//Reads everything until the server closes the connection.
+static std::string receive_all(net::socket& peer) {
+	std::string received;
+	uint8 buffer[4096];
+
+	while (peer.data_available(5000000)) {
+		auto count = peer.read(buffer, sizeof(buffer));
+		if (count == 0)
+			break;
+
+		received.append(reinterpret_cast<const char*>(buffer), count);
+	}
+
+	return received;
+}
+
+//Answers with the target followed by the body.
+static request_server::request_result echo(tcp_connection&, word, uint8, uint8, data_stream& payload, data_stream& response) {
+	http_connection::request request;
+	if (!request.parse(payload))
+		return request_server::request_result::no_response;
+
+	http_connection::write_response(response, 200);
+	response.write(reinterpret_cast<const uint8*>(request.target.data), request.target.length);
+	response.write(request.body, request.body_length);
+
+	return request_server::request_result::success;
+}
+
+TEST(HTTPConnection, PipelinedResponsesKeepRequestOrder) {
+	request_server server(std::vector<endpoint>(), 4, 0xFFFF);
+
+	server.on_request += [](tcp_connection& connection, word worker, uint8 category, uint8 method, data_stream& payload, data_stream& response) {
+		//The first request finishes last, so its response must hold back the others.
+		if (payload.size() > 0 && std::string(reinterpret_cast<const char*>(payload.data()), payload.size()).find("/slow") != std::string::npos)
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		return echo(connection, worker, category, method, payload, response);
+	};
+
+	server.start();
+
+	auto peer = connect_http(server);
+	send_text(peer, "GET /slow HTTP/1.1\r\n\r\nGET /fast HTTP/1.1\r\n\r\nHEAD /head HTTP/1.1\r\n\r\nGET /last HTTP/1.1\r\nConnection: close\r\n\r\n");
+
+	EXPECT_EQ(
+		"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n/slow"
+		"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n/fast"
+		"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n"
+		"HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: close\r\n\r\n/last", receive_all(peer));
+}
+
+TEST(HTTPConnection, ChunkedBodiesAreJoined) {
+	request_server server(std::vector<endpoint>(), 1, 0xFFFF);
+	server.on_request += &echo;
+	server.start();
+
+	auto peer = connect_http(server);
+
+	//Split inside a chunk so the body is parsed again once the rest arrives.
+	send_text(peer, "POST /echo HTTP/1.1\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n5\r\nhel");
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	send_text(peer, "lo\r\n6;name=value\r\n world\r\n0\r\nTrailer: ignored\r\n\r\n");
+
+	EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Length: 16\r\nConnection: close\r\n\r\n/echohello world", receive_all(peer));
+}
+
+TEST(HTTPConnection, MalformedRequestsAreRefused) {
+	request_server server(std::vector<endpoint>(), 1, 0xFFFF);
+	std::atomic<word> handled(0);
+
+	server.on_request += [&handled](tcp_connection&, word, uint8, uint8, data_stream&, data_stream& response) {
+		handled++;
+		http_connection::write_response(response, 200);
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	const char* refused[][2] = {
+		{ "GET / HTTP/1.1\r\nNo colon here\r\n\r\n", "400" },
+		{ "GET /\r\n\r\n", "400" },
+		{ "POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 1\r\n\r\nx", "400" },
+		{ "POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nxy", "400" },
+		{ "POST / HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n", "400" },
+		{ "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n", "400" },
+		{ "POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n0\r\n\r\n", "501" },
+		{ "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhelloXX0\r\n\r\n", "400" },
+		{ "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n\r\n", "400" },
+		{ "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", "400" }
+	};
+
+	for (auto& i : refused) {
+		auto peer = connect_http(server);
+		send_text(peer, i[0]);
+
+		auto received = receive_all(peer);
+		EXPECT_EQ(0U, received.find(std::string("HTTP/1.1 ") + i[1])) << i[0];
+		EXPECT_NE(std::string::npos, received.find("Connection: close\r\n")) << i[0];
+	}
+
+	EXPECT_EQ(0U, handled);
+}
+
+TEST(HTTPConnection, DroppedRequestsAreAnswered) {
+	request_server server(std::vector<endpoint>(), 4, 0xFFFF);
+
+	request_server::route_options late;
+	late.deadline = std::chrono::milliseconds(50);
+	server.configure_route(http_connection::request_category, static_cast<uint8>(http_connection::methods::put), late);
+
+	server.on_request += [](tcp_connection& connection, word worker, uint8 category, uint8 method, data_stream& payload, data_stream& response) {
+		if (method == static_cast<uint8>(http_connection::methods::delete_))
+			return request_server::request_result::no_response;
+
+		if (method == static_cast<uint8>(http_connection::methods::post))
+			throw std::runtime_error("failed");
+
+		//Outlives the route's deadline, so the response is dropped once it is ready.
+		if (method == static_cast<uint8>(http_connection::methods::put))
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+		return echo(connection, worker, category, method, payload, response);
+	};
+
+	server.start();
+
+	auto peer = connect_http(server);
+	send_text(peer, "DELETE /none HTTP/1.1\r\n\r\nPOST /throw HTTP/1.1\r\n\r\nPUT /late HTTP/1.1\r\n\r\nGET /ok HTTP/1.1\r\nConnection: close\r\n\r\n");
+
+	EXPECT_EQ(
+		"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n"
+		"HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n"
+		"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n"
+		"HTTP/1.1 200 OK\r\nContent-Length: 3\r\nConnection: close\r\n\r\n/ok", receive_all(peer));
+
+	EXPECT_EQ(1U, server.stats().expired);
+	EXPECT_EQ(1U, server.stats().failed);
+}
+
+#endif
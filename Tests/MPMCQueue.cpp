@@ -0,0 +1,105 @@
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <gtest/gtest.h>
+
+#include <Utilities/MPMCQueue.h>
+#include <Utilities/WorkProcessor.h>
+
+using namespace util;
+
+TEST(MPMCQueue, FifoAndBounded) {
+	mpmc_queue<int> queue(3);
+
+	for (int i = 0; i < 4; i++)
+		EXPECT_TRUE(queue.try_enqueue(i + 0));
+
+	EXPECT_FALSE(queue.try_enqueue(4));
+
+	for (int i = 0; i < 4; i++)
+		EXPECT_EQ(i, queue.dequeue());
+
+	int item;
+	EXPECT_FALSE(queue.try_dequeue(item));
+
+	queue.enqueue(5);
+	EXPECT_TRUE(queue.try_dequeue(item));
+	EXPECT_EQ(5, item);
+}
+
+TEST(MPMCQueue, DestroysItemsLeftBehind) {
+	auto counted = std::make_shared<int>(0);
+
+	{
+		mpmc_queue<std::shared_ptr<int>> queue(8);
+
+		queue.enqueue(std::shared_ptr<int>(counted));
+		queue.enqueue(std::shared_ptr<int>(counted));
+
+		mpmc_queue<std::shared_ptr<int>> moved(std::move(queue));
+
+		EXPECT_EQ(3, counted.use_count());
+	}
+
+	EXPECT_EQ(1, counted.use_count());
+}
+
+TEST(MPMCQueue, ManyProducersAndConsumers) {
+	typedef mpmc_queue<uint64>::waiter_killed_exception killed;
+
+	const uint64 per_producer = 100000;
+	mpmc_queue<uint64> queue(1024);
+	std::atomic<uint64> sum(0);
+	std::atomic<uint64> received(0);
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([&queue, &sum, &received]() {
+			try {
+				while (true) {
+					sum += queue.dequeue();
+					received++;
+				}
+			}
+			catch (killed) {
+
+			}
+		});
+	}
+
+	for (int i = 0; i < 4; i++) {
+		threads.emplace_back([&queue, per_producer]() {
+			for (uint64 k = 1; k <= per_producer; k++)
+				queue.enqueue(k + 0);
+		});
+	}
+
+	while (received < 4 * per_producer)
+		std::this_thread::yield();
+
+	queue.kill_waiters();
+
+	for (auto& i : threads)
+		i.join();
+
+	EXPECT_EQ(4 * per_producer * (per_producer + 1) / 2, sum.load());
+}
+
+TEST(MPMCQueue, BackendOfWorkProcessor) {
+	work_processor<int, mpmc_queue<int>> processor(2);
+	std::atomic<int> total(0);
+
+	processor.on_item += [&total](word, int& item) { total += item; };
+	processor.start();
+
+	for (int i = 1; i <= 1000; i++)
+		processor.add_work(i + 0);
+
+	while (total != 500500)
+		std::this_thread::yield();
+
+	processor.stop();
+
+	EXPECT_EQ(500500, total.load());
+}
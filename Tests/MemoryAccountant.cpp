@@ -0,0 +1,134 @@
+#include <atomic>
+#include <utility>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <gtest/gtest.h>
+
+#include <Utilities/MemoryAccountant.h>
+#include <Utilities/Net/RequestServer.h>
+#include <Utilities/Net/RequestClient.h>
+
+using namespace util;
+using namespace util::net;
+
+TEST(MemoryAccountant, ChargesAreRefundedWhenDestroyed) {
+	memory_accountant memory;
+	std::atomic<uint64> account(0);
+
+	{
+		auto a = memory.take(0, 100, &account);
+		auto b = memory.take(1, 50);
+
+		EXPECT_EQ(150U, memory.used());
+		EXPECT_EQ(100U, memory.used(0));
+		EXPECT_EQ(50U, memory.used(1));
+		EXPECT_EQ(100U, account.load());
+
+		auto moved = std::move(a);
+
+		EXPECT_EQ(0U, a.bytes());
+		EXPECT_EQ(100U, moved.bytes());
+
+		b.release();
+
+		EXPECT_EQ(100U, memory.used());
+		EXPECT_EQ(0U, memory.used(1));
+	}
+
+	EXPECT_EQ(0U, memory.used());
+	EXPECT_EQ(0U, account.load());
+}
+
+TEST(MemoryAccountant, AssignmentRefundsTheReplacedCharge) {
+	memory_accountant memory;
+	memory_accountant::charge held;
+
+	held = memory.take(2, 10);
+	held = memory.take(2, 30);
+
+	EXPECT_EQ(30U, memory.used(2));
+	EXPECT_EQ(30U, memory.used());
+}
+
+TEST(MemoryAccountant, Budgets) {
+	memory_accountant memory;
+
+	auto unlimited = memory.take(0, 1000);
+	EXPECT_FALSE(memory.over_budget());
+
+	memory.set_budget(1500);
+	memory.set_budget(1, 100);
+
+	EXPECT_FALSE(memory.would_exceed(0, 500));
+	EXPECT_TRUE(memory.would_exceed(0, 501));
+	EXPECT_TRUE(memory.would_exceed(1, 101));
+
+	auto small = memory.take(1, 200);
+
+	EXPECT_TRUE(memory.over_budget());
+
+	small.release();
+	auto large = memory.take(0, 600);
+
+	EXPECT_TRUE(memory.over_budget());
+
+	large.release();
+
+	EXPECT_FALSE(memory.over_budget());
+}
+
+TEST(MemoryAccountant, ServerRecoversFromQueuedPublications) {
+	request_server server(endpoint(std::string("31485")), 1, 0xFFFF);
+
+	request_server::memory_options memory;
+	memory.budget = 2 * tcp_connection::message_max_size;
+	server.configure_memory(memory);
+	server.enable_publish_subscribe(1024, 4096);
+
+	server.on_request += [](tcp_connection&, word, uint8, uint8, data_stream&, data_stream& response) {
+		response.write(static_cast<uint8>(1));
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	request_client client(endpoint(std::string("127.0.0.1"), std::string("31485")), 0xFFFF);
+	std::atomic<bool> blocked(true);
+	std::atomic<word> received(0);
+
+	//Not acknowledging anything yet leaves the publications queued on the server.
+	client.on_publication += [&](const std::string&, data_stream&) {
+		while (blocked)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		received++;
+	};
+
+	client.start();
+	ASSERT_TRUE(client.subscribe("topic").get());
+
+	std::vector<uint8> payload(1000);
+	data_stream publication;
+	publication.write(payload.data(), static_cast<word>(payload.size()));
+
+	const word count = 300;
+	for (word i = 0; i < count; i++)
+		ASSERT_EQ(1U, server.publish("topic", publication));
+
+	EXPECT_GT(server.memory_used(request_server::memory_categories::publications), memory.budget);
+
+	//Credits must still be read past the budget or the queue could never drain.
+	blocked = false;
+
+	for (word i = 0; i < 500 && received < count; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	EXPECT_EQ(count, received.load());
+	EXPECT_EQ(0U, server.memory_used(request_server::memory_categories::publications));
+
+	data_stream request;
+	EXPECT_EQ(1, client.send(1, 1, request, std::chrono::milliseconds(5000)).get().read<uint8>());
+}
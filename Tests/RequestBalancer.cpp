@@ -0,0 +1,131 @@
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/RequestServer.h>
+#include <Utilities/Net/RequestBalancer.h>
+
+#ifdef POSIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+using namespace util;
+using namespace util::net;
+
+namespace {
+	std::unique_ptr<request_server> make_server(const char* port, word answer) {
+		auto server = std::unique_ptr<request_server>(new request_server(endpoint(std::string(port)), 1, 0xFFFF));
+
+		server->on_request += [answer](tcp_connection&, word, uint8, uint8, data_stream&, data_stream& response) {
+			response.write(answer);
+			return request_server::request_result::success;
+		};
+
+		server->start();
+
+		return server;
+	}
+
+	template<typename F> bool eventually(F condition) {
+		for (int i = 0; i < 300 && !condition(); i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		return condition();
+	}
+}
+
+TEST(RequestBalancer, EjectsAndRecoversEndpoints) {
+	auto first = make_server("31460", 1);
+	auto second = make_server("31461", 2);
+
+	request_balancer::options options;
+	options.eject_after = 1;
+	options.ejection_time = std::chrono::milliseconds(100);
+
+	request_balancer balancer({ endpoint(std::string("127.0.0.1"), std::string("31460")), endpoint(std::string("127.0.0.1"), std::string("31461")) }, 0xFFFF, options);
+	balancer.start();
+
+	EXPECT_EQ(2U, balancer.healthy_endpoints());
+
+	data_stream payload;
+	EXPECT_NE(0U, balancer.send(1, 1, payload).get().read<word>());
+
+	second.reset();
+
+	EXPECT_TRUE(eventually([&]() { return balancer.healthy_endpoints() == 1; }));
+
+	for (int i = 0; i < 10; i++)
+		EXPECT_EQ(1U, balancer.send(1, 1, payload).get().read<word>());
+
+	second = make_server("31461", 2);
+
+	EXPECT_TRUE(eventually([&]() { return balancer.healthy_endpoints() == 2; }));
+
+	bool reached = false;
+	for (int i = 0; i < 50 && !reached; i++)
+		reached = balancer.send(1, 1, payload).get().read<word>() == 2;
+
+	EXPECT_TRUE(reached);
+
+	balancer.stop();
+}
+
+#ifdef POSIX
+TEST(RequestBalancer, SlowBackendsConnectConcurrently) {
+	auto live = make_server("31494", 1);
+
+	//A listener whose queue is full, so connects to it hang until they time out.
+	int stalled = ::socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_LE(0, stalled);
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(31495);
+	address.sin_addr.s_addr = inet_addr("127.0.0.1");
+	ASSERT_EQ(0, ::bind(stalled, reinterpret_cast<sockaddr*>(&address), sizeof(address)));
+	ASSERT_EQ(0, ::listen(stalled, 0));
+
+	std::vector<int> queued;
+	for (int i = 0; i < 3; i++) {
+		queued.push_back(::socket(AF_INET, SOCK_STREAM, 0));
+		::fcntl(queued.back(), F_SETFL, O_NONBLOCK);
+		::connect(queued.back(), reinterpret_cast<sockaddr*>(&address), sizeof(address));
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	std::vector<endpoint> endpoints;
+	for (int i = 0; i < 2; i++) {
+		endpoints.push_back(endpoint(std::string("127.0.0.1"), std::string("31495")));
+		endpoints.back().connect_timeout = std::chrono::milliseconds(1000);
+	}
+
+	endpoints.push_back(endpoint(std::string("127.0.0.1"), std::string("31494")));
+
+	request_balancer balancer(endpoints, 0xFFFF);
+
+	//Connecting one backend after another would wait out both timeouts.
+	auto started = std::chrono::steady_clock::now();
+	balancer.start();
+	EXPECT_GT(std::chrono::milliseconds(1800), std::chrono::steady_clock::now() - started);
+
+	EXPECT_EQ(1U, balancer.healthy_endpoints());
+
+	data_stream payload;
+	EXPECT_EQ(1U, balancer.send(1, 1, payload).get().read<word>());
+
+	balancer.stop();
+
+	for (auto i : queued)
+		::close(i);
+
+	::close(stalled);
+}
+#endif
@@ -0,0 +1,244 @@
+#include <vector>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/RequestServer.h>
+#include <Utilities/Net/RequestClient.h>
+
+#ifdef POSIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+using namespace util;
+using namespace util::net;
+
+TEST(RequestClient, RoundTripsPipelinedRequests) {
+	request_server server(endpoint(std::string("31470")), 4, 0xFFFF);
+
+	server.on_request += [](tcp_connection&, word, uint8 category, uint8 method, data_stream& request, data_stream& response) {
+		auto value = request.read<word>();
+
+		//Answer out of order so responses must be matched by id.
+		std::this_thread::sleep_for(std::chrono::microseconds(value % 7 * 100));
+
+		response.write(static_cast<word>(value * 2 + category + method));
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	request_client client(endpoint(std::string("127.0.0.1"), std::string("31470")), 0xFFFF);
+	client.start();
+
+	std::vector<std::future<data_stream>> responses;
+
+	for (word i = 0; i < 200; i++) {
+		data_stream payload;
+		payload.write(i);
+		responses.push_back(client.send(1, 2, payload));
+	}
+
+	for (word i = 0; i < 200; i++)
+		EXPECT_EQ(i * 2 + 3, responses[i].get().read<word>());
+
+	EXPECT_EQ(0U, client.outstanding());
+}
+
+TEST(RequestClient, FailsOutstandingRequestsWhenStopped) {
+	request_server server(endpoint(std::string("31471")), 1, 0xFFFF);
+
+	server.on_request += [](tcp_connection&, word, uint8, uint8, data_stream&, data_stream&) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	request_client client(endpoint(std::string("127.0.0.1"), std::string("31471")), 0xFFFF);
+	client.start();
+
+	data_stream payload;
+	auto response = client.send(1, 1, payload);
+
+	client.stop();
+
+	try {
+		response.get();
+		FAIL();
+	}
+	catch (request_client::request_failed_exception& e) {
+		EXPECT_EQ(request_client::request_status::disconnected, e.status);
+	}
+
+	EXPECT_THROW(client.send(1, 1, payload), request_client::not_running_exception);
+}
+
+TEST(RequestClient, DeadlinePropagationIsOptIn) {
+	request_server plain(endpoint(std::string("31472")), 1, 0xFFFF), propagating(endpoint(std::string("31473")), 1, 0xFFFF);
+
+	auto echo = [](tcp_connection&, word, uint8 category, uint8, data_stream& request, data_stream& response) {
+		response.write(category);
+		response.write(static_cast<word>(request.size() - request.position()));
+
+		return request_server::request_result::success;
+	};
+
+	plain.on_request += echo;
+	propagating.on_request += echo;
+	propagating.enable_deadline_propagation();
+	plain.start();
+	propagating.start();
+
+	request_client to_plain(endpoint(std::string("127.0.0.1"), std::string("31472")), 0xFFFF), to_propagating(endpoint(std::string("127.0.0.1"), std::string("31473")), 0xFFFF);
+	to_propagating.enable_deadline_propagation();
+	to_plain.start();
+	to_propagating.start();
+
+	data_stream payload;
+	payload.write(static_cast<word>(7));
+
+	//Without it the top bit of the category is the application's and the payload is untouched.
+	auto response = to_plain.send(0x90, 1, payload, std::chrono::milliseconds(5000)).get();
+	EXPECT_EQ(0x90, response.read<uint8>());
+	EXPECT_EQ(sizeof(word), response.read<word>());
+
+	response = to_propagating.send(0x10, 1, payload, std::chrono::milliseconds(5000)).get();
+	EXPECT_EQ(0x10, response.read<uint8>());
+	EXPECT_EQ(sizeof(word), response.read<word>());
+}
+
+TEST(RequestClient, CreditCategoryIsOrdinaryWithoutStreaming) {
+	request_server server(endpoint(std::string("31474")), 1, 0xFFFF);
+
+	server.on_request += [](tcp_connection&, word, uint8 category, uint8, data_stream&, data_stream& response) {
+		response.write(category);
+
+		EXPECT_THROW(request_server::stream(), request_server::streaming_disabled_exception);
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	request_client client(endpoint(std::string("127.0.0.1"), std::string("31474")), 0xFFFF);
+	client.start();
+
+	data_stream payload;
+	payload.write(static_cast<uint32>(1));
+
+	uint8 category = request_server::stream_credit_category;
+
+	EXPECT_EQ(category, client.send(category, 0, payload, std::chrono::milliseconds(5000)).get().read<uint8>());
+}
+
+TEST(RequestClient, PayloadsEqualToTheRetryCodeAreResponses) {
+	request_server server(endpoint(std::string("31492")), 1, 0xFFFF);
+
+	server.on_request += [](tcp_connection&, word, uint8, uint8 method, data_stream&, data_stream& response) {
+		if (method == 1)
+			return request_server::request_result::retry_later;
+
+		response.write(static_cast<uint16>(0xFFFF));
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	request_client client(endpoint(std::string("127.0.0.1"), std::string("31492")), 0xFFFF);
+	client.start();
+
+	data_stream payload;
+
+	EXPECT_EQ(0xFFFF, client.send(1, 0, payload, std::chrono::milliseconds(5000)).get().read<uint16>());
+
+	try {
+		client.send(1, 1, payload, std::chrono::milliseconds(5000)).get();
+		ADD_FAILURE();
+	}
+	catch (request_client::request_failed_exception& e) {
+		EXPECT_EQ(request_client::request_status::retries_exhausted, e.status);
+	}
+}
+
+#ifdef POSIX
+//Answers every request the client sends with a retry until count have arrived, and returns when each did.
+static std::vector<std::chrono::steady_clock::time_point> refuse(tcp_connection& peer, word count) {
+	std::vector<std::chrono::steady_clock::time_point> arrivals;
+
+	while (arrivals.size() < count && peer.data_available(1000000)) {
+		for (auto& i : peer.read()) {
+			if (i.closed)
+				return arrivals;
+
+			arrivals.push_back(std::chrono::steady_clock::now());
+
+			data_stream retry;
+			request_server::message::write_header(retry, *reinterpret_cast<const uint16*>(i.data), request_server::retry_flag, 0);
+			retry.write(static_cast<uint16>(0xFFFF));
+
+			EXPECT_TRUE(peer.send(retry.data(), retry.size()));
+		}
+	}
+
+	return arrivals;
+}
+
+TEST(RequestClient, RetriesBackOff) {
+	int pair[2];
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	auto peer = tcp_connection(net::socket(pair[1]));
+	request_client client(tcp_connection(net::socket(pair[0])), 0xFFFF);
+	client.start();
+
+	data_stream payload;
+	auto response = client.send(1, 1, payload, std::chrono::milliseconds(5000));
+	auto arrivals = refuse(peer, request_client::max_retries + 1);
+
+	try {
+		response.get();
+		ADD_FAILURE();
+	}
+	catch (request_client::request_failed_exception& e) {
+		EXPECT_EQ(request_client::request_status::retries_exhausted, e.status);
+	}
+
+	//Each wait is at least half of a ceiling that doubles every time.
+	ASSERT_EQ(request_client::max_retries + 1, arrivals.size());
+
+	for (word i = 1; i < arrivals.size(); i++)
+		EXPECT_GE(arrivals[i] - arrivals[i - 1], request_client::retry_backoff * (1 << (i - 1)) / 2) << i;
+}
+
+TEST(RequestClient, RetriesStopAtTheDeadline) {
+	int pair[2];
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	auto peer = tcp_connection(net::socket(pair[1]));
+	request_client client(tcp_connection(net::socket(pair[0])), 0xFFFF);
+	client.start();
+
+	//The first wait always fits before the deadline and the third never does.
+	data_stream payload;
+	auto response = client.send(1, 1, payload, std::chrono::milliseconds(30));
+	auto arrivals = std::async(std::launch::async, [&peer]() { return refuse(peer, request_client::max_retries + 1); });
+
+	try {
+		response.get();
+		ADD_FAILURE();
+	}
+	catch (request_client::request_failed_exception& e) {
+		EXPECT_EQ(request_client::request_status::expired, e.status);
+	}
+
+	auto count = arrivals.get().size();
+	EXPECT_LE(2U, count);
+	EXPECT_GE(3U, count);
+}
+#endif
@@ -0,0 +1,441 @@
+#include <string>
+#include <memory>
+#include <vector>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <atomic>
+#include <functional>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/RequestServer.h>
+#include <Utilities/Net/RequestClient.h>
+#include <Utilities/Net/SharedMemoryConnection.h>
+
+#ifdef POSIX
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace util;
+using namespace util::net;
+
+static const uint16 retry_code = 0xFFFF;
+
+static void send_request(tcp_connection& connection, uint16 id, uint8 category, uint8 method, const data_stream& payload = data_stream()) {
+	data_stream request;
+	request_server::message::write_header(request, id, category, method);
+	request.write(payload.data(), payload.size());
+
+	ASSERT_TRUE(connection.send(request.data(), request.size()));
+}
+
+//Reads one response and returns what follows its header.
+static data_stream read_response(tcp_connection& connection, uint16& id) {
+	auto messages = connection.read(1);
+	EXPECT_EQ(1U, messages.size());
+
+	if (messages.empty() || messages[0].closed)
+		return data_stream();
+
+	data_stream response(static_cast<const uint8*>(messages[0].data), messages[0].length);
+	uint8 category, method;
+	response >> id >> category >> method;
+
+	return data_stream(response.data_at_cursor(), response.size() - response.position());
+}
+
+#ifdef POSIX
+TEST(RequestServer, PerAddressLimitsSkipSharedMemoryConnections) {
+	request_server server(endpoint(std::string("31489")), 1, retry_code);
+
+	server.on_request += [](tcp_connection&, word, uint8, uint8, data_stream&, data_stream& response) {
+		response.write(static_cast<uint8>(1));
+
+		return request_server::request_result::success;
+	};
+
+	request_server::connection_options options;
+	options.per_address = request_server::rate_limit(0.001, 1);
+	server.configure_connections(options);
+	server.start();
+
+	auto served = make_unique<shared_memory_connection>();
+	shared_memory_connection peer(served->native_handle());
+	server.adopt(move(served));
+
+	//Without a remote address every request is let through, where the limit would otherwise refuse all but the first.
+	for (uint16 i = 0; i < 3; i++) {
+		uint16 id;
+
+		send_request(peer, i, 1, 1);
+		auto response = read_response(peer, id);
+
+		EXPECT_EQ(i, id);
+		EXPECT_EQ(1U, response.read<uint8>());
+	}
+
+	//Connections with an address are still limited by it.
+	tcp_connection client(endpoint(std::string("127.0.0.1"), std::string("31489")));
+	uint16 id;
+
+	send_request(client, 1, 1, 1);
+	EXPECT_EQ(1U, read_response(client, id).read<uint8>());
+
+	send_request(client, 2, 1, 1);
+	EXPECT_EQ(retry_code, read_response(client, id).read<uint16>());
+	EXPECT_EQ(2U, id);
+}
+#endif
+
+TEST(RequestServer, ThrowingHandlersAnswerWithFailure) {
+	request_server server(endpoint(std::string("31490")), 1, retry_code);
+
+	request_server::route_options coalesced;
+	coalesced.coalesce_identical = true;
+	server.configure_route(1, 2, coalesced);
+
+	server.on_request += [](tcp_connection&, word, uint8, uint8 method, data_stream&, data_stream& response) -> request_server::request_result {
+		if (method != 0) {
+			//Long enough for the identical requests behind it to join its flight.
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+			throw std::runtime_error("failed");
+		}
+
+		response.write(static_cast<uint8>(1));
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	request_client client(endpoint(std::string("127.0.0.1"), std::string("31490")), retry_code);
+	client.start();
+
+	data_stream payload;
+	std::vector<std::future<data_stream>> failing;
+
+	failing.push_back(client.send(1, 1, payload, std::chrono::milliseconds(5000)));
+
+	for (word i = 0; i < 3; i++)
+		failing.push_back(client.send(1, 2, payload, std::chrono::milliseconds(5000)));
+
+	for (auto& i : failing) {
+		try {
+			i.get();
+			ADD_FAILURE();
+		}
+		catch (request_client::request_failed_exception& e) {
+			EXPECT_EQ(request_client::request_status::failed, e.status);
+		}
+	}
+
+	EXPECT_EQ(4U, server.stats().failed);
+
+	//The only worker survived.
+	EXPECT_EQ(1U, client.send(1, 0, payload, std::chrono::milliseconds(5000)).get().read<uint8>());
+}
+
+#ifdef POSIX
+TEST(RequestServer, BusyPollServesAndDisconnectsConnections) {
+	request_server server(std::vector<endpoint>(), 2, retry_code);
+	std::atomic<word> disconnected(0);
+
+	request_server::busy_poll_options options;
+	options.io_core = 0;
+	options.request_cores = { 0 };
+	options.worker_spin = std::chrono::microseconds(100);
+	server.enable_busy_poll(options);
+
+	server.on_request += [](tcp_connection& connection, word, uint8, uint8 method, data_stream& payload, data_stream& response) {
+		//Closed from a worker while the I/O thread polls it.
+		if (method == 1) {
+			connection.close();
+
+			return request_server::request_result::no_response;
+		}
+
+		response.write(payload.read<uint32>());
+
+		return request_server::request_result::success;
+	};
+
+	server.on_disconnect += [&disconnected](tcp_connection&) {
+		disconnected++;
+	};
+
+	server.start();
+
+	std::vector<std::unique_ptr<tcp_connection>> peers;
+
+	for (word i = 0; i < 3; i++) {
+		int pair[2];
+		ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+		server.adopt(make_unique<tcp_connection>(net::socket(pair[0])));
+		peers.push_back(make_unique<tcp_connection>(net::socket(pair[1])));
+	}
+
+	send_request(*peers[2], 0, 1, 1);
+
+	for (uint16 i = 0; i < 200; i++) {
+		data_stream payload;
+		payload.write(static_cast<uint32>(i));
+
+		send_request(*peers[i % 2], i, 1, 0, payload);
+	}
+
+	//Two workers may answer a connection's requests out of order.
+	for (word p = 0; p < 2; p++) {
+		std::vector<bool> answered(200, false);
+
+		word count = 0;
+
+		while (count < 100 && peers[p]->data_available(5000000)) {
+			for (auto& i : peers[p]->read()) {
+				ASSERT_FALSE(i.closed);
+
+				data_stream response(static_cast<const uint8*>(i.data), i.length);
+				uint16 id;
+				uint8 category, method;
+				response >> id >> category >> method;
+
+				ASSERT_EQ(p, id % 2U);
+				EXPECT_EQ(id, response.read<uint32>());
+				EXPECT_FALSE(answered[id]);
+
+				answered[id] = true;
+				count++;
+			}
+		}
+
+		EXPECT_EQ(100U, count);
+	}
+
+	for (word i = 0; i < 100 && disconnected == 0; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	EXPECT_EQ(1U, disconnected);
+}
+#endif
+
+#ifdef POSIX
+//Answers with the number it is given and the size of the request's payload.
+static std::function<request_server::request_result(tcp_connection&, word, uint8, uint8, data_stream&, data_stream&)> answer_with(uint8 server) {
+	return [server](tcp_connection&, word, uint8, uint8, data_stream& payload, data_stream& response) {
+		response.write(server);
+		response.write(static_cast<uint32>(payload.size() - payload.position()));
+
+		return request_server::request_result::success;
+	};
+}
+
+TEST(RequestServer, HandsOffListenersAndIdleConnections) {
+	const std::string path = "request_server_handoff_test.sock";
+	::unlink(path.c_str());
+
+	request_server old_server(endpoint(std::string("31493")), 1, retry_code);
+	old_server.on_request += answer_with(1);
+	old_server.enable_publish_subscribe();
+	old_server.start();
+
+	tcp_connection idle(endpoint(std::string("127.0.0.1"), std::string("31493")));
+	net::socket partial(net::socket::families::ip_any, net::socket::types::tcp, endpoint(std::string("127.0.0.1"), std::string("31493")));
+	request_client subscribed(endpoint(std::string("127.0.0.1"), std::string("31493")), retry_code);
+	subscribed.start();
+
+	uint16 id;
+	send_request(idle, 1, 1, 1);
+	EXPECT_EQ(1U, read_response(idle, id).read<uint8>());
+
+	EXPECT_TRUE(subscribed.subscribe("topic").get());
+
+	//All but the last byte of the largest message, which leaves more unread than a uint16 can count.
+	std::vector<uint8> large(tcp_connection::message_length_bytes + 0xFFFF, 0);
+	*reinterpret_cast<uint16*>(large.data()) = 0xFFFF;
+	large[tcp_connection::message_length_bytes] = 2;
+	large[tcp_connection::message_length_bytes + 2] = 1;
+	ASSERT_EQ(large.size() - 1, partial.write(large.data(), static_cast<word>(large.size() - 1)));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	request_server new_server(endpoint(std::string("31493")), 1, retry_code);
+	new_server.on_request += answer_with(2);
+
+	auto inheriting = std::async(std::launch::async, [&]() { return new_server.inherit(path); });
+
+	while (::access(path.c_str(), F_OK) != 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	EXPECT_EQ(2U, old_server.handoff(path, true, std::chrono::milliseconds(1000)));
+	EXPECT_EQ(2U, inheriting.get());
+
+	new_server.start();
+
+	//Idle connections carry on with the new process, the partial message included.
+	send_request(idle, 3, 1, 1);
+	EXPECT_EQ(2U, read_response(idle, id).read<uint8>());
+	EXPECT_EQ(3U, id);
+
+	ASSERT_EQ(1U, partial.write(large.data() + large.size() - 1, 1));
+	auto completed = tcp_connection(std::move(partial));
+	auto response = read_response(completed, id);
+	EXPECT_EQ(2U, id);
+	EXPECT_EQ(2U, response.read<uint8>());
+	EXPECT_EQ(0xFFFFU - 4, response.read<uint32>());
+
+	//Connections with subscriptions stay to be served where they subscribed.
+	data_stream payload;
+	EXPECT_EQ(1U, subscribed.send(1, 1, payload, std::chrono::milliseconds(5000)).get().read<uint8>());
+
+	//New connections reach the new process through the listener it was sent.
+	tcp_connection fresh(endpoint(std::string("127.0.0.1"), std::string("31493")));
+	send_request(fresh, 4, 1, 1);
+	EXPECT_EQ(2U, read_response(fresh, id).read<uint8>());
+
+	subscribed.stop();
+	old_server.stop();
+}
+#endif
+
+#ifdef POSIX
+//Serves one end of a socket pair and returns the other.
+static std::unique_ptr<tcp_connection> connect_pair(request_server& server) {
+	int pair[2];
+	EXPECT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	server.adopt(make_unique<tcp_connection>(net::socket(pair[0])));
+
+	return make_unique<tcp_connection>(net::socket(pair[1]));
+}
+
+TEST(RequestServer, DisconnectingCancelsQueuedRequests) {
+	request_server server(std::vector<endpoint>(), 1, retry_code);
+	std::atomic<bool> started(false), cancelled(false);
+	std::atomic<word> handled(0);
+
+	server.on_request += [&](tcp_connection&, word, uint8, uint8 method, data_stream&, data_stream& response) {
+		//Holds the only worker until the connection goes away.
+		if (method == 1) {
+			started = true;
+
+			for (word i = 0; i < 500 && !request_server::cancellation().cancelled(); i++)
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+			cancelled = request_server::cancellation().cancelled();
+
+			return request_server::request_result::no_response;
+		}
+
+		handled++;
+		response.write(static_cast<uint8>(1));
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	auto leaving = connect_pair(server);
+	auto staying = connect_pair(server);
+
+	send_request(*leaving, 0, 1, 1);
+
+	for (uint16 i = 1; i < 4; i++)
+		send_request(*leaving, i, 1, 0);
+
+	for (word i = 0; i < 500 && !started; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	ASSERT_TRUE(started);
+
+	//Gives the I/O thread time to queue the requests behind the running one.
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	leaving->close();
+
+	for (word i = 0; i < 500 && server.stats().cancelled < 3; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	EXPECT_TRUE(cancelled);
+	EXPECT_EQ(3U, server.stats().cancelled);
+	EXPECT_EQ(0U, handled);
+
+	//Outside of a handler the token is one that is never cancelled.
+	EXPECT_FALSE(request_server::cancellation().cancelled());
+
+	uint16 id;
+	send_request(*staying, 4, 1, 0);
+	EXPECT_EQ(1U, read_response(*staying, id).read<uint8>());
+	EXPECT_EQ(4U, id);
+	EXPECT_EQ(1U, handled);
+}
+#endif
+
+#ifdef POSIX
+//Reads responses until count have arrived and returns their ids in order.
+static std::vector<uint16> read_ids(tcp_connection& connection, word count) {
+	std::vector<uint16> ids;
+
+	while (ids.size() < count && connection.data_available(5000000)) {
+		for (auto& i : connection.read()) {
+			if (i.closed)
+				return ids;
+
+			data_stream response(static_cast<const uint8*>(i.data), i.length);
+			ids.push_back(response.read<uint16>());
+		}
+	}
+
+	return ids;
+}
+
+TEST(RequestServer, CoalescedResponsesWaitForTheWindow) {
+	request_server server(std::vector<endpoint>(), 1, retry_code);
+
+	request_server::route_options immediate;
+	immediate.flush_immediately = true;
+	server.configure_route(1, 1, immediate);
+	server.enable_coalescing(std::chrono::milliseconds(300));
+
+	server.on_request += [](tcp_connection&, word, uint8, uint8 method, data_stream&, data_stream& response) {
+		if (method == 2) {
+			std::vector<uint8> large(40000, 0);
+			response.write(large.data(), static_cast<word>(large.size()));
+		}
+		else {
+			response.write(method);
+		}
+
+		return request_server::request_result::success;
+	};
+
+	server.start();
+
+	auto peer = connect_pair(server);
+	auto sent = std::chrono::steady_clock::now();
+
+	//Held back while it waits for others to join it.
+	send_request(*peer, 1, 1, 0);
+	EXPECT_FALSE(peer->data_available(100000));
+
+	//A route that flushes immediately takes what is waiting along with it, well inside the window.
+	send_request(*peer, 2, 1, 1);
+	EXPECT_EQ(std::vector<uint16>({ 1, 2 }), read_ids(*peer, 2));
+	EXPECT_GT(std::chrono::milliseconds(250), std::chrono::steady_clock::now() - sent);
+
+	//Alone, a response goes out once the window has passed.
+	sent = std::chrono::steady_clock::now();
+	send_request(*peer, 3, 1, 0);
+	EXPECT_EQ(std::vector<uint16>({ 3 }), read_ids(*peer, 1));
+	EXPECT_LE(std::chrono::milliseconds(250), std::chrono::steady_clock::now() - sent);
+
+	//Responses that fill a message don't wait for the window either.
+	sent = std::chrono::steady_clock::now();
+	send_request(*peer, 4, 1, 2);
+	send_request(*peer, 5, 1, 2);
+	EXPECT_EQ(std::vector<uint16>({ 4, 5 }), read_ids(*peer, 2));
+	EXPECT_GT(std::chrono::milliseconds(250), std::chrono::steady_clock::now() - sent);
+}
+#endif
@@ -0,0 +1,60 @@
+#include <string>
+#include <vector>
+#include <chrono>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/Resolver.h>
+
+using namespace util;
+using namespace util::net;
+
+static socket_address loopback(uint16 port) {
+	socket_address address;
+	address.family = socket::families::ipv4;
+	address.address.fill(0x00);
+	address.address[0] = 127;
+	address.address[3] = 1;
+	address.port = port;
+
+	return address;
+}
+
+TEST(Resolver, ResolvesLiteralsAndBoundsItsCache) {
+	resolver names(2, std::chrono::seconds(60), std::chrono::seconds(5), 2, 2);
+
+	auto found = names.resolve("127.0.0.1", "80").get();
+	ASSERT_EQ(1U, found.size());
+	EXPECT_EQ(socket::families::ipv4, found[0].family);
+	EXPECT_EQ(80, found[0].port);
+	EXPECT_EQ(127, found[0].address[0]);
+	EXPECT_EQ(1, found[0].address[3]);
+
+	names.resolve("127.0.0.2", "80").get();
+	names.resolve("127.0.0.3", "80").get();
+
+	EXPECT_EQ(2U, names.cached());
+
+	EXPECT_THROW(names.resolve("name.invalid", "80").get(), socket::invalid_address_exception);
+}
+
+TEST(Resolver, ConnectFallsBackPastRefusedAddresses) {
+	socket listener(socket::families::ip_any, socket::types::tcp, endpoint(std::string("31487")));
+
+	//Nothing listens on the first port, so the attempt there is refused and the next one starts without waiting out the stagger.
+	std::vector<socket_address> candidates = { loopback(31488), loopback(31487) };
+
+	auto start = std::chrono::steady_clock::now();
+	auto connected = socket::connect(candidates, std::chrono::milliseconds(5000), std::chrono::milliseconds(2000));
+
+	EXPECT_TRUE(connected.is_connected());
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(1000));
+
+	resolver names;
+	endpoint ep(std::string("localhost"), std::string("31487"));
+	ep.connect_timeout = std::chrono::milliseconds(5000);
+
+	EXPECT_TRUE(names.connect(ep).get().is_connected());
+
+	ep.address = "name.invalid";
+	EXPECT_THROW(names.connect(ep).get(), socket::invalid_address_exception);
+}
@@ -0,0 +1,124 @@
+#include <string>
+#include <thread>
+#include <chrono>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/ResponseCache.h>
+
+using namespace util;
+using namespace util::net;
+
+static void insert_text(response_cache& cache, const std::string& key, const std::string& body, std::chrono::milliseconds ttl = std::chrono::milliseconds(60000)) {
+	cache.insert(key, reinterpret_cast<const uint8*>(body.data()), static_cast<word>(body.size()), ttl);
+}
+
+//Gets the cached body, or an empty string on a miss.
+static std::string find_text(response_cache& cache, const std::string& key) {
+	data_stream out;
+	if (!cache.find(key, out))
+		return "";
+
+	return std::string(reinterpret_cast<const char*>(out.data()), out.size());
+}
+
+TEST(ResponseCache, ExpiredEntriesAreMisses) {
+	response_cache cache(1024, 1);
+
+	insert_text(cache, "short", "body", std::chrono::milliseconds(50));
+	insert_text(cache, "long", "body");
+
+	EXPECT_EQ("body", find_text(cache, "short"));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	//The expired entry is dropped by the lookup that finds it, and only the other one is left.
+	EXPECT_EQ("", find_text(cache, "short"));
+	EXPECT_EQ("body", find_text(cache, "long"));
+	EXPECT_EQ(std::string("long").size() + 4, cache.size());
+
+	EXPECT_EQ(2U, cache.stats().hits);
+	EXPECT_EQ(1U, cache.stats().misses);
+	EXPECT_EQ(0U, cache.stats().evictions);
+
+	//Entries that could never be served aren't kept.
+	insert_text(cache, "none", "body", std::chrono::milliseconds(0));
+	EXPECT_EQ("", find_text(cache, "none"));
+}
+
+TEST(ResponseCache, InsertingReplacesTheCachedBody) {
+	response_cache cache(1024, 1);
+
+	insert_text(cache, "key", "first");
+	insert_text(cache, "key", "second, longer");
+
+	EXPECT_EQ("second, longer", find_text(cache, "key"));
+	EXPECT_EQ(std::string("key").size() + std::string("second, longer").size(), cache.size());
+
+	insert_text(cache, "key", "");
+	EXPECT_EQ(std::string("key").size(), cache.size());
+
+	//Bodies bigger than a shard are left out rather than emptying it.
+	insert_text(cache, "other", "kept");
+	insert_text(cache, "big", std::string(1024, 'x'));
+
+	EXPECT_EQ("", find_text(cache, "big"));
+	EXPECT_EQ("kept", find_text(cache, "other"));
+	EXPECT_EQ(0U, cache.stats().evictions);
+
+	cache.clear();
+	EXPECT_EQ(0U, cache.size());
+	EXPECT_EQ("", find_text(cache, "other"));
+}
+
+TEST(ResponseCache, EvictionSkipsEntriesThatWereHit) {
+	//Room for three entries of one byte of key and eight of body.
+	response_cache cache(30, 1);
+
+	insert_text(cache, "a", "aaaaaaaa");
+	insert_text(cache, "b", "bbbbbbbb");
+	insert_text(cache, "c", "cccccccc");
+
+	EXPECT_EQ("aaaaaaaa", find_text(cache, "a"));
+
+	//The hand clears the mark on a and takes b, the next unmarked entry, then c as it carries on.
+	insert_text(cache, "d", "dddddddd");
+	EXPECT_EQ(1U, cache.stats().evictions);
+
+	insert_text(cache, "e", "eeeeeeee");
+	EXPECT_EQ(2U, cache.stats().evictions);
+
+	EXPECT_EQ("", find_text(cache, "b"));
+	EXPECT_EQ("", find_text(cache, "c"));
+	EXPECT_EQ("aaaaaaaa", find_text(cache, "a"));
+	EXPECT_EQ("dddddddd", find_text(cache, "d"));
+	EXPECT_EQ("eeeeeeee", find_text(cache, "e"));
+	EXPECT_EQ(27U, cache.size());
+
+	//Once every entry has been hit, a full sweep clears the marks and the hand comes back around to evict.
+	insert_text(cache, "f", "ffffffff");
+	EXPECT_EQ(3U, cache.stats().evictions);
+	EXPECT_EQ(27U, cache.size());
+	EXPECT_EQ("ffffffff", find_text(cache, "f"));
+}
+
+TEST(ResponseCache, ExpiredEntriesAreEvictedEvenIfHit) {
+	response_cache cache(30, 1);
+
+	insert_text(cache, "a", "aaaaaaaa", std::chrono::milliseconds(50));
+	insert_text(cache, "b", "bbbbbbbb");
+	insert_text(cache, "c", "cccccccc");
+
+	EXPECT_EQ("aaaaaaaa", find_text(cache, "a"));
+	EXPECT_EQ("bbbbbbbb", find_text(cache, "b"));
+	EXPECT_EQ("cccccccc", find_text(cache, "c"));
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+	//a's mark no longer protects it once it has expired.
+	insert_text(cache, "d", "dddddddd");
+
+	EXPECT_EQ(1U, cache.stats().evictions);
+	EXPECT_EQ("bbbbbbbb", find_text(cache, "b"));
+	EXPECT_EQ("cccccccc", find_text(cache, "c"));
+	EXPECT_EQ("dddddddd", find_text(cache, "d"));
+}
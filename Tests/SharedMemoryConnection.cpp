@@ -0,0 +1,65 @@
+#include <vector>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/SharedMemoryConnection.h>
+
+#ifdef POSIX
+
+using namespace util;
+using namespace util::net;
+
+TEST(SharedMemoryConnection, MessagesSurviveRingWraparound) {
+	//The smallest ring holds two full messages, so odd sized messages soon straddle its end.
+	shared_memory_connection first(static_cast<word>(tcp_connection::message_max_size));
+	shared_memory_connection second(first.native_handle());
+
+	const word count = 2000;
+
+	std::thread writer([&]() {
+		std::vector<uint8> message;
+
+		for (word i = 0; i < count; i++) {
+			message.resize(1000 + i % 977);
+
+			for (word j = 0; j < message.size(); j++)
+				message[j] = static_cast<uint8>(i + j);
+
+			//The ring fills when the reader falls behind, so this also waits for room.
+			ASSERT_TRUE(first.send(message.data(), static_cast<word>(message.size())));
+		}
+	});
+
+	word received = 0;
+
+	while (received < count) {
+		for (auto& i : second.read(1)) {
+			ASSERT_FALSE(i.closed);
+			ASSERT_EQ(1000 + received % 977, i.length);
+
+			for (word j = 0; j < i.length; j++)
+				ASSERT_EQ(static_cast<uint8>(received + j), i.data[j]);
+
+			received++;
+		}
+	}
+
+	writer.join();
+
+	EXPECT_EQ(count, received);
+}
+
+TEST(SharedMemoryConnection, ClosingIsSeenByThePeer) {
+	shared_memory_connection first;
+	shared_memory_connection second(first.native_handle());
+
+	first.close();
+
+	ASSERT_TRUE(second.data_available(1000000));
+
+	auto messages = second.read();
+	ASSERT_EQ(1U, messages.size());
+	EXPECT_TRUE(messages[0].closed);
+}
+
+#endif
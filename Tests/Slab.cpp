@@ -0,0 +1,106 @@
+#include <string>
+#include <memory>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <Utilities/Slab.h>
+#include <Utilities/Net/RequestServer.h>
+
+#ifdef POSIX
+	#include <sys/socket.h>
+#endif
+
+using namespace util;
+using namespace util::net;
+
+TEST(Slab, ReusesReleasedSlots) {
+	slab<std::string, 2> objects;
+
+	auto a = objects.emplace("a");
+	auto b = objects.emplace("b");
+	auto c = objects.emplace(3, 'c');
+
+	EXPECT_EQ("a", objects[a]);
+	EXPECT_EQ("ccc", objects[c]);
+	EXPECT_EQ(3U, objects.size());
+
+	objects.release(b);
+	objects.release(b);
+
+	EXPECT_EQ(b, objects.emplace("d"));
+	EXPECT_EQ("d", objects[b]);
+	EXPECT_EQ(3U, objects.size());
+}
+
+TEST(Slab, ReferencesSurviveGrowth) {
+	slab<int, 2> objects;
+
+	auto first = objects.emplace(7);
+	auto& value = objects[first];
+
+	for (int i = 0; i < 100; i++)
+		objects.emplace(i);
+
+	EXPECT_EQ(7, value);
+	EXPECT_EQ(&value, &objects[first]);
+}
+
+TEST(Slab, DestroysWhatItHolds) {
+	auto tracked = std::make_shared<int>(0);
+
+	{
+		slab<std::shared_ptr<int>> objects;
+
+		objects.emplace(tracked);
+		objects.release(objects.emplace(tracked));
+
+		EXPECT_EQ(2, tracked.use_count());
+	}
+
+	EXPECT_EQ(1, tracked.use_count());
+}
+
+TEST(Slab, Full) {
+	typedef slab<int, 2> small_slab;
+	small_slab objects(4);
+
+	for (int i = 0; i < 4; i++)
+		objects.emplace(i);
+
+	EXPECT_THROW(objects.emplace(4), small_slab::full_exception);
+}
+
+#ifdef POSIX
+TEST(Slab, ServerRefusesConnectionsPastContextCapacity) {
+	request_server server(endpoint(std::string("31486")), 1, 0xFFFF);
+	server.enable_connection_context<int>(1);
+	server.start();
+
+	//Contexts are allocated a block at a time, so one connection rounds up to a whole block.
+	std::vector<net::socket> peers;
+	for (word i = 0; i < slab<int>::block_size; i++) {
+		int pair[2];
+		ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+		peers.emplace_back(pair[1]);
+		server.adopt(tcp_connection(net::socket(pair[0])));
+	}
+
+	int pair[2];
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	net::socket refused_peer(pair[1]);
+
+	EXPECT_THROW(server.adopt(tcp_connection(net::socket(pair[0]))), request_server::too_many_connections_exception);
+	EXPECT_EQ(1U, server.stats().connections_refused);
+
+	//Connections accepted past the limit are closed without being served.
+	net::socket client(net::socket::families::ip_any, socket::types::tcp, endpoint(std::string("127.0.0.1"), std::string("31486")));
+	uint8 buffer[1];
+
+	ASSERT_TRUE(client.data_available(5000000));
+	EXPECT_EQ(0U, client.read(buffer, sizeof(buffer)));
+	EXPECT_EQ(2U, server.stats().connections_refused);
+
+	server.stop();
+}
+#endif
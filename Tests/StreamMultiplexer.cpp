@@ -0,0 +1,236 @@
+#include <string>
+#include <vector>
+#include <functional>
+#include <array>
+#include <cstring>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/StreamMultiplexer.h>
+
+#ifdef POSIX
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+using namespace util;
+using namespace util::net;
+
+typedef stream_multiplexer::stream_id stream_id;
+
+//Records what a multiplexer raises, by stream.
+struct recorder {
+	std::vector<stream_id> opened;
+	std::vector<stream_id> ended;
+	std::vector<stream_id> reset;
+	std::string data;
+
+	void watch(stream_multiplexer& mux) {
+		mux.on_open += [this](stream_id id) { this->opened.push_back(id); };
+		mux.on_end += [this](stream_id id) { this->ended.push_back(id); };
+		mux.on_reset += [this](stream_id id) { this->reset.push_back(id); };
+		mux.on_data += [this](stream_id, const uint8* data, word length) { this->data.append(reinterpret_cast<const char*>(data), length); };
+	}
+};
+
+static std::array<int, 2> socket_pair() {
+	std::array<int, 2> pair;
+	EXPECT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair.data()));
+
+	return pair;
+}
+
+static stream_multiplexer::options with_initiator(stream_multiplexer::options settings, bool initiator) {
+	settings.initiator = initiator;
+
+	return settings;
+}
+
+//Two multiplexers talking to each other over a socket pair.
+struct multiplexer_pair {
+	tcp_connection first_connection;
+	tcp_connection second_connection;
+	stream_multiplexer first;
+	stream_multiplexer second;
+	recorder first_events;
+	recorder second_events;
+
+	multiplexer_pair(stream_multiplexer::options settings = stream_multiplexer::options()) : multiplexer_pair(settings, socket_pair()) {
+
+	}
+
+	multiplexer_pair(stream_multiplexer::options settings, std::array<int, 2> pair) : first_connection(net::socket(pair[0])), second_connection(net::socket(pair[1])), first(first_connection, with_initiator(settings, true)), second(second_connection, with_initiator(settings, false)) {
+		this->first_events.watch(this->first);
+		this->second_events.watch(this->second);
+	}
+};
+
+//Reads whatever arrives until nothing more does for a while.
+static void read_all(stream_multiplexer& mux, tcp_connection& connection) {
+	while (connection.data_available(100000))
+		ASSERT_TRUE(mux.read());
+}
+
+//Reads from a multiplexer until the condition holds or nothing more arrives for a while.
+static bool read_until(stream_multiplexer& mux, tcp_connection& connection, std::function<bool()> done) {
+	while (!done()) {
+		if (!connection.data_available(1000000))
+			return false;
+
+		if (!mux.read())
+			return false;
+	}
+
+	return true;
+}
+
+static void write_text(stream_multiplexer& mux, stream_id id, const std::string& text) {
+	mux.write(id, reinterpret_cast<const uint8*>(text.data()), static_cast<word>(text.size()));
+}
+
+TEST(StreamMultiplexer, OpensStreamsInBothDirections) {
+	multiplexer_pair p;
+
+	auto id = p.first.open();
+	write_text(p.first, id, "hello");
+	p.first.end(id);
+	p.first.pump();
+
+	ASSERT_TRUE(read_until(p.second, p.second_connection, [&]() { return !p.second_events.ended.empty(); }));
+	ASSERT_EQ(1U, p.second_events.opened.size());
+	EXPECT_EQ(id, p.second_events.opened[0]);
+	EXPECT_EQ("hello", p.second_events.data);
+
+	//The peer answers on the same stream, which closes it on both sides.
+	write_text(p.second, id, "world");
+	p.second.end(id);
+	p.second.pump();
+
+	ASSERT_TRUE(read_until(p.first, p.first_connection, [&]() { return !p.first_events.ended.empty(); }));
+	EXPECT_EQ("world", p.first_events.data);
+	EXPECT_TRUE(p.first_events.opened.empty());
+	EXPECT_EQ(0U, p.first.active_streams());
+	EXPECT_EQ(0U, p.second.active_streams());
+
+	//Streams opened by either side get ids that can't collide.
+	auto other = p.second.open();
+	EXPECT_NE(id % 2, other % 2);
+}
+
+TEST(StreamMultiplexer, ResetStreamsAreNotReopened) {
+	multiplexer_pair p;
+
+	auto id = p.first.open();
+	write_text(p.first, id, "first");
+	p.first.pump();
+
+	ASSERT_TRUE(read_until(p.second, p.second_connection, [&]() { return p.second_events.data == "first"; }));
+
+	p.second.reset(id);
+	p.second.pump();
+
+	//Sent before the reset arrives, so it reaches the peer after it has forgotten the stream.
+	write_text(p.first, id, "late");
+	p.first.end(id);
+	p.first.pump();
+
+	auto marker = p.first.open();
+	write_text(p.first, marker, "!");
+	p.first.pump();
+
+	ASSERT_TRUE(read_until(p.second, p.second_connection, [&]() { return p.second_events.opened.size() == 2; }));
+	ASSERT_TRUE(read_until(p.second, p.second_connection, [&]() { return p.second_events.data.size() == 6; }));
+
+	EXPECT_EQ(marker, p.second_events.opened[1]);
+	EXPECT_EQ("first!", p.second_events.data);
+	EXPECT_TRUE(p.second_events.ended.empty());
+
+	ASSERT_TRUE(read_until(p.first, p.first_connection, [&]() { return !p.first_events.reset.empty(); }));
+	EXPECT_EQ(id, p.first_events.reset[0]);
+}
+
+TEST(StreamMultiplexer, SendersWaitForCredit) {
+	stream_multiplexer::options settings;
+	settings.chunk_size = 1024;
+	settings.initial_window = 4096;
+
+	multiplexer_pair p(settings);
+
+	auto id = p.first.open();
+	std::string payload(10000, 'x');
+	write_text(p.first, id, payload);
+
+	//Nothing beyond the window is sent, however often pump is called.
+	while (p.first.pump())
+		;
+
+	p.first.pump();
+	read_all(p.second, p.second_connection);
+
+	EXPECT_EQ(4096U, p.second_events.data.size());
+
+	//Credit is returned in batches as the receiver consumes data, and each batch lets more through.
+	for (word round = 0; round < 10 && p.second_events.data.size() < payload.size(); round++) {
+		auto before = p.second_events.data.size();
+
+		p.second.pump();
+		read_all(p.first, p.first_connection);
+
+		while (p.first.pump())
+			;
+
+		read_all(p.second, p.second_connection);
+
+		EXPECT_LT(before, p.second_events.data.size());
+	}
+
+	EXPECT_EQ(payload, p.second_events.data);
+	EXPECT_TRUE(p.second_events.reset.empty());
+}
+
+TEST(StreamMultiplexer, OverrunningTheWindowResetsTheStream) {
+	stream_multiplexer::options settings;
+	settings.chunk_size = 1024;
+	settings.initial_window = 4096;
+	settings.initiator = false;
+
+	auto pair = socket_pair();
+	auto raw = tcp_connection(net::socket(pair[0]));
+	auto served = tcp_connection(net::socket(pair[1]));
+	stream_multiplexer mux(served, settings);
+	recorder events;
+	events.watch(mux);
+
+	//A peer that ignores flow control sends a full window and then some on a stream it opens.
+	std::vector<uint8> frame(stream_multiplexer::header_length + 1024, 'x');
+	stream_id id = 1;
+	memcpy(frame.data(), &id, sizeof(id));
+	frame[sizeof(id)] = static_cast<uint8>(stream_multiplexer::frame_types::data);
+
+	for (word i = 0; i < 5; i++)
+		ASSERT_TRUE(raw.send(frame.data(), static_cast<word>(frame.size())));
+
+	ASSERT_TRUE(read_until(mux, served, [&]() { return !events.reset.empty(); }));
+
+	EXPECT_EQ(4096U, events.data.size());
+	EXPECT_EQ(id, events.reset[0]);
+	EXPECT_EQ(0U, mux.active_streams());
+
+	//The peer is told after the credit it never waited for, and anything else it sends on the stream is dropped.
+	mux.pump();
+
+	bool reset = false;
+	while (!reset && raw.data_available(1000000))
+		for (auto& i : raw.read())
+			reset = reset || (i.length == stream_multiplexer::header_length && i.data[sizeof(id)] == static_cast<uint8>(stream_multiplexer::frame_types::reset));
+
+	EXPECT_TRUE(reset);
+
+	ASSERT_TRUE(raw.send(frame.data(), static_cast<word>(frame.size())));
+	ASSERT_TRUE(served.data_available(1000000));
+	ASSERT_TRUE(mux.read());
+
+	EXPECT_EQ(1U, events.opened.size());
+	EXPECT_EQ(4096U, events.data.size());
+}
+
+#endif
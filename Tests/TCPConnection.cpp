@@ -0,0 +1,132 @@
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/TCPConnection.h>
+#include <Utilities/Net/RequestServer.h>
+
+#ifdef POSIX
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace util;
+using namespace util::net;
+
+//A temporary file holding length bytes. It is removed once closed.
+static std::unique_ptr<FILE, int(*)(FILE*)> temporary_file(word length) {
+	std::unique_ptr<FILE, int(*)(FILE*)> file(std::tmpfile(), &std::fclose);
+	EXPECT_NE(nullptr, file.get());
+
+	std::vector<uint8> contents(length, 'x');
+	EXPECT_EQ(length, std::fwrite(contents.data(), 1, contents.size(), file.get()));
+	std::fflush(file.get());
+
+	return file;
+}
+
+TEST(TCPConnection, SendFileFailsOnShortFile) {
+	int pair[2];
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	auto sender = tcp_connection(net::socket(pair[0]));
+	auto receiver = tcp_connection(net::socket(pair[1]));
+	auto file = temporary_file(100);
+
+	EXPECT_FALSE(sender.send_file(fileno(file.get()), 0, 200));
+
+	//Closing is left to the caller, which may share the connection with other threads.
+	EXPECT_TRUE(sender.is_connected());
+}
+
+TEST(TCPConnection, SendFileFailsWhenThePeerCloses) {
+	int pair[2];
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	auto sender = tcp_connection(net::socket(pair[0]));
+	auto file = temporary_file(4 * 1024 * 1024);
+
+	//Goes away after the transfer has started, once the socket buffer is full.
+	std::thread peer([&pair]() {
+		uint8 buffer[1024];
+		EXPECT_LT(0, ::read(pair[1], buffer, sizeof(buffer)));
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		::close(pair[1]);
+	});
+
+	//Would end the process with SIGPIPE if it were raised.
+	EXPECT_FALSE(sender.send_file(fileno(file.get()), 0, 4 * 1024 * 1024));
+
+	peer.join();
+}
+
+TEST(TCPConnection, ServersDisconnectConnectionsClosedByHandlers) {
+	request_server server(std::vector<endpoint>(), 1, 0xFFFF);
+	std::atomic<word> disconnected(0);
+	auto file = temporary_file(100);
+
+	server.on_request += [&file](tcp_connection& connection, word, uint8, uint8 method, data_stream&, data_stream& response) {
+		if (method == 1) {
+			if (!connection.send_file(fileno(file.get()), 0, 200))
+				connection.close();
+
+			return request_server::request_result::no_response;
+		}
+
+		response.write(static_cast<uint8>(1));
+
+		return request_server::request_result::success;
+	};
+
+	server.on_disconnect += [&disconnected](tcp_connection&) {
+		disconnected++;
+	};
+
+	server.start();
+
+	int failing[2], healthy[2];
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, failing));
+	ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, healthy));
+
+	server.adopt(make_unique<tcp_connection>(net::socket(failing[0])));
+	server.adopt(make_unique<tcp_connection>(net::socket(healthy[0])));
+
+	auto failing_peer = tcp_connection(net::socket(failing[1]));
+	auto healthy_peer = tcp_connection(net::socket(healthy[1]));
+
+	data_stream request;
+	request_server::message::write_header(request, 1, 1, 1);
+	ASSERT_TRUE(failing_peer.send(request.data(), request.size()));
+
+	//The peer sees the part of the message that went out and then the end of the connection.
+	bool closed = false;
+	while (!closed && failing_peer.data_available(5000000))
+		for (auto& i : failing_peer.read())
+			closed = closed || i.closed;
+
+	EXPECT_TRUE(closed);
+
+	for (word i = 0; i < 100 && disconnected == 0; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	EXPECT_EQ(1U, disconnected);
+
+	//The I/O thread survived to serve the other connection.
+	data_stream next;
+	request_server::message::write_header(next, 2, 1, 0);
+	ASSERT_TRUE(healthy_peer.send(next.data(), next.size()));
+
+	auto messages = healthy_peer.read(1);
+	ASSERT_EQ(1U, messages.size());
+	ASSERT_FALSE(messages[0].closed);
+	EXPECT_EQ(sizeof(uint16) + 2 * sizeof(uint8) + 1, messages[0].length);
+}
+
+#endif
@@ -0,0 +1,69 @@
+#include <vector>
+#include <chrono>
+#include <gtest/gtest.h>
+
+#include <Utilities/TimerWheel.h>
+
+using namespace util;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+TEST(TimerWheel, FiresWhenDue) {
+	timer_wheel wheel(milliseconds(10));
+	auto start = steady_clock::now();
+	int fired = 0;
+
+	wheel.schedule(milliseconds(50), [&]() { fired++; });
+
+	EXPECT_EQ(0U, wheel.advance(start + milliseconds(45)));
+	EXPECT_EQ(0, fired);
+	EXPECT_EQ(1U, wheel.advance(start + milliseconds(55)));
+	EXPECT_EQ(1, fired);
+	EXPECT_EQ(0U, wheel.size());
+}
+
+TEST(TimerWheel, Cancel) {
+	timer_wheel wheel(milliseconds(10));
+	auto start = steady_clock::now();
+	int fired = 0;
+
+	auto id = wheel.schedule(milliseconds(50), [&]() { fired++; });
+
+	EXPECT_TRUE(wheel.cancel(id));
+	EXPECT_FALSE(wheel.cancel(id));
+	EXPECT_EQ(0U, wheel.advance(start + milliseconds(100)));
+	EXPECT_EQ(0, fired);
+}
+
+TEST(TimerWheel, CascadesInOrder) {
+	timer_wheel wheel(milliseconds(1));
+	auto start = steady_clock::now();
+	std::vector<int> order;
+
+	for (int delay : { 300000, 5000, 70, 3 })
+		wheel.schedule(milliseconds(delay), [&order, delay]() { order.push_back(delay); });
+
+	EXPECT_EQ(1U, wheel.advance(start + milliseconds(60)));
+	EXPECT_EQ(1U, wheel.advance(start + milliseconds(4000)));
+	EXPECT_EQ(1U, wheel.advance(start + milliseconds(5001)));
+	EXPECT_EQ(0U, wheel.advance(start + milliseconds(299990)));
+	EXPECT_EQ(1U, wheel.advance(start + milliseconds(300001)));
+	EXPECT_EQ((std::vector<int>{ 3, 70, 5000, 300000 }), order);
+}
+
+TEST(TimerWheel, RescheduleFromCallback) {
+	timer_wheel wheel(milliseconds(10));
+	auto start = steady_clock::now();
+	int fired = 0;
+	timer_wheel::callback tick;
+
+	tick = [&]() {
+		if (++fired < 3)
+			wheel.schedule(milliseconds(10), tick);
+	};
+
+	wheel.schedule(milliseconds(10), tick);
+
+	EXPECT_EQ(3U, wheel.advance(start + milliseconds(105)));
+	EXPECT_EQ(3, fired);
+}
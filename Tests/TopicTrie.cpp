@@ -0,0 +1,62 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <gtest/gtest.h>
+
+#include <Utilities/TopicTrie.h>
+
+using namespace util;
+
+static std::vector<topic_trie::id> matches(const topic_trie& trie, const std::string& topic) {
+	std::vector<topic_trie::id> found;
+
+	trie.match(topic, [&found](topic_trie::id subscriber) { found.push_back(subscriber); });
+	std::sort(found.begin(), found.end());
+
+	return found;
+}
+
+TEST(TopicTrie, Wildcards) {
+	topic_trie trie;
+
+	trie.insert("prices/ABC/bid", 1);
+	trie.insert("prices/+/bid", 2);
+	trie.insert("prices/#", 3);
+	trie.insert("#", 4);
+	trie.insert("trades/+", 5);
+
+	EXPECT_EQ((std::vector<topic_trie::id>{ 1, 2, 3, 4 }), matches(trie, "prices/ABC/bid"));
+	EXPECT_EQ((std::vector<topic_trie::id>{ 2, 3, 4 }), matches(trie, "prices/XYZ/bid"));
+	EXPECT_EQ((std::vector<topic_trie::id>{ 3, 4 }), matches(trie, "prices"));
+	EXPECT_EQ((std::vector<topic_trie::id>{ 4 }), matches(trie, "trades"));
+	EXPECT_EQ((std::vector<topic_trie::id>{ 4, 5 }), matches(trie, "trades/ABC"));
+	EXPECT_EQ((std::vector<topic_trie::id>{ 4 }), matches(trie, "trades/ABC/1"));
+}
+
+TEST(TopicTrie, InsertAndErase) {
+	topic_trie trie;
+
+	EXPECT_TRUE(trie.insert("a/b", 1));
+	EXPECT_FALSE(trie.insert("a/b", 1));
+	EXPECT_TRUE(trie.insert("a/b", 2));
+	EXPECT_EQ(2U, trie.size());
+
+	EXPECT_FALSE(trie.erase("a/+", 1));
+	EXPECT_TRUE(trie.erase("a/b", 1));
+	EXPECT_FALSE(trie.erase("a/b", 1));
+	EXPECT_EQ((std::vector<topic_trie::id>{ 2 }), matches(trie, "a/b"));
+
+	EXPECT_TRUE(trie.erase("a/b", 2));
+	EXPECT_EQ(0U, trie.size());
+	EXPECT_TRUE(matches(trie, "a/b").empty());
+}
+
+TEST(TopicTrie, InvalidPatterns) {
+	topic_trie trie;
+
+	EXPECT_FALSE(topic_trie::is_valid("a/#/b"));
+	EXPECT_FALSE(topic_trie::is_valid("a/b+"));
+	EXPECT_FALSE(topic_trie::is_valid("a#"));
+	EXPECT_TRUE(topic_trie::is_valid("+/+/#"));
+	EXPECT_THROW(trie.insert("a/#/b", 1), topic_trie::invalid_pattern_exception);
+}
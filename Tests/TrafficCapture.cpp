@@ -0,0 +1,197 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/TrafficCapture.h>
+#include <Utilities/Net/RequestServer.h>
+
+#ifdef POSIX
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace util;
+using namespace util::net;
+
+static const std::string log_path = "traffic_capture_test.log";
+
+static data_stream request_frame(uint16 id, uint8 method) {
+	data_stream frame;
+	request_server::message::write_header(frame, id, 1, method);
+
+	return frame;
+}
+
+static std::vector<uint8> read_file(const std::string& path) {
+	std::vector<uint8> contents;
+	auto file = std::fopen(path.c_str(), "rb");
+	EXPECT_NE(nullptr, file);
+
+	if (!file)
+		return contents;
+
+	int c;
+	while ((c = std::fgetc(file)) != EOF)
+		contents.push_back(static_cast<uint8>(c));
+
+	std::fclose(file);
+
+	return contents;
+}
+
+static void write_file(const std::string& path, const std::vector<uint8>& contents) {
+	auto file = std::fopen(path.c_str(), "wb");
+	ASSERT_NE(nullptr, file);
+	ASSERT_EQ(contents.size(), std::fwrite(contents.data(), 1, contents.size(), file));
+	std::fclose(file);
+}
+
+//Answers every request but those for method 1, which are never answered.
+static request_server::request_result answer_all_but_one(tcp_connection&, word, uint8, uint8 method, data_stream&, data_stream& response) {
+	if (method == 1)
+		return request_server::request_result::no_response;
+
+	response.write(method);
+
+	return request_server::request_result::success;
+}
+
+TEST(TrafficCapture, CapturedTrafficReplays) {
+	{
+		request_server recording(std::vector<endpoint>(), 1, 0xFFFF);
+		std::atomic<word> disconnected(0);
+
+		recording.on_request += &answer_all_but_one;
+		recording.on_disconnect += [&disconnected](tcp_connection&) {
+			disconnected++;
+		};
+
+		recording.enable_capture(log_path);
+		recording.start();
+
+		int pair[2];
+		ASSERT_EQ(0, ::socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+		recording.adopt(make_unique<tcp_connection>(net::socket(pair[0])));
+
+		auto peer = tcp_connection(net::socket(pair[1]));
+
+		for (uint16 i = 0; i < 3; i++) {
+			auto frame = request_frame(i, 0);
+			ASSERT_TRUE(peer.send(frame.data(), frame.size()));
+
+			auto messages = peer.read(1);
+			ASSERT_EQ(1U, messages.size());
+			ASSERT_FALSE(messages[0].closed);
+		}
+
+		peer.close();
+
+		for (word i = 0; i < 100 && disconnected == 0; i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+		ASSERT_EQ(1U, disconnected);
+
+		recording.stop();
+	}
+
+	traffic_replayer replayer(log_path);
+	EXPECT_EQ(3U, replayer.size());
+
+	request_server target(endpoint(std::string("31496")), 1, 0xFFFF);
+	target.on_request += &answer_all_but_one;
+	target.start();
+
+	auto results = replayer.run(endpoint(std::string("127.0.0.1"), std::string("31496")), 0);
+
+	EXPECT_EQ(1U, results.connections);
+	EXPECT_EQ(3U, results.frames);
+	EXPECT_EQ(3U, results.responses);
+	EXPECT_GE(results.max, results.p50);
+
+	::unlink(log_path.c_str());
+}
+
+TEST(TrafficCapture, ReplayStopsWaitingAfterTheDrainTimeout) {
+	{
+		traffic_recorder recorder(log_path);
+
+		auto answered = request_frame(1, 0);
+		auto ignored = request_frame(2, 1);
+
+		recorder.record(1, answered.data(), answered.size());
+		recorder.record(1, ignored.data(), ignored.size());
+		recorder.record_close(1);
+	}
+
+	request_server target(endpoint(std::string("31497")), 1, 0xFFFF);
+	target.on_request += &answer_all_but_one;
+	target.start();
+
+	traffic_replayer replayer(log_path);
+
+	//Both the close and the end of the replay wait for the unanswered request, each no longer than the timeout.
+	auto results = replayer.run(endpoint(std::string("127.0.0.1"), std::string("31497")), 0, std::chrono::milliseconds(200));
+
+	EXPECT_EQ(2U, results.frames);
+	EXPECT_EQ(1U, results.responses);
+	EXPECT_LE(std::chrono::microseconds(400000), results.elapsed);
+	EXPECT_GT(std::chrono::microseconds(2000000), results.elapsed);
+
+	::unlink(log_path.c_str());
+}
+
+TEST(TrafficCapture, InvalidLogsAreRefused) {
+	::unlink(log_path.c_str());
+	EXPECT_THROW(traffic_replayer replayer(log_path), traffic_replayer::could_not_open_exception);
+
+	{
+		traffic_recorder recorder(log_path);
+
+		auto frame = request_frame(1, 0);
+		recorder.record(1, frame.data(), frame.size());
+		recorder.record(2, frame.data(), frame.size());
+	}
+
+	auto valid = read_file(log_path);
+	EXPECT_EQ(2U, traffic_replayer(log_path).size());
+
+	std::vector<std::vector<uint8>> invalid;
+
+	//Empty, without the magic, and with a version that isn't known.
+	invalid.push_back(std::vector<uint8>());
+	invalid.push_back(valid);
+	invalid.back()[0] = 'X';
+	invalid.push_back(valid);
+	invalid.back()[4]++;
+
+	//A frame shorter than its length says.
+	invalid.push_back(valid);
+	invalid.back().pop_back();
+
+	//A varint that never ends, and a record of an unknown kind.
+	invalid.push_back(valid);
+	invalid.back().push_back(0);
+	invalid.back().push_back(0x80);
+	invalid.push_back(valid);
+	invalid.back().insert(invalid.back().end(), { 7, 0, 0 });
+
+	for (auto& i : invalid) {
+		write_file(log_path, i);
+		EXPECT_THROW(traffic_replayer replayer(log_path), traffic_replayer::invalid_log_exception) << i.size();
+	}
+
+	//A log that ends cleanly after a close is whole.
+	auto closed = valid;
+	closed.insert(closed.end(), { 1, 0, 2 });
+	write_file(log_path, closed);
+	EXPECT_EQ(2U, traffic_replayer(log_path).size());
+
+	::unlink(log_path.c_str());
+}
+
+#endif
@@ -0,0 +1,95 @@
+#include <string>
+#include <vector>
+#include <future>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <gtest/gtest.h>
+
+#include <Utilities/Net/WebSocketConnection.h>
+
+#ifdef POSIX
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+using namespace util;
+using namespace util::net;
+
+//Connects a client to a server over loopback. The server only accepts masked frames, so anything it receives was masked.
+static std::unique_ptr<websocket_connection> connect(const std::string& port, std::unique_ptr<websocket_connection>& server) {
+	socket listener(socket::families::ip_any, socket::types::tcp, endpoint(port));
+
+	auto connecting = std::async(std::launch::async, [&port]() { return std::unique_ptr<websocket_connection>(new websocket_connection(endpoint(std::string("127.0.0.1"), port))); });
+
+	server.reset(new websocket_connection(listener.accept()));
+
+	//The first read answers the upgrade.
+	EXPECT_TRUE(server->read().empty());
+
+	return connecting.get();
+}
+
+TEST(WebSocket, ClientFramesAreMasked) {
+	std::unique_ptr<websocket_connection> server;
+	auto client = connect("31483", server);
+
+	ASSERT_TRUE(client->send(reinterpret_cast<const uint8*>("hello"), 5));
+
+	std::vector<uint8> large(1000);
+	for (word i = 0; i < large.size(); i++)
+		large[i] = static_cast<uint8>(i);
+
+	ASSERT_TRUE(client->send(large.data(), static_cast<word>(large.size())));
+
+	auto messages = server->read(2);
+	ASSERT_EQ(2U, messages.size());
+	ASSERT_FALSE(messages[0].closed);
+	ASSERT_EQ(5U, messages[0].length);
+	EXPECT_EQ(0, std::memcmp(messages[0].data, "hello", 5));
+	ASSERT_EQ(large.size(), messages[1].length);
+	EXPECT_EQ(0, std::memcmp(messages[1].data, large.data(), large.size()));
+
+	ASSERT_TRUE(server->send(reinterpret_cast<const uint8*>("world"), 5));
+
+	messages = client->read(1);
+	ASSERT_EQ(1U, messages.size());
+	ASSERT_EQ(5U, messages[0].length);
+	EXPECT_EQ(0, std::memcmp(messages[0].data, "world", 5));
+}
+
+#ifdef POSIX
+TEST(WebSocket, ClientStreamsMaskedFramesAfterAppendedOnes) {
+	std::unique_ptr<websocket_connection> server;
+	auto client = connect("31484", server);
+
+	std::vector<uint8> contents(3000);
+	for (word i = 0; i < contents.size(); i++)
+		contents[i] = static_cast<uint8>(i * 7);
+
+	auto file = std::tmpfile();
+	ASSERT_NE(nullptr, file);
+	ASSERT_EQ(contents.size(), std::fwrite(contents.data(), 1, contents.size(), file));
+	std::fflush(file);
+
+	client->append(reinterpret_cast<const uint8*>("first"), 5);
+	ASSERT_TRUE(client->send_file(fileno(file), 0, contents.size()));
+
+	std::vector<tcp_connection::message> messages;
+	while (messages.size() < 2) {
+		auto received = server->read(1);
+		ASSERT_FALSE(received.empty());
+		ASSERT_FALSE(received.back().closed);
+
+		for (auto& i : received)
+			messages.push_back(std::move(i));
+	}
+
+	ASSERT_EQ(5U, messages[0].length);
+	EXPECT_EQ(0, std::memcmp(messages[0].data, "first", 5));
+	ASSERT_EQ(contents.size(), messages[1].length);
+	EXPECT_EQ(0, std::memcmp(messages[1].data, contents.data(), contents.size()));
+
+	std::fclose(file);
+}
+#endif
@@ -0,0 +1,108 @@
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <gtest/gtest.h>
+
+#include <Utilities/WorkProcessor.h>
+#include <Utilities/FairQueue.h>
+
+#ifdef POSIX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace util;
+
+//Feeds items while another thread keeps changing how long idle workers spin.
+template<typename Q> static void spin_while_processing() {
+	work_processor<int, Q> processor(2);
+	std::atomic<word> processed(0);
+
+	processor.on_item += [&processed](word, int&) {
+		processed++;
+	};
+
+	processor.backlog().set_spin(std::chrono::microseconds(200));
+	processor.start();
+
+	std::atomic<bool> changing(true);
+	std::thread changer([&]() {
+		for (word i = 0; changing; i++)
+			processor.backlog().set_spin(std::chrono::microseconds(i % 2 == 0 ? 0 : 200));
+	});
+
+	for (int i = 0; i < 1000; i++) {
+		processor.add_work(i + 0);
+
+		if (i % 100 == 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	for (word i = 0; i < 500 && processed < 1000; i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	changing = false;
+	changer.join();
+
+	EXPECT_EQ(1000U, processed);
+
+	//Spinning workers still notice being stopped.
+	processor.stop();
+}
+
+TEST(WorkProcessor, StopsWhileWorkersGoIdle) {
+	//Stopping races workers that just found the queue empty and are about to wait, which must still be woken.
+	for (word i = 0; i < 200; i++) {
+		work_processor<int> processor(4);
+		processor.on_item += [](word, int&) {};
+		processor.start();
+		processor.add_work(0);
+		processor.stop();
+	}
+}
+
+TEST(WorkProcessor, SpinningWorkersTakeEveryItem) {
+	spin_while_processing<work_queue<int>>();
+	spin_while_processing<fair_queue<int>>();
+}
+
+#if defined POSIX && defined CPU_SETSIZE
+TEST(WorkProcessor, PinsWorkersToTheirCores) {
+	work_processor<int> processor(2);
+	std::vector<std::atomic<sword>> pinned(2);
+	std::atomic<word> reported(0);
+
+	for (auto& i : pinned)
+		i = -2;
+
+	//Each worker reports the only core it may run on, or -1 if it may run on several.
+	processor.on_item += [&](word worker, int&) {
+		if (pinned[worker] != -2)
+			return;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		ASSERT_EQ(0, pthread_getaffinity_np(pthread_self(), sizeof(set), &set));
+
+		pinned[worker] = CPU_COUNT(&set) == 1 && CPU_ISSET(0, &set) ? 0 : -1;
+		reported++;
+	};
+
+	processor.set_affinity({ 0, -1 });
+	processor.start();
+
+	for (word i = 0; i < 1000 && reported < 2; i++) {
+		processor.add_work(0);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	processor.stop();
+
+	ASSERT_EQ(2U, reported);
+	EXPECT_EQ(0, pinned[0]);
+
+	if (std::thread::hardware_concurrency() > 1)
+		EXPECT_EQ(-1, pinned[1]);
+}
+#endif
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "Common.h"
+
+namespace util {
+	///A flag shared between the owner of some work and whoever performs it.
+	///Copies refer to the same flag, so cancelling any copy cancels them all.
+	class cancellation_token {
+		std::shared_ptr<std::atomic<bool>> flag;
+
+		public:
+			exported cancellation_token() : flag(std::make_shared<std::atomic<bool>>(false)) {
+
+			}
+
+			///Requests that the work stop.
+			exported void cancel() {
+				*this->flag = true;
+			}
+
+			///Gets whether or not the work should stop.
+			///@return True if cancel has been called on any copy, false otherwise.
+			exported bool cancelled() const {
+				return *this->flag;
+			}
+	};
+}
@@ -5,6 +5,7 @@
 #include <mutex>
 #include <utility>
 #include <functional>
+#include <memory>
 
 #include "Common.h"
 
@@ -66,7 +67,8 @@ namespace util {
 		event_single& operator=(const event_single& other) = delete;
 
 	private:
-		handler_type handler;
+		//Shared so a call can take its own reference and run without holding the lock, letting callers on many threads run at once.
+		std::shared_ptr<const handler_type> handler;
 		std::mutex lock;
 
 	public:
@@ -81,8 +83,7 @@ namespace util {
 			std::unique_lock<std::mutex> lck1(this->lock);
 			std::unique_lock<std::mutex> lck2(other.lock);
 
-			this->handler = other.handler;
-			other.handler = nullptr;
+			this->handler = std::move(other.handler);
 
 			return *this;
 		}
@@ -93,16 +94,25 @@ namespace util {
 			if (this->handler)
 				throw event_already_set();
 
-			this->handler = func;
+			this->handler = std::make_shared<const handler_type>(std::move(func));
 
 			if (this->event_added)
 				this->event_added();
 		}
 
 		template<typename... V> exported T operator()(V&&... paras) {
-			std::unique_lock<std::mutex> lck(this->lock);
+			std::shared_ptr<const handler_type> current;
+
+			{
+				std::unique_lock<std::mutex> lck(this->lock);
+
+				current = this->handler;
+			}
+
+			if (!current)
+				throw std::bad_function_call();
 
-			return this->handler(std::forward<V>(paras)...);
+			return (*current)(std::forward<V>(paras)...);
 		}
 	};
 }
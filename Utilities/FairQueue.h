@@ -0,0 +1,206 @@
+#pragma once
+
+#include <utility>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "Common.h"
+#include "Misc.h"
+
+namespace util {
+	///A blocking queue with the same interface as work_queue that serves items fairly across flows.
+	///Each item is mapped to a flow by a key function and flows are served by deficit round robin,
+	///so a flow with weight w gets w * quantum items per round no matter how many it has queued.
+	///Without a key function every item belongs to the same flow and the queue is plain FIFO.
+	template<typename T> class fair_queue {
+		static_assert(std::is_move_assignable<T>::value || std::is_move_constructible<T>::value, "typename T must be move assignable and constructible.");
+
+		public:
+			typedef std::function<uint64(const T&)> key_function;
+			typedef std::function<word(uint64)> weight_function;
+
+		private:
+			struct flow {
+				std::deque<T> items;
+				word deficit;
+				word weight;
+			};
+
+			std::unordered_map<uint64, flow> flows;
+			std::deque<uint64> active;
+			std::shared_ptr<const key_function> key;
+			weight_function weight;
+			word quantum;
+
+			std::mutex lock;
+			std::condition_variable cv;
+			std::atomic<bool> alive;
+			std::atomic<word> count;
+			std::atomic<int64> spin;
+
+			T pop() {
+				auto current = this->active.front();
+				auto& f = this->flows[current];
+
+				if (f.deficit == 0)
+					f.deficit = this->quantum * f.weight;
+
+				T item(std::move(f.items.front()));
+				f.items.pop_front();
+				f.deficit--;
+				this->count.fetch_sub(1, std::memory_order_relaxed);
+
+				if (f.items.empty()) {
+					this->active.pop_front();
+
+					//Keyed flows come and go, but the one flow every item shares without a key would be recreated for the next item.
+					if (this->key)
+						this->flows.erase(current);
+				}
+				else if (f.deficit == 0) {
+					this->active.pop_front();
+					this->active.push_back(current);
+				}
+
+				return item;
+			}
+
+		public:
+			class waiter_killed_exception {};
+
+			fair_queue(const fair_queue& other) = delete;
+			fair_queue& operator=(const fair_queue& other) = delete;
+
+			exported fair_queue(key_function key = nullptr, weight_function weight = nullptr, word quantum = 1) : key(key ? std::make_shared<const key_function>(std::move(key)) : nullptr), weight(weight), quantum(quantum), spin(0) {
+				this->alive = true;
+				this->count = 0;
+			}
+
+			exported ~fair_queue() {
+				this->kill_waiters();
+			}
+
+			exported fair_queue(fair_queue&& other) : spin(0) {
+				this->alive = true;
+				this->count = 0;
+				*this = std::move(other);
+			}
+
+			exported fair_queue& operator=(fair_queue&& other) {
+				std::unique_lock<std::mutex> lck1(this->lock);
+				std::unique_lock<std::mutex> lck2(other.lock);
+
+				this->flows = std::move(other.flows);
+				this->active = std::move(other.active);
+				std::atomic_store(&this->key, std::atomic_load(&other.key));
+				this->weight = std::move(other.weight);
+				this->quantum = other.quantum;
+				this->count = other.count.load();
+				this->spin = other.spin.load();
+				other.count = 0;
+
+				return *this;
+			}
+
+			///Changes how items are assigned to flows. Only affects flows created afterwards.
+			///@param key Maps an item to its flow. Null puts every item in one flow.
+			///@param weight Maps a flow key to its weight. Null gives every flow a weight of one.
+			///@param quantum The number of items a flow of weight one is served per round.
+			exported void set_policy(key_function key, weight_function weight = nullptr, word quantum = 1) {
+				std::unique_lock<std::mutex> lck(this->lock);
+
+				std::atomic_store(&this->key, key ? std::make_shared<const key_function>(std::move(key)) : std::shared_ptr<const key_function>());
+				this->weight = weight;
+				this->quantum = quantum > 0 ? quantum : 1;
+			}
+
+			///Makes dequeue spin for up to the given time waiting for an item before it sleeps.
+			///Trades a busy core for not paying the wake up latency when items arrive often. Zero, the default, sleeps right away.
+			exported void set_spin(std::chrono::microseconds spin) {
+				//Read by consumers without the lock, which they only take once they stop spinning.
+				this->spin = spin.count();
+			}
+
+			exported void enqueue(T&& item) {
+				//Keyed before locking so a slow key function doesn't hold up every producer and consumer.
+				auto key = std::atomic_load(&this->key);
+				uint64 k = key ? (*key)(item) : 0;
+
+				std::unique_lock<std::mutex> lock(this->lock);
+
+				auto iter = this->flows.find(k);
+
+				if (iter == this->flows.end()) {
+					iter = this->flows.emplace(k, flow()).first;
+					iter->second.weight = this->weight ? this->weight(k) : 1;
+
+					if (iter->second.weight == 0)
+						iter->second.weight = 1;
+				}
+
+				if (iter->second.items.empty()) {
+					iter->second.deficit = 0;
+					this->active.push_back(k);
+				}
+
+				iter->second.items.push_back(std::move(item));
+				this->count.fetch_add(1, std::memory_order_release);
+				this->cv.notify_one();
+			}
+
+			exported bool dequeue(T& target) {
+				if (!this->alive)
+					return false;
+
+				misc::spin_wait(this->count, this->alive, std::chrono::microseconds(this->spin.load(std::memory_order_relaxed)));
+
+				std::unique_lock<std::mutex> lock(this->lock);
+
+				while (this->active.empty()) {
+					if (!this->alive)
+						return false;
+
+					this->cv.wait(lock);
+				}
+
+				target = this->pop();
+
+				return true;
+			}
+
+			exported T dequeue() {
+				if (!this->alive)
+					throw waiter_killed_exception();
+
+				misc::spin_wait(this->count, this->alive, std::chrono::microseconds(this->spin.load(std::memory_order_relaxed)));
+
+				std::unique_lock<std::mutex> lock(this->lock);
+
+				while (this->active.empty()) {
+					if (!this->alive)
+						throw waiter_killed_exception();
+
+					this->cv.wait(lock);
+				}
+
+				return this->pop();
+			}
+
+			exported void kill_waiters() {
+				//Set under the lock so a consumer can't miss it between finding the queue empty and starting to wait.
+				{
+					std::unique_lock<std::mutex> lock(this->lock);
+					this->alive = false;
+				}
+
+				this->cv.notify_all();
+			}
+	};
+}
@@ -0,0 +1,290 @@
+#pragma once
+
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstddef>
+
+#include "Common.h"
+#include "Misc.h"
+
+namespace util {
+	///A bounded blocking queue with the same interface as work_queue, for use as the queue of a work_processor when items arrive too quickly for a lock.
+	///Items live in a ring of cells that producers and consumers claim with a compare and swap on their position, so neither takes a lock
+	///and an uncontended enqueue or dequeue is a handful of atomic operations. Each cell carries a sequence number that says whose turn it is.
+	///Consumers that find the queue empty spin, backing off, then sleep. Producers only take the lock to wake one when a consumer is asleep.
+	///A producer that finds the queue full waits for room.
+	template<typename T> class mpmc_queue {
+		static_assert(std::is_move_constructible<T>::value, "typename T must be move constructible.");
+
+		static const word cache_line = 64;
+
+		struct cell {
+			std::atomic<std::size_t> sequence;
+			typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+
+			T& item() {
+				return *reinterpret_cast<T*>(&this->storage);
+			}
+		};
+
+		//The positions are each on their own cache line so producers and consumers don't invalidate each other's.
+		std::unique_ptr<cell[]> cells;
+		std::size_t mask;
+		char pad1[cache_line];
+		std::atomic<std::size_t> enqueue_position;
+		char pad2[cache_line];
+		std::atomic<std::size_t> dequeue_position;
+		char pad3[cache_line];
+
+		std::mutex lock;
+		std::condition_variable cv;
+		std::atomic<word> sleepers;
+		std::atomic<bool> alive;
+		std::chrono::microseconds spin;
+
+		void allocate(word capacity) {
+			std::size_t size = 2;
+
+			while (size < capacity)
+				size <<= 1;
+
+			this->cells.reset(new cell[size]);
+			this->mask = size - 1;
+
+			for (std::size_t i = 0; i < size; i++)
+				this->cells[i].sequence.store(i, std::memory_order_relaxed);
+
+			this->enqueue_position = 0;
+			this->dequeue_position = 0;
+		}
+
+		//Claims the oldest cell holding an item, or returns null if there is none.
+		cell* claim(std::size_t& position) {
+			position = this->dequeue_position.load(std::memory_order_relaxed);
+
+			while (true) {
+				auto c = &this->cells[position & this->mask];
+				auto difference = static_cast<std::ptrdiff_t>(c->sequence.load(std::memory_order_acquire) - (position + 1));
+
+				if (difference == 0) {
+					if (this->dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						return c;
+				}
+				else if (difference < 0) {
+					return nullptr;
+				}
+				else {
+					position = this->dequeue_position.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		//Destroys the moved from item and hands the cell to the producer one lap ahead.
+		void vacate(cell* c, std::size_t position) {
+			c->item().~T();
+			c->sequence.store(position + this->mask + 1, std::memory_order_release);
+		}
+
+		void drain() {
+			std::size_t position;
+			cell* c;
+
+			while ((c = this->claim(position)) != nullptr)
+				this->vacate(c, position);
+		}
+
+		bool wait() {
+			auto until = std::chrono::steady_clock::now() + this->spin;
+			word backoff = 1;
+
+			while (this->alive && std::chrono::steady_clock::now() < until) {
+				if (!this->empty())
+					return true;
+
+				for (word i = 0; i < backoff; i++)
+					misc::cpu_relax();
+
+				if (backoff < 64)
+					backoff <<= 1;
+				else
+					std::this_thread::yield();
+			}
+
+			std::unique_lock<std::mutex> lck(this->lock);
+
+			//Announcing the sleep before checking again pairs with the fence in enqueue, so either the producer sees the sleeper or this sees the item.
+			this->sleepers.fetch_add(1, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			if (this->alive && this->empty())
+				this->cv.wait(lck);
+
+			this->sleepers.fetch_sub(1, std::memory_order_relaxed);
+
+			return this->alive;
+		}
+
+		bool empty() const {
+			auto position = this->dequeue_position.load(std::memory_order_relaxed);
+			auto& c = this->cells[position & this->mask];
+
+			return static_cast<std::ptrdiff_t>(c.sequence.load(std::memory_order_acquire) - (position + 1)) < 0;
+		}
+
+		public:
+			class waiter_killed_exception {};
+
+			mpmc_queue(const mpmc_queue& other) = delete;
+			mpmc_queue& operator=(const mpmc_queue& other) = delete;
+
+			///Constructs an empty queue.
+			///@param capacity The most items held at once. Rounded up to a power of two.
+			exported mpmc_queue(word capacity = 1 << 16) : spin(20) {
+				this->sleepers = 0;
+				this->alive = true;
+				this->allocate(capacity);
+			}
+
+			exported ~mpmc_queue() {
+				this->kill_waiters();
+				this->drain();
+			}
+
+			exported mpmc_queue(mpmc_queue&& other) : spin(20) {
+				this->sleepers = 0;
+				this->alive = true;
+				this->allocate(2);
+				*this = std::move(other);
+			}
+
+			///Not safe while either queue is in use.
+			exported mpmc_queue& operator=(mpmc_queue&& other) {
+				this->drain();
+
+				//The ring left behind is empty, so it is as good as new for other.
+				std::swap(this->cells, other.cells);
+				std::swap(this->mask, other.mask);
+
+				auto enqueued = this->enqueue_position.load();
+				auto dequeued = this->dequeue_position.load();
+
+				this->enqueue_position = other.enqueue_position.load();
+				this->dequeue_position = other.dequeue_position.load();
+				other.enqueue_position = enqueued;
+				other.dequeue_position = dequeued;
+
+				this->spin = other.spin;
+
+				return *this;
+			}
+
+			///Sets the longest dequeue spins waiting for an item before it sleeps. Twenty microseconds by default.
+			exported void set_spin(std::chrono::microseconds spin) {
+				this->spin = spin;
+			}
+
+			///Adds an item unless the queue is full.
+			///@return True if the item was added. It is left untouched otherwise.
+			exported bool try_enqueue(T&& item) {
+				auto position = this->enqueue_position.load(std::memory_order_relaxed);
+				cell* c;
+
+				while (true) {
+					c = &this->cells[position & this->mask];
+					auto difference = static_cast<std::ptrdiff_t>(c->sequence.load(std::memory_order_acquire) - position);
+
+					if (difference == 0) {
+						if (this->enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (difference < 0) {
+						return false;
+					}
+					else {
+						position = this->enqueue_position.load(std::memory_order_relaxed);
+					}
+				}
+
+				new (&c->item()) T(std::move(item));
+				c->sequence.store(position + 1, std::memory_order_release);
+
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+
+				if (this->sleepers.load(std::memory_order_relaxed) != 0) {
+					std::unique_lock<std::mutex> lck(this->lock);
+					this->cv.notify_one();
+				}
+
+				return true;
+			}
+
+			///Removes the oldest item without waiting.
+			///@return True if an item was moved into target, false if the queue was empty.
+			exported bool try_dequeue(T& target) {
+				std::size_t position;
+				auto c = this->claim(position);
+
+				if (!c)
+					return false;
+
+				target = std::move(c->item());
+				this->vacate(c, position);
+
+				return true;
+			}
+
+			exported void enqueue(T&& item) {
+				for (word i = 0; !this->try_enqueue(std::move(item)); i++) {
+					if (i < 64)
+						misc::cpu_relax();
+					else
+						std::this_thread::yield();
+				}
+			}
+
+			exported bool dequeue(T& target) {
+				while (this->alive) {
+					if (this->try_dequeue(target))
+						return true;
+
+					if (!this->wait())
+						return false;
+				}
+
+				return false;
+			}
+
+			exported T dequeue() {
+				std::size_t position;
+
+				while (this->alive) {
+					auto c = this->claim(position);
+
+					if (c) {
+						T item(std::move(c->item()));
+						this->vacate(c, position);
+
+						return item;
+					}
+
+					if (!this->wait())
+						break;
+				}
+
+				throw waiter_killed_exception();
+			}
+
+			exported void kill_waiters() {
+				this->alive = false;
+
+				std::unique_lock<std::mutex> lck(this->lock);
+				this->cv.notify_all();
+			}
+	};
+}
@@ -0,0 +1,106 @@
+#include "MemoryAccountant.h"
+
+using namespace std;
+using namespace util;
+
+memory_accountant::charge::charge() : owner(nullptr), account(nullptr), category(0), size(0) {
+
+}
+
+memory_accountant::charge::charge(memory_accountant* owner, word category, uint64 size, atomic<uint64>* account) : owner(owner), account(account), category(category), size(size) {
+
+}
+
+memory_accountant::charge::charge(charge&& other) : owner(other.owner), account(other.account), category(other.category), size(other.size) {
+	other.owner = nullptr;
+	other.size = 0;
+}
+
+memory_accountant::charge::~charge() {
+	this->release();
+}
+
+memory_accountant::charge& memory_accountant::charge::operator=(charge&& other) {
+	this->release();
+
+	this->owner = other.owner;
+	this->account = other.account;
+	this->category = other.category;
+	this->size = other.size;
+
+	other.owner = nullptr;
+	other.size = 0;
+
+	return *this;
+}
+
+void memory_accountant::charge::release() {
+	if (this->owner)
+		this->owner->refund(this->category, this->size, this->account);
+
+	this->owner = nullptr;
+	this->size = 0;
+}
+
+uint64 memory_accountant::charge::bytes() const {
+	return this->size;
+}
+
+memory_accountant::memory_accountant() : total(0), budget(0) {
+	for (auto& i : this->categories)
+		i = 0;
+
+	this->category_budgets.fill(0);
+}
+
+void memory_accountant::set_budget(uint64 bytes) {
+	this->budget = bytes;
+}
+
+void memory_accountant::set_budget(word category, uint64 bytes) {
+	this->category_budgets[category] = bytes;
+}
+
+memory_accountant::charge memory_accountant::take(word category, uint64 bytes, atomic<uint64>* account) {
+	this->total.fetch_add(bytes, memory_order_relaxed);
+	this->categories[category].fetch_add(bytes, memory_order_relaxed);
+
+	if (account)
+		account->fetch_add(bytes, memory_order_relaxed);
+
+	return charge(this, category, bytes, account);
+}
+
+void memory_accountant::refund(word category, uint64 bytes, atomic<uint64>* account) {
+	this->total.fetch_sub(bytes, memory_order_relaxed);
+	this->categories[category].fetch_sub(bytes, memory_order_relaxed);
+
+	if (account)
+		account->fetch_sub(bytes, memory_order_relaxed);
+}
+
+uint64 memory_accountant::used() const {
+	return this->total.load(memory_order_relaxed);
+}
+
+uint64 memory_accountant::used(word category) const {
+	return this->categories[category].load(memory_order_relaxed);
+}
+
+bool memory_accountant::over_budget() const {
+	if (this->budget != 0 && this->used() > this->budget)
+		return true;
+
+	for (word i = 0; i < memory_accountant::max_categories; i++)
+		if (this->category_budgets[i] != 0 && this->used(i) > this->category_budgets[i])
+			return true;
+
+	return false;
+}
+
+bool memory_accountant::would_exceed(word category, uint64 bytes) const {
+	if (this->budget != 0 && this->used() + bytes > this->budget)
+		return true;
+
+	return this->category_budgets[category] != 0 && this->used(category) + bytes > this->category_budgets[category];
+}
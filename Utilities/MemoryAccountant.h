@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+
+#include "Common.h"
+
+namespace util {
+	///Counts the bytes held by a process in a handful of categories against an overall budget and a budget per category.
+	///Memory is accounted with charges that are refunded when they are destroyed, so it follows whatever owns them.
+	///A charge may also count against an account, such as that of one connection. The accountant only counts, callers decide what to do past a budget.
+	///Counting is lock free and may happen on any thread.
+	class memory_accountant {
+		public:
+			static const word max_categories = 8;
+
+			///Bytes counted against an accountant until destroyed or released. Moving it moves the bytes with it.
+			class charge {
+				public:
+					exported charge();
+					exported charge(charge&& other);
+					exported ~charge();
+
+					exported charge& operator=(charge&& other);
+
+					///Refunds the bytes now.
+					exported void release();
+
+					///Gets the number of bytes charged.
+					exported uint64 bytes() const;
+
+					charge(const charge& other) = delete;
+					charge& operator=(const charge& other) = delete;
+
+				private:
+					memory_accountant* owner;
+					std::atomic<uint64>* account;
+					word category;
+					uint64 size;
+
+					charge(memory_accountant* owner, word category, uint64 size, std::atomic<uint64>* account);
+
+					friend class memory_accountant;
+			};
+
+			///Constructs an accountant with no budgets.
+			exported memory_accountant();
+
+			///Sets the most bytes that may be used in total. Zero is no limit.
+			exported void set_budget(uint64 bytes);
+
+			///Sets the most bytes that may be used by one category. Zero is no limit.
+			exported void set_budget(word category, uint64 bytes);
+
+			///Counts bytes until the returned charge is destroyed. Charges are always taken, even past a budget.
+			///@param category The category to count them in, less than max_categories.
+			///@param bytes The number of bytes.
+			///@param account Also counts the bytes here if not null. Must outlive the charge.
+			///@return The charge.
+			exported charge take(word category, uint64 bytes, std::atomic<uint64>* account = nullptr);
+
+			///Gets the bytes used in total.
+			exported uint64 used() const;
+
+			///Gets the bytes used by one category.
+			exported uint64 used(word category) const;
+
+			///Gets whether or not the total or any category is over its budget.
+			exported bool over_budget() const;
+
+			///Gets whether or not charging more bytes would go over the total budget or that of the category.
+			exported bool would_exceed(word category, uint64 bytes) const;
+
+			memory_accountant(const memory_accountant& other) = delete;
+			memory_accountant& operator=(const memory_accountant& other) = delete;
+
+		private:
+			std::atomic<uint64> total;
+			std::array<std::atomic<uint64>, max_categories> categories;
+			uint64 budget;
+			std::array<uint64, max_categories> category_budgets;
+
+			void refund(word category, uint64 bytes, std::atomic<uint64>* account);
+	};
+}
@@ -1,5 +1,17 @@
 #include "Misc.h"
 
+#ifdef WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <Windows.h>
+#elif defined POSIX
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+#if defined _M_X64 || defined _M_IX86 || defined __x86_64__ || defined __i386__
+	#include <immintrin.h>
+#endif
+
 using namespace std;
 using namespace util;
 
@@ -59,3 +71,44 @@ bool misc::is_string_utf8(const string& str) {
 
 	return true;
 }
+
+bool misc::pin_thread(thread::native_handle_type thread, word core) {
+#ifdef WINDOWS
+	if (core >= sizeof(DWORD_PTR) * 8)
+		return false;
+
+	return ::SetThreadAffinityMask(thread, static_cast<DWORD_PTR>(1) << core) != 0;
+#elif defined POSIX
+	if (core >= CPU_SETSIZE)
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+
+	return ::pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#endif
+}
+
+void misc::cpu_relax() {
+#if defined _M_X64 || defined _M_IX86 || defined __x86_64__ || defined __i386__
+	_mm_pause();
+#elif defined __aarch64__
+	asm volatile("yield");
+#endif
+}
+
+void misc::spin_wait(const atomic<word>& count, const atomic<bool>& alive, chrono::microseconds spin) {
+	if (spin.count() == 0)
+		return;
+
+	auto until = chrono::steady_clock::now() + spin;
+
+	while (count.load(memory_order_acquire) == 0 && alive) {
+		for (word i = 0; i < 64 && count.load(memory_order_relaxed) == 0; i++)
+			misc::cpu_relax();
+
+		if (chrono::steady_clock::now() >= until)
+			break;
+	}
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include "Common.h"
 
@@ -18,5 +21,25 @@ namespace util {
 		 * @warning Does NOT check normalization etc!
 		 */
 		exported bool is_string_utf8(const std::string& str);
+
+		/**
+		 * Restrict @a thread to run only on processor @a core
+		 *
+		 * @return true if the thread was pinned, false otherwise
+		 */
+		exported bool pin_thread(std::thread::native_handle_type thread, word core);
+
+		/**
+		 * Tell the processor the caller is spinning on a value another thread will change,
+		 * so it can save power and yield to a sibling hyperthread
+		 */
+		exported void cpu_relax();
+
+		/**
+		 * Spin for up to @a spin while @a count is zero and @a alive is set, so a consumer
+		 * of a blocking queue that is handed an item soon can skip sleeping and being woken.
+		 * The count is polled without the queue's lock
+		 */
+		exported void spin_wait(const std::atomic<word>& count, const std::atomic<bool>& alive, std::chrono::microseconds spin);
 	}
 }
@@ -0,0 +1,719 @@
+#include "HTTPConnection.h"
+
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#include "RequestServer.h"
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+//The id, category and method that start every request and response.
+static const word header_length = sizeof(uint16) + 2 * sizeof(uint8);
+
+static const char* method_names[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH" };
+
+static bool equals_ignoring_case(const char* data, word length, const char* other) {
+	word i = 0;
+
+	for (; i < length && other[i] != '\0'; i++)
+		if (tolower(static_cast<unsigned char>(data[i])) != tolower(static_cast<unsigned char>(other[i])))
+			return false;
+
+	return i == length && other[i] == '\0';
+}
+
+static const char* reason_phrase(uint16 status) {
+	switch (status) {
+		case 100: return "Continue";
+		case 200: return "OK";
+		case 201: return "Created";
+		case 202: return "Accepted";
+		case 204: return "No Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 409: return "Conflict";
+		case 413: return "Payload Too Large";
+		case 429: return "Too Many Requests";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		case 501: return "Not Implemented";
+		case 503: return "Service Unavailable";
+		case 504: return "Gateway Timeout";
+		default: return "";
+	}
+}
+
+static void put(vector<uint8>& out, const void* data, word length) {
+	auto bytes = reinterpret_cast<const uint8*>(data);
+
+	out.insert(out.end(), bytes, bytes + length);
+}
+
+static void put(vector<uint8>& out, const char* text) {
+	put(out, text, static_cast<word>(strlen(text)));
+}
+
+static void put(vector<uint8>& out, word value, word base) {
+	char digits[16];
+	word count = 0;
+
+	do {
+		digits[count++] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value > 0);
+
+	while (count > 0)
+		out.push_back(static_cast<uint8>(digits[--count]));
+}
+
+static uint8* write_text(uint8* out, const uint8* data, word length) {
+	auto size = static_cast<uint16>(length);
+
+	memcpy(out, &size, sizeof(size));
+	memcpy(out + sizeof(size), data, length);
+
+	return out + sizeof(size) + length;
+}
+
+//Finds a CRLF at or after start, returning end if there is none.
+static word find_line_end(const uint8* data, word start, word end) {
+	for (word i = start; i + 1 < end; i++)
+		if (data[i] == '\r' && data[i + 1] == '\n')
+			return i;
+
+	return end;
+}
+
+string http_connection::request::text::str() const {
+	return string(this->data, this->length);
+}
+
+bool http_connection::request::text::equals(const char* other) const {
+	return equals_ignoring_case(this->data, this->length, other);
+}
+
+bool http_connection::request::parse(data_stream& payload) {
+	auto read_text = [&payload](text& target) {
+		auto length = payload.read<uint16>();
+
+		target.data = reinterpret_cast<const char*>(payload.read(length));
+		target.length = length;
+	};
+
+	try {
+		read_text(this->method);
+		read_text(this->target);
+
+		auto count = payload.read<uint16>();
+		this->headers.resize(count);
+
+		for (auto& i : this->headers) {
+			read_text(i.first);
+			read_text(i.second);
+		}
+
+		this->body_length = payload.size() - payload.position();
+		this->body = payload.read(this->body_length);
+	}
+	catch (data_stream::read_past_end_exception) {
+		return false;
+	}
+
+	return true;
+}
+
+const http_connection::request::text* http_connection::request::header(const char* name) const {
+	for (auto& i : this->headers)
+		if (i.first.equals(name))
+			return &i.second;
+
+	return nullptr;
+}
+
+http_connection::http_connection(socket&& socket) : tcp_connection(move(socket)) {
+	this->next_id = 0;
+	this->closing = false;
+	this->stopped = false;
+	this->continued = false;
+	this->unacknowledged = 0;
+}
+
+http_connection::http_connection(http_connection&& other) : tcp_connection(move(other)) {
+	this->exchanges = move(other.exchanges);
+	this->next_id = other.next_id;
+	this->closing = other.closing;
+	this->stopped = other.stopped;
+	this->continued = other.continued;
+	this->unacknowledged = other.unacknowledged.load();
+}
+
+http_connection& http_connection::operator = (http_connection&& other) {
+	static_cast<tcp_connection&>(*this) = move(static_cast<tcp_connection&>(other));
+	this->exchanges = move(other.exchanges);
+	this->next_id = other.next_id;
+	this->closing = other.closing;
+	this->stopped = other.stopped;
+	this->continued = other.continued;
+	this->unacknowledged = other.unacknowledged.load();
+	return *this;
+}
+
+http_connection::~http_connection() {
+
+}
+
+bool http_connection::data_available() const {
+	if (!this->connected)
+		throw tcp_connection::not_connected_exception();
+
+	//Readable when there is something to report even if the socket has nothing new.
+	if (this->closing || this->unacknowledged > 0)
+		return true;
+
+	return tcp_connection::data_available();
+}
+
+bool http_connection::data_available(word timeout) const {
+	if (!this->connected)
+		throw tcp_connection::not_connected_exception();
+
+	if (this->closing || this->unacknowledged > 0)
+		return true;
+
+	return tcp_connection::data_available(timeout);
+}
+
+vector<tcp_connection::message> http_connection::read(word wait_for) {
+	if (!this->connected)
+		throw tcp_connection::not_connected_exception();
+
+	vector<tcp_connection::message> messages;
+
+	//Streamed chunks count against the window of request_server until acknowledged. The client has no way to,
+	//so they are acknowledged once written and TCP is left to push back on the handler.
+	uint32 consumed = static_cast<uint32>(this->unacknowledged.exchange(0));
+	if (consumed > 0) {
+		data_stream credit;
+		request_server::message::write_header(credit, 0, request_server::stream_credit_category, 0);
+		credit.write(consumed);
+
+		messages.emplace_back(credit.data(), credit.size());
+	}
+
+	//Closed from here rather than where the last response is written so the owner learns of it on its own thread.
+	if (this->closing) {
+		if (!this->outgoing.empty())
+			this->flush();
+
+		tcp_connection::close();
+		messages.emplace_back(true);
+
+		return messages;
+	}
+
+	if (!messages.empty() && !tcp_connection::data_available(0))
+		return messages;
+
+	do {
+		word received = this->receive(this->buffer + this->received, tcp_connection::message_max_size - this->received);
+
+		if (received == tcp_connection::would_block) {
+			if (messages.size() < wait_for)
+				this->connection.data_available(100000);
+
+			continue;
+		}
+
+		if (received == 0) {
+			tcp_connection::close();
+			messages.emplace_back(true);
+			return messages;
+		}
+
+		//Nothing after a request that closes the connection is answered.
+		if (this->stopped) {
+			this->received = 0;
+			break;
+		}
+
+		this->received += received;
+
+		while (this->parse(messages))
+			;
+	} while (messages.size() < wait_for && !this->stopped);
+
+	return messages;
+}
+
+bool http_connection::parse(vector<tcp_connection::message>& messages) {
+	if (this->stopped || this->received == 0)
+		return false;
+
+	auto data = this->buffer;
+	word end = this->received;
+	bool full = end == tcp_connection::message_max_size;
+
+	static const char terminator[] = "\r\n\r\n";
+
+	//The head ends at the first empty line.
+	auto head_end = static_cast<word>(search(data, data + end, terminator, terminator + 4) - data);
+	if (head_end == end) {
+		if (full)
+			this->fail(431);
+
+		return false;
+	}
+
+	word line_end = find_line_end(data, 0, end);
+	word body_start = head_end + 4;
+
+	//The request line is the method, the target and the version separated by single spaces.
+	auto method_end = static_cast<word>(find(data, data + line_end, ' ') - data);
+	auto target_end = method_end < line_end ? static_cast<word>(find(data + method_end + 1, data + line_end, ' ') - data) : line_end;
+
+	if (method_end == 0 || target_end >= line_end || line_end - target_end - 1 != 8 || memcmp(data + target_end + 1, "HTTP/1.", 7) != 0) {
+		this->fail(400);
+		return false;
+	}
+
+	bool keep_alive = data[line_end - 1] != '0';
+	bool chunked = false;
+	bool expect_continue = false;
+	bool has_length = false;
+	bool has_encoding = false;
+	word content_length = 0;
+
+	this->header_spans.clear();
+
+	for (word position = line_end + 2; position < head_end + 2; ) {
+		word header_end = find_line_end(data, position, end);
+		auto colon = static_cast<word>(find(data + position, data + header_end, ':') - data);
+
+		if (colon == position || colon >= header_end) {
+			this->fail(400);
+			return false;
+		}
+
+		word value_start = colon + 1;
+		word value_end = header_end;
+
+		while (value_start < value_end && (data[value_start] == ' ' || data[value_start] == '\t'))
+			value_start++;
+
+		while (value_end > value_start && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t'))
+			value_end--;
+
+		auto name = reinterpret_cast<const char*>(data + position);
+		auto value = reinterpret_cast<const char*>(data + value_start);
+		word name_length = colon - position;
+		word value_length = value_end - value_start;
+
+		if (equals_ignoring_case(name, name_length, "Content-Length")) {
+			//A proxy in front may have picked a different one, so any second length, even an equal one, could smuggle a request past it.
+			if (has_length) {
+				this->fail(400);
+				return false;
+			}
+
+			has_length = true;
+
+			for (word i = 0; i < value_length; i++) {
+				if (!isdigit(static_cast<unsigned char>(value[i])) || content_length > tcp_connection::message_max_size) {
+					this->fail(400);
+					return false;
+				}
+
+				content_length = content_length * 10 + (value[i] - '0');
+			}
+		}
+		else if (equals_ignoring_case(name, name_length, "Transfer-Encoding")) {
+			if (has_encoding) {
+				this->fail(400);
+				return false;
+			}
+
+			//Only chunked is understood, and guessing where a body in any other coding ends would desynchronize the connection.
+			if (!equals_ignoring_case(value, value_length, "chunked")) {
+				this->fail(501);
+				return false;
+			}
+
+			has_encoding = true;
+			chunked = true;
+		}
+		else if (equals_ignoring_case(name, name_length, "Connection")) {
+			if (equals_ignoring_case(value, value_length, "close"))
+				keep_alive = false;
+			else if (equals_ignoring_case(value, value_length, "keep-alive"))
+				keep_alive = true;
+		}
+		else if (equals_ignoring_case(name, name_length, "Expect")) {
+			expect_continue = equals_ignoring_case(value, value_length, "100-continue");
+		}
+
+		this->header_spans.emplace_back(span{ position, name_length }, span{ value_start, value_length });
+		position = header_end + 2;
+	}
+
+	//Allowed by the standard with the length ignored, but that is exactly the disagreement request smuggling relies on.
+	if (chunked && has_length) {
+		this->fail(400);
+		return false;
+	}
+
+	word body_length = 0;
+	word consumed = 0;
+
+	if (chunked) {
+		//Checked to the end before anything moves, since an incomplete body is parsed again from the start once more arrives.
+		vector<span> chunks;
+		word position = body_start;
+
+		while (true) {
+			word size_end = find_line_end(data, position, end);
+			if (size_end >= end)
+				goto incomplete;
+
+			word size = 0;
+			word digits = 0;
+
+			for (word i = position; i < size_end && data[i] != ';'; i++, digits++) {
+				auto digit = tolower(data[i]);
+
+				if (!isxdigit(digit) || size > tcp_connection::message_max_size) {
+					this->fail(400);
+					return false;
+				}
+
+				size = size * 16 + static_cast<word>(isdigit(digit) ? digit - '0' : digit - 'a' + 10);
+			}
+
+			if (digits == 0) {
+				this->fail(400);
+				return false;
+			}
+
+			position = size_end + 2;
+
+			if (size == 0)
+				break;
+
+			if (position + size + 2 > end)
+				goto incomplete;
+
+			if (data[position + size] != '\r' || data[position + size + 1] != '\n') {
+				this->fail(400);
+				return false;
+			}
+
+			chunks.push_back(span{ position, size });
+			position += size + 2;
+		}
+
+		//Trailers are skipped up to the empty line that ends the body.
+		while (true) {
+			word trailer_end = find_line_end(data, position, end);
+			if (trailer_end >= end)
+				goto incomplete;
+
+			bool empty = trailer_end == position;
+			position = trailer_end + 2;
+
+			if (empty)
+				break;
+		}
+
+		consumed = position;
+
+		for (auto& i : chunks) {
+			memmove(data + body_start + body_length, data + i.offset, i.length);
+			body_length += i.length;
+		}
+	}
+	else {
+		if (body_start + content_length > tcp_connection::message_max_size) {
+			this->fail(413);
+			return false;
+		}
+
+		if (body_start + content_length > end)
+			goto incomplete;
+
+		body_length = content_length;
+		consumed = body_start + content_length;
+	}
+
+	{
+		methods method = methods::other;
+		for (word i = 0; i < sizeof(method_names) / sizeof(method_names[0]); i++)
+			if (method_end == strlen(method_names[i]) && memcmp(data, method_names[i], method_end) == 0)
+				method = static_cast<methods>(i);
+
+		word target_start = method_end + 1;
+		word size = header_length + 3 * sizeof(uint16) + method_end + target_end - target_start + body_length;
+
+		for (auto& i : this->header_spans)
+			size += 2 * sizeof(uint16) + i.first.length + i.second.length;
+
+		if (size > 0xFFFF) {
+			this->fail(431);
+			return false;
+		}
+
+		tcp_connection::message request(false);
+		request.data = new uint8[size];
+		request.length = size;
+
+		uint16 id = this->next_id++;
+		auto count = static_cast<uint16>(this->header_spans.size());
+		auto out = request.data;
+
+		memcpy(out, &id, sizeof(id));
+		out[2] = http_connection::request_category;
+		out[3] = static_cast<uint8>(method);
+		out = write_text(out + header_length, data, method_end);
+		out = write_text(out, data + target_start, target_end - target_start);
+		memcpy(out, &count, sizeof(count));
+		out += sizeof(count);
+
+		for (auto& i : this->header_spans) {
+			out = write_text(out, data + i.first.offset, i.first.length);
+			out = write_text(out, data + i.second.offset, i.second.length);
+		}
+
+		memcpy(out, data + body_start, body_length);
+
+		exchange e;
+		e.id = id;
+		e.head = method == methods::head;
+		e.close = !keep_alive;
+		e.streamed = false;
+		e.complete = false;
+
+		this->exchanges.push_back(move(e));
+		messages.push_back(move(request));
+
+		if (!keep_alive)
+			this->stopped = true;
+	}
+
+	memmove(data, data + consumed, this->received - consumed);
+	this->received -= consumed;
+	this->continued = false;
+
+	return true;
+
+incomplete:
+	if (full) {
+		this->fail(413);
+		return false;
+	}
+
+	//Clients that asked wait for this before sending the body. Only sent when it can't overtake an earlier response.
+	if (expect_continue && !this->continued && this->exchanges.empty()) {
+		static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+		this->continued = true;
+		this->ensure_write(reinterpret_cast<const uint8*>(interim), sizeof(interim) - 1);
+	}
+
+	return false;
+}
+
+void http_connection::fail(uint16 status) {
+	exchange e;
+	e.id = this->next_id++;
+	e.head = false;
+	e.close = true;
+	e.streamed = false;
+	e.complete = false;
+
+	this->exchanges.push_back(move(e));
+	this->stopped = true;
+	this->received = 0;
+
+	data_stream response;
+	http_connection::write_response(response, status);
+
+	this->render(this->exchanges.back(), response.data(), response.size(), false);
+	this->release();
+
+	if (!this->outgoing.empty())
+		this->flush();
+}
+
+void http_connection::append(const uint8* buffer, word length) {
+	if (!this->connected)
+		throw tcp_connection::not_connected_exception();
+
+	if (length < header_length)
+		return;
+
+	uint16 id;
+	memcpy(&id, buffer, sizeof(id));
+
+	auto target = find_if(this->exchanges.begin(), this->exchanges.end(), [id](const exchange& e) { return e.id == id; });
+	if (target == this->exchanges.end() || target->complete)
+		return;
+
+	//Whatever the handler wrote before it threw is no response at all, unless part of a streamed one is already out.
+	if ((buffer[2] & request_server::failure_flag) && !target->streamed) {
+		data_stream failure;
+		http_connection::write_response(failure, 500);
+
+		this->render(*target, failure.data(), failure.size(), false);
+	}
+	else {
+		this->render(*target, buffer + header_length, length - header_length, (buffer[2] & request_server::stream_chunk_flag) != 0);
+	}
+
+	this->release();
+}
+
+void http_connection::render(exchange& target, const uint8* payload, word length, bool chunk) {
+	auto& out = target.output;
+
+	if (chunk || target.streamed) {
+		if (!target.streamed) {
+			put(out, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n");
+			if (target.close)
+				put(out, "Connection: close\r\n");
+			put(out, "\r\n");
+
+			target.streamed = true;
+		}
+
+		if (chunk)
+			this->unacknowledged += length;
+
+		//An empty chunk would end the body early.
+		if (!target.head && length > 0) {
+			put(out, length, 16);
+			put(out, "\r\n");
+			put(out, payload, length);
+			put(out, "\r\n");
+		}
+
+		if (!chunk) {
+			if (!target.head)
+				put(out, "0\r\n\r\n");
+
+			target.complete = true;
+		}
+
+		return;
+	}
+
+	data_stream response(payload, length);
+	uint16 status = 503;
+	response_headers headers;
+	bool valid = false;
+
+	try {
+		if (length >= 2 * sizeof(uint16)) {
+			status = response.read<uint16>();
+			headers.resize(response.read<uint16>());
+
+			for (auto& i : headers) {
+				i.first = response.read_string();
+				i.second = response.read_string();
+			}
+
+			valid = status >= 100 && status <= 599;
+		}
+	}
+	catch (data_stream::read_past_end_exception) {
+
+	}
+
+	//Whatever doesn't hold a response, such as a retry code, means the server couldn't answer.
+	if (!valid) {
+		status = 503;
+		headers.clear();
+	}
+
+	word body_length = valid ? response.size() - response.position() : 0;
+	bool bodiless = status == 204 || status == 304 || status < 200;
+
+	put(out, "HTTP/1.1 ");
+	put(out, status, 10);
+	put(out, " ");
+	put(out, reason_phrase(status));
+	put(out, "\r\n");
+
+	for (auto& i : headers) {
+		put(out, i.first.data(), static_cast<word>(i.first.size()));
+		put(out, ": ");
+		put(out, i.second.data(), static_cast<word>(i.second.size()));
+		put(out, "\r\n");
+	}
+
+	if (!bodiless) {
+		put(out, "Content-Length: ");
+		put(out, body_length, 10);
+		put(out, "\r\n");
+	}
+
+	if (target.close)
+		put(out, "Connection: close\r\n");
+
+	put(out, "\r\n");
+
+	if (!bodiless && !target.head)
+		put(out, response.data_at_cursor(), body_length);
+
+	target.complete = true;
+}
+
+void http_connection::release() {
+	while (!this->exchanges.empty()) {
+		auto& front = this->exchanges.front();
+
+		this->outgoing.insert(this->outgoing.end(), front.output.begin(), front.output.end());
+		front.output.clear();
+
+		if (!front.complete)
+			break;
+
+		if (front.close) {
+			this->closing = true;
+			this->exchanges.clear();
+			break;
+		}
+
+		this->exchanges.pop_front();
+	}
+}
+
+bool http_connection::send_queued() {
+	if (!this->connected)
+		throw tcp_connection::not_connected_exception();
+
+	vector<uint8> combined;
+
+	for (auto& i : this->queued)
+		combined.insert(combined.end(), i.data, i.data + i.length);
+
+	this->queued.clear();
+
+	return this->send(combined.data(), static_cast<word>(combined.size()));
+}
+
+void http_connection::write_response(data_stream& response, uint16 status, const response_headers& headers) {
+	response.write(status);
+	response.write(static_cast<uint16>(headers.size()));
+
+	for (auto& i : headers) {
+		response.write(i.first);
+		response.write(i.second);
+	}
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <utility>
+#include <atomic>
+
+#include "../Common.h"
+#include "../DataStream.h"
+#include "Socket.h"
+#include "TCPConnection.h"
+
+namespace util {
+	namespace net {
+		///A tcp_connection that speaks HTTP/1.1 on the wire and request_server messages to its owner, so HTTP requests are served
+		///by the same I/O thread and workers as everything else. Accepted on endpoints with is_http set.
+		///Each request is read as a message with request_category and its method, whose payload request parses.
+		///Handlers answer by starting the response with write_response and appending the body.
+		///Connections are kept alive unless the client asks otherwise, and pipelined requests may be answered in any order,
+		///responses are held back until those before them are written. Every request must be answered or the ones after it never are,
+		///so request_server answers those it drops, because their deadline passed or their handler gave no response, with 503,
+		///and those whose handler threw with 500.
+		///Requests with more than one Content-Length or Transfer-Encoding, or with both, are refused with 400, and codings other than chunked with 501.
+		///Request heads are parsed in place in the receive buffer, and request bodies may be sent with chunked encoding.
+		///A streamed response is sent with chunked encoding as a 200, each chunk as it is written.
+		///Requests are limited to what fits in one message, larger ones are answered with 413 or 431 and the connection is closed.
+		class http_connection : public tcp_connection {
+			public:
+				enum class methods : uint8 {
+					get,
+					head,
+					post,
+					put,
+					delete_,
+					options,
+					patch,
+					other
+				};
+
+				///A view of the payload of a request message. Its text points into the payload, which must outlive it.
+				struct exported request {
+					struct exported text {
+						const char* data;
+						word length;
+
+						///Copies the text.
+						std::string str() const;
+
+						///Compares with a string, ignoring ASCII case.
+						bool equals(const char* other) const;
+					};
+
+					text method;
+					text target;
+					std::vector<std::pair<text, text>> headers;
+					const uint8* body;
+					word body_length;
+
+					///Reads a request from the payload without copying it.
+					///@param payload The request payload, positioned at its start. Left positioned after it.
+					///@return False if the payload is not a request written by http_connection.
+					bool parse(data_stream& payload);
+
+					///Gets the value of the first header with the name, ignoring case.
+					///@return The value, or nullptr if the header is missing.
+					const text* header(const char* name) const;
+				};
+
+				typedef std::vector<std::pair<std::string, std::string>> response_headers;
+
+				///The category of the messages HTTP requests are read as. Their method is one of methods.
+				static const uint8 request_category = 0x7D;
+
+				///Accepts the server side of a connection.
+				exported http_connection(socket&& socket);
+
+				exported http_connection(http_connection&& other);
+				exported virtual ~http_connection() override;
+				exported http_connection& operator=(http_connection&& other);
+
+				exported virtual std::vector<tcp_connection::message> read(word wait_for = 0) override;
+				exported virtual bool data_available() const override;
+				exported virtual bool data_available(word timeout) const override;
+				exported virtual void append(const uint8* buffer, word length) override;
+				exported virtual bool send_queued() override;
+
+				///Starts a response. The body is whatever is written to the stream after it.
+				///Content-Length, Transfer-Encoding and Connection are added by the connection and must not be given.
+				///Responses too short to hold a status, such as a retry code, are sent as 503.
+				///@param response The response stream the handler was given.
+				///@param status The status code.
+				///@param headers The headers.
+				exported static void write_response(data_stream& response, uint16 status, const response_headers& headers = response_headers());
+
+				http_connection(const http_connection& other) = delete;
+				http_connection& operator=(const http_connection& other) = delete;
+
+			private:
+				//A request in flight, in the order they arrived. Its response collects in output until every one before it is written.
+				struct exchange {
+					uint16 id;
+					bool head;
+					bool close;
+					bool streamed;
+					bool complete;
+					std::vector<uint8> output;
+				};
+
+				//Where a header lies in the receive buffer.
+				struct span {
+					word offset;
+					word length;
+				};
+
+				std::deque<exchange> exchanges;
+				std::vector<std::pair<span, span>> header_spans;
+				uint16 next_id;
+				bool closing;
+				bool stopped;
+				bool continued;
+				std::atomic<word> unacknowledged;
+
+				bool parse(std::vector<tcp_connection::message>& messages);
+				void fail(uint16 status);
+				void render(exchange& target, const uint8* payload, word length, bool chunk);
+				void release();
+		};
+	}
+}
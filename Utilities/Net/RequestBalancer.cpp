@@ -0,0 +1,455 @@
+#include "RequestBalancer.h"
+
+#include <utility>
+#include <algorithm>
+#include <exception>
+
+#include "Resolver.h"
+#include "TLS.h"
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+const word request_balancer::latency_samples;
+
+request_balancer::options::options() {
+	this->policy = policies::power_of_two;
+	this->hedging = false;
+	this->hedge_percentile = 0.95;
+	this->min_hedge_delay = chrono::milliseconds(1);
+	this->eject_after = 5;
+	this->ejection_time = chrono::seconds(5);
+	this->propagate_deadlines = false;
+}
+
+bool request_balancer::hedge::operator<(const hedge& other) const {
+	//priority_queue is a max heap, the earliest hedge must compare greatest.
+	return this->when > other.when;
+}
+
+request_balancer::request_balancer(vector<endpoint> endpoints, uint16 retry_code, options opts) : generator(random_device()()), opts(opts), samples(request_balancer::latency_samples) {
+	this->retry_code = retry_code;
+	this->running = false;
+	this->sample_index = 0;
+	this->sample_count = 0;
+	this->hedge_after = static_cast<uint64>(opts.min_hedge_delay.count());
+
+	for (auto& i : endpoints) {
+		auto b = make_unique<backend>();
+		b->ep = i;
+		b->outstanding = 0;
+		b->latency = 0;
+		b->failures = 0;
+		this->backends.push_back(move(b));
+	}
+}
+
+request_balancer::~request_balancer() {
+	this->stop();
+}
+
+void request_balancer::start() {
+	if (this->running)
+		return;
+
+	this->running = true;
+
+	vector<future<net::socket>> connecting;
+	for (auto& i : this->backends)
+		connecting.push_back(resolver::shared().connect(i->ep));
+
+	for (word i = 0; i < this->backends.size(); i++) {
+		auto& b = this->backends[i];
+		auto client = this->connect(b->ep, connecting[i]);
+
+		unique_lock<mutex> lck(this->backend_lock);
+
+		if (client)
+			b->client = move(client);
+		else
+			b->ejected_until = clock::now() + this->opts.ejection_time;
+	}
+
+	this->hedge_worker = thread(&request_balancer::hedge_run, this);
+	this->connect_worker = thread(&request_balancer::connect_run, this);
+}
+
+void request_balancer::stop() {
+	if (!this->running)
+		return;
+
+	{
+		unique_lock<mutex> lck(this->hedge_lock);
+		this->running = false;
+		this->hedges = priority_queue<hedge>();
+	}
+
+	this->hedge_cv.notify_all();
+	this->hedge_worker.join();
+
+	//Taking the lock orders the store to running before the reconnecting thread's next check.
+	{
+		unique_lock<mutex> lck(this->backend_lock);
+	}
+
+	this->connect_cv.notify_all();
+	this->connect_worker.join();
+
+	//Clients complete their outstanding requests as they stop, and those callbacks take the backend lock.
+	vector<shared_ptr<request_client>> clients;
+
+	{
+		unique_lock<mutex> lck(this->backend_lock);
+
+		for (auto& i : this->backends)
+			clients.push_back(move(i->client));
+
+		clients.insert(clients.end(), this->retired.begin(), this->retired.end());
+		this->retired.clear();
+	}
+
+	clients.clear();
+}
+
+word request_balancer::healthy_endpoints() {
+	unique_lock<mutex> lck(this->backend_lock);
+	auto now = clock::now();
+	word count = 0;
+
+	for (auto& i : this->backends)
+		if (i->client && i->client->is_connected() && now >= i->ejected_until)
+			count++;
+
+	return count;
+}
+
+chrono::microseconds request_balancer::hedge_delay() const {
+	return chrono::microseconds(this->hedge_after.load());
+}
+
+void request_balancer::send(uint8 category, uint8 method, const data_stream& payload, callback_type callback, chrono::milliseconds deadline) {
+	auto request = make_shared<flight>();
+	request->category = category;
+	request->method = method;
+	request->payload = payload;
+	request->callback = move(callback);
+	request->deadline = deadline.count() != 0 ? clock::now() + deadline : clock::time_point::max();
+	request->done = false;
+	request->attempts = 0;
+
+	shared_ptr<request_client> client;
+	auto target = this->pick(nullptr, client);
+
+	if (!target) {
+		data_stream empty;
+		request->callback(request_status::disconnected, empty);
+		return;
+	}
+
+	request->first = target;
+
+	if (this->opts.hedging && this->backends.size() > 1) {
+		{
+			unique_lock<mutex> lck(this->hedge_lock);
+			this->hedges.push(hedge{ clock::now() + chrono::microseconds(this->hedge_after.load()), request });
+		}
+
+		this->hedge_cv.notify_one();
+	}
+
+	this->dispatch(*target, move(client), move(request));
+}
+
+future<data_stream> request_balancer::send(uint8 category, uint8 method, const data_stream& payload, chrono::milliseconds deadline) {
+	auto promise = make_shared<std::promise<data_stream>>();
+	auto result = promise->get_future();
+
+	this->send(category, method, payload, [promise](request_status status, data_stream& response) {
+		if (status == request_status::success)
+			promise->set_value(move(response));
+		else
+			promise->set_exception(make_exception_ptr(request_client::request_failed_exception(status)));
+	}, deadline);
+
+	return result;
+}
+
+bool request_balancer::available(backend& b, clock::time_point now) {
+	if (now < b.ejected_until)
+		return false;
+
+	if (b.client && b.client->is_connected())
+		return true;
+
+	//Destroyed outside the lock by pick, since stopping completes its outstanding requests.
+	if (b.client) {
+		this->retired.push_back(move(b.client));
+		this->connect_cv.notify_one();
+	}
+
+	return false;
+}
+
+request_balancer::backend* request_balancer::pick(backend* exclude, shared_ptr<request_client>& client) {
+	vector<shared_ptr<request_client>> retired;
+	backend* result = nullptr;
+
+	{
+		unique_lock<mutex> lck(this->backend_lock);
+		auto now = clock::now();
+
+		vector<backend*> candidates;
+		for (auto& i : this->backends)
+			if (i.get() != exclude && this->available(*i, now))
+				candidates.push_back(i.get());
+
+		if (candidates.size() == 1) {
+			result = candidates[0];
+		}
+		else if (candidates.size() > 1) {
+			if (this->opts.policy == policies::least_outstanding) {
+				result = *min_element(candidates.begin(), candidates.end(), [](backend* a, backend* b) {
+					word a_outstanding = a->outstanding, b_outstanding = b->outstanding;
+					return a_outstanding < b_outstanding || (a_outstanding == b_outstanding && a->latency < b->latency);
+				});
+			}
+			else {
+				uniform_int_distribution<word> distribution(0, static_cast<word>(candidates.size() - 1));
+				word first = distribution(this->generator);
+				word second = distribution(this->generator);
+
+				if (second == first)
+					second = (first + 1) % candidates.size();
+
+				//Score by latency scaled by queue depth so a fast but busy replica still loses to an idle one.
+				auto a = candidates[first], b = candidates[second];
+				uint64 a_score = (a->latency + 1) * (a->outstanding + 1);
+				uint64 b_score = (b->latency + 1) * (b->outstanding + 1);
+
+				result = a_score <= b_score ? a : b;
+			}
+		}
+
+		if (result)
+			client = result->client;
+
+		retired.swap(this->retired);
+	}
+
+	return result;
+}
+
+void request_balancer::dispatch(backend& target, shared_ptr<request_client> client, shared_ptr<flight> request) {
+	auto start = clock::now();
+	auto callback = [this, &target, request, start](request_status status, data_stream& response) {
+		target.outstanding--;
+		this->record(target, status, clock::now() - start);
+
+		if (status == request_status::success) {
+			if (!request->done.exchange(true))
+				request->callback(status, response);
+		}
+		else if (--request->attempts == 0 && !request->done.exchange(true)) {
+			request->callback(status, response);
+		}
+	};
+
+	request->attempts++;
+	target.outstanding++;
+
+	auto timeout = chrono::milliseconds(0);
+	if (request->deadline != clock::time_point::max()) {
+		timeout = chrono::duration_cast<chrono::milliseconds>(request->deadline - start);
+
+		if (timeout.count() <= 0) {
+			data_stream empty;
+			callback(request_status::expired, empty);
+			return;
+		}
+	}
+
+	try {
+		client->send(request->category, request->method, request->payload, callback, timeout);
+	}
+	catch (request_client::not_running_exception) {
+		data_stream empty;
+		callback(request_status::disconnected, empty);
+	}
+	catch (request_client::too_many_requests_exception) {
+		data_stream empty;
+		callback(request_status::retries_exhausted, empty);
+	}
+}
+
+void request_balancer::record(backend& target, request_status status, clock::duration latency) {
+	//The caller giving up says nothing about the health of the endpoint.
+	if (status == request_status::expired)
+		return;
+
+	if (status != request_status::success) {
+		if (++target.failures >= this->opts.eject_after) {
+			unique_lock<mutex> lck(this->backend_lock);
+			target.ejected_until = clock::now() + this->opts.ejection_time;
+			target.failures = 0;
+		}
+
+		return;
+	}
+
+	target.failures = 0;
+
+	auto sample = static_cast<uint64>(chrono::duration_cast<chrono::microseconds>(latency).count());
+	uint64 previous = target.latency;
+
+	//An exponentially weighted moving average with a weight of 1/8 for the newest sample.
+	target.latency = previous == 0 ? sample : previous - previous / 8 + sample / 8;
+
+	if (!this->opts.hedging)
+		return;
+
+	unique_lock<mutex> lck(this->sample_lock);
+
+	this->samples[this->sample_index] = sample;
+	this->sample_index = (this->sample_index + 1) % request_balancer::latency_samples;
+	this->sample_count++;
+
+	if (this->sample_count % request_balancer::percentile_refresh != 0)
+		return;
+
+	word count = min(this->sample_count, request_balancer::latency_samples);
+	vector<uint64> sorted(this->samples.begin(), this->samples.begin() + count);
+	auto nth = sorted.begin() + static_cast<word>(this->opts.hedge_percentile * (count - 1));
+
+	nth_element(sorted.begin(), nth, sorted.end());
+
+	this->hedge_after = max(*nth, static_cast<uint64>(this->opts.min_hedge_delay.count()));
+}
+
+shared_ptr<request_client> request_balancer::connect(const endpoint& ep, future<net::socket>& connecting) {
+	//Checked now and then so stop doesn't wait out a slow connect.
+	while (connecting.wait_for(chrono::milliseconds(100)) != future_status::ready)
+		if (!this->running)
+			return nullptr;
+
+	try {
+		auto connected = connecting.get();
+		if (!connected.is_connected())
+			return nullptr;
+
+		tcp_connection connection(move(connected));
+
+		if (ep.tls)
+			connection.start_tls(ep.tls, ep.address);
+
+		auto client = make_shared<request_client>(move(connection), this->retry_code);
+
+		if (this->opts.propagate_deadlines)
+			client->enable_deadline_propagation();
+
+		client->start();
+
+		return client;
+	}
+	catch (socket::could_not_connect_exception) {
+
+	}
+	catch (socket::could_not_create_exception) {
+
+	}
+	catch (socket::invalid_address_exception) {
+
+	}
+	catch (tls_context::handshake_failed_exception) {
+
+	}
+
+	return nullptr;
+}
+
+void request_balancer::connect_run() {
+	unique_lock<mutex> lck(this->backend_lock);
+
+	while (this->running) {
+		auto now = clock::now();
+		auto next = clock::time_point::max();
+		vector<backend*> due;
+
+		for (auto& i : this->backends) {
+			if (i->client && i->client->is_connected())
+				continue;
+
+			if (now >= i->ejected_until)
+				due.push_back(i.get());
+			else
+				next = min(next, i->ejected_until);
+		}
+
+		if (due.empty()) {
+			if (next == clock::time_point::max())
+				this->connect_cv.wait(lck);
+			else
+				this->connect_cv.wait_until(lck, next);
+
+			continue;
+		}
+
+		vector<future<net::socket>> connecting;
+		for (auto b : due)
+			connecting.push_back(resolver::shared().connect(b->ep));
+
+		for (word i = 0; i < due.size(); i++) {
+			auto b = due[i];
+
+			lck.unlock();
+			auto client = this->running ? this->connect(b->ep, connecting[i]) : nullptr;
+			lck.lock();
+
+			if (client) {
+				if (b->client)
+					this->retired.push_back(move(b->client));
+
+				//The latency from before it went away says nothing about the new connection.
+				b->client = move(client);
+				b->failures = 0;
+				b->latency = 0;
+			}
+			else {
+				b->ejected_until = clock::now() + this->opts.ejection_time;
+			}
+		}
+	}
+}
+
+void request_balancer::hedge_run() {
+	unique_lock<mutex> lck(this->hedge_lock);
+
+	while (this->running) {
+		if (this->hedges.empty()) {
+			this->hedge_cv.wait(lck);
+			continue;
+		}
+
+		auto when = this->hedges.top().when;
+		if (clock::now() < when) {
+			this->hedge_cv.wait_until(lck, when);
+			continue;
+		}
+
+		auto request = this->hedges.top().request;
+		this->hedges.pop();
+
+		if (request->done)
+			continue;
+
+		lck.unlock();
+
+		shared_ptr<request_client> client;
+		auto target = this->pick(request->first, client);
+
+		if (target && !request->done)
+			this->dispatch(*target, move(client), move(request));
+
+		lck.lock();
+	}
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <queue>
+#include <random>
+#include <chrono>
+
+#include "../Common.h"
+#include "../DataStream.h"
+#include "Socket.h"
+#include "RequestClient.h"
+
+namespace util {
+	namespace net {
+		///Spreads requests across several request_server replicas using one pipelined request_client per endpoint.
+		///Endpoints are scored by their live latency and outstanding requests, endpoints that keep failing are ejected for a while,
+		///and requests may optionally be hedged to a second endpoint once they have been outstanding longer than a latency percentile.
+		class request_balancer {
+			public:
+				enum class policies {
+					least_outstanding,
+					power_of_two
+				};
+
+				typedef request_client::request_status request_status;
+				typedef request_client::callback_type callback_type;
+
+				struct exported options {
+					///How an endpoint is chosen for each request.
+					policies policy;
+
+					///Whether or not a request still outstanding after the hedge delay is also sent to a second endpoint.
+					bool hedging;
+
+					///The latency percentile, in [0, 1], after which a request is hedged.
+					float64 hedge_percentile;
+
+					///The smallest delay before hedging, used until enough latency samples are collected.
+					std::chrono::microseconds min_hedge_delay;
+
+					///The number of consecutive failures after which an endpoint is ejected.
+					word eject_after;
+
+					///How long an ejected endpoint is left out of rotation before it is tried again.
+					///Endpoints whose connection was lost are reconnected in the background after it, and stay out of rotation until that succeeds.
+					std::chrono::milliseconds ejection_time;
+
+					///Whether or not each request's remaining time is sent to the servers, which must have deadline propagation enabled.
+					bool propagate_deadlines;
+
+					options();
+				};
+
+				///Constructs a new balancer. Connections are not established until start is called.
+				///@param endpoints The request_server replicas.
+				///@param retry_code The retry code the servers were constructed with.
+				///@param opts The balancing options.
+				exported request_balancer(std::vector<endpoint> endpoints, uint16 retry_code, options opts = options());
+
+				///Destructs the instance. Outstanding requests complete with request_status::disconnected.
+				exported ~request_balancer();
+
+				///Connects to every reachable endpoint and starts the hedging and reconnecting threads.
+				exported void start();
+
+				///Disconnects from every endpoint and stops the hedging and reconnecting threads.
+				exported void stop();
+
+				///Gets the number of endpoints currently in rotation.
+				///@return The number of healthy endpoints.
+				exported word healthy_endpoints();
+
+				///Gets the current delay after which a request is hedged.
+				///@return The hedge delay.
+				exported std::chrono::microseconds hedge_delay() const;
+
+				///Sends a request to the best endpoint and invokes the callback when it completes.
+				///If every endpoint is ejected the callback is invoked immediately with request_status::disconnected.
+				///@param category The request category.
+				///@param method The request method.
+				///@param payload The request payload.
+				///@param callback The callback invoked on completion.
+				///@param deadline How long to wait for the response, including any hedge. Zero waits indefinitely.
+				exported void send(uint8 category, uint8 method, const data_stream& payload, callback_type callback, std::chrono::milliseconds deadline = std::chrono::milliseconds(0));
+
+				///Sends a request to the best endpoint and returns a future for the response.
+				///The future throws request_client::request_failed_exception if the request does not succeed.
+				///@param category The request category.
+				///@param method The request method.
+				///@param payload The request payload.
+				///@param deadline How long to wait for the response, including any hedge. Zero waits indefinitely.
+				///@return The response, positioned just past the response header.
+				exported std::future<data_stream> send(uint8 category, uint8 method, const data_stream& payload, std::chrono::milliseconds deadline = std::chrono::milliseconds(0));
+
+				request_balancer(const request_balancer& other) = delete;
+				request_balancer& operator=(const request_balancer& other) = delete;
+
+			private:
+				typedef std::chrono::steady_clock clock;
+
+				static const word latency_samples = 1024;
+				static const word percentile_refresh = 64;
+
+				struct backend {
+					endpoint ep;
+					std::shared_ptr<request_client> client;
+					std::atomic<word> outstanding;
+					std::atomic<uint64> latency;
+					std::atomic<word> failures;
+					clock::time_point ejected_until;
+				};
+
+				struct flight {
+					uint8 category;
+					uint8 method;
+					data_stream payload;
+					callback_type callback;
+					clock::time_point deadline;
+					std::atomic<bool> done;
+					std::atomic<word> attempts;
+					backend* first;
+				};
+
+				struct hedge {
+					clock::time_point when;
+					std::shared_ptr<flight> request;
+
+					bool operator<(const hedge& other) const;
+				};
+
+				std::vector<std::unique_ptr<backend>> backends;
+				std::vector<std::shared_ptr<request_client>> retired;
+				std::mutex backend_lock;
+				std::mt19937_64 generator;
+
+				options opts;
+				uint16 retry_code;
+
+				std::vector<uint64> samples;
+				word sample_index;
+				word sample_count;
+				std::mutex sample_lock;
+				std::atomic<uint64> hedge_after;
+
+				std::priority_queue<hedge> hedges;
+				std::mutex hedge_lock;
+				std::condition_variable hedge_cv;
+				std::thread hedge_worker;
+				std::atomic<bool> running;
+
+				//Connecting can take as long as the connect timeout, so it is only waited for here and never with backend_lock held.
+				//Every due backend connects at once on the resolver's connect threads, so one slow backend doesn't hold up the rest.
+				std::condition_variable connect_cv;
+				std::thread connect_worker;
+
+				bool available(backend& b, clock::time_point now);
+				backend* pick(backend* exclude, std::shared_ptr<request_client>& client);
+				void dispatch(backend& target, std::shared_ptr<request_client> client, std::shared_ptr<flight> request);
+				void record(backend& target, request_status status, clock::duration latency);
+				void hedge_run();
+				std::shared_ptr<request_client> connect(const endpoint& ep, std::future<net::socket>& connecting);
+				void connect_run();
+		};
+	}
+}
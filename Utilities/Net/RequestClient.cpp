@@ -0,0 +1,420 @@
+#include "RequestClient.h"
+
+#include <utility>
+#include <vector>
+#include <memory>
+#include <exception>
+
+#include "RequestServer.h"
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+const chrono::milliseconds request_client::sweep_interval(5);
+const chrono::milliseconds request_client::retry_backoff(10);
+
+request_client::request_failed_exception::request_failed_exception(request_status status) : status(status) {
+
+}
+
+request_client::request_client(endpoint ep, uint16 retry_code) : connection(ep), generator(random_device()()), sweeper(request_client::sweep_interval) {
+	this->retry_code = retry_code;
+	this->next_id = 0;
+	this->propagate_deadlines = false;
+	this->running = false;
+	this->connected = true;
+}
+
+request_client::request_client(tcp_connection&& connection, uint16 retry_code) : connection(move(connection)), generator(random_device()()), sweeper(request_client::sweep_interval) {
+	this->retry_code = retry_code;
+	this->next_id = 0;
+	this->propagate_deadlines = false;
+	this->running = false;
+	this->connected = true;
+}
+
+request_client::~request_client() {
+	this->stop();
+}
+
+void request_client::enable_deadline_propagation() {
+	this->propagate_deadlines = true;
+}
+
+void request_client::start() {
+	if (this->running)
+		return;
+
+	this->running = true;
+	this->reader = thread(&request_client::read_run, this);
+	this->sweeper.on_tick += bind(&request_client::sweep, this);
+	this->sweeper.start();
+}
+
+void request_client::stop() {
+	if (!this->running)
+		return;
+
+	this->running = false;
+	this->sweeper.stop();
+
+	{
+		unique_lock<mutex> lck(this->send_lock);
+		this->connected = false;
+		this->connection.close();
+	}
+
+	this->reader.join();
+	this->fail_all();
+}
+
+bool request_client::is_connected() const {
+	return this->connected;
+}
+
+word request_client::outstanding() {
+	unique_lock<mutex> lck(this->pending_lock);
+
+	return this->pending.size();
+}
+
+void request_client::send(uint8 category, uint8 method, const data_stream& payload, callback_type callback, chrono::milliseconds deadline) {
+	this->send(category, method, payload, nullptr, move(callback), deadline);
+}
+
+void request_client::send(uint8 category, uint8 method, const data_stream& payload, chunk_callback_type on_chunk, callback_type callback, chrono::milliseconds deadline) {
+	if (!this->running)
+		throw not_running_exception();
+
+	uint16 id;
+	data_stream frame;
+	pending_request request;
+	request.category = category;
+	request.method = method;
+	request.attempts = 0;
+	request.deadline = deadline.count() != 0 ? clock::now() + deadline : clock::time_point::max();
+	request.retry_at = clock::time_point::max();
+	request.payload = payload;
+	request.callback = move(callback);
+	request.on_chunk = move(on_chunk);
+
+	{
+		unique_lock<mutex> lck(this->pending_lock);
+
+		if (this->pending.size() > 0xFFFF)
+			throw too_many_requests_exception();
+
+		while (this->pending.count(this->next_id) != 0)
+			this->next_id++;
+
+		id = this->next_id++;
+
+		if (!this->connected) {
+			lck.unlock();
+
+			data_stream empty;
+			request.callback(request_status::disconnected, empty);
+
+			return;
+		}
+
+		frame = this->frame(id, request);
+
+		if (request.deadline != clock::time_point::max())
+			this->expiries.emplace(request.deadline, id);
+
+		//The request must be visible to the reader before it can possibly be answered.
+		this->pending[id] = move(request);
+	}
+
+	if (this->transmit(frame))
+		return;
+
+	data_stream empty;
+	this->complete(id, request_status::disconnected, empty);
+}
+
+future<data_stream> request_client::send(uint8 category, uint8 method, const data_stream& payload, chrono::milliseconds deadline) {
+	auto promise = make_shared<std::promise<data_stream>>();
+	auto result = promise->get_future();
+
+	this->send(category, method, payload, [promise](request_status status, data_stream& response) {
+		if (status == request_status::success)
+			promise->set_value(move(response));
+		else
+			promise->set_exception(make_exception_ptr(request_failed_exception(status)));
+	}, deadline);
+
+	return result;
+}
+
+future<bool> request_client::subscribe(const string& pattern) {
+	return this->subscription(request_server::subscribe_method, pattern);
+}
+
+future<bool> request_client::unsubscribe(const string& pattern) {
+	return this->subscription(request_server::unsubscribe_method, pattern);
+}
+
+future<bool> request_client::subscription(uint8 method, const string& pattern) {
+	auto promise = make_shared<std::promise<bool>>();
+	auto result = promise->get_future();
+
+	data_stream payload;
+	payload.write(pattern);
+
+	this->send(request_server::subscription_category, method, payload, [promise](request_status status, data_stream& response) {
+		if (status != request_status::success)
+			promise->set_exception(make_exception_ptr(request_failed_exception(status)));
+		else if (response.size() - response.position() < sizeof(uint8))
+			promise->set_value(false);
+		else
+			promise->set_value(response.read<uint8>() != 0);
+	});
+
+	return result;
+}
+
+data_stream request_client::frame(uint16 id, const pending_request& request) const {
+	data_stream frame;
+
+	if (this->propagate_deadlines && request.deadline != clock::time_point::max()) {
+		auto remaining = chrono::duration_cast<chrono::milliseconds>(request.deadline - clock::now()).count();
+
+		request_server::message::write_header(frame, id, static_cast<uint8>(request.category | request_server::deadline_flag), request.method);
+		frame.write(static_cast<uint32>(remaining > 0 ? remaining : 0));
+	}
+	else {
+		request_server::message::write_header(frame, id, request.category, request.method);
+	}
+
+	frame.write(request.payload);
+
+	return frame;
+}
+
+bool request_client::transmit(const data_stream& frame) {
+	unique_lock<mutex> lck(this->send_lock);
+
+	if (!this->connected)
+		return false;
+
+	try {
+		return this->connection.send(frame.data(), frame.size());
+	}
+	catch (tcp_connection::not_connected_exception) {
+		return false;
+	}
+}
+
+void request_client::complete(uint16 id, request_status status, data_stream& response) {
+	callback_type callback;
+
+	{
+		unique_lock<mutex> lck(this->pending_lock);
+
+		auto iter = this->pending.find(id);
+		if (iter == this->pending.end())
+			return;
+
+		callback = move(iter->second.callback);
+		this->pending.erase(iter);
+	}
+
+	callback(status, response);
+}
+
+void request_client::fail_all() {
+	unordered_map<uint16, pending_request> failed;
+
+	{
+		unique_lock<mutex> lck(this->pending_lock);
+		failed = move(this->pending);
+		this->pending.clear();
+		this->expiries.clear();
+		this->retries.clear();
+	}
+
+	data_stream empty;
+	for (auto& i : failed)
+		i.second.callback(request_status::disconnected, empty);
+}
+
+void request_client::sweep() {
+	vector<callback_type> expired;
+	auto now = clock::now();
+
+	{
+		unique_lock<mutex> lck(this->pending_lock);
+
+		while (!this->expiries.empty() && this->expiries.begin()->first <= now) {
+			auto iter = this->pending.find(this->expiries.begin()->second);
+
+			//The id may have completed and been reused by a request with a different deadline.
+			if (iter != this->pending.end() && iter->second.deadline == this->expiries.begin()->first) {
+				expired.push_back(move(iter->second.callback));
+				this->pending.erase(iter);
+			}
+
+			this->expiries.erase(this->expiries.begin());
+		}
+	}
+
+	data_stream empty;
+	for (auto& i : expired)
+		i(request_status::expired, empty);
+
+	vector<pair<uint16, data_stream>> resent;
+
+	{
+		unique_lock<mutex> lck(this->pending_lock);
+
+		while (!this->retries.empty() && this->retries.begin()->first <= now) {
+			auto iter = this->pending.find(this->retries.begin()->second);
+
+			//Framed now so a propagated deadline counts the time spent waiting.
+			if (iter != this->pending.end() && iter->second.retry_at == this->retries.begin()->first)
+				resent.emplace_back(iter->first, this->frame(iter->first, iter->second));
+
+			this->retries.erase(this->retries.begin());
+		}
+	}
+
+	for (auto& i : resent)
+		if (!this->transmit(i.second))
+			this->connected = false;
+}
+
+void request_client::read_run() {
+	while (this->running && this->connected) {
+		vector<tcp_connection::message> messages;
+
+		try {
+			//Secured connections don't wait in read, so wait here to avoid spinning on a partial record.
+			if (!this->connection.data_available(100000))
+				continue;
+
+			messages = this->connection.read();
+		}
+		catch (tcp_connection::not_connected_exception) {
+			break;
+		}
+		catch (socket::not_connected_exception) {
+			//stop closed the socket between the connection's check and the socket's.
+			break;
+		}
+
+		for (auto& i : messages) {
+			if (i.closed) {
+				this->connected = false;
+				break;
+			}
+
+			if (i.length < 4)
+				continue;
+
+			data_stream response(i.data, i.length);
+			i.data = nullptr;
+			i.length = 0;
+
+			uint16 id;
+			uint8 category, method;
+			response >> id >> category >> method;
+
+			if (category == request_server::subscription_category && method == request_server::publication_method) {
+				auto consumed = static_cast<uint32>(response.size());
+
+				try {
+					auto topic = response.read_string();
+
+					this->on_publication(topic, response);
+				}
+				catch (data_stream::read_past_end_exception) {
+
+				}
+
+				data_stream credit;
+				request_server::message::write_header(credit, 0, request_server::stream_credit_category, request_server::publication_credit_method);
+				credit.write(consumed);
+
+				if (!this->transmit(credit))
+					this->connected = false;
+
+				continue;
+			}
+
+			if (category & request_server::stream_chunk_flag) {
+				chunk_callback_type on_chunk;
+				auto consumed = static_cast<uint32>(response.size() - response.position());
+
+				{
+					unique_lock<mutex> lck(this->pending_lock);
+
+					auto iter = this->pending.find(id);
+					if (iter != this->pending.end())
+						on_chunk = iter->second.on_chunk;
+				}
+
+				if (on_chunk)
+					on_chunk(response);
+
+				//Acknowledged even when nobody wants the chunk, otherwise the server would stop sending to the whole connection.
+				data_stream credit;
+				request_server::message::write_header(credit, id, request_server::stream_credit_category, 0);
+				credit.write(consumed);
+
+				if (!this->transmit(credit))
+					this->connected = false;
+
+				continue;
+			}
+
+			if (category & request_server::failure_flag) {
+				this->complete(id, request_status::failed, response);
+				continue;
+			}
+
+			//Marked in the header, since a payload that happens to equal the retry code is an ordinary response.
+			if (category & request_server::retry_flag) {
+				auto status = request_status::success;
+
+				{
+					unique_lock<mutex> lck(this->pending_lock);
+
+					auto iter = this->pending.find(id);
+					if (iter == this->pending.end())
+						continue;
+
+					auto& request = iter->second;
+
+					if (++request.attempts > request_client::max_retries) {
+						status = request_status::retries_exhausted;
+					}
+					else {
+						//Resending at once would only meet the same overload. The random part keeps clients refused together from returning together.
+						auto ceiling = request_client::retry_backoff.count() << (request.attempts - 1);
+						auto delay = uniform_int_distribution<int64>(ceiling / 2, ceiling)(this->generator);
+
+						request.retry_at = clock::now() + chrono::milliseconds(delay);
+
+						if (request.retry_at >= request.deadline)
+							status = request_status::expired;
+						else
+							this->retries.emplace(request.retry_at, id);
+					}
+				}
+
+				if (status != request_status::success)
+					this->complete(id, status, response);
+
+				continue;
+			}
+
+			this->complete(id, request_status::success, response);
+		}
+	}
+
+	this->connected = false;
+	this->fail_all();
+}
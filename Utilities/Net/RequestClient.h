@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <string>
+#include <random>
+
+#include "../Common.h"
+#include "../DataStream.h"
+#include "../Timer.h"
+#include "../Event.h"
+#include "Socket.h"
+#include "TCPConnection.h"
+
+namespace util {
+	namespace net {
+		///An asynchronous client for the request_server wire protocol.
+		///Any number of requests may be in flight on the one connection. Responses are matched back to their request by id.
+		class request_client {
+			public:
+				enum class request_status {
+					success,
+					retries_exhausted,
+					disconnected,
+					expired,
+
+					///The server's handler for the request threw.
+					failed
+				};
+
+				///Invoked on the reader thread when a request completes.
+				///The stream is positioned just past the response header on success.
+				typedef std::function<void(request_status, data_stream&)> callback_type;
+
+				///Invoked on the reader thread for each chunk of a streamed response, in order, before the callback sees the final part.
+				///The stream is positioned just past the response header.
+				typedef std::function<void(data_stream&)> chunk_callback_type;
+
+				class request_failed_exception {
+					public:
+						request_status status;
+
+						exported request_failed_exception(request_status status);
+				};
+
+				class too_many_requests_exception {};
+				class not_running_exception {};
+
+				///The number of times a request is resent after the server asks for it to be retried.
+				static const word max_retries = 5;
+
+				///The longest wait before the first resend. It doubles for each one after, and a random part of up to half of it is taken off.
+				///A resend that couldn't happen before the request's deadline isn't made, and the request expires instead.
+				static const std::chrono::milliseconds retry_backoff;
+
+				///Constructs a new client by establishing a new connection to the specified endpoint.
+				///Blocks for as long as resolving and connecting take, up to the endpoint's connect_timeout.
+				///To connect without blocking, use resolver::connect and pass the connection to the other constructor.
+				///@param ep The endpoint of the request_server.
+				///@param retry_code The retry code the server was constructed with.
+				exported request_client(endpoint ep, uint16 retry_code);
+
+				///Constructs a new client over an existing connection. Takes ownership of the connection.
+				///@param connection The connection to the request_server.
+				///@param retry_code The retry code the server was constructed with.
+				exported request_client(tcp_connection&& connection, uint16 retry_code);
+
+				///Destructs the instance. Outstanding requests complete with request_status::disconnected.
+				exported ~request_client();
+
+				///Sends each request's remaining time to the server so it can drop the request once nobody is waiting for it.
+				///The server must have deadline propagation enabled too, since it changes the request header. Must be called before start.
+				exported void enable_deadline_propagation();
+
+				///Starts the reader thread. Requests may not be sent until the client is started.
+				exported void start();
+
+				///Closes the connection and stops the reader thread.
+				exported void stop();
+
+				///Gets whether or not the underlying connection is still open.
+				///@return True if connected, false otherwise.
+				exported bool is_connected() const;
+
+				///Gets the number of requests awaiting a response.
+				///@return The number of outstanding requests.
+				exported word outstanding();
+
+				///Sends a request and invokes the callback when it completes.
+				///@param category The request category.
+				///@param method The request method.
+				///@param payload The request payload.
+				///@param callback The callback invoked on completion.
+				///@param deadline How long to wait for the response. Zero waits indefinitely.
+				///With deadline propagation enabled, the remaining time is sent to the server, which drops the request once it passes.
+				exported void send(uint8 category, uint8 method, const data_stream& payload, callback_type callback, std::chrono::milliseconds deadline = std::chrono::milliseconds(0));
+
+				///Sends a request whose response the server may stream, invoking on_chunk for each chunk and the callback with the final part.
+				///Each chunk is acknowledged once on_chunk returns, so a slow on_chunk slows the server down instead of queueing.
+				///@param category The request category.
+				///@param method The request method.
+				///@param payload The request payload.
+				///@param on_chunk The callback invoked for each chunk.
+				///@param callback The callback invoked on completion.
+				///@param deadline How long to wait for the whole response. Zero waits indefinitely.
+				exported void send(uint8 category, uint8 method, const data_stream& payload, chunk_callback_type on_chunk, callback_type callback, std::chrono::milliseconds deadline = std::chrono::milliseconds(0));
+
+				///Sends a request and returns a future for the response.
+				///The future throws request_failed_exception if the request does not succeed.
+				///@param category The request category.
+				///@param method The request method.
+				///@param payload The request payload.
+				///@param deadline How long to wait for the response. Zero waits indefinitely.
+				///@return The response, positioned just past the response header.
+				exported std::future<data_stream> send(uint8 category, uint8 method, const data_stream& payload, std::chrono::milliseconds deadline = std::chrono::milliseconds(0));
+
+				///Subscribes to the publications of a server with publish and subscribe enabled. They are raised through on_publication.
+				///@param pattern The topic pattern, as described by topic_trie.
+				///@return Whether or not the server accepted the pattern.
+				exported std::future<bool> subscribe(const std::string& pattern);
+
+				///Unsubscribes from a pattern passed to subscribe.
+				///@param pattern The pattern exactly as it was subscribed to.
+				///@return Whether or not the connection was subscribed to the pattern.
+				exported std::future<bool> unsubscribe(const std::string& pattern);
+
+				///Raised on the reader thread for each publication with its topic and the payload.
+				///Each one is acknowledged once the handlers return, so slow handlers make the server conflate or drop publications instead of queueing.
+				event<const std::string&, data_stream&> on_publication;
+
+				request_client(const request_client& other) = delete;
+				request_client& operator=(const request_client& other) = delete;
+
+			private:
+				typedef std::chrono::steady_clock clock;
+
+				static const std::chrono::milliseconds sweep_interval;
+
+				struct pending_request {
+					uint8 category;
+					uint8 method;
+					word attempts;
+					clock::time_point deadline;
+					clock::time_point retry_at;
+					data_stream payload;
+					callback_type callback;
+					chunk_callback_type on_chunk;
+				};
+
+				tcp_connection connection;
+				uint16 retry_code;
+				uint16 next_id;
+				bool propagate_deadlines;
+
+				std::unordered_map<uint16, pending_request> pending;
+				std::multimap<clock::time_point, uint16> expiries;
+				std::multimap<clock::time_point, uint16> retries;
+				std::mt19937_64 generator;
+				std::mutex pending_lock;
+				std::mutex send_lock;
+
+				std::thread reader;
+				std::atomic<bool> running;
+				std::atomic<bool> connected;
+				timer<> sweeper;
+
+				data_stream frame(uint16 id, const pending_request& request) const;
+
+				std::future<bool> subscription(uint8 method, const std::string& pattern);
+
+				bool transmit(const data_stream& frame);
+				void complete(uint16 id, request_status status, data_stream& response);
+				void fail_all();
+				void sweep();
+				void read_run();
+		};
+	}
+}
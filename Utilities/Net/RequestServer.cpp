@@ -1,14 +1,147 @@
 #include "RequestServer.h"
+#include "WebSocketConnection.h"
+#include "HTTPConnection.h"
+#include "../Misc.h"
 
 #include <utility>
 #include <functional>
 #include <memory>
 #include <algorithm>
+#include <cstring>
+
+#ifdef POSIX
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <unistd.h>
+#endif
 
 using namespace std;
 using namespace util;
 using namespace util::net;
 
+static threadlocal const cancellation_token* current_cancellation = nullptr;
+static threadlocal int64 current_cache_ttl = 0;
+static threadlocal request_server* current_server = nullptr;
+static threadlocal request_server::message* current_response = nullptr;
+static threadlocal bool current_streamed = false;
+
+//The id, category and method that start every request and response.
+static const word header_length = sizeof(uint16) + 2 * sizeof(uint8);
+
+//Identifies identical requests for coalescing and caching.
+static string request_key(uint8 category, uint8 method, const uint8* payload, word length) {
+	string key;
+	key.reserve(2 + length);
+	key.push_back(static_cast<char>(category));
+	key.push_back(static_cast<char>(method));
+	key.append(reinterpret_cast<const char*>(payload), length);
+
+	return key;
+}
+
+#ifdef POSIX
+//Each record of a handoff is one datagram on a SOCK_SEQPACKET Unix socket, carrying at most one descriptor.
+enum class handoff_records : uint8 {
+	listener,
+	connection,
+	done
+};
+
+static const word handoff_record_max_size = tcp_connection::message_max_size + 16;
+
+static int handoff_channel(const string& path, bool listen) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+
+	if (path.size() >= sizeof(address.sun_path))
+		return -1;
+
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.c_str(), path.size());
+
+	int channel = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (channel == -1)
+		return -1;
+
+	if (listen) {
+		::unlink(path.c_str());
+
+		if (::bind(channel, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 && ::listen(channel, 1) == 0) {
+			int accepted = ::accept4(channel, nullptr, nullptr, SOCK_CLOEXEC);
+
+			::close(channel);
+			::unlink(path.c_str());
+
+			return accepted;
+		}
+	}
+	else if (::connect(channel, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+		return channel;
+	}
+
+	::close(channel);
+
+	return -1;
+}
+
+static bool send_record(int channel, const data_stream& record, int fd) {
+	iovec data;
+	data.iov_base = const_cast<uint8*>(record.data());
+	data.iov_len = record.size();
+
+	msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &data;
+	header.msg_iovlen = 1;
+
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	if (fd != -1) {
+		header.msg_control = control;
+		header.msg_controllen = sizeof(control);
+
+		cmsghdr* rights = CMSG_FIRSTHDR(&header);
+		rights->cmsg_level = SOL_SOCKET;
+		rights->cmsg_type = SCM_RIGHTS;
+		rights->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(rights), &fd, sizeof(int));
+	}
+
+	return ::sendmsg(channel, &header, MSG_NOSIGNAL) == static_cast<ssize_t>(record.size());
+}
+
+static bool receive_record(int channel, data_stream& record, int& fd) {
+	vector<uint8> buffer(handoff_record_max_size);
+
+	iovec data;
+	data.iov_base = buffer.data();
+	data.iov_len = buffer.size();
+
+	msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &data;
+	header.msg_iovlen = 1;
+
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+
+	auto received = ::recvmsg(channel, &header, MSG_CMSG_CLOEXEC);
+	if (received <= 0)
+		return false;
+
+	fd = -1;
+	for (cmsghdr* i = CMSG_FIRSTHDR(&header); i; i = CMSG_NXTHDR(&header, i))
+		if (i->cmsg_level == SOL_SOCKET && i->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(i), sizeof(int));
+
+	//The non-const constructor would take ownership of the vector's storage.
+	record = data_stream(static_cast<const uint8*>(buffer.data()), static_cast<word>(received));
+
+	return true;
+}
+#endif
+
 #ifdef WINDOWS
 //Remove tcp_server::state once bind becomes move aware.
 void request_server::on_client_connect_hack(unique_ptr<tcp_connection> connection, void* state) {
@@ -16,19 +149,115 @@ void request_server::on_client_connect_hack(unique_ptr<tcp_connection> connectio
 }
 #endif
 
-request_server::request_server() : incoming(0) , outgoing(0) {
+request_server::client::client(unique_ptr<tcp_connection> connection) : connection(move(connection)) {
+	static atomic<uint64> next_id(0);
+
+	this->id = ++next_id;
+	this->read_memory = 0;
+	this->queued_memory = 0;
+	this->memory_paused = false;
+	this->in_flight = 0;
+	this->last_activity = chrono::steady_clock::now();
+	this->idle_timer = timer_wheel::invalid;
+	this->handshake_timer = timer_wheel::invalid;
+	this->heartbeat_timer = timer_wheel::invalid;
+	this->flush_at = chrono::steady_clock::time_point::max();
+	this->stream_outstanding = 0;
+	this->next_publication = 0;
+	this->publication_outstanding = 0;
+	this->publication_round = 0;
+}
+
+request_server::client::~client() {
+	if (this->contexts)
+		this->contexts->release(this->connection->context_slot);
+}
+
+request_server::rate_limit::rate_limit() : rate(0), burst(1), policy(rate_limit_policies::reject) {
+
+}
+
+request_server::rate_limit::rate_limit(double rate, double burst, rate_limit_policies policy) : rate(rate), burst(burst < 1 ? 1 : burst), policy(policy) {
+
+}
+
+request_server::token_bucket::token_bucket() : tokens(0) {
+
+}
+
+bool request_server::token_bucket::ready(const rate_limit& limit, chrono::steady_clock::time_point now) {
+	//A new bucket was last updated at the clock's epoch, so it starts full.
+	this->tokens = min(limit.burst, this->tokens + limit.rate * chrono::duration<double>(now - this->updated).count());
+	this->updated = now;
+
+	return this->tokens >= 1;
+}
+
+bool request_server::token_bucket::full(const rate_limit& limit, chrono::steady_clock::time_point now) const {
+	return this->tokens + limit.rate * chrono::duration<double>(now - this->updated).count() >= limit.burst;
+}
+
+request_server::route_options::route_options() : deadline(0), flush_immediately(false), coalesce_identical(false) {
+
+}
+
+request_server::connection_options::connection_options() : idle_timeout(0), handshake_timeout(0), heartbeat_interval(0), stream_window(256 * 1024) {
+
+}
+
+request_server::memory_options::memory_options() : budget(0), per_connection(0) {
+
+}
+
+request_server::busy_poll_options::busy_poll_options() : io_core(-1), worker_spin(50), socket_busy_poll(50) {
+
+}
+
+request_server::request_server() : incoming(0) , outgoing(0), coalesce(false), coalesce_window(0), propagate_deadlines(false), busy_poll(false) {
 	this->running = false;
 	this->valid = false;
+	this->expired = 0;
+	this->cancelled = 0;
+	this->timed_out = 0;
+	this->coalesced = 0;
+	this->failed = 0;
+	this->rate_limited = 0;
+	this->route_rate_limited = false;
+	this->streaming = false;
+	this->publish_subscribe = false;
+	this->publication_limit = 0;
+	this->publication_window = 0;
+	this->publication_round = 0;
+	this->conflated = 0;
+	this->publications_dropped = 0;
+	this->memory_pauses = 0;
+	this->connections_refused = 0;
 }
 
 request_server::request_server(endpoint port, word workers, uint16 retry_code) : request_server(vector<endpoint>{ port }, workers, retry_code) {
 	
 }
 
-request_server::request_server(vector<endpoint> ports, word workers, uint16 retry_code) : incoming(workers) , outgoing(workers) {
+request_server::request_server(vector<endpoint> ports, word workers, uint16 retry_code) : incoming(workers) , outgoing(workers), coalesce(false), coalesce_window(0), propagate_deadlines(false), busy_poll(false) {
 	this->running = false;
 	this->valid = true;
 	this->retry_code = retry_code;
+	this->expired = 0;
+	this->cancelled = 0;
+	this->timed_out = 0;
+	this->coalesced = 0;
+	this->failed = 0;
+	this->rate_limited = 0;
+	this->route_rate_limited = false;
+	this->streaming = false;
+	this->publish_subscribe = false;
+	this->publication_limit = 0;
+	this->publication_window = 0;
+	this->publication_round = 0;
+	this->conflated = 0;
+	this->publications_dropped = 0;
+	this->memory_pauses = 0;
+	this->connections_refused = 0;
 
 	for (word i = 0; i < ports.size(); i++) {
 		this->servers.emplace_back(ports[i]);
@@ -42,11 +271,27 @@ request_server::request_server(vector<endpoint> ports, word workers, uint16 retr
 	}
 }
 
-request_server::request_server(request_server&& other) : incoming(0) , outgoing(0) {
+request_server::request_server(request_server&& other) : incoming(0) , outgoing(0), coalesce(false), coalesce_window(0), propagate_deadlines(false), busy_poll(false) {
 	if (other.running)
 		throw cant_move_running_server_exception();
 
 	this->running = false;
+	this->expired = 0;
+	this->cancelled = 0;
+	this->timed_out = 0;
+	this->coalesced = 0;
+	this->failed = 0;
+	this->rate_limited = 0;
+	this->route_rate_limited = false;
+	this->streaming = false;
+	this->publish_subscribe = false;
+	this->publication_limit = 0;
+	this->publication_window = 0;
+	this->publication_round = 0;
+	this->conflated = 0;
+	this->publications_dropped = 0;
+	this->memory_pauses = 0;
+	this->connections_refused = 0;
 	*this = move(other);
 }
 
@@ -57,6 +302,22 @@ request_server& request_server::operator = (request_server&& other) {
 	this->valid = other.valid.load();
 	this->retry_code = other.retry_code;
 	this->running = false;
+	this->routes = move(other.routes);
+	this->route_rate_limited = other.route_rate_limited;
+	this->connection_limits = other.connection_limits;
+	this->memory_limits = other.memory_limits;
+	this->coalesce = other.coalesce;
+	this->coalesce_window = other.coalesce_window;
+	this->propagate_deadlines = other.propagate_deadlines;
+	this->busy_poll = other.busy_poll;
+	this->busy_poll_settings = other.busy_poll_settings;
+	this->cache = move(other.cache);
+	this->capture = move(other.capture);
+	this->contexts = move(other.contexts);
+	this->streaming = other.streaming;
+	this->publish_subscribe = other.publish_subscribe;
+	this->publication_limit = other.publication_limit;
+	this->publication_window = other.publication_window;
 	this->servers = move(other.servers);
 	this->incoming = move(other.incoming);
 	this->outgoing = move(other.outgoing);
@@ -77,6 +338,15 @@ void request_server::start() {
 
 	this->running = true;
 
+	{
+		unique_lock<recursive_mutex> lck(this->client_lock);
+
+		for (auto& i : this->clients) {
+			this->prepare(*i->connection);
+			this->watch(i);
+		}
+	}
+
 	this->incoming.on_item += std::bind(&request_server::on_incoming, this, placeholders::_1, placeholders::_2);
 	this->outgoing.on_item += std::bind(&request_server::on_outgoing, this, placeholders::_1, placeholders::_2);
 
@@ -84,6 +354,9 @@ void request_server::start() {
 	this->outgoing.start();
 	this->io_worker = thread(&request_server::io_run, this);
 
+	if (this->busy_poll && this->busy_poll_settings.io_core >= 0)
+		misc::pin_thread(this->io_worker.native_handle(), static_cast<word>(this->busy_poll_settings.io_core));
+
 	for (auto& i : this->servers)
 		i.start();
 }
@@ -100,13 +373,34 @@ void request_server::stop() {
 	this->io_worker.join();
 	this->incoming.stop();
 	this->outgoing.stop();
+
+	unique_lock<recursive_mutex> lck(this->client_lock);
+
+	for (auto& i : this->clients)
+		this->unwatch(*i);
+
+	if (this->capture)
+		this->capture->flush();
 }
 
 tcp_connection& request_server::adopt(tcp_connection&& connection, bool call_on_connect) {
+	return this->adopt(make_unique<tcp_connection>(move(connection)), call_on_connect);
+}
+
+tcp_connection& request_server::adopt(unique_ptr<tcp_connection> connection, bool call_on_connect) {
+	auto created = this->make_client(move(connection));
+	if (!created)
+		throw too_many_connections_exception();
+
 	unique_lock<recursive_mutex> lck(this->client_lock);
 
-	this->clients.push_back(make_unique<tcp_connection>(move(connection)));
-	auto& ref = *this->clients.back();
+	this->clients.push_back(move(created));
+	auto& ref = *this->clients.back()->connection;
+
+	if (this->running) {
+		this->prepare(ref);
+		this->watch(this->clients.back());
+	}
 
 	if (call_on_connect)
 		this->on_connect(ref);
@@ -114,72 +408,1285 @@ tcp_connection& request_server::adopt(tcp_connection&& connection, bool call_on_
 	return ref;
 }
 
-void request_server::on_client_connect(unique_ptr<tcp_connection> connection) {
+void request_server::configure_route(uint8 category, uint8 method, route_options options) {
+	this->routes[static_cast<uint16>(category << 8 | method)] = options;
+
+	if (options.limit.rate > 0)
+		this->route_rate_limited = true;
+}
+
+request_server::statistics request_server::stats() const {
+	statistics result;
+
+	result.expired = this->expired;
+	result.cancelled = this->cancelled;
+	result.timed_out = this->timed_out;
+	result.coalesced = this->coalesced;
+	result.failed = this->failed;
+	result.rate_limited = this->rate_limited;
+	result.conflated = this->conflated;
+	result.publications_dropped = this->publications_dropped;
+	result.memory_used = this->memory.used();
+	result.memory_pauses = this->memory_pauses;
+	result.connections_refused = this->connections_refused;
+
+	if (this->cache) {
+		auto cached = this->cache->stats();
+
+		result.cache_hits = cached.hits;
+		result.cache_misses = cached.misses;
+		result.cache_evictions = cached.evictions;
+	}
+	else {
+		result.cache_hits = 0;
+		result.cache_misses = 0;
+		result.cache_evictions = 0;
+	}
+
+	return result;
+}
+
+void request_server::enable_coalescing(chrono::microseconds window) {
+	this->coalesce = true;
+	this->coalesce_window = window;
+}
+
+void request_server::enable_response_cache(word capacity, word shards) {
+	this->cache = make_unique<response_cache>(capacity, shards);
+}
+
+void request_server::enable_capture(const string& path) {
+	this->capture = make_unique<traffic_recorder>(path);
+}
+
+void request_server::enable_streaming() {
+	this->streaming = true;
+}
+
+void request_server::enable_publish_subscribe(word limit, word window) {
+	this->publish_subscribe = true;
+	this->publication_limit = limit > 0 ? limit : 1;
+	this->publication_window = window;
+}
+
+word request_server::publish(const string& topic, const data_stream& payload, const string& key) {
+	auto frame = make_shared<data_stream>();
+	message::write_header(*frame, 0, request_server::subscription_category, request_server::publication_method);
+	frame->write(topic);
+	frame->write(payload);
+
+	if (frame->size() > tcp_connection::message_max_size - tcp_connection::message_length_bytes)
+		throw tcp_connection::message_too_long_exception();
+
+	shared_ptr<const data_stream> shared = move(frame);
+	word reached = 0;
+
 	unique_lock<recursive_mutex> lck(this->client_lock);
-	this->clients.push_back(move(connection));
-	this->on_connect(*this->clients.back());
+	unique_lock<mutex> subscription_lck(this->subscription_lock);
+
+	auto round = ++this->publication_round;
+
+	this->topics.match(topic, [&](topic_trie::id subscriber) {
+		auto& target = *this->subscribers[subscriber];
+
+		if (target.publication_round == round)
+			return;
+
+		target.publication_round = round;
+		reached++;
+
+		this->enqueue_publication(target, shared, key);
+	});
+
+	return reached;
+}
+
+void request_server::enable_deadline_propagation() {
+	this->propagate_deadlines = true;
+}
+
+void request_server::enable_busy_poll(busy_poll_options options) {
+	this->busy_poll = true;
+	this->busy_poll_settings = options;
+
+	this->incoming.backlog().set_spin(options.worker_spin);
+	this->outgoing.backlog().set_spin(options.worker_spin);
+	this->incoming.set_affinity(options.request_cores);
+	this->outgoing.set_affinity(options.response_cores);
+}
+
+void request_server::configure_connections(connection_options options) {
+	this->connection_limits = options;
+}
+
+void request_server::configure_memory(memory_options options) {
+	this->memory_limits = options;
+	this->memory.set_budget(options.budget);
+}
+
+uint64 request_server::memory_used(memory_categories category) const {
+	return this->memory.used(static_cast<word>(category));
 }
 
-void request_server::on_client_disconnect(tcp_connection& connection) {
+uint64 request_server::memory_used(const tcp_connection& connection) {
 	unique_lock<recursive_mutex> lck(this->client_lock);
-	this->on_disconnect(connection);
-	auto iter = find_if(this->clients.begin(), this->clients.end(), [&connection](unique_ptr<tcp_connection>& conn) { return conn.get() == &connection; });
-	this->clients.erase(iter);
+
+	for (auto& i : this->clients)
+		if (i->connection.get() == &connection)
+			return i->read_memory + i->queued_memory;
+
+	return 0;
 }
 
-void request_server::on_incoming(word worker_number, message& request) {
-	if (request.data.size() < 4)
-		return;
+void request_server::enable_fair_scheduling(fairness_key key, fairness_weight weight) {
+	this->incoming.backlog().set_policy([key](const message& m) -> uint64 {
+		if (key)
+			return key(m.connection);
+
+		return reinterpret_cast<uint64>(&m.connection);
+	}, weight);
+}
+
+const cancellation_token& request_server::cancellation() {
+	static const cancellation_token never;
+
+	return current_cancellation ? *current_cancellation : never;
+}
+
+void request_server::cache_response(chrono::milliseconds ttl) {
+	current_cache_ttl = ttl.count();
+}
+
+request_server::response_stream request_server::stream() {
+	if (!current_response)
+		throw no_current_request_exception();
+
+	if (!current_server->streaming)
+		throw streaming_disabled_exception();
+
+	return response_stream(current_server, current_response);
+}
+
+request_server::response_stream::response_stream(request_server* server, message* response) : server(server), response(response) {
+
+}
+
+bool request_server::response_stream::write(const data_stream& chunk) {
+	return this->write(chunk.data(), chunk.size());
+}
+
+bool request_server::response_stream::write(const uint8* data, word length) {
+	if (length > tcp_connection::message_max_size - header_length)
+		throw tcp_connection::message_too_long_exception();
+
+	auto& owner = this->response->owner;
+	auto deadline = this->response->deadline;
+
+	if (owner) {
+		unique_lock<mutex> lck(owner->stream_lock);
+
+		//The window may be overrun by one chunk so that chunks larger than it still make progress.
+		while (owner->stream_outstanding >= this->server->connection_limits.stream_window) {
+			auto now = chrono::steady_clock::now();
+
+			if (owner->token.cancelled() || now > deadline)
+				return false;
+
+			//Woken by acknowledgements, disconnects only show up in the token so check it regularly.
+			owner->stream_acknowledged.wait_until(lck, min(deadline, now + chrono::milliseconds(50)));
+		}
+
+		owner->stream_outstanding += length;
+		owner->in_flight++;
+	}
 
 	uint16 id;
-	uint8 category, method;
-	request.data >> id >> category >> method;
+	memcpy(&id, this->response->data.data(), sizeof(id));
 
-	message response(request.connection, id);
+	message chunk(this->response->connection, id, request_server::stream_chunk_flag);
+	chunk.deadline = deadline;
+	chunk.urgent = true;
+	chunk.owner = owner;
+	chunk.data.write(data, length);
 
-	switch (this->on_request(request.connection, worker_number, category, method, request.data, response.data)) {
-		case request_result::success:
-			this->enqueue_outgoing(move(response));
+	current_streamed = true;
 
-			break;
-		case request_result::retry_later:
-			if (++request.attempts >= request_server::max_retries)
-				this->enqueue_incoming(move(request));
-			else
-				response.data.write(this->retry_code);
+	//Written from the handler's thread rather than queued so chunks can't be reordered among the outgoing workers.
+	this->server->on_outgoing(0, chunk);
 
+	return true;
+}
+
+#ifdef POSIX
+word request_server::handoff(const string& path, bool include_idle, chrono::milliseconds drain_timeout) {
+	int channel = handoff_channel(path, false);
+	if (channel == -1)
+		throw handoff_failed_exception();
+
+	//Each listener stops accepting here before it is sent, but its socket stays open throughout,
+	//so connections arriving in between wait in its backlog for the other process instead of being refused.
+	for (auto& i : this->servers) {
+		data_stream record;
+		record.write(static_cast<uint8>(handoff_records::listener));
+		record.write(i.local_endpoint().port);
+
+		//Not started means nothing is listening yet, so there is nothing to send.
+		auto released = i.release_listener();
+		if (!released.is_connected())
+			continue;
+
+		auto fd = released.release();
+		bool sent = send_record(channel, record, fd);
+
+		//Closing without shutting down leaves the socket listening for the other process.
+		::close(fd);
+
+		if (!sent) {
+			::close(channel);
+			throw handoff_failed_exception();
+		}
+	}
+
+	word handed = 0;
+
+	if (include_idle) {
+		unique_lock<recursive_mutex> lck(this->client_lock);
+
+		auto candidates = this->clients;
+		for (auto& i : candidates) {
+			auto& connection = *i->connection;
+
+			if (i->in_flight != 0 || !connection.is_connected() || connection.tls() || dynamic_cast<websocket_connection*>(&connection) || dynamic_cast<http_connection*>(&connection))
+				continue;
+
+			//The other process has no way to learn what it is subscribed to, so it would silently stop getting publications.
+			if (this->publish_subscribe) {
+				unique_lock<mutex> subscription_lck(this->subscription_lock);
+
+				if (!i->subscriptions.empty())
+					continue;
+			}
+
+			try {
+				//Other transports, such as shared memory, have no socket to send.
+				if (!connection.base_socket().is_connected())
+					continue;
+
+				if (connection.buffered() != 0)
+					this->flush(*i);
+
+				auto unread = connection.unread();
+
+				data_stream record;
+				record.write(static_cast<uint8>(handoff_records::connection));
+				//A partial message of the largest size doesn't fit in a uint16.
+				record.write(static_cast<uint32>(unread.size()));
+				record.write(unread.data(), static_cast<word>(unread.size()));
+
+				//Detaching only once the other process has the socket leaves the connection served here, untouched, if sending fails.
+				if (!send_record(channel, record, connection.base_socket().native_handle()))
+					break;
+
+				::close(connection.detach(unread).release());
+			}
+			catch (tcp_connection::not_connected_exception) {
+				//Flushing may have found it closed.
+				continue;
+			}
+
+			this->on_client_disconnect(*i);
+			handed++;
+		}
+	}
+
+	data_stream done;
+	done.write(static_cast<uint8>(handoff_records::done));
+	bool completed = send_record(channel, done, -1);
+
+	::close(channel);
+
+	auto until = chrono::steady_clock::now() + drain_timeout;
+	while (chrono::steady_clock::now() < until) {
+		unique_lock<recursive_mutex> lck(this->client_lock);
+
+		if (none_of(this->clients.begin(), this->clients.end(), [](shared_ptr<client>& c) { return c->in_flight != 0; }))
 			break;
-		case request_result::no_response:
-			break;
+
+		lck.unlock();
+		this_thread::sleep_for(chrono::milliseconds(1));
 	}
-}
 
-void request_server::on_outgoing(word worker_number, message& response) {
-	unique_lock<recursive_mutex> lck(this->client_lock);
-	auto iter = find_if(this->clients.begin(), this->clients.end(), [&response](unique_ptr<tcp_connection>& conn) { return conn.get() == &response.connection; });
+	{
+		//Responses coalesced after the last pass of the I/O loop would otherwise be lost when stop is called.
+		unique_lock<recursive_mutex> lck(this->client_lock);
+
+		for (auto& i : this->clients)
+			if (i->connection->buffered() != 0)
+				this->flush(*i);
+	}
+
+	if (!completed)
+		throw handoff_failed_exception();
 
-	if (iter != this->clients.end() && response.connection.base_socket().is_connected())
-		response.connection.send(response.data.data(), response.data.size());
+	return handed;
 }
 
-void request_server::io_run() {
-	while (this->running) {
-		unique_lock<recursive_mutex> lck(this->client_lock);
+word request_server::inherit(const string& path) {
+	int channel = handoff_channel(path, true);
+	if (channel == -1)
+		throw handoff_failed_exception();
 
-		for (auto& i : this->clients) {
-			if (i->data_available()) {
-				for (auto& k : i->read()) {
-					if (!k.closed) {
-						this->enqueue_incoming(message(*i, move(k)));
-					}
-					else {
-						this->on_client_disconnect(*i);
-						goto end;
+	word inherited = 0;
+	bool completed = false;
+	data_stream record;
+	int fd;
+
+	while (!completed && receive_record(channel, record, fd)) {
+		try {
+			switch (static_cast<handoff_records>(record.read<uint8>())) {
+				case handoff_records::listener: {
+					auto port = record.read_string();
+					auto server = find_if(this->servers.begin(), this->servers.end(), [&port](tcp_server& s) { return s.local_endpoint().port == port; });
+
+					if (fd != -1 && server != this->servers.end())
+						server->adopt_listener(net::socket(fd));
+					else if (fd != -1)
+						::close(fd);
+
+					break;
+				}
+
+				case handoff_records::connection: {
+					auto length = record.read<uint32>();
+					auto data = record.read(length);
+
+					if (fd != -1) {
+						try {
+							this->adopt(tcp_connection(net::socket(fd), vector<uint8>(data, data + length)), true);
+							inherited++;
+						}
+						catch (too_many_connections_exception) {
+
+						}
 					}
+
+					break;
 				}
+
+				case handoff_records::done:
+					completed = true;
+					break;
 			}
 		}
-	end:
+		catch (data_stream::read_past_end_exception) {
+			if (fd != -1)
+				::close(fd);
+
+			break;
+		}
+	}
+
+	::close(channel);
+
+	if (!completed)
+		throw handoff_failed_exception();
+
+	return inherited;
+}
+#endif
+
+shared_ptr<request_server::client> request_server::make_client(unique_ptr<tcp_connection> connection) {
+	auto created = make_shared<client>(move(connection));
+
+	created->buffer_charge = this->account(memory_categories::connection_buffers, tcp_connection::message_max_size, created.get());
+
+	if (this->contexts) {
+		created->connection->context_slot = this->contexts->allocate();
+
+		if (created->connection->context_slot == static_cast<word>(-1)) {
+			this->connections_refused++;
+			created->connection->close();
+
+			return nullptr;
+		}
+
+		created->contexts = this->contexts;
+	}
+
+	return created;
+}
+
+void request_server::on_client_connect(unique_ptr<tcp_connection> connection) {
+	//Refusing outright is kinder than accepting a connection that can't be read, and it keeps a flood of connections from using up the budget on buffers alone.
+	if (this->memory.would_exceed(static_cast<word>(memory_categories::connection_buffers), tcp_connection::message_max_size)) {
+		this->connections_refused++;
+		connection->close();
+		return;
+	}
+
+	auto created = this->make_client(move(connection));
+	if (!created)
+		return;
+
+	unique_lock<recursive_mutex> lck(this->client_lock);
+	this->clients.push_back(move(created));
+	this->prepare(*this->clients.back()->connection);
+	this->watch(this->clients.back());
+	this->on_connect(*this->clients.back()->connection);
+}
+
+void request_server::on_client_disconnect(client& disconnected) {
+	unique_lock<recursive_mutex> lck(this->client_lock);
+
+	//Queued messages hold a reference to the client, so the connection outlives the list entry until they drain.
+	disconnected.token.cancel();
+	this->unwatch(disconnected);
+
+	//Deferred messages are only released by the I/O loop, which no longer sees this client, and they would keep it alive forever.
+	this->cancelled += disconnected.deferred.size();
+	disconnected.deferred.clear();
+
+	//The subscriber map holds the client, so it must let go of it here too.
+	if (this->publish_subscribe)
+		this->unsubscribe_all(disconnected);
+
+	if (this->capture)
+		this->capture->record_close(disconnected.id);
+
+	this->on_disconnect(*disconnected.connection);
+	auto iter = find_if(this->clients.begin(), this->clients.end(), [&disconnected](shared_ptr<client>& c) { return c.get() == &disconnected; });
+	this->clients.erase(iter);
+}
+
+void request_server::prepare(tcp_connection& connection) {
+#if defined POSIX && defined SO_BUSY_POLL
+	if (!this->busy_poll || this->busy_poll_settings.socket_busy_poll.count() == 0)
+		return;
+
+	try {
+		auto& sock = connection.base_socket();
+		int usecs = static_cast<int>(this->busy_poll_settings.socket_busy_poll.count());
+
+		//Connections over other transports have no socket.
+		if (sock.is_connected())
+			::setsockopt(sock.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+	}
+	catch (tcp_connection::not_connected_exception) {
+
+	}
+#endif
+}
+
+void request_server::watch(const shared_ptr<client>& watched) {
+	weak_ptr<client> weak = watched;
+	auto& limits = this->connection_limits;
+
+	if (limits.idle_timeout.count() != 0)
+		watched->idle_timer = this->timers.schedule(limits.idle_timeout, bind(&request_server::on_idle_timer, this, weak));
+
+	auto websocket = dynamic_cast<websocket_connection*>(watched->connection.get());
+	if (!websocket)
+		return;
+
+	if (limits.handshake_timeout.count() != 0 && !websocket->handshake_complete())
+		watched->handshake_timer = this->timers.schedule(limits.handshake_timeout, bind(&request_server::on_handshake_timer, this, weak));
+
+	if (limits.heartbeat_interval.count() != 0)
+		watched->heartbeat_timer = this->timers.schedule(limits.heartbeat_interval, bind(&request_server::on_heartbeat_timer, this, weak));
+}
+
+void request_server::on_idle_timer(weak_ptr<client> weak) {
+	auto c = weak.lock();
+	if (!c)
+		return;
+
+	//Activity only updates a timestamp, so check it here and re-arm for whatever is left.
+	auto idle = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - c->last_activity);
+	c->idle_timer = timer_wheel::invalid;
+
+	if (idle >= this->connection_limits.idle_timeout)
+		this->time_out(*c);
+	else
+		c->idle_timer = this->timers.schedule(this->connection_limits.idle_timeout - idle, bind(&request_server::on_idle_timer, this, weak));
+}
+
+void request_server::on_handshake_timer(weak_ptr<client> weak) {
+	auto c = weak.lock();
+	if (!c)
+		return;
+
+	c->handshake_timer = timer_wheel::invalid;
+
+	if (!static_cast<websocket_connection&>(*c->connection).handshake_complete())
+		this->time_out(*c);
+}
+
+void request_server::on_heartbeat_timer(weak_ptr<client> weak) {
+	auto c = weak.lock();
+	if (!c)
+		return;
+
+	auto& websocket = static_cast<websocket_connection&>(*c->connection);
+	c->heartbeat_timer = timer_wheel::invalid;
+
+	if (websocket.ping_outstanding()) {
+		this->time_out(*c);
+		return;
+	}
+
+	try {
+		websocket.send_ping();
+	}
+	catch (tcp_connection::not_connected_exception) {
+		return;
+	}
+
+	c->heartbeat_timer = this->timers.schedule(this->connection_limits.heartbeat_interval, bind(&request_server::on_heartbeat_timer, this, weak));
+}
+
+void request_server::unwatch(client& watched) {
+	this->timers.cancel(watched.idle_timer);
+	this->timers.cancel(watched.handshake_timer);
+	this->timers.cancel(watched.heartbeat_timer);
+
+	watched.idle_timer = timer_wheel::invalid;
+	watched.handshake_timer = timer_wheel::invalid;
+	watched.heartbeat_timer = timer_wheel::invalid;
+}
+
+void request_server::time_out(client& expired) {
+	this->timed_out++;
+
+	expired.connection->close();
+	this->on_client_disconnect(expired);
+}
+
+void request_server::finish(message& m) {
+	if (m.owner)
+		m.owner->in_flight--;
+}
+
+void request_server::drop(message& m) {
+	//HTTP answers requests in order, so one left without a response would hold back every one after it forever.
+	//An empty response takes its place in flight, sent as a 503 or ending the body of a streamed one.
+	if (m.data.size() >= sizeof(uint16) && dynamic_cast<http_connection*>(&m.connection)) {
+		uint16 id;
+		memcpy(&id, m.data.data(), sizeof(id));
+
+		message response(m.connection, id);
+		response.owner = m.owner;
+		response.urgent = true;
+
+		this->on_outgoing(0, response);
+
+		return;
+	}
+
+	this->finish(m);
+}
+
+void request_server::flush(client& flushed) {
+	flushed.flush_at = chrono::steady_clock::time_point::max();
+
+	try {
+		flushed.connection->flush();
+	}
+	catch (tcp_connection::not_connected_exception) {
+
+	}
+}
+
+bool request_server::read_header(message& request, request_header& header) const {
+	if (request.data.size() < header_length)
+		return false;
+
+	request.data >> header.id >> header.category >> header.method;
+
+	header.deadline = chrono::steady_clock::time_point::max();
+	header.urgent = false;
+	header.coalesce_identical = false;
+
+	if (this->propagate_deadlines && (header.category & request_server::deadline_flag)) {
+		if (request.data.size() - request.data.position() < sizeof(uint32))
+			return false;
+
+		header.category = static_cast<uint8>(header.category & ~request_server::deadline_flag);
+		header.deadline = request.received + chrono::milliseconds(request.data.read<uint32>());
+	}
+
+	auto route = this->routes.find(static_cast<uint16>(header.category << 8 | header.method));
+
+	if (route != this->routes.end()) {
+		if (route->second.deadline.count() != 0)
+			header.deadline = min(header.deadline, request.received + route->second.deadline);
+
+		header.urgent = route->second.flush_immediately;
+		header.coalesce_identical = route->second.coalesce_identical;
+	}
+
+	return true;
+}
+
+uint8 request_server::request_category(const message& request) const {
+	auto category = request.data.data()[2];
+
+	return this->propagate_deadlines ? static_cast<uint8>(category & ~request_server::deadline_flag) : category;
+}
+
+bool request_server::answer_from_cache(message& request) {
+	request_header header;
+
+	if (this->read_header(request, header)) {
+		message response(request.connection, header.id);
+		auto key = request_key(header.category, header.method, request.data.data_at_cursor(), request.data.size() - request.data.position());
+
+		if (this->cache->find(key, response.data)) {
+			response.deadline = header.deadline;
+			response.urgent = header.urgent;
+			response.owner = request.owner;
+
+			//Written here rather than queued for the outgoing workers, it costs less than the hand off would.
+			this->on_outgoing(0, response);
+
+			return true;
+		}
+	}
+
+	request.data.seek(0);
+
+	return false;
+}
+
+void request_server::take_credit(client& source, const message& credit) {
+	uint32 consumed = 0;
+
+	if (credit.data.size() >= header_length + sizeof(consumed))
+		memcpy(&consumed, credit.data.data() + header_length, sizeof(consumed));
+
+	if (credit.data.data()[3] == request_server::publication_credit_method) {
+		unique_lock<mutex> lck(this->subscription_lock);
+
+		source.publication_outstanding -= min<word>(consumed, source.publication_outstanding);
+		this->send_publications(source);
+
+		return;
+	}
+
+	unique_lock<mutex> lck(source.stream_lock);
+
+	source.stream_outstanding -= min<word>(consumed, source.stream_outstanding);
+	source.stream_acknowledged.notify_all();
+}
+
+void request_server::subscribe(const shared_ptr<client>& source, message& request) {
+	request_header header;
+	bool succeeded = false;
+
+	if (!this->read_header(request, header)) {
+		this->finish(request);
+		return;
+	}
+
+	try {
+		auto pattern = request.data.read_string();
+
+		unique_lock<mutex> lck(this->subscription_lock);
+		auto& patterns = source->subscriptions;
+		auto existing = find(patterns.begin(), patterns.end(), pattern);
+
+		if (header.method == request_server::subscribe_method && topic_trie::is_valid(pattern)) {
+			if (existing == patterns.end()) {
+				this->topics.insert(pattern, source->id);
+				patterns.push_back(pattern);
+				this->subscribers[source->id] = source;
+			}
+
+			succeeded = true;
+		}
+		else if (header.method == request_server::unsubscribe_method && existing != patterns.end()) {
+			this->topics.erase(pattern, source->id);
+			patterns.erase(existing);
+
+			if (patterns.empty())
+				this->subscribers.erase(source->id);
+
+			succeeded = true;
+		}
+	}
+	catch (data_stream::read_past_end_exception) {
+
+	}
+
+	//Answered from here like a rejection, the response takes over the request's place in flight.
+	message response(request.connection, header.id);
+	response.owner = source;
+	response.urgent = true;
+	response.data.write(static_cast<uint8>(succeeded ? 1 : 0));
+
+	this->on_outgoing(0, response);
+}
+
+void request_server::unsubscribe_all(client& source) {
+	unique_lock<mutex> lck(this->subscription_lock);
+
+	for (auto& i : source.subscriptions)
+		this->topics.erase(i, source.id);
+
+	this->subscribers.erase(source.id);
+	source.subscriptions.clear();
+	source.publications.clear();
+	source.conflatable.clear();
+}
+
+void request_server::enqueue_publication(client& target, const shared_ptr<const data_stream>& frame, const string& key) {
+	if (target.publications.empty() && target.publication_outstanding < this->publication_window) {
+		target.publications.push_back(publication{ frame, string(), target.next_publication++, memory_accountant::charge() });
+		this->send_publications(target);
+
+		return;
+	}
+
+	if (!key.empty()) {
+		auto queued = target.conflatable.find(key);
+
+		if (queued != target.conflatable.end()) {
+			//Sequences are consecutive from the front, so the offset from the first is the position.
+			auto& replaced = target.publications[queued->second - target.publications.front().sequence];
+			replaced.frame = frame;
+			replaced.accounted = this->account(memory_categories::publications, frame->size(), &target);
+			this->conflated++;
+
+			return;
+		}
+	}
+
+	if (target.publications.size() >= this->publication_limit) {
+		auto& oldest = target.publications.front();
+
+		if (!oldest.key.empty())
+			target.conflatable.erase(oldest.key);
+
+		target.publications.pop_front();
+		this->publications_dropped++;
+	}
+
+	if (!key.empty())
+		target.conflatable[key] = target.next_publication;
+
+	target.publications.push_back(publication{ frame, key, target.next_publication++, this->account(memory_categories::publications, frame->size(), &target) });
+}
+
+void request_server::send_publications(client& target) {
+	//The window may be overrun by one publication so that ones larger than it still make progress.
+	while (!target.publications.empty() && target.publication_outstanding < this->publication_window) {
+		auto& next = target.publications.front();
+		auto frame = next.frame;
+
+		if (!next.key.empty())
+			target.conflatable.erase(next.key);
+
+		target.publications.pop_front();
+		target.publication_outstanding += frame->size();
+
+		try {
+			target.connection->send(frame->data(), frame->size());
+		}
+		catch (tcp_connection::not_connected_exception) {
+			//The I/O thread notices the disconnect on its next read and drops the subscriptions.
+			target.publications.clear();
+			target.conflatable.clear();
+		}
+	}
+}
+
+void request_server::on_incoming(word worker_number, message& request) {
+	if (request.owner && request.owner->token.cancelled()) {
+		this->cancelled++;
+		this->finish(request);
+		return;
+	}
+
+	request_header header;
+
+	if (!this->read_header(request, header)) {
+		this->finish(request);
+		return;
+	}
+
+	//Nobody is waiting for the answer anymore, so don't spend a worker computing it.
+	if (chrono::steady_clock::now() > header.deadline) {
+		this->expired++;
+		this->drop(request);
+		return;
+	}
+
+	//The handler consumes the payload, so remember where it starts for the key.
+	auto payload_start = request.data.position();
+	string flight;
+
+	if (header.coalesce_identical) {
+		flight = request_key(header.category, header.method, request.data.data_at_cursor(), request.data.size() - payload_start);
+
+		unique_lock<mutex> lck(this->flight_lock);
+
+		auto existing = this->flights.find(flight);
+		if (existing != this->flights.end()) {
+			existing->second.push_back(follower{ move(request), header.id, header.deadline, header.urgent });
+			return;
+		}
+
+		this->flights[flight];
+	}
+
+	message response(request.connection, header.id);
+	response.deadline = header.deadline;
+	response.urgent = header.urgent;
+	response.owner = request.owner;
+
+	current_cancellation = request.owner ? &request.owner->token : nullptr;
+	current_cache_ttl = 0;
+	current_server = this;
+	current_response = &response;
+	current_streamed = false;
+
+	request_result result;
+
+	try {
+		result = this->on_request(request.connection, worker_number, header.category, header.method, request.data, response.data);
+	}
+	catch (...) {
+		current_cancellation = nullptr;
+		current_server = nullptr;
+		current_response = nullptr;
+
+		//Left in place, the flight would never land and every identical request after it would park behind it forever.
+		//The followers run the handler themselves rather than share a failure that might not be theirs.
+		if (header.coalesce_identical)
+			this->land(flight, request_result::retry_later, response);
+
+		//Answered rather than rethrown, which would end the worker and leave the request in flight forever.
+		message failure(request.connection, header.id, request_server::failure_flag);
+		failure.deadline = header.deadline;
+		failure.urgent = header.urgent;
+		failure.owner = request.owner;
+
+		this->failed++;
+		this->enqueue_outgoing(move(failure));
+
+		return;
+	}
+
+	current_cancellation = nullptr;
+	current_server = nullptr;
+	current_response = nullptr;
+
+	if (result == request_result::success && current_cache_ttl > 0 && this->cache && !current_streamed) {
+		auto key = flight.empty() ? request_key(header.category, header.method, request.data.data() + payload_start, request.data.size() - payload_start) : flight;
+
+		this->cache->insert(key, response.data.data() + header_length, response.data.size() - header_length, chrono::milliseconds(current_cache_ttl));
+	}
+
+	//The followers can't be sent the chunks already written, so let them run the handler themselves.
+	if (header.coalesce_identical)
+		this->land(flight, current_streamed ? request_result::retry_later : result, response);
+
+	switch (result) {
+		case request_result::success:
+			this->enqueue_outgoing(move(response));
+
+			break;
+		case request_result::retry_later:
+			if (++request.attempts < request_server::max_retries) {
+				request.data.seek(0);
+				this->enqueue_incoming(move(request));
+			}
+			else {
+				//Whatever the handler wrote before giving up is no part of the answer.
+				message retry(request.connection, header.id, request_server::retry_flag);
+				retry.deadline = header.deadline;
+				retry.urgent = header.urgent;
+				retry.owner = request.owner;
+				retry.data.write(this->retry_code);
+
+				this->enqueue_outgoing(move(retry));
+			}
+
+			break;
+		case request_result::no_response:
+			this->drop(request);
+
+			break;
+	}
+}
+
+void request_server::land(const string& key, request_result result, const message& response) {
+	vector<follower> followers;
+
+	{
+		unique_lock<mutex> lck(this->flight_lock);
+
+		auto flight = this->flights.find(key);
+		followers = move(flight->second);
+		this->flights.erase(flight);
+	}
+
+	for (auto& i : followers) {
+		switch (result) {
+			case request_result::success: {
+				message answer(i.request.connection, i.id);
+				answer.deadline = i.deadline;
+				answer.urgent = i.urgent;
+				answer.owner = i.request.owner;
+				answer.data.write(response.data.data() + header_length, response.data.size() - header_length);
+
+				this->coalesced++;
+				this->enqueue_outgoing(move(answer));
+
+				break;
+			}
+			case request_result::retry_later:
+				//Each one retries on its own, and whichever runs first leads the next flight.
+				i.request.data.seek(0);
+				this->enqueue_incoming(move(i.request));
+
+				break;
+			case request_result::no_response:
+				this->drop(i.request);
+
+				break;
+		}
+	}
+}
+
+void request_server::on_outgoing(word, message& response) {
+	auto now = chrono::steady_clock::now();
+
+	if (now > response.deadline) {
+		this->expired++;
+		this->drop(response);
+		return;
+	}
+
+	if (response.owner && response.owner->token.cancelled()) {
+		this->cancelled++;
+		this->finish(response);
+		return;
+	}
+
+	unique_lock<recursive_mutex> lck(this->client_lock);
+
+	if (!response.owner) {
+		auto iter = find_if(this->clients.begin(), this->clients.end(), [&response](shared_ptr<client>& c) { return c->connection.get() == &response.connection; });
+
+		if (iter == this->clients.end())
+			return;
+	}
+
+	try {
+		if (response.connection.is_connected()) {
+			if (!this->coalesce || !response.owner) {
+				response.connection.send(response.data.data(), response.data.size());
+			}
+			else {
+				auto& owner = *response.owner;
+
+				response.connection.append(response.data.data(), response.data.size());
+
+				if (response.urgent || response.connection.buffered() >= tcp_connection::message_max_size)
+					this->flush(owner);
+				else if (owner.flush_at == chrono::steady_clock::time_point::max())
+					owner.flush_at = now + this->coalesce_window;
+			}
+		}
+	}
+	catch (tcp_connection::not_connected_exception) {
+		this->cancelled++;
+	}
+
+	this->finish(response);
+}
+
+memory_accountant::charge request_server::account(memory_categories category, uint64 bytes, client* owner) {
+	if (!owner)
+		return this->memory.take(static_cast<word>(category), bytes);
+
+	auto inbound = category == memory_categories::connection_buffers || category == memory_categories::requests;
+
+	return this->memory.take(static_cast<word>(category), bytes, inbound ? &owner->read_memory : &owner->queued_memory);
+}
+
+bool request_server::memory_exhausted(client& source) {
+	//Only what reading adds can pause it. Stopping reads for responses or publications would also stop the credits and closes that drain them.
+	auto inbound = this->memory.used(static_cast<word>(memory_categories::connection_buffers)) + this->memory.used(static_cast<word>(memory_categories::requests));
+	auto exhausted = (this->memory_limits.budget != 0 && inbound > this->memory_limits.budget) || (this->memory_limits.per_connection != 0 && source.read_memory > this->memory_limits.per_connection);
+
+	if (exhausted && !source.memory_paused)
+		this->memory_pauses++;
+
+	source.memory_paused = exhausted;
+
+	return exhausted;
+}
+
+bool request_server::receive(const shared_ptr<client>& source) {
+	for (auto& k : source->connection->read()) {
+		if (!k.closed) {
+			message m(*source->connection, move(k));
+
+			if (this->capture)
+				this->capture->record(source->id, m.data.data(), m.data.size());
+
+			//Without either feature nothing is ever owed credit, so the category belongs to on_request like any other.
+			if ((this->streaming || this->publish_subscribe) && m.data.size() >= header_length && m.data.data()[2] == request_server::stream_credit_category) {
+				this->take_credit(*source, m);
+				continue;
+			}
+
+			m.owner = source;
+			m.accounted = this->account(memory_categories::requests, m.data.size(), source.get());
+			source->in_flight++;
+			source->last_activity = m.received;
+
+			if (this->publish_subscribe && m.data.size() >= header_length && this->request_category(m) == request_server::subscription_category) {
+				this->subscribe(source, m);
+				continue;
+			}
+
+			//Keep arrival order behind anything a rate limit is holding back.
+			if (!source->deferred.empty())
+				source->deferred.push_back(move(m));
+			else if (!this->admit(source, m))
+				return false;
+		}
+		else {
+			this->on_client_disconnect(*source);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+const request_server::rate_limit* request_server::check_limits(client& source, const message& request, chrono::steady_clock::time_point now) {
+	token_bucket* buckets[3];
+	word count = 0;
+
+	auto& per_connection = this->connection_limits.per_connection;
+	auto& per_address = this->connection_limits.per_address;
+
+	if (per_connection.rate > 0) {
+		if (!source.bucket.ready(per_connection, now))
+			return &per_connection;
+
+		buckets[count++] = &source.bucket;
+	}
+
+	string address;
+	bool addressed = false;
+
+	if (per_address.rate > 0) {
+		//Connections over other transports, such as shared memory, have no remote address to limit by.
+		try {
+			auto remote = request.connection.address();
+			address.assign(reinterpret_cast<const char*>(remote.data()), remote.size());
+			addressed = true;
+		}
+		catch (tcp_connection::not_connected_exception) {
+
+		}
+		catch (net::socket::not_connected_exception) {
+
+		}
+	}
+
+	if (addressed) {
+		//Buckets that have refilled hold nothing worth keeping, so drop them now and then to bound the map.
+		if (now >= this->next_bucket_prune) {
+			for (auto i = this->address_buckets.begin(); i != this->address_buckets.end(); )
+				i = i->second.full(per_address, now) ? this->address_buckets.erase(i) : next(i);
+
+			this->next_bucket_prune = now + chrono::seconds(10);
+		}
+
+		auto& bucket = this->address_buckets[address];
+		if (!bucket.ready(per_address, now))
+			return &per_address;
+
+		buckets[count++] = &bucket;
+	}
+
+	if (this->route_rate_limited && request.data.size() >= header_length) {
+		auto category = this->request_category(request);
+		auto key = static_cast<uint16>(category << 8 | request.data.data()[3]);
+		auto route = this->routes.find(key);
+
+		if (route != this->routes.end() && route->second.limit.rate > 0) {
+			auto& bucket = this->route_buckets[key];
+			if (!bucket.ready(route->second.limit, now))
+				return &route->second.limit;
+
+			buckets[count++] = &bucket;
+		}
+	}
+
+	//Only taken once every limit has room, so a request refused by one doesn't use up the others.
+	for (word i = 0; i < count; i++)
+		buckets[i]->tokens -= 1;
+
+	return nullptr;
+}
+
+bool request_server::admit(const shared_ptr<client>& source, message& request) {
+	auto exceeded = this->check_limits(*source, request, chrono::steady_clock::now());
+
+	if (!exceeded) {
+		this->dispatch(request);
+		return true;
+	}
+
+	this->rate_limited++;
+
+	switch (exceeded->policy) {
+		case rate_limit_policies::reject:
+			this->reject(request);
+
+			return true;
+
+		case rate_limit_policies::delay:
+			source->deferred.push_back(move(request));
+
+			return true;
+
+		case rate_limit_policies::disconnect:
+			this->finish(request);
+			source->connection->close();
+			this->on_client_disconnect(*source);
+
+			return false;
+	}
+
+	return true;
+}
+
+bool request_server::release_deferred(const shared_ptr<client>& source) {
+	auto now = chrono::steady_clock::now();
+
+	while (!source->deferred.empty()) {
+		auto exceeded = this->check_limits(*source, source->deferred.front(), now);
+
+		if (exceeded && exceeded->policy == rate_limit_policies::delay)
+			return true;
+
+		auto request = move(source->deferred.front());
+		source->deferred.pop_front();
+
+		if (!exceeded) {
+			this->dispatch(request);
+			continue;
+		}
+
+		//Held back by one limit and now refused by another.
+		this->rate_limited++;
+
+		if (exceeded->policy == rate_limit_policies::reject) {
+			this->reject(request);
+		}
+		else {
+			this->finish(request);
+			source->connection->close();
+			this->on_client_disconnect(*source);
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void request_server::reject(message& request) {
+	if (request.data.size() < sizeof(uint16)) {
+		this->finish(request);
+		return;
+	}
+
+	uint16 id;
+	memcpy(&id, request.data.data(), sizeof(id));
+
+	message response(request.connection, id, request_server::retry_flag);
+	response.owner = request.owner;
+	response.data.write(this->retry_code);
+
+	this->on_outgoing(0, response);
+}
+
+void request_server::dispatch(message& request) {
+	if (this->cache && this->answer_from_cache(request))
+		return;
+
+	this->enqueue_incoming(move(request));
+}
+
+void request_server::io_run() {
+	vector<shared_ptr<client>> polled;
+
+	while (this->running) {
+		unique_lock<recursive_mutex> lck(this->client_lock);
+		auto now = chrono::steady_clock::now();
+
+		for (auto& i : this->clients)
+			if (i->flush_at <= now)
+				this->flush(*i);
+
+		if (this->busy_poll) {
+			//The lock is taken for one client at a time so the workers writing responses never wait out a whole pass of the loop.
+			polled = this->clients;
+			lck.unlock();
+
+			for (auto& i : polled) {
+				lck.lock();
+
+				try {
+					if (!i->deferred.empty())
+						this->release_deferred(i);
+					else if (!this->memory_exhausted(*i) && i->connection->data_available(0))
+						this->receive(i);
+				}
+				catch (tcp_connection::not_connected_exception) {
+					//Closed by a handler rather than by the peer, so no read will ever report it. It may have been removed since the snapshot.
+					if (find(this->clients.begin(), this->clients.end(), i) != this->clients.end())
+						this->on_client_disconnect(*i);
+				}
+
+				lck.unlock();
+			}
+
+			polled.clear();
+
+			lck.lock();
+			this->timers.advance();
+
+			continue;
+		}
+
+		for (auto& i : this->clients) {
+			//Closed by a handler rather than by the peer, such as after a failed send_file, so no read will ever report it.
+			if (!i->connection->is_connected()) {
+				this->on_client_disconnect(*i);
+				break;
+			}
+
+			if (!i->deferred.empty()) {
+				if (!this->release_deferred(i))
+					break;
+			}
+			else if (!this->memory_exhausted(*i) && i->connection->data_available() && !this->receive(i)) {
+				break;
+			}
+		}
+
+		this->timers.advance();
+		lck.unlock();
+
 		this_thread::yield();
 	}
 }
@@ -197,6 +1704,7 @@ void request_server::enqueue_outgoing(message m) {
 		return;
 
 	m.data.seek(0);
+	m.accounted = this->account(memory_categories::responses, m.data.size(), m.owner.get());
 	this->outgoing.add_work(move(m));
 }
 
@@ -204,23 +1712,38 @@ request_server::message::message(tcp_connection& connection, tcp_connection::mes
 	message.data = nullptr;
 	message.length = 0;
 	this->attempts = 0;
+	this->received = chrono::steady_clock::now();
+	this->deadline = chrono::steady_clock::time_point::max();
+	this->urgent = false;
 }
 
 request_server::message::message(tcp_connection& connection, data_stream data) : connection(connection), data(move(data)) {
 	this->attempts = 0;
+	this->received = chrono::steady_clock::now();
+	this->deadline = chrono::steady_clock::time_point::max();
+	this->urgent = false;
 }
 
 request_server::message::message(tcp_connection& connection, const uint8* data, word length) : connection(connection), data(data, length) {
 	this->attempts = 0;
+	this->received = chrono::steady_clock::now();
+	this->deadline = chrono::steady_clock::time_point::max();
+	this->urgent = false;
 }
 
 request_server::message::message(tcp_connection& connection, uint16 id, uint8 category, uint8 method) : connection(connection) {
 	request_server::message::write_header(this->data, id, category, method);
 	this->attempts = 0;
+	this->received = chrono::steady_clock::now();
+	this->deadline = chrono::steady_clock::time_point::max();
+	this->urgent = false;
 }
 
-request_server::message::message(request_server::message&& other) : connection(other.connection), data(move(other.data)) {
+request_server::message::message(request_server::message&& other) : connection(other.connection), data(move(other.data)), owner(move(other.owner)), accounted(move(other.accounted)) {
 	this->attempts = other.attempts;
+	this->received = other.received;
+	this->deadline = other.deadline;
+	this->urgent = other.urgent;
 }
 
 void request_server::message::write_header(data_stream& stream, uint16 id, uint8 category, uint8 method) {
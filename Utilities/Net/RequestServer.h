@@ -3,24 +3,54 @@
 #include <atomic>
 #include <vector>
 #include <list>
+#include <deque>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <memory>
+#include <chrono>
+#include <unordered_map>
+#include <functional>
+#include <string>
+#include <typeinfo>
 
 #include "../Common.h"
 #include "../DataStream.h"
 #include "../WorkProcessor.h"
+#include "../FairQueue.h"
 #include "../Event.h"
+#include "../CancellationToken.h"
+#include "../TimerWheel.h"
+#include "../TopicTrie.h"
+#include "../Slab.h"
+#include "../MemoryAccountant.h"
 #include "TCPServer.h"
 #include "TCPConnection.h"
+#include "ResponseCache.h"
+#include "TrafficCapture.h"
 
 namespace util {
 	namespace net {
 		class request_server {
 			public:
+				struct client;
+
 				struct exported message {
 					tcp_connection& connection;
 					word attempts;
 					data_stream data;
+					std::chrono::steady_clock::time_point received;
+					std::chrono::steady_clock::time_point deadline;
+
+					///Write the response immediately even when the server coalesces responses.
+					bool urgent;
+
+					///The connection the message was read from. Keeps the connection alive while the message is queued.
+					///Empty for messages constructed outside of the server.
+					std::shared_ptr<client> owner;
+
+					///The bytes of data counted against the server's memory budget while the message is queued.
+					memory_accountant::charge accounted;
 
 					message(tcp_connection& connection, tcp_connection::message message);
 					message(tcp_connection& connection, data_stream data);
@@ -35,17 +65,221 @@ namespace util {
 					message& operator=(message&& other) = delete;
 				};
 
+				enum class rate_limit_policies {
+					///Answer at once with the retry code, which request_client retries on its own.
+					reject,
+
+					///Stop reading from the connection until the request fits the limit, so TCP pushes back on the client.
+					delay,
+
+					///Close the connection.
+					disconnect
+				};
+
+				///A token bucket. Every request takes a token, and tokens refill at rate up to burst.
+				struct exported rate_limit {
+					///Tokens added per second. Zero disables the limit.
+					double rate;
+
+					///The most tokens the bucket holds, which is how many requests may arrive at once. At least one.
+					double burst;
+
+					///What happens to requests that find the bucket empty.
+					rate_limit_policies policy;
+
+					rate_limit();
+					rate_limit(double rate, double burst, rate_limit_policies policy = rate_limit_policies::reject);
+				};
+
+				struct exported route_options {
+					///The longest a request may wait before its handler runs. Zero means no limit.
+					///A shorter deadline sent by the client takes precedence.
+					std::chrono::milliseconds deadline;
+
+					///Write responses on this route as soon as they are ready even when the server coalesces responses.
+					///Anything already waiting for the connection is written along with them.
+					bool flush_immediately;
+
+					///Run the handler once for requests on this route that arrive while an identical one is being handled, and answer them all with its response.
+					///Requests are identical when their category, method and payload match byte for byte. Only for handlers whose response depends on nothing else.
+					bool coalesce_identical;
+
+					///Limits the requests on this route from all connections together.
+					rate_limit limit;
+
+					route_options();
+				};
+
+				struct exported connection_options {
+					///Connections that send no request for this long are closed. Zero means no limit.
+					std::chrono::milliseconds idle_timeout;
+
+					///WebSocket connections that have not completed the upgrade this long after connecting are closed. Zero means no limit.
+					std::chrono::milliseconds handshake_timeout;
+
+					///How often WebSocket connections are pinged. Connections that have not answered the previous ping are closed. Zero disables pings.
+					std::chrono::milliseconds heartbeat_interval;
+
+					///The most bytes of streamed chunks a connection may have sent but not yet acknowledged before response_stream::write waits.
+					word stream_window;
+
+					///Limits the requests from each connection.
+					rate_limit per_connection;
+
+					///Limits the requests from all the connections of each remote address together.
+					///Connections without a remote address, such as shared memory ones, are only limited per connection.
+					rate_limit per_address;
+
+					connection_options();
+				};
+
+				///What the server's memory is counted as, for memory_used.
+				enum class memory_categories {
+					///The read buffer every connection holds.
+					connection_buffers,
+
+					///Requests read but not yet handled, including those held back by a rate limit.
+					requests,
+
+					///Responses waiting to be written.
+					responses,
+
+					///Publications queued for subscribers whose window is used up, counted once for every queue they wait in.
+					publications
+				};
+
+				struct exported memory_options {
+					///The most bytes the server may hold. Past it, new connections are closed as soon as they are accepted.
+					///Once read buffers and requests alone pass it, no connection is read until the requests are handled.
+					///Responses and publications don't stop reads since their credits and the closes that free them arrive by reading. Zero means no limit.
+					uint64 budget;
+
+					///The most bytes one connection's read buffer and requests may hold. Past it, that connection isn't read until they are handled. Zero means no limit.
+					uint64 per_connection;
+
+					memory_options();
+				};
+
+				struct exported busy_poll_options {
+					///The core the I/O thread is pinned to. Negative leaves it unpinned.
+					sword io_core;
+
+					///The cores the request and response workers are pinned to, in worker order. Workers without one are left unpinned.
+					std::vector<sword> request_cores;
+					std::vector<sword> response_cores;
+
+					///How long an idle worker spins waiting for work before it sleeps.
+					std::chrono::microseconds worker_spin;
+
+					///How long a read may busy poll the device queue, set as SO_BUSY_POLL on each connection where supported. Zero leaves it unset.
+					std::chrono::microseconds socket_busy_poll;
+
+					busy_poll_options();
+				};
+
+				struct exported statistics {
+					///Requests dropped because their deadline passed before they were handled or answered.
+					uint64 expired;
+
+					///Requests and responses dropped because their connection closed while they were queued.
+					uint64 cancelled;
+
+					///Connections closed by the idle, handshake or heartbeat timeouts.
+					uint64 timed_out;
+
+					///Requests answered with the response to an identical request that was already being handled.
+					uint64 coalesced;
+
+					///Requests whose handler threw, answered with failure_flag.
+					uint64 failed;
+
+					///Lookups in the response cache, and entries it dropped for room. All zero unless the cache is enabled.
+					uint64 cache_hits;
+					uint64 cache_misses;
+					uint64 cache_evictions;
+
+					///Requests that found a rate limit exhausted, whatever its policy did with them.
+					uint64 rate_limited;
+
+					///Queued publications replaced by a newer one with the same key, and publications dropped because a subscriber's queue was full.
+					uint64 conflated;
+					uint64 publications_dropped;
+
+					///Bytes held in all categories, times a connection stopped being read for memory, and connections closed because the budget or the connection contexts were used up.
+					uint64 memory_used;
+					uint64 memory_pauses;
+					uint64 connections_refused;
+				};
+
 				enum class request_result {
 					success,
 					no_response,
 					retry_later
 				};
 
+				typedef std::function<uint64(tcp_connection&)> fairness_key;
+				typedef std::function<word(uint64)> fairness_weight;
+
 				class cant_move_running_server_exception {};
 				class cant_start_default_constructed_exception {};
+				class handoff_failed_exception {};
+				class no_current_request_exception {};
+				class wrong_context_type_exception {};
+				class streaming_disabled_exception {};
+				class too_many_connections_exception {};
+
+				///Sends a response in chunks as the handler produces them instead of as one message, obtained from stream inside on_request.
+				///Chunks are written in order and the data_stream the handler fills is sent last to end the stream.
+				///Each connection may only have stream_window bytes of chunks unacknowledged, so a slow reader slows the handler instead of growing memory.
+				///Streamed responses are never cached, and coalesced requests waiting on one run their handler themselves.
+				class response_stream {
+					public:
+						///Sends a chunk, waiting first while the connection's window is used up.
+						///@param data The chunk. At most a full message less the response header.
+						///@param length The length of the chunk.
+						///@return True if the chunk was sent, false if the request was cancelled or its deadline passed while waiting.
+						exported bool write(const uint8* data, word length);
+						exported bool write(const data_stream& chunk);
+
+					private:
+						request_server* server;
+						message* response;
+
+						response_stream(request_server* server, message* response);
+
+						friend class request_server;
+				};
 
 				static const word max_retries = 5;
 
+				///Set on the category of a request whose header carries a uint32 deadline, in milliseconds, after the method.
+				///Only with deadline propagation enabled, otherwise categories keep all eight bits.
+				static const uint8 deadline_flag = 0x80;
+
+				///Set on the category of each chunk of a streamed response. The response without it ends the stream.
+				static const uint8 stream_chunk_flag = 0x40;
+
+				///Set on the category of the empty response sent in place of one whose handler threw.
+				static const uint8 failure_flag = 0x10;
+
+				///Set on the category of the response telling the client to send the request again later. Its payload is still the retry code.
+				static const uint8 retry_flag = 0x20;
+
+				///The category of the requests clients send to acknowledge chunks, carrying the uint32 number of bytes consumed.
+				///Once streaming or publish and subscribe is enabled they are handled by the server and never reach on_request.
+				static const uint8 stream_credit_category = 0x7F;
+
+				///The category of subscription requests and of publications once publish and subscribe is enabled.
+				///Subscription requests carry a pattern as a string and are answered with a uint8 that is one if it succeeded.
+				///Publications have an id of zero and carry the topic as a string followed by the payload.
+				static const uint8 subscription_category = 0x7E;
+				static const uint8 subscribe_method = 0;
+				static const uint8 unsubscribe_method = 1;
+				static const uint8 publication_method = 2;
+
+				///The method of stream_credit_category requests that acknowledge publications rather than chunks.
+				static const uint8 publication_credit_method = 1;
+
 				exported request_server();
 				exported request_server(net::endpoint port, word workers, uint16 retry_code);
 				exported request_server(std::vector<net::endpoint> ports, word workers, uint16 retry_code);
@@ -60,6 +294,141 @@ namespace util {
 				exported void start();
 				exported void stop();
 				exported tcp_connection& adopt(tcp_connection&& connection, bool call_on_connect = false);
+
+				///Serves an existing connection of any kind, such as a shared_memory_connection, alongside those accepted by the server.
+				///@throws too_many_connections_exception if every connection context is taken. The connection is closed.
+				exported tcp_connection& adopt(std::unique_ptr<tcp_connection> connection, bool call_on_connect = false);
+
+				///Must be called before start.
+				exported void configure_route(uint8 category, uint8 method, route_options options);
+
+				///Must be called before start.
+				exported void configure_connections(connection_options options);
+
+				///Counts the bytes held in buffers and queues and pushes back on clients once they pass a budget instead of growing without bound.
+				///Must be called before start.
+				exported void configure_memory(memory_options options);
+
+				exported statistics stats() const;
+
+				///Gets the bytes held in one category.
+				exported uint64 memory_used(memory_categories category) const;
+
+				///Gets the bytes held for one connection, or zero if it isn't served by this server.
+				exported uint64 memory_used(const tcp_connection& connection);
+
+				///Serves queued requests by deficit round robin across flows instead of in arrival order,
+				///so a client that pipelines a burst of requests only delays its own.
+				///Must be called before start.
+				///@param key Maps a connection to its flow, for example a tenant id. Null gives every connection its own flow.
+				///@param weight Maps a flow key to the number of requests it is served per round. Null gives every flow a weight of one.
+				exported void enable_fair_scheduling(fairness_key key = nullptr, fairness_weight weight = nullptr);
+
+				///Batches responses for the same connection into a single write instead of one write per response.
+				///Batches are written on the next pass of the I/O loop once the oldest response has waited window,
+				///or as soon as they grow to the size of a full message.
+				///Must be called before start.
+				///@param window How long a response may wait for others to join it. Zero writes on the next pass.
+				exported void enable_coalescing(std::chrono::microseconds window = std::chrono::microseconds(0));
+
+				///Keeps the responses handlers mark with cache_response and answers identical requests with them straight from the I/O thread,
+				///without queueing them for a worker. Requests are identical when their category, method and payload match byte for byte.
+				///Must be called before start.
+				///@param capacity The most bytes of requests and responses to hold. The least recently useful entries are evicted past it.
+				///@param shards The number of independently locked parts the cache is split into.
+				exported void enable_response_cache(word capacity, word shards = 16);
+
+				///Records every frame received, and when each connection closes, to a log that traffic_replayer can play back against another build.
+				///Must be called before start.
+				///@param path The file to write. Replaced if it exists.
+				///@throws traffic_recorder::could_not_open_exception if the file can't be created.
+				exported void enable_capture(const std::string& path);
+
+				///Lets handlers send their responses in chunks with stream. Requests in stream_credit_category then acknowledge chunks
+				///instead of reaching on_request, so the category can't be used for anything else.
+				///Must be called before start.
+				exported void enable_streaming();
+
+				///Lets connections subscribe to topics with subscription_category requests, handled on the I/O thread without reaching on_request,
+				///and delivers what publish sends to every subscriber whose pattern matches. Patterns are those of topic_trie.
+				///Each subscriber may only have window bytes of publications unacknowledged, past which its publications queue.
+				///A queued publication is replaced in place by a newer one with the same key, so a slow subscriber skips to the latest value
+				///instead of falling further behind, and the oldest is dropped once limit are queued.
+				///Must be called before start.
+				///@param limit The most publications queued for one subscriber.
+				///@param window The most bytes of publications a subscriber may have unacknowledged.
+				exported void enable_publish_subscribe(word limit = 1024, word window = 256 * 1024);
+
+				///Sends a publication to every subscriber of a matching pattern. It is encoded once and shared by all of them.
+				///Subscribers to several matching patterns receive it once.
+				///@param topic The topic. Without wildcards.
+				///@param payload The payload. At most a full message less the header and topic.
+				///@param key Identifies what the publication is the latest value of, such as an instrument, for conflation. Empty publications are never conflated.
+				///@return The number of subscribers it was sent or queued to.
+				///@throws tcp_connection::message_too_long_exception if the publication doesn't fit in a message.
+				exported word publish(const std::string& topic, const data_stream& payload, const std::string& key = "");
+
+				///Gives every connection a default constructed T, kept in a slab indexed by the connection's context slot instead of behind tcp_connection::state.
+				///It is constructed before on_connect and destroyed once the connection has disconnected and nothing queued refers to it.
+				///Must be called before start.
+				template<typename T> void enable_connection_context(word max_connections = 1 << 16) {
+					this->contexts.reset(new typed_context_store<T>(max_connections));
+				}
+
+				///Gets the context of a connection served by this server.
+				///@throws wrong_context_type_exception if T is not the type given to enable_connection_context.
+				template<typename T> T& context(tcp_connection& connection) {
+					if (!this->contexts || this->contexts->type() != typeid(T) || connection.context_slot == slab<T>::invalid)
+						throw wrong_context_type_exception();
+
+					return static_cast<typed_context_store<T>&>(*this->contexts).objects[connection.context_slot];
+				}
+
+#ifdef POSIX
+				///Hands the listening sockets, and optionally the idle connections, to a process waiting in inherit
+				///so this one can be replaced without refusing or dropping connections.
+				///Accepting stops once the listeners are sent. Requests already received are still answered and this waits for them,
+				///so stop can be called as soon as it returns. Connections handed over raise on_disconnect here.
+				///Secured, WebSocket and HTTP connections, and those with subscriptions, are never handed over. They are served here until they close.
+				///@param path The Unix domain socket the new process is listening on.
+				///@param include_idle Whether or not to hand over connections with no requests in flight.
+				///@param drain_timeout The longest to wait for the requests still in flight here.
+				///@return The number of connections handed over.
+				exported word handoff(const std::string& path, bool include_idle = true, std::chrono::milliseconds drain_timeout = std::chrono::milliseconds(30000));
+
+				///Waits for a process to call handoff, then takes over the listening sockets and connections it sends.
+				///Listeners are matched to this server's endpoints by port, endpoints without a match bind as usual on start.
+				///Anything received before a failure is kept. Must be called before start.
+				///@param path The Unix domain socket to listen on. Replaced if it exists.
+				///@return The number of connections taken over.
+				exported word inherit(const std::string& path);
+#endif
+
+				///Lets clients that enable deadline propagation send how long they will wait for each request, marked with deadline_flag,
+				///so requests nobody is waiting for anymore are dropped instead of handled. Categories with the top bit set can't be used with it.
+				///Must be called before start.
+				exported void enable_deadline_propagation();
+
+				///Spends dedicated cores on latency: the I/O loop checks connections without waiting and never sleeps,
+				///idle workers spin before sleeping, and the threads can be pinned so they stay warm on their cores.
+				///Only worth it when there are more cores than busy threads, otherwise the spinning threads starve the rest.
+				///Must be called before start.
+				exported void enable_busy_poll(busy_poll_options options = busy_poll_options());
+
+				///Gets the cancellation token of the request being handled on the calling worker.
+				///The token is cancelled once the requesting connection disconnects, so long running handlers should poll it.
+				///@return The token, or a token that is never cancelled when called outside of on_request.
+				exported static const cancellation_token& cancellation();
+
+				///Marks the response of the request being handled on the calling worker as cacheable.
+				///Does nothing unless the response cache is enabled and the handler returns success.
+				///@param ttl How long identical requests may be answered with this response.
+				exported static void cache_response(std::chrono::milliseconds ttl);
+
+				///Gets a sink that streams the response of the request being handled on the calling worker.
+				///@throws no_current_request_exception when called outside of on_request.
+				///@throws streaming_disabled_exception unless enable_streaming was called.
+				exported static response_stream stream();
 				
 				request_server(const request_server& other) = delete;
 				request_server& operator=(const request_server& other) = delete;
@@ -69,28 +438,220 @@ namespace util {
 				event<tcp_connection&> on_disconnect;
 
 			private:
+				//Declared first so that it outlives the clients and queued messages whose charges refer to it.
+				memory_accountant memory;
+				memory_options memory_limits;
+				std::atomic<uint64> memory_pauses;
+				std::atomic<uint64> connections_refused;
+
 				std::list<tcp_server> servers;
-				std::vector<std::unique_ptr<tcp_connection>> clients;
+				std::vector<std::shared_ptr<client>> clients;
 				std::recursive_mutex client_lock;
 
-				work_processor<message> incoming;
+				work_processor<message, fair_queue<message>> incoming;
 				work_processor<message> outgoing;
 
 				uint16 retry_code;
 
+				std::unordered_map<uint16, route_options> routes;
+				std::atomic<uint64> expired;
+				std::atomic<uint64> cancelled;
+				std::atomic<uint64> timed_out;
+				std::atomic<uint64> coalesced;
+				std::atomic<uint64> failed;
+				std::atomic<uint64> rate_limited;
+
+				struct token_bucket {
+					double tokens;
+					std::chrono::steady_clock::time_point updated;
+
+					token_bucket();
+
+					bool ready(const rate_limit& limit, std::chrono::steady_clock::time_point now);
+					bool full(const rate_limit& limit, std::chrono::steady_clock::time_point now) const;
+				};
+
+				//Only touched by the I/O thread.
+				bool route_rate_limited;
+				std::unordered_map<uint16, token_bucket> route_buckets;
+				std::unordered_map<std::string, token_bucket> address_buckets;
+				std::chrono::steady_clock::time_point next_bucket_prune;
+
+				std::unique_ptr<response_cache> cache;
+				std::unique_ptr<traffic_recorder> capture;
+
+				struct context_store {
+					virtual ~context_store() {}
+					virtual const std::type_info& type() const = 0;
+					virtual word allocate() = 0;
+					virtual void release(word slot) = 0;
+				};
+
+				template<typename T> struct typed_context_store : context_store {
+					slab<T> objects;
+
+					typed_context_store(word max_connections) : objects(max_connections) {}
+
+					virtual const std::type_info& type() const override { return typeid(T); }
+					virtual word allocate() override {
+						try {
+							return this->objects.emplace();
+						}
+						catch (typename slab<T>::full_exception) {
+							return slab<T>::invalid;
+						}
+					}
+					virtual void release(word slot) override { this->objects.release(slot); }
+				};
+
+				std::shared_ptr<context_store> contexts;
+
+				struct publication {
+					std::shared_ptr<const data_stream> frame;
+					std::string key;
+					uint64 sequence;
+					memory_accountant::charge accounted;
+				};
+
+				//The trie, the clients with subscriptions and the subscription state of every client are only touched with subscription_lock held.
+				//It is taken after client_lock since publications are written to the connections.
+				bool streaming;
+				bool publish_subscribe;
+				word publication_limit;
+				word publication_window;
+				topic_trie topics;
+				std::unordered_map<uint64, std::shared_ptr<client>> subscribers;
+				uint64 publication_round;
+				std::mutex subscription_lock;
+				std::atomic<uint64> conflated;
+				std::atomic<uint64> publications_dropped;
+
+				struct request_header {
+					uint16 id;
+					uint8 category;
+					uint8 method;
+					std::chrono::steady_clock::time_point deadline;
+					bool urgent;
+					bool coalesce_identical;
+				};
+
+				//A request waiting on an identical one, with what on_incoming parsed from its header.
+				struct follower {
+					message request;
+					uint16 id;
+					std::chrono::steady_clock::time_point deadline;
+					bool urgent;
+				};
+
+				//Keyed by category, method and payload. An entry exists while its first request is being handled.
+				std::unordered_map<std::string, std::vector<follower>> flights;
+				std::mutex flight_lock;
+
+				//Only touched with client_lock held, which io_run holds while advancing it.
+				connection_options connection_limits;
+				timer_wheel timers;
+
+				bool coalesce;
+				std::chrono::microseconds coalesce_window;
+
+				bool propagate_deadlines;
+
+				bool busy_poll;
+				busy_poll_options busy_poll_settings;
+
 				std::thread io_worker;
 				std::atomic<bool> running;
 				std::atomic<bool> valid;
 
 				void on_client_connect(std::unique_ptr<tcp_connection> connection);
-				void on_client_disconnect(tcp_connection& connection);
+				std::shared_ptr<client> make_client(std::unique_ptr<tcp_connection> connection);
+				void on_client_disconnect(client& disconnected);
+				void watch(const std::shared_ptr<client>& watched);
+				void unwatch(client& watched);
+				void time_out(client& expired);
+				void on_idle_timer(std::weak_ptr<client> weak);
+				void on_handshake_timer(std::weak_ptr<client> weak);
+				void on_heartbeat_timer(std::weak_ptr<client> weak);
+				void finish(message& m);
+				void drop(message& m);
+				uint8 request_category(const message& request) const;
+				bool read_header(message& request, request_header& header) const;
+				bool answer_from_cache(message& request);
+				void take_credit(client& source, const message& credit);
+				void subscribe(const std::shared_ptr<client>& source, message& request);
+				void unsubscribe_all(client& source);
+				void enqueue_publication(client& target, const std::shared_ptr<const data_stream>& frame, const std::string& key);
+				void send_publications(client& target);
+				const rate_limit* check_limits(client& source, const message& request, std::chrono::steady_clock::time_point now);
+				bool admit(const std::shared_ptr<client>& source, message& request);
+				bool release_deferred(const std::shared_ptr<client>& source);
+				void reject(message& request);
+				void dispatch(message& request);
+				void land(const std::string& key, request_result result, const message& response);
+				void flush(client& flushed);
+				void prepare(tcp_connection& connection);
 				void on_incoming(word worker_number, message& response);
 				void on_outgoing(word worker_number, message& response);
+				memory_accountant::charge account(memory_categories category, uint64 bytes, client* owner);
+				bool memory_exhausted(client& source);
+				bool receive(const std::shared_ptr<client>& source);
 				void io_run();
 
 #ifdef WINDOWS
 				static void on_client_connect_hack(std::unique_ptr<tcp_connection> connection, void* state);
 #endif
 		};
+
+		struct request_server::client {
+			std::unique_ptr<tcp_connection> connection;
+			cancellation_token token;
+
+			///Unique among all the clients of the process.
+			uint64 id;
+
+			///Bytes held for this client, split by whether reading adds to them or writing drains them, and the charge for its read buffer.
+			///Declared before anything charged to them.
+			std::atomic<uint64> read_memory;
+			std::atomic<uint64> queued_memory;
+			memory_accountant::charge buffer_charge;
+
+			///Whether or not the I/O thread has stopped reading the connection for memory.
+			bool memory_paused;
+
+			std::atomic<word> in_flight;
+			std::chrono::steady_clock::time_point last_activity;
+			timer_wheel::id idle_timer;
+			timer_wheel::id handshake_timer;
+			timer_wheel::id heartbeat_timer;
+
+			///When the responses appended to the connection are due to be written. Max when nothing is waiting.
+			std::chrono::steady_clock::time_point flush_at;
+
+			///Bytes of streamed chunks sent but not yet acknowledged, guarded by stream_lock.
+			word stream_outstanding;
+			std::mutex stream_lock;
+			std::condition_variable stream_acknowledged;
+
+			///Requests held back by a delaying rate limit, in arrival order. The connection isn't read while any are waiting.
+			std::deque<message> deferred;
+			token_bucket bucket;
+
+			///The patterns subscribed to, the publications waiting for the window to open, and the bytes of publications not yet acknowledged.
+			///Queued publications with a key are indexed by it, and numbered consecutively so the index can find them. Guarded by subscription_lock.
+			std::vector<std::string> subscriptions;
+			std::deque<publication> publications;
+			std::unordered_map<std::string, uint64> conflatable;
+			uint64 next_publication;
+			word publication_outstanding;
+
+			///The last round of publish that reached this client, so that overlapping patterns don't send it twice.
+			uint64 publication_round;
+
+			///Where the connection's context lives, released with the client since queued messages may still use it.
+			std::shared_ptr<context_store> contexts;
+
+			client(std::unique_ptr<tcp_connection> connection);
+			~client();
+		};
 	}
 }
@@ -0,0 +1,199 @@
+#include "Resolver.h"
+
+#include <utility>
+#include <cstring>
+#include <memory>
+
+#ifdef WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#elif defined POSIX
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <netdb.h>
+#endif
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+static string cache_key(const string& host, const string& port) {
+	//Neither host names, address literals nor ports contain a slash.
+	return host + "/" + port;
+}
+
+static void fulfil(promise<resolver::addresses>& target, bool failed, const resolver::addresses& result) {
+	if (failed)
+		target.set_exception(make_exception_ptr(net::socket::invalid_address_exception()));
+	else
+		target.set_value(result);
+}
+
+resolver::resolver(word threads, chrono::seconds ttl, chrono::seconds failure_ttl, word connect_threads, word capacity) : ttl(ttl), failure_ttl(failure_ttl), capacity(capacity > 0 ? capacity : 1), pool(threads > 0 ? threads : 1), connectors(connect_threads > 0 ? connect_threads : 1) {
+	this->pool.on_item += [](word, function<void()>& job) { job(); };
+	this->connectors.on_item += [](word, function<void()>& job) { job(); };
+	this->pool.start();
+	this->connectors.start();
+}
+
+resolver::~resolver() {
+	//Connects may be waiting on lookups, so they stop first.
+	this->connectors.stop();
+	this->pool.stop();
+}
+
+resolver& resolver::shared() {
+	static resolver instance;
+
+	return instance;
+}
+
+future<resolver::addresses> resolver::resolve(const string& host, const string& port) {
+	promise<addresses> result;
+	auto answer = result.get_future();
+	auto key = cache_key(host, port);
+
+	unique_lock<mutex> lck(this->lock);
+
+	auto hit = this->cache.find(key);
+	if (hit != this->cache.end() && hit->second.expires > chrono::steady_clock::now()) {
+		fulfil(result, hit->second.failed, hit->second.result);
+		return answer;
+	}
+
+	auto& waiting = this->pending[key];
+	waiting.push_back(move(result));
+
+	if (waiting.size() == 1)
+		this->pool.add_work(bind(&resolver::lookup, this, host, port));
+
+	return answer;
+}
+
+future<net::socket> resolver::connect(endpoint ep) {
+	auto result = make_shared<promise<net::socket>>();
+	auto deadline = chrono::steady_clock::now() + ep.connect_timeout;
+
+	//Waiting on the lookup is fine here since lookups run on the other pool.
+	auto found = make_shared<future<addresses>>(this->resolve(ep.address, ep.port));
+
+	this->connectors.add_work([result, found, deadline]() {
+		if (found->wait_until(deadline) != future_status::ready) {
+			result->set_value(net::socket());
+			return;
+		}
+
+		addresses candidates;
+
+		try {
+			candidates = found->get();
+		}
+		catch (...) {
+			result->set_exception(current_exception());
+			return;
+		}
+
+		auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+		if (remaining.count() <= 0)
+			result->set_value(net::socket());
+		else
+			result->set_value(net::socket::connect(candidates, remaining));
+	});
+
+	return result->get_future();
+}
+
+void resolver::clear() {
+	unique_lock<mutex> lck(this->lock);
+
+	this->cache.clear();
+}
+
+word resolver::cached() {
+	unique_lock<mutex> lck(this->lock);
+
+	return this->cache.size();
+}
+
+resolver::entry resolver::query(const string& host, const string& port) {
+	addrinfo hints;
+	addrinfo* results = nullptr;
+	entry found;
+
+	initialize_sockets();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	found.failed = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0 || results == nullptr;
+
+	for (addrinfo* i = found.failed ? nullptr : results; i; i = i->ai_next) {
+		socket_address address;
+		address.address.fill(0x00);
+
+		if (i->ai_family == AF_INET) {
+			auto ipv4 = reinterpret_cast<sockaddr_in*>(i->ai_addr);
+			address.family = net::socket::families::ipv4;
+			address.port = ntohs(ipv4->sin_port);
+			memcpy(address.address.data(), &ipv4->sin_addr, 4);
+		}
+		else if (i->ai_family == AF_INET6) {
+			auto ipv6 = reinterpret_cast<sockaddr_in6*>(i->ai_addr);
+			address.family = net::socket::families::ipv6;
+			address.port = ntohs(ipv6->sin6_port);
+			memcpy(address.address.data(), &ipv6->sin6_addr, 16);
+		}
+		else {
+			continue;
+		}
+
+		found.result.push_back(address);
+	}
+
+	if (results)
+		::freeaddrinfo(results);
+
+	found.failed = found.result.empty();
+	found.expires = chrono::steady_clock::now() + (found.failed ? this->failure_ttl : this->ttl);
+
+	return found;
+}
+
+void resolver::store(const string& key, const entry& found) {
+	if (this->cache.size() >= this->capacity && this->cache.find(key) == this->cache.end()) {
+		auto now = chrono::steady_clock::now();
+
+		for (auto i = this->cache.begin(); i != this->cache.end(); ) {
+			if (i->second.expires <= now)
+				i = this->cache.erase(i);
+			else
+				++i;
+		}
+
+		//Everything is still fresh, so make room at the cost of one name being looked up again early.
+		if (this->cache.size() >= this->capacity)
+			this->cache.erase(this->cache.begin());
+	}
+
+	this->cache[key] = found;
+}
+
+void resolver::lookup(string host, string port) {
+	auto key = cache_key(host, port);
+	auto found = this->query(host, port);
+	vector<promise<addresses>> waiting;
+
+	{
+		unique_lock<mutex> lck(this->lock);
+
+		this->store(key, found);
+		waiting = move(this->pending[key]);
+		this->pending.erase(key);
+	}
+
+	for (auto& i : waiting)
+		fulfil(i, found.failed, found.result);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <functional>
+
+#include "../Common.h"
+#include "../WorkProcessor.h"
+#include "Socket.h"
+
+namespace util {
+	namespace net {
+		///Resolves host names on a small pool of threads and caches the results, so the threads that connect never wait on DNS themselves.
+		///Names go through the system resolver, which also consults the hosts file. It does not report record TTLs,
+		///so answers are kept for a fixed time and failures for a shorter one. Concurrent lookups of the same name share one query.
+		///Connects run on threads of their own, so slow connects never hold up lookups and slow lookups only hold up the connects waiting on them.
+		class resolver {
+			public:
+				typedef std::vector<socket_address> addresses;
+
+				///Constructs a new resolver.
+				///@param threads The number of lookups that may run at once.
+				///@param ttl How long an answer is reused.
+				///@param failure_ttl How long a name that failed to resolve keeps failing without being looked up again.
+				///@param connect_threads The number of connects that may run at once.
+				///@param capacity The most names cached. Expired entries are dropped first once it is reached, then arbitrary ones.
+				exported resolver(word threads = 2, std::chrono::seconds ttl = std::chrono::seconds(60), std::chrono::seconds failure_ttl = std::chrono::seconds(5), word connect_threads = 4, word capacity = 4096);
+				exported ~resolver();
+
+				///Resolves a host name.
+				///@param host The name or literal address.
+				///@param port The port or service name.
+				///@return The addresses, in the order the system prefers them. Holds socket::invalid_address_exception if the name does not resolve.
+				exported std::future<addresses> resolve(const std::string& host, const std::string& port);
+
+				///Resolves the endpoint's address on the pool and connects to it as socket::connect does on a connect thread.
+				///@param ep The endpoint. Its connect_timeout covers resolving and connecting.
+				///@return The socket, unconnected if the timeout passed or every address refused. Holds socket::invalid_address_exception if the name does not resolve.
+				exported std::future<socket> connect(endpoint ep);
+
+				///Drops every cached answer and failure.
+				exported void clear();
+
+				///Gets the number of names cached, including expired ones not yet dropped.
+				exported word cached();
+
+				///Gets the resolver socket uses to connect to endpoints.
+				exported static resolver& shared();
+
+				resolver(const resolver& other) = delete;
+				resolver& operator=(const resolver& other) = delete;
+
+			private:
+				struct entry {
+					addresses result;
+					bool failed;
+					std::chrono::steady_clock::time_point expires;
+				};
+
+				std::unordered_map<std::string, entry> cache;
+				std::unordered_map<std::string, std::vector<std::promise<addresses>>> pending;
+				std::mutex lock;
+				std::chrono::seconds ttl;
+				std::chrono::seconds failure_ttl;
+				word capacity;
+				work_processor<std::function<void()>> pool;
+				work_processor<std::function<void()>> connectors;
+
+				entry query(const std::string& host, const std::string& port);
+				void store(const std::string& key, const entry& found);
+				void lookup(std::string host, std::string port);
+		};
+	}
+}
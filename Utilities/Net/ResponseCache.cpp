@@ -0,0 +1,159 @@
+#include "ResponseCache.h"
+
+#include <functional>
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+response_cache::response_cache(word capacity, word shards) {
+	if (shards == 0)
+		shards = 1;
+
+	this->shard_capacity = capacity / shards;
+	this->hits = 0;
+	this->misses = 0;
+	this->evictions = 0;
+
+	for (word i = 0; i < shards; i++) {
+		this->shards.emplace_back(new shard());
+		this->shards.back()->hand = 0;
+		this->shards.back()->bytes = 0;
+	}
+}
+
+response_cache::shard& response_cache::shard_for(const string& key) {
+	return *this->shards[hash<string>()(key) % this->shards.size()];
+}
+
+bool response_cache::find(const string& key, data_stream& out) {
+	auto& target = this->shard_for(key);
+	unique_lock<mutex> lck(target.lock);
+
+	auto found = target.index.find(key);
+	if (found == target.index.end()) {
+		this->misses++;
+		return false;
+	}
+
+	auto& e = target.slots[found->second];
+
+	if (e.expires <= chrono::steady_clock::now()) {
+		this->remove(target, found->second);
+		this->misses++;
+		return false;
+	}
+
+	e.referenced = true;
+	out.write(e.body.data(), static_cast<word>(e.body.size()));
+
+	this->hits++;
+
+	return true;
+}
+
+void response_cache::insert(const string& key, const uint8* body, word length, chrono::milliseconds ttl) {
+	word cost = static_cast<word>(key.size()) + length;
+
+	if (ttl.count() <= 0 || cost > this->shard_capacity)
+		return;
+
+	auto& target = this->shard_for(key);
+	auto now = chrono::steady_clock::now();
+	unique_lock<mutex> lck(target.lock);
+
+	auto existing = target.index.find(key);
+	if (existing != target.index.end())
+		this->remove(target, existing->second);
+
+	while (target.bytes + cost > this->shard_capacity)
+		this->evict_one(target, now);
+
+	word slot;
+	if (!target.free_slots.empty()) {
+		slot = target.free_slots.back();
+		target.free_slots.pop_back();
+	}
+	else {
+		slot = static_cast<word>(target.slots.size());
+		target.slots.emplace_back();
+	}
+
+	auto& e = target.slots[slot];
+	e.key = key;
+	e.body.assign(body, body + length);
+	e.expires = now + ttl;
+	e.referenced = false;
+
+	target.index[key] = slot;
+	target.bytes += cost;
+}
+
+void response_cache::evict_one(shard& target, chrono::steady_clock::time_point now) {
+	//Only called while bytes are held, so some slot is occupied and at most two sweeps find one to evict.
+	while (true) {
+		if (target.hand >= target.slots.size())
+			target.hand = 0;
+
+		word slot = target.hand++;
+		auto& e = target.slots[slot];
+
+		if (e.key.empty())
+			continue;
+
+		if (e.referenced && e.expires > now) {
+			e.referenced = false;
+			continue;
+		}
+
+		this->remove(target, slot);
+		this->evictions++;
+
+		return;
+	}
+}
+
+void response_cache::remove(shard& target, word slot) {
+	auto& e = target.slots[slot];
+
+	target.bytes -= static_cast<word>(e.key.size() + e.body.size());
+	target.index.erase(e.key);
+	target.free_slots.push_back(slot);
+
+	string().swap(e.key);
+	vector<uint8>().swap(e.body);
+}
+
+void response_cache::clear() {
+	for (auto& i : this->shards) {
+		unique_lock<mutex> lck(i->lock);
+
+		i->index.clear();
+		i->slots.clear();
+		i->free_slots.clear();
+		i->hand = 0;
+		i->bytes = 0;
+	}
+}
+
+word response_cache::size() {
+	word result = 0;
+
+	for (auto& i : this->shards) {
+		unique_lock<mutex> lck(i->lock);
+
+		result += i->bytes;
+	}
+
+	return result;
+}
+
+response_cache::statistics response_cache::stats() const {
+	statistics result;
+
+	result.hits = this->hits;
+	result.misses = this->misses;
+	result.evictions = this->evictions;
+
+	return result;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+
+#include "../Common.h"
+#include "../DataStream.h"
+
+namespace util {
+	namespace net {
+		///A size bounded cache of response bodies keyed by the bytes of the request they answer.
+		///Keys are spread over shards that each have their own lock, so lookups from the I/O thread rarely wait on inserts from the workers.
+		///Each shard evicts with CLOCK: a hit marks its entry as referenced, and the hand clears the mark on the entries it passes
+		///and evicts the first one it finds unmarked or expired. New entries start unmarked, so one that is never hit again goes first.
+		class response_cache {
+			public:
+				struct statistics {
+					uint64 hits;
+					uint64 misses;
+
+					///Entries dropped to make room for others.
+					uint64 evictions;
+				};
+
+				///Constructs a new cache.
+				///@param capacity The most bytes of keys and bodies to hold, split evenly between the shards.
+				///@param shards The number of independently locked shards.
+				exported response_cache(word capacity, word shards = 16);
+
+				///Looks up a key.
+				///@param key The request bytes.
+				///@param out The stream the cached body is written to on a hit.
+				///@return True if an unexpired body was found, false otherwise.
+				exported bool find(const std::string& key, data_stream& out);
+
+				///Caches a body, replacing any already cached for the key.
+				///Bodies that would not fit in a shard on their own are not cached.
+				///@param key The request bytes.
+				///@param body The response body.
+				///@param length The length of the body.
+				///@param ttl How long the body may be served.
+				exported void insert(const std::string& key, const uint8* body, word length, std::chrono::milliseconds ttl);
+
+				///Drops every entry.
+				exported void clear();
+
+				///Gets the number of bytes of keys and bodies held.
+				exported word size();
+
+				exported statistics stats() const;
+
+				response_cache(const response_cache& other) = delete;
+				response_cache& operator=(const response_cache& other) = delete;
+
+			private:
+				struct entry {
+					std::string key;
+					std::vector<uint8> body;
+					std::chrono::steady_clock::time_point expires;
+					bool referenced;
+				};
+
+				struct shard {
+					std::mutex lock;
+					std::unordered_map<std::string, word> index;
+					std::vector<entry> slots;
+					std::vector<word> free_slots;
+					word hand;
+					word bytes;
+				};
+
+				std::vector<std::unique_ptr<shard>> shards;
+				word shard_capacity;
+				std::atomic<uint64> hits;
+				std::atomic<uint64> misses;
+				std::atomic<uint64> evictions;
+
+				shard& shard_for(const std::string& key);
+				void evict_one(shard& target, std::chrono::steady_clock::time_point now);
+				void remove(shard& target, word slot);
+		};
+	}
+}
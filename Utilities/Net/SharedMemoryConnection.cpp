@@ -0,0 +1,280 @@
+#include "SharedMemoryConnection.h"
+
+#ifdef POSIX
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../Misc.h"
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+struct shared_memory_connection::ring {
+	//Each index is only written by one side, so keep them on separate cache lines.
+	alignas(64) atomic<uint64> head;
+	alignas(64) atomic<uint64> tail;
+	alignas(64) atomic<uint32> reader_parked;
+	atomic<uint32> writer_parked;
+	atomic<uint32> closed;
+};
+
+struct shared_memory_connection::region {
+	atomic<uint32> magic;
+	uint64 capacity;
+	ring rings[2];
+};
+
+static const uint32 region_magic = 0x75736D63;
+static const word spin_iterations = 200;
+static const word forever = static_cast<word>(-1);
+
+static void wake(atomic<uint32>& parked) {
+	if (parked.load() == 0)
+		return;
+
+	parked.store(0);
+	::syscall(SYS_futex, reinterpret_cast<uint32*>(&parked), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+//Spins, then sleeps on parked until ready holds or the timeout, in microseconds, passes.
+//The peer checks parked after every change it makes, so it only makes the wake up call when this side is actually asleep.
+template<typename F> static bool wait_until(atomic<uint32>& parked, F ready, word timeout) {
+	for (word i = 0; i < spin_iterations; i++) {
+		if (ready())
+			return true;
+
+		misc::cpu_relax();
+	}
+
+	if (timeout == 0)
+		return ready();
+
+	auto until = chrono::steady_clock::now() + chrono::microseconds(timeout);
+
+	while (true) {
+		parked.store(1);
+
+		if (ready()) {
+			parked.store(0);
+			return true;
+		}
+
+		timespec remaining;
+		timespec* limit = nullptr;
+
+		if (timeout != forever) {
+			auto left = chrono::duration_cast<chrono::nanoseconds>(until - chrono::steady_clock::now()).count();
+			if (left <= 0) {
+				parked.store(0);
+				return ready();
+			}
+
+			remaining.tv_sec = static_cast<time_t>(left / 1000000000);
+			remaining.tv_nsec = static_cast<long>(left % 1000000000);
+			limit = &remaining;
+		}
+
+		::syscall(SYS_futex, reinterpret_cast<uint32*>(&parked), FUTEX_WAIT, 1, limit, nullptr, 0);
+		parked.store(0);
+
+		if (ready())
+			return true;
+	}
+}
+
+shared_memory_connection::shared_memory_connection(word capacity) {
+	uint64 rounded = 1;
+	while (rounded < capacity || rounded < tcp_connection::message_max_size)
+		rounded <<= 1;
+
+	this->capacity = rounded;
+	this->fd = ::memfd_create("util_shared_memory_connection", MFD_CLOEXEC);
+	if (this->fd == -1)
+		throw could_not_create_exception();
+
+	if (::ftruncate(this->fd, static_cast<off_t>(sizeof(region) + 2 * this->capacity)) != 0) {
+		::close(this->fd);
+		throw could_not_create_exception();
+	}
+
+	this->map(true);
+}
+
+shared_memory_connection::shared_memory_connection(int fd) {
+	this->fd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (this->fd == -1)
+		throw invalid_region_exception();
+
+	this->map(false);
+}
+
+shared_memory_connection::~shared_memory_connection() {
+	this->close();
+
+	::munmap(this->shared, this->mapped_length);
+	::close(this->fd);
+}
+
+void shared_memory_connection::map(bool first) {
+	struct stat info;
+
+	if (!first && (::fstat(this->fd, &info) != 0 || static_cast<uint64>(info.st_size) <= sizeof(region))) {
+		::close(this->fd);
+		throw invalid_region_exception();
+	}
+
+	this->mapped_length = static_cast<word>(first ? sizeof(region) + 2 * this->capacity : info.st_size);
+
+	void* address = ::mmap(nullptr, this->mapped_length, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+	if (address == MAP_FAILED) {
+		::close(this->fd);
+
+		if (first)
+			throw could_not_create_exception();
+		else
+			throw invalid_region_exception();
+	}
+
+	this->shared = reinterpret_cast<region*>(address);
+
+	if (first) {
+		//The file starts zeroed, which is already the state of an empty ring, so only the header needs writing.
+		new (this->shared) region();
+		this->shared->capacity = this->capacity;
+		this->shared->magic.store(region_magic);
+	}
+	else {
+		this->capacity = this->shared->capacity;
+
+		if (this->shared->magic.load() != region_magic || (this->capacity & (this->capacity - 1)) != 0 || sizeof(region) + 2 * this->capacity != this->mapped_length) {
+			::munmap(address, this->mapped_length);
+			::close(this->fd);
+			throw invalid_region_exception();
+		}
+	}
+
+	uint8* data = reinterpret_cast<uint8*>(this->shared) + sizeof(region);
+
+	this->outbound = &this->shared->rings[first ? 0 : 1];
+	this->inbound = &this->shared->rings[first ? 1 : 0];
+	this->outbound_data = data + (first ? 0 : this->capacity);
+	this->inbound_data = data + (first ? this->capacity : 0);
+
+	this->buffer = new uint8[tcp_connection::message_max_size];
+	this->received = 0;
+	this->connected = true;
+}
+
+int shared_memory_connection::native_handle() const {
+	return this->fd;
+}
+
+bool shared_memory_connection::data_available() const {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	return this->wait_readable(250);
+}
+
+bool shared_memory_connection::data_available(word timeout) const {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	return this->wait_readable(timeout);
+}
+
+bool shared_memory_connection::wait_readable(word timeout) const {
+	auto& r = *this->inbound;
+
+	//A closed ring counts as readable so the next read reports it.
+	return wait_until(r.reader_parked, [&r]() { return r.tail.load() != r.head.load(memory_order_relaxed) || r.closed.load() != 0; }, timeout);
+}
+
+void shared_memory_connection::close() {
+	if (!this->connected)
+		return;
+
+	this->outbound->closed.store(1);
+	this->inbound->closed.store(1);
+
+	wake(this->outbound->reader_parked);
+	wake(this->inbound->writer_parked);
+
+	tcp_connection::close();
+}
+
+word shared_memory_connection::receive(uint8* data, word count) {
+	auto& r = *this->inbound;
+
+	while (true) {
+		uint64 head = r.head.load(memory_order_relaxed);
+		uint64 tail = r.tail.load(memory_order_acquire);
+
+		if (tail != head) {
+			word length = static_cast<word>(min<uint64>(count, tail - head));
+			uint64 offset = head & (this->capacity - 1);
+			uint64 first = min<uint64>(length, this->capacity - offset);
+
+			memcpy(data, this->inbound_data + offset, static_cast<size_t>(first));
+			memcpy(data + first, this->inbound_data, static_cast<size_t>(length - first));
+
+			r.head.store(head + length);
+			wake(r.writer_parked);
+
+			return length;
+		}
+
+		if (r.closed.load() != 0)
+			return 0;
+
+		this->wait_readable(forever);
+	}
+}
+
+word shared_memory_connection::transmit(const uint8* data, word count) {
+	auto& r = *this->outbound;
+	word written = 0;
+
+	while (written < count) {
+		if (r.closed.load() != 0)
+			break;
+
+		uint64 tail = r.tail.load(memory_order_relaxed);
+		uint64 space = this->capacity - (tail - r.head.load(memory_order_acquire));
+
+		if (space == 0) {
+			auto capacity = this->capacity;
+			wait_until(r.writer_parked, [&r, tail, capacity]() { return tail - r.head.load() != capacity || r.closed.load() != 0; }, forever);
+			continue;
+		}
+
+		word length = static_cast<word>(min<uint64>(count - written, space));
+		uint64 offset = tail & (this->capacity - 1);
+		uint64 first = min<uint64>(length, this->capacity - offset);
+
+		memcpy(this->outbound_data + offset, data + written, static_cast<size_t>(first));
+		memcpy(this->outbound_data, data + written + first, static_cast<size_t>(length - first));
+
+		r.tail.store(tail + length);
+		wake(r.reader_parked);
+
+		written += length;
+	}
+
+	return written;
+}
+
+#endif
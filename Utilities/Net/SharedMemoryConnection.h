@@ -0,0 +1,71 @@
+#pragma once
+
+#include "../Common.h"
+#include "TCPConnection.h"
+
+#ifdef POSIX
+
+namespace util {
+	namespace net {
+		///A tcp_connection between two processes on the same machine that moves bytes through shared memory instead of a socket.
+		///Each direction is a single producer, single consumer ring in a memfd, so neither side makes a system call
+		///while the other keeps up. A side that runs out of data or room spins briefly, then sleeps on a futex,
+		///and the peer only pays for a wake up when it sees the other side asleep.
+		///Framing, reading, sending, appending and queueing behave exactly as for a socket.
+		///There is no socket, so address and base_socket are not available, and one thread at a time may read and one may write.
+		class shared_memory_connection : public tcp_connection {
+			public:
+				class could_not_create_exception {};
+				class invalid_region_exception {};
+
+				///The default capacity of each direction's ring.
+				static const word default_capacity = 1 << 20;
+
+				///Creates a new region and connects to it as the first side.
+				///Pass native_handle to the other process, for example over a Unix socket with SCM_RIGHTS or by fork, and construct the second side from it there.
+				///@param capacity The number of bytes each direction can hold. Rounded up to a power of two no smaller than a full message.
+				exported shared_memory_connection(word capacity = shared_memory_connection::default_capacity);
+
+				///Connects as the second side to a region created by another shared_memory_connection.
+				///@param fd The memfd of the region. It is duplicated, so the caller still owns it.
+				exported shared_memory_connection(int fd);
+
+				exported virtual ~shared_memory_connection() override;
+
+				///Gets the memfd of the region.
+				///@return The file descriptor. Owned by the connection.
+				exported int native_handle() const;
+
+				exported virtual bool data_available() const override;
+				exported virtual bool data_available(word timeout) const override;
+				exported virtual void close() override;
+
+				shared_memory_connection(const shared_memory_connection& other) = delete;
+				shared_memory_connection(shared_memory_connection&& other) = delete;
+				shared_memory_connection& operator=(const shared_memory_connection& other) = delete;
+				shared_memory_connection& operator=(shared_memory_connection&& other) = delete;
+
+			protected:
+				virtual word receive(uint8* data, word count) override;
+				virtual word transmit(const uint8* data, word count) override;
+
+			private:
+				struct ring;
+				struct region;
+
+				int fd;
+				region* shared;
+				word mapped_length;
+				ring* inbound;
+				ring* outbound;
+				uint8* inbound_data;
+				uint8* outbound_data;
+				uint64 capacity;
+
+				void map(bool first);
+				bool wait_readable(word timeout) const;
+		};
+	}
+}
+
+#endif
@@ -1,9 +1,11 @@
 #include "Socket.h"
+#include "Resolver.h"
 
 #include <utility>
 #include <memory>
 #include <algorithm>
 #include <cstring>
+#include <future>
 
 #ifdef WINDOWS
 	#define WIN32_LEAN_AND_MEAN
@@ -27,6 +29,9 @@
 	#include <stdio.h>
 	#include <string.h>
 	#include <endian.h>
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <errno.h>
 
 #define close_sock close
 #define closed_socket -1
@@ -37,18 +42,29 @@ using namespace std;
 using namespace util;
 using namespace util::net;
 
-endpoint::endpoint(std::string address, std::string port, bool is_websocket) : address(address), port(port), is_websocket(is_websocket) {
+endpoint::endpoint(std::string address, std::string port, bool is_websocket) : address(address), port(port), is_websocket(is_websocket), is_http(false), connect_timeout(10000) {
 
 }
 
-endpoint::endpoint(std::string port, bool is_websocket) : address(""), port(port), is_websocket(is_websocket) {
+endpoint::endpoint(std::string port, bool is_websocket) : address(""), port(port), is_websocket(is_websocket), is_http(false), connect_timeout(10000) {
 
 }
 
-endpoint::endpoint() : address(""), port(""), is_websocket(false) {
+endpoint::endpoint() : address(""), port(""), is_websocket(false), is_http(false), connect_timeout(10000) {
 
 }
 
+void util::net::initialize_sockets() {
+#ifdef WINDOWS
+	if (!::winsock_initialized) {
+		WSADATA startup_data;
+		if (::WSAStartup(514, &startup_data) != 0)
+			throw runtime_error("WinSock failed to initialize.");
+		::winsock_initialized = true;
+	}
+#endif
+}
+
 #ifdef WINDOWS
 uintptr prep_socket(socket::families family, socket::types type, string address, string port, addrinfo** addr_info) {
 #elif defined POSIX
@@ -57,13 +73,9 @@ int prep_socket(socket::families family, socket::types type, string address, str
 	addrinfo hints;
 	addrinfo* server_addr_info;
 
+	initialize_sockets();
+
 #ifdef WINDOWS
-	if (!::winsock_initialized) {
-		WSADATA startup_data;
-		if (::WSAStartup(514, &startup_data) != 0)
-			throw runtime_error("WinSock failed to initialize.");
-		::winsock_initialized = true;
-	}
 	uintptr raw_socket;
 #elif defined POSIX
 	int raw_socket;
@@ -122,22 +134,91 @@ socket::socket() {
 	this->connected = false;
 }
 
+static void copy_address(const sockaddr_storage& remote_address, array<uint8, socket::address_length>& endpoint_address) {
+	if (remote_address.ss_family == AF_INET) {
+		const sockaddr_in* ipv4 = reinterpret_cast<const sockaddr_in*>(&remote_address);
+		memset(endpoint_address.data(), 0, 10); //to copy the ipv4 address in ipv6 mapped format
+		memset(endpoint_address.data() + 10, 1, 2);
+		#ifdef WINDOWS
+		memcpy(endpoint_address.data() + 12, reinterpret_cast<const uint8*>(&ipv4->sin_addr.S_un.S_addr), 4);
+		#elif defined POSIX
+		memcpy(endpoint_address.data() + 12, reinterpret_cast<const uint8*>(&ipv4->sin_addr.s_addr), 4);
+		#endif
+	}
+	else if (remote_address.ss_family == AF_INET6) {
+		const sockaddr_in6* ipv6 = reinterpret_cast<const sockaddr_in6*>(&remote_address);
+		#ifdef WINDOWS
+		memcpy(endpoint_address.data(), ipv6->sin6_addr.u.Byte, sizeof(ipv6->sin6_addr.u.Byte));
+		#elif defined POSIX
+		memcpy(endpoint_address.data(), ipv6->sin6_addr.s6_addr, sizeof(ipv6->sin6_addr.s6_addr));
+		#endif
+	}
+}
+
+socket::socket(native_handle_type handle) : socket(families::ip_any, types::tcp) {
+	sockaddr_storage address;
+
+#ifdef WINDOWS
+	int address_length = sizeof(address);
+#elif defined POSIX
+	socklen_t address_length = sizeof(address);
+#endif
+
+	this->raw_socket = handle;
+	this->connected = handle != closed_socket;
+
+	if (::getsockname(handle, reinterpret_cast<sockaddr*>(&address), &address_length) == 0) {
+		if (address.ss_family == AF_INET)
+			this->family = families::ipv4;
+		else if (address.ss_family == AF_INET6)
+			this->family = families::ipv6;
+	}
+
+	//Listening sockets have no peer and keep the zeroed address.
+	address_length = sizeof(address);
+	if (::getpeername(handle, reinterpret_cast<sockaddr*>(&address), &address_length) == 0)
+		copy_address(address, this->endpoint_address);
+}
+
 socket::socket(families family, types type, endpoint ep) : socket(family, type) {
+	if (ep.address != "") {
+		auto deadline = chrono::steady_clock::now() + ep.connect_timeout;
+		auto resolving = resolver::shared().resolve(ep.address, ep.port);
+
+		if (resolving.wait_until(deadline) != future_status::ready)
+			throw could_not_connect_exception();
+
+		vector<socket_address> candidates;
+		for (auto& i : resolving.get())
+			if (family == families::ip_any || i.family == family)
+				candidates.push_back(i);
+
+		auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+		if (remaining.count() <= 0)
+			throw could_not_connect_exception();
+
+		*this = socket::connect(candidates, remaining);
+		if (!this->connected)
+			throw could_not_connect_exception();
+
+		return;
+	}
+
 	addrinfo* server_addr_info;
 
 	this->raw_socket = prep_socket(family, type, ep.address, ep.port, &server_addr_info);
 
-	if (ep.address != "") {
-		if (::connect(this->raw_socket, server_addr_info->ai_addr, static_cast<int>(server_addr_info->ai_addrlen)) != 0)
-			goto error;
-	}
-	else {
-		if (::bind(this->raw_socket, server_addr_info->ai_addr, (int)server_addr_info->ai_addrlen) != 0)
-			goto error;
+#ifdef POSIX
+	//Connections closed by the server linger in TIME_WAIT, which would otherwise keep a restarted server from binding the port.
+	int reuse = 1;
+	::setsockopt(this->raw_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
 
-		if (::listen(this->raw_socket, SOMAXCONN) != 0)
-			goto error;
-	}
+	if (::bind(this->raw_socket, server_addr_info->ai_addr, (int)server_addr_info->ai_addrlen) != 0)
+		goto error;
+
+	if (::listen(this->raw_socket, SOMAXCONN) != 0)
+		goto error;
 
 	this->connected = true;
 
@@ -149,10 +230,158 @@ error:
 	::close_sock(this->raw_socket);
 	freeaddrinfo(server_addr_info);
 
-	if (ep.address != "")
-		throw could_not_connect_exception();
-	else
-		throw could_not_listen_exception();
+	throw could_not_listen_exception();
+}
+
+#ifdef WINDOWS
+static uintptr start_connect(const socket_address& target) {
+#elif defined POSIX
+static int start_connect(const socket_address& target) {
+#endif
+	sockaddr_storage address;
+	int address_length;
+	memset(&address, 0, sizeof(address));
+
+	if (target.family == socket::families::ipv4) {
+		sockaddr_in* ipv4 = reinterpret_cast<sockaddr_in*>(&address);
+		ipv4->sin_family = AF_INET;
+		ipv4->sin_port = htons(target.port);
+		memcpy(&ipv4->sin_addr, target.address.data(), 4);
+		address_length = sizeof(sockaddr_in);
+	}
+	else {
+		sockaddr_in6* ipv6 = reinterpret_cast<sockaddr_in6*>(&address);
+		ipv6->sin6_family = AF_INET6;
+		ipv6->sin6_port = htons(target.port);
+		memcpy(&ipv6->sin6_addr, target.address.data(), 16);
+		address_length = sizeof(sockaddr_in6);
+	}
+
+	initialize_sockets();
+
+	auto raw_socket = ::socket(address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if (raw_socket == closed_socket)
+		return closed_socket;
+
+#ifdef WINDOWS
+	u_long mode = 1;
+	::ioctlsocket(raw_socket, FIONBIO, &mode);
+
+	if (::connect(raw_socket, reinterpret_cast<sockaddr*>(&address), address_length) != 0 && ::WSAGetLastError() != WSAEWOULDBLOCK) {
+#elif defined POSIX
+	::fcntl(raw_socket, F_SETFL, ::fcntl(raw_socket, F_GETFL, 0) | O_NONBLOCK);
+
+	if (::connect(raw_socket, reinterpret_cast<sockaddr*>(&address), address_length) != 0 && errno != EINPROGRESS) {
+#endif
+		::close_sock(raw_socket);
+		return closed_socket;
+	}
+
+	return raw_socket;
+}
+
+net::socket socket::connect(const vector<socket_address>& candidates, chrono::milliseconds timeout, chrono::milliseconds stagger) {
+	struct attempt {
+		native_handle_type handle;
+		const socket_address* target;
+	};
+
+	//Interleaving the families means a broken one only costs a stagger per attempt instead of its whole list.
+	vector<const socket_address*> order, ipv6, ipv4;
+	for (auto& i : candidates)
+		(i.family == families::ipv6 ? ipv6 : ipv4).push_back(&i);
+
+	for (word i = 0; i < ipv6.size() || i < ipv4.size(); i++) {
+		if (i < ipv6.size())
+			order.push_back(ipv6[i]);
+
+		if (i < ipv4.size())
+			order.push_back(ipv4[i]);
+	}
+
+	vector<attempt> running;
+	vector<pollfd> polled;
+	native_handle_type winner = closed_socket;
+	word next = 0;
+	auto deadline = chrono::steady_clock::now() + timeout;
+	auto next_start = chrono::steady_clock::now();
+
+	while (winner == closed_socket) {
+		auto now = chrono::steady_clock::now();
+		if (now >= deadline)
+			break;
+
+		if (next < order.size() && (running.empty() || now >= next_start)) {
+			auto target = order[next++];
+			auto handle = start_connect(*target);
+
+			if (handle != closed_socket) {
+				running.push_back(attempt { handle, target });
+				next_start = now + stagger;
+			}
+
+			continue;
+		}
+
+		if (running.empty())
+			break;
+
+		auto until = next < order.size() ? min(next_start, deadline) : deadline;
+		auto wait = chrono::duration_cast<chrono::milliseconds>(until - now).count() + 1;
+
+		polled.clear();
+		for (auto& i : running) {
+			pollfd p;
+			p.fd = i.handle;
+			p.events = POLLOUT;
+			p.revents = 0;
+			polled.push_back(p);
+		}
+
+#ifdef WINDOWS
+		if (::WSAPoll(polled.data(), static_cast<ULONG>(polled.size()), static_cast<INT>(wait)) <= 0)
+#elif defined POSIX
+		if (::poll(polled.data(), static_cast<nfds_t>(polled.size()), static_cast<int>(wait)) <= 0)
+#endif
+			continue;
+
+		for (word i = polled.size(); i > 0; i--) {
+			auto& p = polled[i - 1];
+			if (p.revents == 0)
+				continue;
+
+			int error = 0;
+#ifdef WINDOWS
+			int error_length = sizeof(error);
+			::getsockopt(p.fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &error_length);
+#elif defined POSIX
+			socklen_t error_length = sizeof(error);
+			::getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+#endif
+
+			if (error == 0 && (p.revents & POLLOUT) != 0 && winner == closed_socket) {
+				winner = p.fd;
+			}
+			else {
+				//A failure starts the next attempt right away rather than waiting out the stagger.
+				::close_sock(p.fd);
+				next_start = now;
+			}
+
+			running.erase(running.begin() + (i - 1));
+		}
+	}
+
+	for (auto& i : running)
+		::close_sock(i.handle);
+
+	if (winner == closed_socket)
+		return socket(families::ip_any, types::tcp);
+
+	socket result(winner);
+	result.set_blocking(true);
+
+	return result;
 }
 
 socket::socket(socket&& other) {
@@ -215,24 +444,7 @@ net::socket socket::accept() {
 
 	new_socket.connected = true;
 
-	if (remote_address.ss_family == AF_INET) {
-		sockaddr_in* ipv4 = reinterpret_cast<sockaddr_in*>(&remote_address);
-		memset(new_socket.endpoint_address.data(), 0, 10); //to copy the ipv4 address in ipv6 mapped format
-		memset(new_socket.endpoint_address.data() + 10, 1, 2);
-		#ifdef WINDOWS
-		memcpy(new_socket.endpoint_address.data() + 12, reinterpret_cast<uint8*>(&ipv4->sin_addr.S_un.S_addr), 4);
-		#elif defined POSIX
-		memcpy(new_socket.endpoint_address.data() + 12, reinterpret_cast<uint8*>(&ipv4->sin_addr.s_addr), 4);
-		#endif
-	}
-	else if (remote_address.ss_family == AF_INET6) {
-		sockaddr_in6* ipv6 = reinterpret_cast<sockaddr_in6*>(&remote_address);
-		#ifdef WINDOWS
-		memcpy(new_socket.endpoint_address.data(), ipv6->sin6_addr.u.Byte, sizeof(ipv6->sin6_addr.u.Byte));
-		#elif defined POSIX
-		memcpy(new_socket.endpoint_address.data(), ipv6->sin6_addr.s6_addr, sizeof(ipv6->sin6_addr.s6_addr));
-		#endif
-	}
+	copy_address(remote_address, new_socket.endpoint_address);
 
 	return new_socket;
 }
@@ -255,7 +467,14 @@ word socket::write(const uint8* buffer, word count) {
 	if (count == 0)
 		return 0;
 
-	return static_cast<word>(::send(this->raw_socket, reinterpret_cast<const char*>(buffer), static_cast<int>(count), 0));
+#ifdef MSG_NOSIGNAL
+	//A peer that already closed must fail the write, not raise SIGPIPE and end the process.
+	int flags = MSG_NOSIGNAL;
+#else
+	int flags = 0;
+#endif
+
+	return static_cast<word>(::send(this->raw_socket, reinterpret_cast<const char*>(buffer), static_cast<int>(count), flags));
 }
 
 array<uint8, socket::address_length> socket::remote_address() const {
@@ -270,25 +489,55 @@ bool socket::is_connected() const {
 }
 
 bool socket::data_available() const {
+	return this->data_available(250);
+}
+
+bool socket::data_available(word timeout) const {
 	if (!this->connected)
 		throw not_connected_exception();
 
-	static fd_set read_set;
+	fd_set read_set;
 	FD_ZERO(&read_set);
 
-	timeval timeout;
-	timeout.tv_usec = 250;
-	timeout.tv_sec = 0;
+	timeval wait;
+	wait.tv_sec = static_cast<long>(timeout / 1000000);
+	wait.tv_usec = static_cast<long>(timeout % 1000000);
 
 	FD_SET(this->raw_socket, &read_set);
 
 #ifdef WINDOWS
-	return ::select(0, &read_set, nullptr, nullptr, &timeout) > 0;
+	return ::select(0, &read_set, nullptr, nullptr, &wait) > 0;
 #elif defined POSIX
-	return ::select(this->raw_socket + 1, &read_set, nullptr, nullptr, &timeout) > 0;
+	return ::select(this->raw_socket + 1, &read_set, nullptr, nullptr, &wait) > 0;
 #endif
 }
 
+void socket::set_blocking(bool blocking) {
+	if (!this->connected)
+		throw not_connected_exception();
+
+#ifdef WINDOWS
+	u_long mode = blocking ? 0 : 1;
+	::ioctlsocket(this->raw_socket, FIONBIO, &mode);
+#elif defined POSIX
+	int flags = ::fcntl(this->raw_socket, F_GETFL, 0);
+	::fcntl(this->raw_socket, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
+
+socket::native_handle_type socket::native_handle() const {
+	return this->raw_socket;
+}
+
+socket::native_handle_type socket::release() {
+	auto handle = this->raw_socket;
+
+	this->connected = false;
+	this->raw_socket = closed_socket;
+
+	return handle;
+}
+
 
 int16 util::net::host_to_net_int16(int16 value) {
 	return htons(value);
@@ -2,16 +2,30 @@
 
 #include <string>
 #include <array>
+#include <memory>
+#include <vector>
+#include <chrono>
 
 #include "../Common.h"
 
 namespace util {
 	namespace net {
+		class tls_context;
+
 		struct endpoint {
 			std::string address;
 			std::string port;
 			bool is_websocket;
 
+			///When set, connections accepted on this endpoint speak HTTP/1.1 through http_connection. Ignored when is_websocket is set.
+			bool is_http;
+
+			///When set, connections to or accepted on this endpoint are secured with TLS using this context.
+			std::shared_ptr<tls_context> tls;
+
+			///How long connecting to this endpoint may take, name resolution included, before it fails. Defaults to ten seconds.
+			std::chrono::milliseconds connect_timeout;
+
 			exported endpoint(std::string address, std::string port, bool is_websocket = false);
 			exported endpoint(std::string port, bool is_websocket = false);
 			exported endpoint();
@@ -32,10 +46,18 @@ namespace util {
 		 * foo.listen("8080");
 		 * foo.accept();
 		 */
+		struct socket_address;
+
 		class exported socket {
 			public:	
 				static const uint16 address_length = 16;
 
+				#ifdef WINDOWS
+				typedef uintptr native_handle_type;
+				#elif defined POSIX
+				typedef int native_handle_type;
+				#endif
+
 				enum class types {
 					tcp
 				};
@@ -46,9 +68,22 @@ namespace util {
 					ip_any
 				};
 
+				/**
+				 * Listen on @a ep if it has no address, otherwise connect to it
+				 *
+				 * Addresses are resolved through the shared resolver's cache and connected to as by connect,
+				 * so connecting fails after the endpoint's connect_timeout instead of whenever the system gives up
+				 */
 				socket(families family, types type, endpoint ep);
 				socket(socket&& other);
 				socket();
+
+				/**
+				 * Take ownership of an existing stream socket, for example one received from another process
+				 *
+				 * @param handle The operating system handle of a listening or connected socket
+				 */
+				explicit socket(native_handle_type handle);
 				~socket();
 
 				socket& operator=(socket&& other);
@@ -59,6 +94,16 @@ namespace util {
 				class could_not_create_exception {};
 				class invalid_address_exception {};
 
+				/**
+				 * Connect to whichever of @a candidates accepts first
+				 *
+				 * Attempts run in parallel without blocking on any one of them: the candidates are interleaved by family,
+				 * IPv6 first, and a new attempt starts every @a stagger or as soon as one fails, as in RFC 8305 happy eyeballs
+				 *
+				 * @returns a connected socket, or an unconnected one if every attempt failed or @a timeout passed
+				 */
+				static socket connect(const std::vector<socket_address>& candidates, std::chrono::milliseconds timeout, std::chrono::milliseconds stagger = std::chrono::milliseconds(250));
+
 				/**
 				 * Disconnect and close the connection
 				 */
@@ -104,6 +149,30 @@ namespace util {
 				 */
 				bool data_available() const;
 
+				/**
+				 * @param timeout How long to wait for data, in microseconds
+				 *
+				 * @returns true if there is data available to be read, or a connection to be accepted, before the timeout, false otherwise.
+				 */
+				bool data_available(word timeout) const;
+
+				/**
+				 * Choose whether accept, read and write wait or return immediately when they cannot make progress
+				 */
+				void set_blocking(bool blocking);
+
+				/**
+				 * Give up ownership of the handle without shutting it down or closing it
+				 *
+				 * @returns the operating system handle of the socket, which the caller must now close
+				 */
+				native_handle_type release();
+
+				/**
+				 * @returns the operating system handle of the socket
+				 */
+				native_handle_type native_handle() const;
+
 				socket(const socket& other) = delete;
 				socket& operator=(const socket& other) = delete;
 
@@ -122,6 +191,20 @@ namespace util {
 				socket(families family, types type);
 		};
 
+		///A resolved IP address and port.
+		struct socket_address {
+			///Either ipv4 or ipv6.
+			socket::families family;
+
+			///The address in network order. IPv4 addresses use the first four bytes.
+			std::array<uint8, socket::address_length> address;
+
+			uint16 port;
+		};
+
+		///Prepares the platform's socket library. Called by everything here that needs it, only call it before using the platform's functions directly.
+		exported void initialize_sockets();
+
 		int16 host_to_net_int16(int16 value);
 		int32 host_to_net_int32(int32 value);
 		int64 host_to_net_int64(int64 value);
@@ -0,0 +1,334 @@
+#include "StreamMultiplexer.h"
+
+#include <cstring>
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+stream_multiplexer::options::options() : initiator(true), chunk_size(4096), initial_window(0x10000) {
+
+}
+
+stream_multiplexer::stream::stream(word window) : sent(0), window(static_cast<sword>(window)), credit(0), receive_window(window) {
+	this->scheduled = false;
+	this->ending = false;
+	this->local_ended = false;
+	this->remote_ended = false;
+}
+
+stream_multiplexer::stream_multiplexer(tcp_connection& connection, options settings) : connection(connection), settings(settings) {
+	if (this->settings.chunk_size == 0 || this->settings.chunk_size > 0xFFFF - stream_multiplexer::header_length)
+		this->settings.chunk_size = 0xFFFF - stream_multiplexer::header_length;
+
+	if (this->settings.initial_window < this->settings.chunk_size)
+		this->settings.initial_window = this->settings.chunk_size;
+
+	this->next_id = this->settings.initiator ? 1 : 2;
+	this->highest_remote = 0;
+}
+
+stream_multiplexer::stream_id stream_multiplexer::open() {
+	unique_lock<mutex> lck(this->lock);
+
+	auto id = this->next_id;
+	this->next_id += 2;
+	this->streams.emplace(id, stream(this->settings.initial_window));
+
+	//Control frames go out first and in order, so the peer sees the stream open before any later one sends data.
+	this->queue_control(id, frame_types::data);
+
+	return id;
+}
+
+void stream_multiplexer::write(stream_id id, const uint8* buffer, word length) {
+	unique_lock<mutex> lck(this->lock);
+
+	auto& s = this->find(id);
+	if (s.ending)
+		throw stream_ended_exception();
+
+	s.pending.insert(s.pending.end(), buffer, buffer + length);
+	this->schedule(id, s);
+}
+
+void stream_multiplexer::end(stream_id id) {
+	unique_lock<mutex> lck(this->lock);
+
+	auto& s = this->find(id);
+	if (s.ending)
+		return;
+
+	s.ending = true;
+	this->schedule(id, s);
+}
+
+void stream_multiplexer::reset(stream_id id) {
+	unique_lock<mutex> lck(this->lock);
+
+	auto iter = this->streams.find(id);
+	if (iter == this->streams.end())
+		throw unknown_stream_exception();
+
+	this->streams.erase(iter);
+	this->queue_control(id, frame_types::reset);
+}
+
+bool stream_multiplexer::pump() {
+	unique_lock<mutex> lck(this->lock);
+
+	for (auto& i : this->control) {
+		if (i.type == frame_types::window_update) {
+			//The peer may only send more once it has been told, so the credit counts from here.
+			auto iter = this->streams.find(i.id);
+			if (iter != this->streams.end())
+				iter->second.receive_window += i.increment;
+
+			this->frame(i.id, i.type, reinterpret_cast<const uint8*>(&i.increment), sizeof(i.increment));
+		}
+		else {
+			this->frame(i.id, i.type, nullptr, 0);
+		}
+	}
+
+	this->control.clear();
+
+	//Streams take turns a chunk at a time, going to the back of the line while they still have work.
+	//The turns continue until a window's worth has been appended so each flush is one large write.
+	word appended = 0;
+	while (!this->ready.empty() && appended < this->settings.initial_window) {
+		auto id = this->ready.front();
+		this->ready.pop_front();
+
+		auto iter = this->streams.find(id);
+		if (iter == this->streams.end())
+			continue;
+
+		auto& s = iter->second;
+		word available = static_cast<word>(s.pending.size()) - s.sent;
+		s.scheduled = false;
+
+		if (available > 0 && s.window > 0) {
+			word chunk = min(min(available, this->settings.chunk_size), static_cast<word>(s.window));
+
+			this->frame(id, frame_types::data, s.pending.data() + s.sent, chunk);
+
+			s.sent += chunk;
+			s.window -= static_cast<sword>(chunk);
+			available -= chunk;
+			appended += chunk;
+		}
+
+		if (available == 0) {
+			s.pending.clear();
+			s.sent = 0;
+
+			if (s.ending && !s.local_ended) {
+				this->frame(id, frame_types::end, nullptr, 0);
+				s.local_ended = true;
+
+				if (s.remote_ended) {
+					this->streams.erase(iter);
+					continue;
+				}
+			}
+		}
+		else if (s.sent >= this->settings.initial_window) {
+			s.pending.erase(s.pending.begin(), s.pending.begin() + s.sent);
+			s.sent = 0;
+		}
+
+		this->schedule(id, s);
+	}
+
+	bool more = !this->ready.empty();
+
+	lck.unlock();
+
+	this->connection.flush();
+
+	return more;
+}
+
+bool stream_multiplexer::read() {
+	for (auto& i : this->connection.read())
+		if (!this->receive(i))
+			return false;
+
+	return true;
+}
+
+bool stream_multiplexer::receive(const tcp_connection::message& message) {
+	if (message.closed)
+		return false;
+
+	if (message.length < stream_multiplexer::header_length)
+		return true;
+
+	stream_id id;
+	memcpy(&id, message.data, sizeof(id));
+
+	auto type = static_cast<frame_types>(message.data[sizeof(id)]);
+	auto payload = message.data + stream_multiplexer::header_length;
+	word length = message.length - stream_multiplexer::header_length;
+	bool opened = false;
+	bool overrun = false;
+
+	{
+		unique_lock<mutex> lck(this->lock);
+
+		auto iter = this->streams.find(id);
+		if (iter == this->streams.end()) {
+			//Anything other than the first frame of a new stream the peer opened belongs to a stream that is already gone.
+			//Streams open in order of their ids, so a lower id than the highest seen was reset or finished rather than new.
+			bool remote = (id % 2 == 1) != this->settings.initiator;
+			if (!remote || id <= this->highest_remote || (type != frame_types::data && type != frame_types::end))
+				return true;
+
+			iter = this->streams.emplace(id, stream(this->settings.initial_window)).first;
+			this->highest_remote = id;
+			opened = true;
+		}
+
+		auto& s = iter->second;
+
+		switch (type) {
+			case frame_types::data:
+				if (s.remote_ended)
+					return true;
+
+				//A peer that ignores the window would have this buffer whatever it sends, so the stream is abandoned instead.
+				if (length > s.receive_window) {
+					this->streams.erase(iter);
+					this->queue_control(id, frame_types::reset);
+					overrun = true;
+
+					break;
+				}
+
+				s.receive_window -= length;
+
+				break;
+
+			case frame_types::end:
+				s.remote_ended = true;
+
+				if (s.local_ended)
+					this->streams.erase(iter);
+
+				break;
+
+			case frame_types::window_update:
+				if (length >= sizeof(uint32)) {
+					uint32 increment;
+					memcpy(&increment, payload, sizeof(increment));
+
+					s.window += static_cast<sword>(increment);
+					this->schedule(id, s);
+				}
+
+				return true;
+
+			case frame_types::reset:
+				this->streams.erase(iter);
+
+				break;
+
+			default:
+				return true;
+		}
+	}
+
+	if (opened)
+		this->on_open(id);
+
+	if (overrun) {
+		this->on_reset(id);
+		return true;
+	}
+
+	switch (type) {
+		case frame_types::data: {
+			//The frame that opens a stream carries nothing.
+			if (length == 0)
+				break;
+
+			this->on_data(id, payload, length);
+
+			unique_lock<mutex> lck(this->lock);
+
+			auto iter = this->streams.find(id);
+			if (iter == this->streams.end())
+				break;
+
+			//Grant credit back in batches rather than once per chunk.
+			auto& s = iter->second;
+
+			s.credit += length;
+			if (s.credit >= this->settings.initial_window / 2) {
+				this->queue_control(id, frame_types::window_update, s.credit);
+				s.credit = 0;
+			}
+
+			break;
+		}
+
+		case frame_types::end:
+			this->on_end(id);
+			break;
+
+		case frame_types::reset:
+			this->on_reset(id);
+			break;
+
+		default:
+			break;
+	}
+
+	return true;
+}
+
+word stream_multiplexer::active_streams() {
+	unique_lock<mutex> lck(this->lock);
+
+	return static_cast<word>(this->streams.size());
+}
+
+stream_multiplexer::stream& stream_multiplexer::find(stream_id id) {
+	auto iter = this->streams.find(id);
+	if (iter == this->streams.end())
+		throw unknown_stream_exception();
+
+	return iter->second;
+}
+
+void stream_multiplexer::schedule(stream_id id, stream& s) {
+	if (s.scheduled)
+		return;
+
+	bool has_data = s.sent < s.pending.size() && s.window > 0;
+	bool has_end = s.ending && !s.local_ended && s.sent == s.pending.size();
+
+	if (has_data || has_end) {
+		s.scheduled = true;
+		this->ready.push_back(id);
+	}
+}
+
+void stream_multiplexer::queue_control(stream_id id, frame_types type, uint32 increment) {
+	this->control.push_back(control_frame{ id, type, increment });
+}
+
+void stream_multiplexer::frame(stream_id id, frame_types type, const uint8* payload, word length) {
+	this->scratch.resize(stream_multiplexer::header_length + length);
+
+	memcpy(this->scratch.data(), &id, sizeof(id));
+	this->scratch[sizeof(id)] = static_cast<uint8>(type);
+
+	if (length > 0)
+		memcpy(this->scratch.data() + stream_multiplexer::header_length, payload, length);
+
+	this->connection.append(this->scratch.data(), static_cast<word>(this->scratch.size()));
+}
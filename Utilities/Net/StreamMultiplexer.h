@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+
+#include "../Common.h"
+#include "../Event.h"
+#include "TCPConnection.h"
+
+namespace util {
+	namespace net {
+		///Carries any number of independent byte streams over one tcp_connection.
+		///Streams are sent in chunks of bounded size, taking turns, so a large transfer never holds up a small one for more than a chunk.
+		///Each stream has its own flow control window that the receiver replenishes as it consumes data,
+		///so a slow consumer of one stream does not stall the others. A peer that sends past the window has the stream reset.
+		///Opening a stream sends an empty data frame so the peer sees streams open in the order of their ids,
+		///which lets it drop frames still in flight for streams it already reset instead of taking them for new ones.
+		///Each frame is a single tcp_connection message with a uint32 stream id and a uint8 frame type in front of the payload.
+		///Nothing is written until pump is called, including the window updates generated by receiving, so pump regularly.
+		class stream_multiplexer {
+			public:
+				typedef uint32 stream_id;
+
+				enum class frame_types : uint8 {
+					data,
+					end,
+					window_update,
+					reset
+				};
+
+				struct exported options {
+					///Whether or not this side opened the connection. The two sides must differ so their stream ids never collide.
+					bool initiator;
+
+					///The largest payload a single data frame carries.
+					word chunk_size;
+
+					///The number of bytes a stream may have unacknowledged before the sender stops sending on it.
+					word initial_window;
+
+					options();
+				};
+
+				class unknown_stream_exception {};
+				class stream_ended_exception {};
+
+				///The number of bytes in front of the payload of every frame.
+				static const word header_length = sizeof(stream_id) + sizeof(frame_types);
+
+				///Constructs a new multiplexer. The connection must outlive it.
+				///@param connection The connection to multiplex. Nothing else may read from or write to it.
+				///@param settings How streams are chunked and flow controlled. Both sides should use the same chunk size and window.
+				exported stream_multiplexer(tcp_connection& connection, options settings = options());
+
+				///Opens a new stream. The peer learns of it on the next pump.
+				///@return The id of the stream.
+				exported stream_id open();
+
+				///Queues data to be sent on a stream. The data is sent by pump.
+				///Streams opened by the peer may be written to without calling open.
+				///@param id The stream.
+				///@param buffer The data.
+				///@param length The number of bytes.
+				exported void write(stream_id id, const uint8* buffer, word length);
+
+				///Ends a stream once the data queued on it has been sent.
+				exported void end(stream_id id);
+
+				///Abandons a stream immediately, dropping anything queued on it.
+				exported void reset(stream_id id);
+
+				///Sends queued data a chunk at a time from each stream with room in its window in turn, up to one window in total,
+				///then flushes the connection. Must only be called from one thread at a time.
+				///@return True if data is still queued on streams that have room in their window, false otherwise.
+				exported bool pump();
+
+				///Reads from the connection and dispatches any complete frames.
+				///@return False if the connection closed, true otherwise.
+				exported bool read();
+
+				///Dispatches a message read from the connection elsewhere.
+				///@return False if the message signals that the connection closed, true otherwise.
+				exported bool receive(const tcp_connection::message& message);
+
+				///Gets the number of streams that are open in at least one direction.
+				exported word active_streams();
+
+				///Raised when the peer opens a stream.
+				event<stream_id> on_open;
+
+				///Raised for each chunk of data received. Credit for it is returned to the peer once the handlers return.
+				event<stream_id, const uint8*, word> on_data;
+
+				///Raised when the peer ends a stream.
+				event<stream_id> on_end;
+
+				///Raised when the peer resets a stream, or when this side resets one because the peer sent more than its window.
+				event<stream_id> on_reset;
+
+				stream_multiplexer(const stream_multiplexer& other) = delete;
+				stream_multiplexer& operator=(const stream_multiplexer& other) = delete;
+
+			private:
+				struct stream {
+					std::vector<uint8> pending;
+					word sent;
+					sword window;
+					word credit;
+					word receive_window;
+					bool scheduled;
+					bool ending;
+					bool local_ended;
+					bool remote_ended;
+
+					stream(word window);
+				};
+
+				tcp_connection& connection;
+				options settings;
+				stream_id next_id;
+
+				//The highest id of a stream the peer opened. Lower ones that aren't in streams are closed.
+				stream_id highest_remote;
+
+				std::unordered_map<stream_id, stream> streams;
+				std::deque<stream_id> ready;
+				//Frames that don't carry stream data, sent first on the next pump.
+				struct control_frame {
+					stream_id id;
+					frame_types type;
+					uint32 increment;
+				};
+
+				std::vector<control_frame> control;
+				std::vector<uint8> scratch;
+				std::mutex lock;
+
+				stream& find(stream_id id);
+				void schedule(stream_id id, stream& s);
+				void queue_control(stream_id id, frame_types type, uint32 increment = 0);
+				void frame(stream_id id, frame_types type, const uint8* payload, word length);
+		};
+	}
+}
@@ -1,9 +1,20 @@
 #include "TCPConnection.h"
 
 #include <cstring>
+#include <cerrno>
 #include <thread>
 #include <utility>
 
+#ifdef POSIX
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <sys/sendfile.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <signal.h>
+	#include <time.h>
+#endif
+
 using namespace std;
 using namespace util;
 using namespace util::net;
@@ -11,6 +22,7 @@ using namespace util::net;
 tcp_connection::tcp_connection() {
 	this->received = 0;
 	this->state = nullptr;
+	this->context_slot = static_cast<word>(-1);
 	this->connected = false;
 	this->buffer = nullptr;
 }
@@ -18,21 +30,40 @@ tcp_connection::tcp_connection() {
 tcp_connection::tcp_connection(endpoint ep) : connection(socket::families::ip_any, socket::types::tcp, ep) {
 	this->received = 0;
 	this->state = nullptr;
+	this->context_slot = static_cast<word>(-1);
 	this->connected = true;
+	this->buffer = nullptr;
+
+	if (ep.tls)
+		this->start_tls(ep.tls, ep.address);
+
 	this->buffer = new uint8[tcp_connection::message_max_size];
 }
 
 tcp_connection::tcp_connection(socket&& sock) : connection(move(sock)) {
 	this->received = 0;
 	this->state = nullptr;
+	this->context_slot = static_cast<word>(-1);
 	this->connected = true;
 	this->buffer = new uint8[tcp_connection::message_max_size];
 }
 
-tcp_connection::tcp_connection(tcp_connection&& other) : connection(move(other.connection)) {
+tcp_connection::tcp_connection(socket&& sock, const vector<uint8>& unread) : tcp_connection(move(sock)) {
+	if (unread.size() > tcp_connection::message_max_size)
+		throw message_too_long_exception();
+
+	if (!unread.empty())
+		memcpy(this->buffer, unread.data(), unread.size());
+
+	this->received = static_cast<word>(unread.size());
+}
+
+tcp_connection::tcp_connection(tcp_connection&& other) : connection(move(other.connection)), session_context(move(other.session_context)), session(move(other.session)) {
 	this->state = other.state;
+	this->context_slot = other.context_slot;
 	this->connected = other.connected;
 	this->queued = move(other.queued);
+	this->outgoing = move(other.outgoing);
 	this->received = other.received;
 	this->buffer = other.buffer;
 	other.buffer = nullptr;
@@ -49,9 +80,13 @@ tcp_connection& tcp_connection::operator = (tcp_connection&& other) {
 	this->close();
 
 	this->connection = move(other.connection);
+	this->session_context = move(other.session_context);
+	this->session = move(other.session);
 	this->state = other.state;
+	this->context_slot = other.context_slot;
 	this->connected = other.connected;
 	this->queued = move(other.queued);
+	this->outgoing = move(other.outgoing);
 	this->received = other.received;
 	this->buffer = other.buffer;
 	other.buffer = nullptr;
@@ -74,20 +109,65 @@ array<uint8, socket::address_length> tcp_connection::address() const {
 	return this->connection.remote_address();
 }
 
-const socket& tcp_connection::base_socket() const {
+const net::socket& tcp_connection::base_socket() const {
 	if (!this->connected)
 		throw not_connected_exception();
 
 	return this->connection;
 }
 
+bool tcp_connection::is_connected() const {
+	return this->connected;
+}
+
 bool tcp_connection::data_available() const {
 	if (!this->connected)
 		throw not_connected_exception();
 
+	//An expired handshake is reported so the next read closes the connection.
+	if (this->session && (this->session->pending() || this->session->expired()))
+		return true;
+
 	return this->connection.data_available();
 }
 
+bool tcp_connection::data_available(word timeout) const {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	if (this->session && (this->session->pending() || this->session->expired()))
+		return true;
+
+	return this->connection.data_available(timeout);
+}
+
+void tcp_connection::start_tls(shared_ptr<tls_context> context, const string& server_name) {
+	this->begin_tls(move(context), server_name);
+
+	try {
+		this->session->complete_handshake();
+	}
+	catch (tls_context::handshake_failed_exception) {
+		this->session.reset();
+		this->session_context.reset();
+
+		throw;
+	}
+}
+
+void tcp_connection::begin_tls(shared_ptr<tls_context> context, const string& server_name) {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	this->connection.set_blocking(false);
+	this->session = make_unique<tls_session>(*context, this->connection.native_handle(), server_name);
+	this->session_context = move(context);
+}
+
+const tls_session* tcp_connection::tls() const {
+	return this->session.get();
+}
+
 vector<tcp_connection::message> tcp_connection::read(word wait_for) {
 	if (!this->connected)
 		throw not_connected_exception();
@@ -95,7 +175,15 @@ vector<tcp_connection::message> tcp_connection::read(word wait_for) {
 	vector<tcp_connection::message> messages;
 
 	do {
-		word received = this->connection.read(this->buffer + this->received, tcp_connection::message_max_size - this->received);
+		word received = this->receive(this->buffer + this->received, tcp_connection::message_max_size - this->received);
+
+		if (received == tcp_connection::would_block) {
+			if (messages.size() < wait_for)
+				this->connection.data_available(100000);
+
+			continue;
+		}
+
 		this->received += received;
 
 		if (received == 0) {
@@ -110,7 +198,7 @@ vector<tcp_connection::message> tcp_connection::read(word wait_for) {
 
 			if (remaining >= 0) {
 				messages.emplace_back(this->buffer + tcp_connection::message_length_bytes, length);
-				memcpy(this->buffer, this->buffer + this->received - remaining, remaining);
+				memmove(this->buffer, this->buffer + this->received - remaining, remaining);
 				this->received = remaining;
 			}
 			else {
@@ -129,13 +217,10 @@ bool tcp_connection::send(const uint8* buffer, word length) {
 	if (length > 0xFFFF)
 		throw message_too_long_exception();
 
-	if (!this->ensure_write(reinterpret_cast<uint8*>(&length), tcp_connection::message_length_bytes))
-		return false;
-
-	if (!this->ensure_write(buffer, length))
-		return false;
+	//Writing the header and the data separately would leave the data waiting on Nagle for the header's ACK.
+	this->append(buffer, length);
 
-	return true;
+	return this->flush();
 }
 
 void tcp_connection::enqueue(const uint8* buffer, word length) {
@@ -177,21 +262,257 @@ error:
 	return false;
 }
 
+void tcp_connection::append(const uint8* buffer, word length) {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	if (length > 0xFFFF)
+		throw message_too_long_exception();
+
+	uint8 header[tcp_connection::max_frame_header];
+	word header_length = this->frame_header(header, length);
+
+	this->outgoing.insert(this->outgoing.end(), header, header + header_length);
+	this->outgoing.insert(this->outgoing.end(), buffer, buffer + length);
+
+	this->frame_payload(this->outgoing.data() + this->outgoing.size() - length, length);
+}
+
+bool tcp_connection::flush() {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	bool result = this->ensure_write(this->outgoing.data(), static_cast<word>(this->outgoing.size()));
+
+	//Don't let one large burst pin memory for the rest of the connection's life.
+	if (this->outgoing.capacity() > tcp_connection::message_max_size)
+		vector<uint8>().swap(this->outgoing);
+	else
+		this->outgoing.clear();
+
+	return result;
+}
+
+word tcp_connection::buffered() const {
+	return static_cast<word>(this->outgoing.size());
+}
+
+#ifdef POSIX
+//sendfile and splice have no MSG_NOSIGNAL, so a peer that goes away mid-transfer would raise SIGPIPE and end the process.
+//It is blocked on the calling thread instead and any instance raised meanwhile is taken back before unblocking.
+struct sigpipe_guard {
+	sigset_t previous;
+	bool was_pending;
+
+	sigpipe_guard() {
+		sigset_t pending, blocked;
+
+		sigpending(&pending);
+		this->was_pending = sigismember(&pending, SIGPIPE) == 1;
+
+		sigemptyset(&blocked);
+		sigaddset(&blocked, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &blocked, &this->previous);
+	}
+
+	~sigpipe_guard() {
+		sigset_t pending;
+
+		sigpending(&pending);
+
+		if (!this->was_pending && sigismember(&pending, SIGPIPE) == 1) {
+			sigset_t raised;
+			timespec none = { 0, 0 };
+
+			sigemptyset(&raised);
+			sigaddset(&raised, SIGPIPE);
+			while (sigtimedwait(&raised, nullptr, &none) == -1 && errno == EINTR)
+				;
+		}
+
+		pthread_sigmask(SIG_SETMASK, &this->previous, nullptr);
+	}
+};
+
+bool tcp_connection::send_file(int fd, uint64 offset, uint64 length) {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	return this->stream(fd, &offset, length);
+}
+
+bool tcp_connection::send_pipe(int fd, uint64 length) {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	return this->stream(fd, nullptr, length);
+}
+
+bool tcp_connection::stream(int fd, uint64* offset, uint64 length) {
+	//Anything appended earlier must reach the peer before the messages streamed after it.
+	if (!this->outgoing.empty() && !this->flush())
+		return false;
+
+	sigpipe_guard guard;
+	auto handle = this->connection.native_handle();
+	bool zero_copy = !this->transforms_payload() && (!this->session || (offset && this->session->kernel_send()));
+	vector<uint8> staging;
+	uint8 header[tcp_connection::max_frame_header];
+
+	if (!zero_copy)
+		staging.resize(length < 0xFFFF ? static_cast<size_t>(length) : 0xFFFF);
+
+	while (length > 0) {
+		word chunk = length < 0xFFFF ? static_cast<word>(length) : 0xFFFF;
+		word header_length = this->frame_header(header, chunk);
+		word sent = 0;
+
+		if (!this->session) {
+			//MSG_MORE lets the kernel put the header in the same segment as the data that follows.
+			while (sent < header_length) {
+				auto result = ::send(handle, header + sent, header_length - sent, MSG_MORE | MSG_NOSIGNAL);
+				if (result <= 0)
+					goto error;
+
+				sent += static_cast<word>(result);
+			}
+		}
+		else if (!this->ensure_write(header, header_length)) {
+			goto error;
+		}
+
+		if (!zero_copy) {
+			//The whole chunk is staged before it is written so frame_payload sees it from its first byte.
+			for (sent = 0; sent < chunk; ) {
+				auto result = offset ? ::pread(fd, staging.data() + sent, chunk - sent, static_cast<off_t>(*offset)) : ::read(fd, staging.data() + sent, chunk - sent);
+				if (result <= 0)
+					goto error;
+
+				if (offset)
+					*offset += result;
+
+				sent += static_cast<word>(result);
+			}
+
+			this->frame_payload(staging.data(), chunk);
+
+			if (!this->ensure_write(staging.data(), chunk))
+				goto error;
+		}
+		else {
+			for (sent = 0; sent < chunk; ) {
+				ssize_t result;
+
+				if (this->session) {
+					result = this->session->send_file(fd, *offset, chunk - sent);
+					if (result <= 0)
+						goto error;
+
+					*offset += result;
+				}
+				else if (offset) {
+					off_t position = static_cast<off_t>(*offset);
+					result = ::sendfile(handle, fd, &position, chunk - sent);
+					if (result <= 0)
+						goto error;
+
+					*offset = static_cast<uint64>(position);
+				}
+				else {
+					result = ::splice(fd, nullptr, handle, nullptr, chunk - sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+					if (result <= 0)
+						goto error;
+				}
+
+				sent += static_cast<word>(result);
+			}
+		}
+
+		length -= chunk;
+	}
+
+	return true;
+
+error:
+	//Left to the caller, which may be a worker while another thread reads the connection. It can't carry further messages once part of one is out.
+	return false;
+}
+#endif
+
+word tcp_connection::frame_header(uint8* header, word length) {
+	reinterpret_cast<uint16*>(header)[0] = static_cast<uint16>(length);
+
+	return tcp_connection::message_length_bytes;
+}
+
+void tcp_connection::frame_payload(uint8*, word) {
+
+}
+
+bool tcp_connection::transforms_payload() const {
+	return false;
+}
+
+net::socket tcp_connection::detach(vector<uint8>& unread) {
+	if (!this->connected)
+		throw not_connected_exception();
+
+	if (this->session)
+		throw cant_detach_secured_exception();
+
+	unread.assign(this->buffer, this->buffer + this->received);
+
+	this->received = 0;
+	this->connected = false;
+
+	return move(this->connection);
+}
+
+vector<uint8> tcp_connection::unread() const {
+	return vector<uint8>(this->buffer, this->buffer + this->received);
+}
+
 void tcp_connection::close() {
 	if (!this->connected)
 		return;
 
+	if (this->session)
+		this->session->shutdown();
+
 	this->connection.close();
 	this->connected = false;
 }
 
+word tcp_connection::receive(uint8* data, word count) {
+	if (this->session)
+		return this->session->read(data, count);
+
+	return this->connection.read(data, count);
+}
+
+word tcp_connection::receive_waiting(uint8* data, word count) {
+	word received;
+
+	while ((received = this->receive(data, count)) == tcp_connection::would_block)
+		this->connection.data_available(100000);
+
+	return received;
+}
+
+word tcp_connection::transmit(const uint8* data, word count) {
+	if (this->session)
+		return this->session->write(data, count);
+
+	return this->connection.write(data, count);
+}
+
 bool tcp_connection::ensure_write(const uint8* data, word count) {
 	if (count == 0)
 		return true;
 
 	word sent = 0;
 	for (word i = 0; i < 10 && sent < count; i++) {
-		sent += this->connection.write(data + sent, count - sent);
+		sent += this->transmit(data + sent, count - sent);
 
 		this_thread::sleep_for(chrono::microseconds(i * 10));
 	}
@@ -231,11 +552,12 @@ tcp_connection::message& tcp_connection::message::operator=(const tcp_connection
 	if (this->data)
 		delete[] this->data;
 
-	this->data = other.data;
+	this->data = other.data ? new uint8[other.length] : nullptr;
 	this->length = other.length;
 	this->closed = other.closed;
 
-	memcpy(this->data, other.data, this->length);
+	if (this->data)
+		memcpy(this->data, other.data, this->length);
 
 	return *this;
 }
@@ -2,9 +2,12 @@
 
 #include <vector>
 #include <array>
+#include <memory>
+#include <string>
 
 #include "../Common.h"
 #include "Socket.h"
+#include "TLS.h"
 
 namespace util {
 	namespace net {
@@ -62,11 +65,16 @@ namespace util {
 
 				class not_connected_exception {};
 				class message_too_long_exception {};
+				class cant_detach_secured_exception {};
 
 				///State to be stored with this connection.
 				///Not used in any way by this class
 				void* state;
 
+				///The slot of the connection's context in the server that serves it, see request_server::enable_connection_context.
+				///Not used in any way by this class. Invalid when there is none.
+				word context_slot;
+
 				///Constructs an unconnected instance.
 				///You must move assign to make use of it.
 				exported tcp_connection();
@@ -75,7 +83,13 @@ namespace util {
 				///Takes ownership of the socket.
 				exported tcp_connection(socket&& sock);
 
+				///Constructs a new tcp_connection that carries on from one given up with detach.
+				///Takes ownership of the socket.
+				///@param unread The bytes detach returned. They are read before anything new from the socket.
+				exported tcp_connection(socket&& sock, const std::vector<uint8>& unread);
+
 				///Constructs a new tcp_connection by establishing a new connection to the specified address and port.
+				///Performs a TLS handshake if the endpoint has a TLS context.
 				///@param address The address to connect to. 
 				///@param port The port to connect to. 
 				exported tcp_connection(endpoint ep);
@@ -97,9 +111,34 @@ namespace util {
 				///@return The socket.
 				exported const socket& base_socket() const;
 
+				///Gets whether or not the connection is open.
+				///@return True if the connection is open, false otherwise.
+				exported bool is_connected() const;
+
 				///Gets whether or not data is available to be read.
 				///@return True if data is available, false otherwise.
-				exported bool data_available() const;
+				exported virtual bool data_available() const;
+
+				///Gets whether or not data is available to be read within the given time.
+				///@param timeout How long to wait, in microseconds. Zero only checks.
+				///@return True if data is available, false otherwise.
+				exported virtual bool data_available(word timeout) const;
+
+				///Secures the connection with TLS. Blocks until the handshake completes.
+				///Subsequent reads and sends keep the same framing, only the bytes on the wire are encrypted.
+				///The socket is made non-blocking, so read returns what is complete rather than waiting on a partial record.
+				///@param context The context to use. Its role decides which side of the handshake this connection takes.
+				///@param server_name The name of the server, used for SNI and session resumption. Ignored by servers.
+				///@throws tls_context::handshake_failed_exception if the handshake failed or timed out.
+				exported void start_tls(std::shared_ptr<tls_context> context, const std::string& server_name = "");
+
+				///Secures the connection with TLS like start_tls but without waiting for the handshake.
+				///It advances as reads find data and the connection closes on the first read once it fails or times out, which data_available reports.
+				exported void begin_tls(std::shared_ptr<tls_context> context, const std::string& server_name = "");
+
+				///Gets the TLS state of the connection.
+				///@return The TLS session, or nullptr if the connection is not secured.
+				exported const tls_session* tls() const;
 
 				///Gets a list of messages that are available and complete.
 				///@param wait_for The number of messages to wait for. Defaults to zero. 
@@ -125,6 +164,49 @@ namespace util {
 				///Clears without sending the data in the internal pending queue.
 				exported void clear_queued();
 
+				///Frames the data like send but only adds it to an internal buffer.
+				///Call flush to write everything appended since the last flush in one go.
+				///@param buffer The data to send. 
+				///@param length The number of bytes to be sent. 
+				exported virtual void append(const uint8* buffer, word length);
+
+				///Writes everything added with append.
+				///@return True if all the data was sent, false otherwise.
+				exported bool flush();
+
+				///Gets the number of bytes added with append that have not been flushed.
+				///@return The number of bytes.
+				exported word buffered() const;
+
+#ifdef POSIX
+				///Sends part of a file without copying it through user space.
+				///The range is sent as consecutive messages of at most 0xFFFF bytes, each framed as if passed to send.
+				///Secured connections only avoid the copy when kernel TLS is active.
+				///If false is returned part of a message may already be out, so the connection should be closed. It is not closed here because the caller may be one thread of several using it.
+				///@param fd The file to read from. Its file offset is not changed.
+				///@param offset The offset of the first byte to send.
+				///@param length The number of bytes to send.
+				///@return True if all the data was sent, false otherwise.
+				exported bool send_file(int fd, uint64 offset, uint64 length);
+
+				///Sends data read from a pipe without copying it through user space. Framed the same way as send_file.
+				///Fails the same way as send_file if the pipe is closed before length bytes are read.
+				///@param fd The read end of the pipe.
+				///@param length The number of bytes to send.
+				///@return True if all the data was sent, false otherwise.
+				exported bool send_pipe(int fd, uint64 length);
+#endif
+
+				///Gives up the socket without closing it so another owner, possibly in another process, can carry on with the connection.
+				///The connection is left closed. Secured connections cannot be detached since their state lives in the TLS session.
+				///@param unread Receives the bytes read from the socket that do not yet make up a complete message.
+				///@return The socket.
+				exported socket detach(std::vector<uint8>& unread);
+
+				///Gets the bytes detach would return without detaching, so they can be sent before the connection is given up.
+				///@return The bytes read from the socket that do not yet make up a complete message.
+				exported std::vector<uint8> unread() const;
+
 				///Closes the underlying connection.
 				exported virtual void close();
 
@@ -149,8 +231,41 @@ namespace util {
 				word received;
 				bool connected;
 				std::vector<message> queued;
+				std::vector<uint8> outgoing;
+				std::shared_ptr<tls_context> session_context;
+				std::unique_ptr<tls_session> session;
+
+				///The largest header frame_header writes.
+				static const word max_frame_header = 8;
+
+				///Writes the header that precedes a message of the given length.
+				///@return The number of bytes written.
+				virtual word frame_header(uint8* header, word length);
 
+				///Transforms a message in place once append has copied it after its header. Does nothing by default.
+				virtual void frame_payload(uint8* payload, word length);
+
+				///Gets whether or not frame_payload changes the bytes, in which case they can't be sent without copying them first. False by default.
+				virtual bool transforms_payload() const;
+
+				///Returned by receive when a secured connection has no complete record yet.
+				static const word would_block = tls_session::would_block;
+
+				///Reads at least one byte unless the connection closed. Everything else reads through this.
+				///@return The number of bytes read, zero if the connection closed, or would_block if a secured connection has nothing to read yet.
+				virtual word receive(uint8* data, word count);
+
+				///Reads like receive but waits instead of returning would_block.
+				word receive_waiting(uint8* data, word count);
+
+				///Writes some of the data. Everything else writes through this.
+				///@return The number of bytes written, zero on failure.
+				virtual word transmit(const uint8* data, word count);
 				bool ensure_write(const uint8* data, word count);
+
+#ifdef POSIX
+				bool stream(int fd, uint64* offset, uint64 length);
+#endif
 		};
 	}
 }
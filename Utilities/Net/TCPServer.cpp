@@ -3,6 +3,7 @@
 #include <utility>
 
 #include "WebSocketConnection.h"
+#include "HTTPConnection.h"
 
 using namespace std;
 using namespace util;
@@ -49,8 +50,14 @@ void tcp_server::start() {
 	if (this->active)
 		return;
 
+	if (!this->listener.is_connected())
+		this->listener = socket(socket::families::ip_any, socket::types::tcp, this->ep);
+
+	//The listener may be shared with another process during a handoff, so a connection it reports can be taken
+	//by the other process before accept runs. Not blocking there keeps stop from waiting on the next connection.
+	this->listener.set_blocking(false);
+
 	this->active = true;
-	this->listener = socket(socket::families::ip_any, socket::types::tcp, this->ep);
 	this->accept_worker = thread(&tcp_server::accept_worker_run, this);
 }
 
@@ -59,18 +66,62 @@ void tcp_server::stop() {
 		return;
 
 	this->active = false;
-	this->listener.close();
 	this->accept_worker.join();
+	this->listener.close();
+}
+
+void tcp_server::adopt_listener(socket&& listener) {
+	this->listener = move(listener);
+}
+
+net::socket tcp_server::release_listener() {
+	if (this->active) {
+		this->active = false;
+		this->accept_worker.join();
+	}
+
+	return move(this->listener);
+}
+
+const endpoint& tcp_server::local_endpoint() const {
+	return this->ep;
 }
 
 void tcp_server::accept_worker_run() {
 	while (this->active) {
+		if (!this->listener.data_available(100000))
+			continue;
+
 		socket accepted = this->listener.accept();
-		if (accepted.is_connected())
+		if (!accepted.is_connected())
+			continue;
+
+#ifdef WINDOWS
+		//Accepted sockets inherit non-blocking mode from the listener on Windows.
+		accepted.set_blocking(true);
+#endif
+
+		unique_ptr<tcp_connection> connection;
+		if (this->ep.is_websocket)
+			connection = make_unique<websocket_connection>(move(accepted));
+		else if (this->ep.is_http)
+			connection = make_unique<http_connection>(move(accepted));
+		else
+			connection = make_unique<tcp_connection>(move(accepted));
+
+		if (this->ep.tls) {
+			try {
+				connection->begin_tls(this->ep.tls);
+			}
+			catch (tls_context::could_not_create_exception) {
+				continue;
+			}
+		}
+
 #ifdef WINDOWS
-			this->on_connect(!this->ep.is_websocket ? make_unique<tcp_connection>(move(accepted)) : make_unique<websocket_connection>(move(accepted)), this->state);
+		this->on_connect(move(connection), this->state);
 #else
-			this->on_connect(!this->ep.is_websocket ? make_unique<tcp_connection>(move(accepted)) : make_unique<websocket_connection>(move(accepted)));
+		this->on_connect(move(connection));
 #endif
 	}
 }
@@ -23,6 +23,17 @@ namespace util {
 				exported void start();
 				exported void stop();
 
+				///Listens on an already listening socket, for example one inherited from another process, instead of binding a new one.
+				///Must be called before start.
+				exported void adopt_listener(socket&& listener);
+
+				///Stops accepting without closing the listening socket, so another owner can keep accepting on it.
+				///@return The listening socket, unconnected if the server was not running.
+				exported socket release_listener();
+
+				///Gets the endpoint the server was constructed with.
+				exported const endpoint& local_endpoint() const;
+
 				class cant_move_running_server_exception {};
 				class cant_start_default_constructed_exception {};
 
@@ -0,0 +1,340 @@
+#include "TLS.h"
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#ifdef WINDOWS
+	#define WIN32_LEAN_AND_MEAN
+	#include <winsock2.h>
+#elif defined POSIX
+	#include <poll.h>
+	#include <sys/socket.h>
+#endif
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+//Waits for the socket to become readable or writable as OpenSSL asked. A negative timeout waits indefinitely.
+static bool wait_for(socket::native_handle_type handle, int error, chrono::milliseconds timeout) {
+	pollfd descriptor;
+	descriptor.fd = handle;
+	descriptor.events = error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN;
+	descriptor.revents = 0;
+
+	auto milliseconds = timeout.count() < 0 ? -1 : static_cast<int>(timeout.count());
+
+#ifdef WINDOWS
+	return ::WSAPoll(&descriptor, 1, milliseconds) > 0;
+#elif defined POSIX
+	return ::poll(&descriptor, 1, milliseconds) > 0;
+#endif
+}
+
+tls_context::tls_context(roles role) : context_role(role), handshake_timeout(10000), write_timeout(10000) {
+	this->context = ::SSL_CTX_new(role == roles::server ? ::TLS_server_method() : ::TLS_client_method());
+
+	if (!this->context)
+		throw could_not_create_exception();
+
+	this->verify = role == roles::client;
+
+	SSL_CTX_set_app_data(this->context, this);
+	::SSL_CTX_set_min_proto_version(this->context, TLS1_2_VERSION);
+
+#ifdef SSL_OP_ENABLE_KTLS
+	::SSL_CTX_set_options(this->context, SSL_OP_ENABLE_KTLS);
+#endif
+
+	if (role == roles::server) {
+		static const uint8 session_context[] = { 'u', 't', 'i', 'l' };
+
+		//Stateless tickets are issued by default, the server side cache only covers TLS 1.2 session ids.
+		::SSL_CTX_set_session_cache_mode(this->context, SSL_SESS_CACHE_SERVER);
+		::SSL_CTX_set_session_id_context(this->context, session_context, sizeof(session_context));
+	}
+	else {
+		::SSL_CTX_set_session_cache_mode(this->context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		::SSL_CTX_sess_set_new_cb(this->context, &tls_context::on_new_session);
+		::SSL_CTX_set_default_verify_paths(this->context);
+		::SSL_CTX_set_verify(this->context, SSL_VERIFY_PEER, nullptr);
+	}
+}
+
+tls_context::~tls_context() {
+	for (auto& i : this->sessions)
+		::SSL_SESSION_free(i.second);
+
+	::SSL_CTX_free(this->context);
+}
+
+void tls_context::load_certificate(const string& certificate_file, const string& key_file) {
+	if (::SSL_CTX_use_certificate_chain_file(this->context, certificate_file.c_str()) != 1)
+		throw invalid_certificate_exception();
+
+	if (::SSL_CTX_use_PrivateKey_file(this->context, key_file.c_str(), SSL_FILETYPE_PEM) != 1)
+		throw invalid_certificate_exception();
+
+	if (::SSL_CTX_check_private_key(this->context) != 1)
+		throw invalid_certificate_exception();
+}
+
+void tls_context::load_trusted(const string& ca_file) {
+	if (::SSL_CTX_load_verify_locations(this->context, ca_file.c_str(), nullptr) != 1)
+		throw invalid_certificate_exception();
+}
+
+void tls_context::set_verify_peer(bool verify) {
+	this->verify = verify;
+
+	::SSL_CTX_set_verify(this->context, verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, nullptr);
+}
+
+void tls_context::set_kernel_offload(bool enabled) {
+#ifdef SSL_OP_ENABLE_KTLS
+	if (enabled)
+		::SSL_CTX_set_options(this->context, SSL_OP_ENABLE_KTLS);
+	else
+		::SSL_CTX_clear_options(this->context, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+void tls_context::set_handshake_timeout(chrono::milliseconds timeout) {
+	this->handshake_timeout = timeout;
+}
+
+void tls_context::set_write_timeout(chrono::milliseconds timeout) {
+	this->write_timeout = timeout;
+}
+
+tls_context::roles tls_context::role() const {
+	return this->context_role;
+}
+
+int tls_context::on_new_session(SSL* ssl, SSL_SESSION* session) {
+	auto context = reinterpret_cast<tls_context*>(SSL_CTX_get_app_data(::SSL_get_SSL_CTX(ssl)));
+	auto name = ::SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+
+	unique_lock<mutex> lck(context->session_lock);
+
+	auto& slot = context->sessions[name ? name : ""];
+	if (slot)
+		::SSL_SESSION_free(slot);
+
+	slot = session;
+
+	//Returning one keeps our reference to the session.
+	return 1;
+}
+
+tls_session::tls_session(tls_context& context, socket::native_handle_type handle, const string& server_name) : handle(handle), done(false), abandoned(false), deadline(chrono::steady_clock::now() + context.handshake_timeout), write_timeout(context.write_timeout) {
+	this->ssl = ::SSL_new(context.context);
+
+	if (!this->ssl)
+		throw tls_context::could_not_create_exception();
+
+	::SSL_set_fd(this->ssl, static_cast<int>(handle));
+
+	if (context.context_role == tls_context::roles::client) {
+		if (server_name != "") {
+			::SSL_set_tlsext_host_name(this->ssl, server_name.c_str());
+
+			if (context.verify)
+				::SSL_set1_host(this->ssl, server_name.c_str());
+		}
+
+		unique_lock<mutex> lck(context.session_lock);
+
+		auto iter = context.sessions.find(server_name);
+		if (iter != context.sessions.end())
+			::SSL_set_session(this->ssl, iter->second);
+	}
+
+	if (context.context_role == tls_context::roles::server)
+		::SSL_set_accept_state(this->ssl);
+	else
+		::SSL_set_connect_state(this->ssl);
+}
+
+const word tls_session::would_block;
+
+tls_session::~tls_session() {
+	::SSL_free(this->ssl);
+}
+
+bool tls_session::handshake() {
+	if (this->done)
+		return true;
+
+	if (this->expired())
+		throw tls_context::handshake_failed_exception();
+
+	while (true) {
+		::ERR_clear_error();
+
+		int result = ::SSL_do_handshake(this->ssl);
+		if (result == 1) {
+			this->done = true;
+			return true;
+		}
+
+		int error = ::SSL_get_error(this->ssl, result);
+		::ERR_clear_error();
+
+		if (error == SSL_ERROR_WANT_READ)
+			return false;
+
+		//The socket's send buffer is rarely full this early, so waiting out the remaining time for room is fine.
+		auto remaining = chrono::duration_cast<chrono::milliseconds>(this->deadline - chrono::steady_clock::now());
+		if (error != SSL_ERROR_WANT_WRITE || remaining.count() <= 0 || !wait_for(this->handle, error, remaining))
+			throw tls_context::handshake_failed_exception();
+	}
+}
+
+void tls_session::complete_handshake() {
+	while (!this->handshake()) {
+		auto remaining = chrono::duration_cast<chrono::milliseconds>(this->deadline - chrono::steady_clock::now());
+
+		if (remaining.count() <= 0 || !wait_for(this->handle, SSL_ERROR_WANT_READ, remaining))
+			throw tls_context::handshake_failed_exception();
+	}
+}
+
+bool tls_session::established() const {
+	return this->done;
+}
+
+bool tls_session::expired() const {
+	return !this->done && chrono::steady_clock::now() >= this->deadline;
+}
+
+word tls_session::read(uint8* buffer, word count) {
+	if (this->abandoned)
+		return 0;
+
+	try {
+		if (!this->handshake())
+			return tls_session::would_block;
+	}
+	catch (tls_context::handshake_failed_exception) {
+		return 0;
+	}
+
+	::ERR_clear_error();
+
+	int received = ::SSL_read(this->ssl, buffer, static_cast<int>(count));
+	if (received > 0)
+		return static_cast<word>(received);
+
+	int error = ::SSL_get_error(this->ssl, received);
+	::ERR_clear_error();
+
+	//Part of a record, or a renegotiation waiting on the peer. Only a close notification or a real error ends the connection.
+	if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+		return tls_session::would_block;
+
+	return 0;
+}
+
+word tls_session::write(const uint8* buffer, word count) {
+	if (count == 0 || this->abandoned)
+		return 0;
+
+	try {
+		this->complete_handshake();
+	}
+	catch (tls_context::handshake_failed_exception) {
+		return 0;
+	}
+
+	auto until = chrono::steady_clock::now() + this->write_timeout;
+
+	while (true) {
+		::ERR_clear_error();
+
+		int sent = ::SSL_write(this->ssl, buffer, static_cast<int>(count));
+		if (sent > 0)
+			return static_cast<word>(sent);
+
+		int error = ::SSL_get_error(this->ssl, sent);
+		::ERR_clear_error();
+
+		//Wait for room like a blocking socket would. The retry must pass the same buffer and count.
+		if (error != SSL_ERROR_WANT_WRITE && error != SSL_ERROR_WANT_READ)
+			return 0;
+
+		if (!this->wait_for_room(error, until))
+			return 0;
+	}
+}
+
+#ifdef POSIX
+word tls_session::send_file(int fd, uint64 offset, word count) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined OPENSSL_NO_KTLS
+	if (this->abandoned)
+		return 0;
+
+	auto until = chrono::steady_clock::now() + this->write_timeout;
+
+	while (true) {
+		::ERR_clear_error();
+
+		auto sent = ::SSL_sendfile(this->ssl, fd, static_cast<off_t>(offset), count, 0);
+		if (sent > 0)
+			return static_cast<word>(sent);
+
+		int error = ::SSL_get_error(this->ssl, static_cast<int>(sent));
+		::ERR_clear_error();
+
+		if (error != SSL_ERROR_WANT_WRITE || !this->wait_for_room(error, until))
+			return 0;
+	}
+#else
+	return 0;
+#endif
+}
+#endif
+
+bool tls_session::wait_for_room(int error, chrono::steady_clock::time_point until) {
+	auto remaining = chrono::duration_cast<chrono::milliseconds>(until - chrono::steady_clock::now());
+
+	if (remaining.count() > 0 && wait_for(this->handle, error, remaining))
+		return true;
+
+	//Writers hold the connection while they wait, so a peer that stops reading can't be allowed to hold it forever.
+	//Part of a record may already be out, so the stream can't carry anything else. Shutting the socket down lets whoever reads it see the end.
+	this->abandoned = true;
+
+#ifdef WINDOWS
+	::shutdown(this->handle, SD_BOTH);
+#elif defined POSIX
+	::shutdown(this->handle, SHUT_RDWR);
+#endif
+
+	return false;
+}
+
+bool tls_session::pending() const {
+	return ::SSL_pending(this->ssl) > 0;
+}
+
+bool tls_session::resumed() const {
+	return ::SSL_session_reused(this->ssl) == 1;
+}
+
+bool tls_session::kernel_send() const {
+	return BIO_get_ktls_send(::SSL_get_wbio(this->ssl));
+}
+
+bool tls_session::kernel_receive() const {
+	return BIO_get_ktls_recv(::SSL_get_rbio(this->ssl));
+}
+
+void tls_session::shutdown() {
+	::SSL_shutdown(this->ssl);
+	::ERR_clear_error();
+}
+
+SSL* tls_session::native_handle() const {
+	return this->ssl;
+}
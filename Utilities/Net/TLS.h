@@ -0,0 +1,165 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <chrono>
+
+#include "../Common.h"
+#include "Socket.h"
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+
+namespace util {
+	namespace net {
+		///Configuration shared by every TLS connection in one role. Wraps an OpenSSL SSL_CTX.
+		///Servers issue session tickets so returning clients can resume without a full handshake.
+		///Clients cache the last session per server name and offer it on the next connection.
+		///When the kernel supports it, record encryption is offloaded to kernel TLS once the handshake completes.
+		class tls_context {
+			public:
+				enum class roles {
+					server,
+					client
+				};
+
+				class could_not_create_exception {};
+				class invalid_certificate_exception {};
+				class handshake_failed_exception {};
+
+				///Constructs a new context.
+				///Client contexts verify the peer against the system trust store unless set_verify_peer(false) is called.
+				///@param role Whether connections using this context accept or initiate the handshake.
+				exported tls_context(roles role);
+
+				///Destructs the instance. Every connection using the context must be closed first.
+				exported ~tls_context();
+
+				///Loads the certificate chain and private key presented to peers.
+				///@param certificate_file The PEM encoded certificate chain.
+				///@param key_file The PEM encoded private key.
+				exported void load_certificate(const std::string& certificate_file, const std::string& key_file);
+
+				///Loads the certificates trusted when verifying peers.
+				///@param ca_file The PEM encoded certificates.
+				exported void load_trusted(const std::string& ca_file);
+
+				///Sets whether or not the peer's certificate must be valid for the handshake to succeed.
+				exported void set_verify_peer(bool verify);
+
+				///Sets whether or not record encryption is offloaded to kernel TLS when available. Enabled by default.
+				exported void set_kernel_offload(bool enabled);
+
+				///Sets how long a handshake may take in total before the connection is abandoned. Ten seconds by default.
+				exported void set_handshake_timeout(std::chrono::milliseconds timeout);
+
+				///Sets how long a single write may wait for the peer to make room before the connection is abandoned. Ten seconds by default.
+				exported void set_write_timeout(std::chrono::milliseconds timeout);
+
+				///Gets the role connections using this context take.
+				///@return The role.
+				exported roles role() const;
+
+				tls_context(const tls_context& other) = delete;
+				tls_context& operator=(const tls_context& other) = delete;
+
+			private:
+				ssl_ctx_st* context;
+				roles context_role;
+				bool verify;
+				std::chrono::milliseconds handshake_timeout;
+				std::chrono::milliseconds write_timeout;
+
+				std::unordered_map<std::string, ssl_session_st*> sessions;
+				std::mutex session_lock;
+
+				static int on_new_session(ssl_st* ssl, ssl_session_st* session);
+
+				friend class tls_session;
+		};
+
+		///The TLS state of a single connection over a non-blocking socket.
+		///The handshake advances whenever the session is read, so a server never waits on a slow peer. Writes wait for it to complete.
+		class tls_session {
+			public:
+				///Returned by read when no complete record has arrived yet.
+				static const word would_block = static_cast<word>(-1);
+
+				///Prepares a session over a connected socket. The handshake starts on the first read, write or call to handshake.
+				///The socket must be non-blocking. The handshake must complete within the context's handshake timeout from now.
+				///@param context The context to use.
+				///@param handle The connected socket.
+				///@param server_name The name of the server, used for SNI and session resumption. Ignored by servers.
+				exported tls_session(tls_context& context, socket::native_handle_type handle, const std::string& server_name);
+
+				///Destructs the instance without notifying the peer.
+				exported ~tls_session();
+
+				///Advances the handshake as far as the data received so far allows.
+				///@return True once the handshake is complete, false while it waits for the peer.
+				///@throws tls_context::handshake_failed_exception if it failed or its timeout passed.
+				exported bool handshake();
+
+				///Advances the handshake until it completes, waiting for the peer.
+				///@throws tls_context::handshake_failed_exception if it failed or its timeout passed.
+				exported void complete_handshake();
+
+				///Gets whether or not the handshake has completed.
+				exported bool established() const;
+
+				///Gets whether or not the handshake timeout passed before the handshake completed.
+				exported bool expired() const;
+
+				///Reads up to count decrypted bytes without waiting. Advances the handshake first if it is still in progress.
+				///@return The number of bytes read, would_block if no complete record is available, or zero if the connection closed or failed.
+				exported word read(uint8* buffer, word count);
+
+				///Writes count bytes, waiting for the socket to accept them and for the handshake if it is still in progress.
+				///If the socket doesn't accept them within the context's write timeout the session is abandoned and the socket shut down, so reads see the connection end.
+				///@return The number of bytes written, zero on failure.
+				exported word write(const uint8* buffer, word count);
+
+#ifdef POSIX
+				///Sends part of a file directly from the page cache. Only possible when kernel_send is true.
+				///@param fd The file to read from. Its file offset is not changed.
+				///@param offset The offset of the first byte to send.
+				///@param count The maximum number of bytes to send.
+				///@return The number of bytes sent, zero on failure. Times out the same way as write.
+				exported word send_file(int fd, uint64 offset, word count);
+#endif
+
+				///Gets whether or not decrypted data is buffered and can be read without touching the socket.
+				exported bool pending() const;
+
+				///Gets whether or not the session was resumed from a ticket instead of a full handshake.
+				exported bool resumed() const;
+
+				///Gets whether or not writes are encrypted by kernel TLS.
+				exported bool kernel_send() const;
+
+				///Gets whether or not reads are decrypted by kernel TLS.
+				exported bool kernel_receive() const;
+
+				///Sends the close notification to the peer.
+				exported void shutdown();
+
+				///Gets the underlying OpenSSL handle.
+				exported ssl_st* native_handle() const;
+
+				tls_session(const tls_session& other) = delete;
+				tls_session& operator=(const tls_session& other) = delete;
+
+			private:
+				ssl_st* ssl;
+				socket::native_handle_type handle;
+				bool done;
+				bool abandoned;
+				std::chrono::steady_clock::time_point deadline;
+				std::chrono::milliseconds write_timeout;
+
+				bool wait_for_room(int error, std::chrono::steady_clock::time_point until);
+		};
+	}
+}
@@ -0,0 +1,343 @@
+#include "TrafficCapture.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <cstring>
+
+#include "TCPConnection.h"
+#include "RequestServer.h"
+
+using namespace std;
+using namespace util;
+using namespace util::net;
+
+//The file starts with the magic and a version, then holds records of a kind byte followed by
+//varints for the microseconds since the previous record and the connection, and for frames the length and the bytes.
+static const uint8 log_magic[4] = { 'U', 'T', 'R', 'C' };
+static const uint8 log_version = 1;
+
+enum class record_kinds : uint8 {
+	frame,
+	close
+};
+
+static void write_varint(vector<uint8>& out, uint64 value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<uint8>(value | 0x80));
+		value >>= 7;
+	}
+
+	out.push_back(static_cast<uint8>(value));
+}
+
+static bool read_varint(const vector<uint8>& in, word& position, uint64& value) {
+	value = 0;
+
+	for (word shift = 0; shift < 64 && position < in.size(); shift += 7) {
+		uint8 byte = in[position++];
+		value |= static_cast<uint64>(byte & 0x7F) << shift;
+
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+traffic_recorder::traffic_recorder(const string& path, word buffer_size) : buffer_size(buffer_size), pending(false), stopping(false), last(chrono::steady_clock::now()) {
+	this->file = fopen(path.c_str(), "wb");
+	if (!this->file)
+		throw could_not_open_exception();
+
+	this->active.reserve(this->buffer_size + 64);
+	this->active.insert(this->active.end(), log_magic, log_magic + sizeof(log_magic));
+	this->active.push_back(log_version);
+
+	this->writer = thread(&traffic_recorder::write_run, this);
+}
+
+traffic_recorder::~traffic_recorder() {
+	this->flush();
+
+	{
+		unique_lock<mutex> lck(this->lock);
+		this->stopping = true;
+	}
+
+	this->changed.notify_all();
+	this->writer.join();
+
+	fclose(this->file);
+}
+
+void traffic_recorder::record(uint64 connection, const uint8* data, word length) {
+	this->append(static_cast<uint8>(record_kinds::frame), connection, data, length);
+}
+
+void traffic_recorder::record_close(uint64 connection) {
+	this->append(static_cast<uint8>(record_kinds::close), connection, nullptr, 0);
+}
+
+void traffic_recorder::append(uint8 kind, uint64 connection, const uint8* data, word length) {
+	unique_lock<mutex> lck(this->lock);
+	auto now = chrono::steady_clock::now();
+
+	this->active.push_back(kind);
+	write_varint(this->active, static_cast<uint64>(chrono::duration_cast<chrono::microseconds>(now - this->last).count()));
+	write_varint(this->active, connection);
+
+	if (kind == static_cast<uint8>(record_kinds::frame)) {
+		write_varint(this->active, length);
+		this->active.insert(this->active.end(), data, data + length);
+	}
+
+	this->last = now;
+
+	if (this->active.size() >= this->buffer_size)
+		this->hand_off(lck);
+}
+
+void traffic_recorder::hand_off(unique_lock<mutex>& lck) {
+	this->changed.wait(lck, [this]() { return !this->pending; });
+
+	swap(this->active, this->writing);
+	this->pending = true;
+	this->changed.notify_all();
+}
+
+void traffic_recorder::flush() {
+	unique_lock<mutex> lck(this->lock);
+
+	if (!this->active.empty())
+		this->hand_off(lck);
+
+	this->changed.wait(lck, [this]() { return !this->pending; });
+	fflush(this->file);
+}
+
+void traffic_recorder::write_run() {
+	unique_lock<mutex> lck(this->lock);
+
+	while (true) {
+		this->changed.wait(lck, [this]() { return this->pending || this->stopping; });
+
+		if (!this->pending)
+			return;
+
+		//The buffer being written is only touched here until pending is cleared, so the recording side can keep filling the other.
+		lck.unlock();
+		fwrite(this->writing.data(), 1, this->writing.size(), this->file);
+		lck.lock();
+
+		this->writing.clear();
+		this->pending = false;
+		this->changed.notify_all();
+	}
+}
+
+traffic_replayer::traffic_replayer(const string& path) : frames(0) {
+	auto file = fopen(path.c_str(), "rb");
+	if (!file)
+		throw could_not_open_exception();
+
+	uint8 chunk[64 * 1024];
+	size_t read;
+	while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		this->log.insert(this->log.end(), chunk, chunk + read);
+
+	fclose(file);
+
+	if (this->log.size() < sizeof(log_magic) + 1 || memcmp(this->log.data(), log_magic, sizeof(log_magic)) != 0 || this->log[sizeof(log_magic)] != log_version)
+		throw invalid_log_exception();
+
+	word position = sizeof(log_magic) + 1;
+	uint64 at = 0;
+
+	while (position < this->log.size()) {
+		entry e;
+		uint8 kind = this->log[position++];
+		uint64 delta, length = 0;
+
+		if (!read_varint(this->log, position, delta) || !read_varint(this->log, position, e.connection))
+			throw invalid_log_exception();
+
+		if (kind == static_cast<uint8>(record_kinds::frame) && (!read_varint(this->log, position, length) || length > this->log.size() - position))
+			throw invalid_log_exception();
+
+		if (kind > static_cast<uint8>(record_kinds::close))
+			throw invalid_log_exception();
+
+		at += delta;
+
+		e.at = at;
+		e.closed = kind == static_cast<uint8>(record_kinds::close);
+		e.offset = position;
+		e.length = static_cast<word>(length);
+
+		position += e.length;
+
+		if (!e.closed)
+			this->frames++;
+
+		this->entries.push_back(e);
+	}
+}
+
+word traffic_replayer::size() const {
+	return this->frames;
+}
+
+chrono::microseconds traffic_replayer::duration() const {
+	if (this->entries.empty())
+		return chrono::microseconds(0);
+
+	return chrono::microseconds(this->entries.back().at - this->entries.front().at);
+}
+
+traffic_replayer::results traffic_replayer::run(endpoint target, double speed, chrono::milliseconds drain_timeout) {
+	typedef chrono::steady_clock clock;
+
+	results result;
+	vector<unique_ptr<tcp_connection>> open;
+	unordered_map<uint64, word> slots;
+	unordered_map<uint64, clock::time_point> outstanding;
+	vector<word> unanswered;
+	vector<chrono::microseconds> latencies;
+
+	result.connections = 0;
+	result.frames = 0;
+	result.responses = 0;
+
+	auto first = this->entries.empty() ? 0 : this->entries.front().at;
+	auto start = clock::now();
+
+	//Reads whatever has arrived on every connection and matches responses to the requests waiting on them.
+	auto poll = [&]() {
+		bool any = false;
+
+		for (word i = 0; i < open.size(); i++) {
+			auto& c = open[i];
+
+			try {
+				if (!c || !c->data_available(0))
+					continue;
+
+				for (auto& m : c->read()) {
+					if (m.closed) {
+						c.reset();
+						unanswered[i] = 0;
+						break;
+					}
+
+					any = true;
+
+					if (m.length < 4 || (m.data[2] & request_server::stream_chunk_flag) != 0)
+						continue;
+
+					uint16 id;
+					memcpy(&id, m.data, sizeof(id));
+
+					auto waiting = outstanding.find(static_cast<uint64>(i) << 16 | id);
+					if (waiting == outstanding.end())
+						continue;
+
+					latencies.push_back(chrono::duration_cast<chrono::microseconds>(clock::now() - waiting->second));
+					outstanding.erase(waiting);
+					unanswered[i]--;
+					result.responses++;
+				}
+			}
+			catch (tcp_connection::not_connected_exception) {
+				c.reset();
+				unanswered[i] = 0;
+			}
+		}
+
+		return any;
+	};
+
+	for (auto& e : this->entries) {
+		auto offset = chrono::microseconds(speed > 0 ? static_cast<int64>((e.at - first) / speed) : 0);
+		auto due = start + offset;
+
+		while (clock::now() < due)
+			if (!poll())
+				this_thread::sleep_for(min(chrono::duration_cast<chrono::microseconds>(due - clock::now()), chrono::microseconds(50)));
+
+		auto slot = slots.find(e.connection);
+
+		if (e.closed) {
+			if (slot == slots.end() || !open[slot->second])
+				continue;
+
+			//Sped up, the close comes sooner after the last requests than it did, so give their responses a chance to arrive first.
+			auto close_by = clock::now() + drain_timeout;
+			while (unanswered[slot->second] > 0 && clock::now() < close_by)
+				if (!poll())
+					this_thread::sleep_for(chrono::microseconds(50));
+
+			if (open[slot->second])
+				open[slot->second]->close();
+
+			continue;
+		}
+
+		if (slot == slots.end()) {
+			slot = slots.emplace(e.connection, static_cast<word>(open.size())).first;
+			open.emplace_back();
+			unanswered.push_back(0);
+		}
+
+		auto& c = open[slot->second];
+
+		if (!c || !c->is_connected()) {
+			try {
+				c = make_unique<tcp_connection>(target);
+				result.connections++;
+			}
+			catch (socket::could_not_connect_exception) {
+				c.reset();
+				continue;
+			}
+		}
+
+		auto frame = this->log.data() + e.offset;
+
+		//Acknowledgements of streamed chunks are never answered.
+		if (e.length >= 4 && frame[2] != request_server::stream_credit_category) {
+			uint16 id;
+			memcpy(&id, frame, sizeof(id));
+			if (outstanding.emplace(static_cast<uint64>(slot->second) << 16 | id, clock::now()).second)
+				unanswered[slot->second]++;
+		}
+
+		try {
+			if (c->send(frame, e.length))
+				result.frames++;
+		}
+		catch (tcp_connection::not_connected_exception) {
+			c.reset();
+		}
+	}
+
+	auto drain_until = clock::now() + drain_timeout;
+	while (!outstanding.empty() && clock::now() < drain_until)
+		if (!poll())
+			this_thread::sleep_for(chrono::microseconds(50));
+
+	result.elapsed = chrono::duration_cast<chrono::microseconds>(clock::now() - start);
+
+	sort(latencies.begin(), latencies.end());
+
+	if (latencies.empty()) {
+		result.p50 = result.p99 = result.max = chrono::microseconds(0);
+	}
+	else {
+		result.p50 = latencies[latencies.size() / 2];
+		result.p99 = latencies[latencies.size() * 99 / 100];
+		result.max = latencies.back();
+	}
+
+	return result;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+
+#include "../Common.h"
+#include "Socket.h"
+
+namespace util {
+	namespace net {
+		///Writes the frames a server receives to a compact log that traffic_replayer can play back.
+		///Each record holds the time since the previous one, the connection and the frame, with every integer varint encoded.
+		///Records collect in memory and a writer thread appends them to the file a buffer at a time,
+		///so recording only blocks when the disk falls a whole buffer behind.
+		class traffic_recorder {
+			public:
+				class could_not_open_exception {};
+
+				///Starts a new log, replacing any file at the path.
+				///@param path The file to write.
+				///@param buffer_size How many bytes collect before they are handed to the writer thread.
+				exported traffic_recorder(const std::string& path, word buffer_size = 1 << 20);
+
+				///Writes everything recorded and closes the file.
+				exported ~traffic_recorder();
+
+				///Records a frame received on a connection.
+				///@param connection Identifies the connection. Frames with the same value are replayed on the same connection.
+				///@param data The frame, without the length prefix.
+				///@param length The length of the frame.
+				exported void record(uint64 connection, const uint8* data, word length);
+
+				///Records that a connection closed.
+				exported void record_close(uint64 connection);
+
+				///Waits until everything recorded so far is in the file.
+				exported void flush();
+
+				traffic_recorder(const traffic_recorder& other) = delete;
+				traffic_recorder& operator=(const traffic_recorder& other) = delete;
+
+			private:
+				std::FILE* file;
+				word buffer_size;
+				std::vector<uint8> active;
+				std::vector<uint8> writing;
+				bool pending;
+				bool stopping;
+				std::chrono::steady_clock::time_point last;
+				std::mutex lock;
+				std::condition_variable changed;
+				std::thread writer;
+
+				void append(uint8 kind, uint64 connection, const uint8* data, word length);
+				void hand_off(std::unique_lock<std::mutex>& lck);
+				void write_run();
+		};
+
+		///Plays a log written by traffic_recorder against a server over fresh connections, with the original spacing or faster,
+		///and measures how long each request takes to be answered. Responses are matched to requests by the request_server header id.
+		class traffic_replayer {
+			public:
+				class could_not_open_exception {};
+				class invalid_log_exception {};
+
+				struct results {
+					uint64 connections;
+					uint64 frames;
+					uint64 responses;
+
+					///From the first frame sent until the last response arrived or the drain timeout passed.
+					std::chrono::microseconds elapsed;
+
+					///Between sending a request and receiving the response that ends it.
+					std::chrono::microseconds p50;
+					std::chrono::microseconds p99;
+					std::chrono::microseconds max;
+				};
+
+				///Loads a log.
+				///@param path The file written by traffic_recorder.
+				exported traffic_replayer(const std::string& path);
+
+				///Gets the number of frames in the log.
+				exported word size() const;
+
+				///Gets the time between the first and last record of the log.
+				exported std::chrono::microseconds duration() const;
+
+				///Replays the log. Each recorded connection is opened when its first frame is due and closed when it closed in the log,
+				///once the requests sent on it have been answered or the drain timeout has passed.
+				///@param target The server to drive.
+				///@param speed How many times faster than recorded to send. Zero or less sends as fast as possible.
+				///@param drain_timeout How long to wait for responses once every frame is sent.
+				///@return What was sent and how fast it was answered.
+				exported results run(endpoint target, double speed = 1.0, std::chrono::milliseconds drain_timeout = std::chrono::milliseconds(5000));
+
+			private:
+				struct entry {
+					uint64 at;
+					uint64 connection;
+					bool closed;
+					word offset;
+					word length;
+				};
+
+				std::vector<uint8> log;
+				std::vector<entry> entries;
+				word frames;
+		};
+	}
+}
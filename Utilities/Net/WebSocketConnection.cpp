@@ -1,6 +1,9 @@
 #include "WebSocketConnection.h"
 
 #include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <limits>
 
 #include "../Misc.h"
 #include "../Cryptography.h"
@@ -10,20 +13,74 @@ using namespace std;
 using namespace util;
 using namespace util::net;
 
-websocket_connection::websocket_connection(socket&& socket) : tcp_connection(move(socket)) {
+static const char* accept_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+//Each client gets its own generator for masking keys, seeded from one shared sequence so connections never share a stream.
+static uint64 mask_seed() {
+	static atomic<uint64> sequence(crypto::random_uint64(0, numeric_limits<uint64>::max()));
+
+	uint64 z = sequence.fetch_add(0x9E3779B97F4A7C15ULL) + 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+
+	return z != 0 ? z : 1;
+}
+
+websocket_connection::websocket_connection(socket&& socket) : tcp_connection(move(socket)), rtt(0) {
 	this->ready = false;
+	this->client = false;
+	this->mask_state = 0;
 	this->buffer_start = this->buffer;
+	this->ping_sequence = 0;
+	this->awaiting_pong = false;
+}
+
+websocket_connection::websocket_connection(endpoint ep, const string& resource) : tcp_connection(ep), rtt(0) {
+	this->ready = false;
+	this->client = true;
+	this->mask_state = mask_seed();
+	this->buffer_start = this->buffer;
+	this->ping_sequence = 0;
+	this->awaiting_pong = false;
+
+	this->client_handshake(ep.address + ":" + ep.port, resource);
+}
+
+websocket_connection::websocket_connection(socket&& socket, const string& host, const string& resource) : tcp_connection(move(socket)), rtt(0) {
+	this->ready = false;
+	this->client = true;
+	this->mask_state = mask_seed();
+	this->buffer_start = this->buffer;
+	this->ping_sequence = 0;
+	this->awaiting_pong = false;
+
+	this->client_handshake(host, resource);
 }
 
 websocket_connection::websocket_connection(websocket_connection&& other) : tcp_connection(move(other)) {
 	this->ready = other.ready;
+	this->client = other.client;
+	this->mask_state = other.mask_state;
+	memcpy(this->mask_key, other.mask_key, sizeof(this->mask_key));
 	this->buffer_start = other.buffer_start;
+	this->ping_sequence = other.ping_sequence;
+	this->awaiting_pong = other.awaiting_pong;
+	this->ping_sent = other.ping_sent;
+	this->rtt = other.rtt;
 }
 
 websocket_connection& websocket_connection::operator = (websocket_connection&& other) {
 	static_cast<tcp_connection&>(*this) = move(static_cast<tcp_connection&>(other));
 	this->ready = other.ready;
+	this->client = other.client;
+	this->mask_state = other.mask_state;
+	memcpy(this->mask_key, other.mask_key, sizeof(this->mask_key));
 	this->buffer_start = other.buffer_start;
+	this->ping_sequence = other.ping_sequence;
+	this->awaiting_pong = other.awaiting_pong;
+	this->ping_sent = other.ping_sent;
+	this->rtt = other.rtt;
 	return *this;
 }
 
@@ -32,7 +89,10 @@ websocket_connection::~websocket_connection() {
 }
 
 bool websocket_connection::handshake() {
-	word received = this->connection.read(this->buffer + this->received, tcp_connection::message_max_size - this->received);
+	word received = this->receive(this->buffer + this->received, tcp_connection::message_max_size - this->received);
+	if (received == tcp_connection::would_block)
+		return false;
+
 	this->received += received;
 
 	if (received == 0)
@@ -60,7 +120,7 @@ complete:
 
 	data_stream key;
 	key.write(this->buffer + keyPos, keyEnd - keyPos);
-	key.write("258EAFA5-E914-47DA-95CA-C5AB0DC85B11", 36);
+	key.write(accept_guid, 36);
 
 	string base64 = misc::base64_encode(crypto::calculate_sha1(key.data(), key.size()).data(), crypto::sha1_length);
 
@@ -74,10 +134,69 @@ complete:
 
 	this->ready = true;
 	this->received -= i + 4;
+	memmove(this->buffer, this->buffer + i + 4, this->received);
 
 	return false;
 }
 
+void websocket_connection::client_handshake(const string& host, const string& resource) {
+	uint64 nonce[2] = { this->next_random(), this->next_random() };
+	string key = misc::base64_encode(reinterpret_cast<uint8*>(nonce), sizeof(nonce));
+	string request = "GET " + resource + " HTTP/1.1\r\nHost: " + host + "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: " + key + "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+
+	if (!this->ensure_write(reinterpret_cast<const uint8*>(request.data()), static_cast<word>(request.size())))
+		throw handshake_failed_exception();
+
+	const char* terminator = "\r\n\r\n";
+	uint8* end = this->buffer;
+
+	do {
+		if (this->received == tcp_connection::message_max_size)
+			throw handshake_failed_exception();
+
+		word received = this->receive_waiting(this->buffer + this->received, tcp_connection::message_max_size - this->received);
+		if (received == 0)
+			throw handshake_failed_exception();
+
+		this->received += received;
+		end = search(this->buffer, this->buffer + this->received, terminator, terminator + 4);
+	} while (end == this->buffer + this->received);
+
+	string response(reinterpret_cast<char*>(this->buffer), end - this->buffer + 2);
+	string lowered(response);
+	transform(lowered.begin(), lowered.end(), lowered.begin(), [](char c) { return static_cast<char>(tolower(static_cast<unsigned char>(c))); });
+
+	auto accept_position = lowered.find("\r\nsec-websocket-accept:");
+	if (lowered.compare(0, 12, "http/1.1 101") != 0 || accept_position == string::npos)
+		throw handshake_failed_exception();
+
+	auto value_start = response.find_first_not_of(' ', accept_position + 23);
+	auto value_end = response.find("\r\n", value_start);
+	while (value_end > value_start && response[value_end - 1] == ' ')
+		value_end--;
+
+	string expected_input = key + accept_guid;
+	string expected = misc::base64_encode(crypto::calculate_sha1(reinterpret_cast<const uint8*>(expected_input.data()), static_cast<word>(expected_input.size())).data(), crypto::sha1_length);
+
+	if (response.compare(value_start, value_end - value_start, expected) != 0)
+		throw handshake_failed_exception();
+
+	//Keep any frames the server sent right behind its response.
+	word header_length = static_cast<word>(end - this->buffer) + 4;
+	this->received -= header_length;
+	memmove(this->buffer, this->buffer + header_length, this->received);
+
+	this->ready = true;
+}
+
+uint64 websocket_connection::next_random() {
+	this->mask_state ^= this->mask_state >> 12;
+	this->mask_state ^= this->mask_state << 25;
+	this->mask_state ^= this->mask_state >> 27;
+
+	return this->mask_state * 0x2545F4914F6CDD1DULL;
+}
+
 vector<tcp_connection::message> websocket_connection::read(word wait_for) {
 	if (!this->connected)
 		throw tcp_connection::not_connected_exception();
@@ -94,7 +213,15 @@ vector<tcp_connection::message> websocket_connection::read(word wait_for) {
 	}
 
 	do {
-		word received = this->connection.read(this->buffer_start + this->received, tcp_connection::message_max_size - this->received);
+		word received = this->receive(this->buffer_start + this->received, tcp_connection::message_max_size - this->received);
+
+		if (received == tcp_connection::would_block) {
+			if (messages.size() < wait_for)
+				this->connection.data_available(100000);
+
+			continue;
+		}
+
 		this->received += received;
 
 		if (received == 0) {
@@ -102,92 +229,110 @@ vector<tcp_connection::message> websocket_connection::read(word wait_for) {
 			goto close;
 		}
 
-		while (this->received > 0) {
-			if (this->received >= 2) {
-				bool RSV1 = (this->buffer_start[0] >> 6 & 0x1) != 0;
-				bool RSV2 = (this->buffer_start[0] >> 5 & 0x1) != 0;
-				bool RSV3 = (this->buffer_start[0] >> 4 & 0x1) != 0;
-				bool FIN = (this->buffer_start[0] >> 7 & 0x1) != 0;
-				bool mask = (this->buffer_start[1] >> 7 & 0x1) != 0;
-				uint8 code = this->buffer_start[0] & 0xF;
-				uint16 length = this->buffer_start[1] & 0x7F;
-				word header_end = 2;
-
-				if (!mask || RSV1 || RSV2 || RSV3) {
-					this->close(close_codes::protocal_error);
-					goto close;
-				}
-
-				if (length == 126) {
-					length = net::net_to_host_int16(reinterpret_cast<uint16*>(this->buffer_start)[1]);
-					header_end += 2;
-				}
-				else if (length == 127) {
-					this->close(close_codes::message_too_big);
-					goto close;
-				}
-
-				auto mask_buffer = this->buffer_start + header_end;
-				header_end += 4;
-				auto payload_buffer = this->buffer_start + header_end;
+		while (this->received >= 2) {
+			word remaining;
+			bool RSV1 = (this->buffer_start[0] >> 6 & 0x1) != 0;
+			bool RSV2 = (this->buffer_start[0] >> 5 & 0x1) != 0;
+			bool RSV3 = (this->buffer_start[0] >> 4 & 0x1) != 0;
+			bool FIN = (this->buffer_start[0] >> 7 & 0x1) != 0;
+			bool mask = (this->buffer_start[1] >> 7 & 0x1) != 0;
+			uint8 code = this->buffer_start[0] & 0xF;
+			uint16 length = this->buffer_start[1] & 0x7F;
+			word header_end = 2;
+
+			//Clients must mask every frame and servers must never mask one.
+			if (mask == this->client || RSV1 || RSV2 || RSV3) {
+				this->close(close_codes::protocal_error);
+				goto close;
+			}
 
-				if (this->received < header_end + length)
+			if (length == 126) {
+				if (this->received < 4)
 					break;
 
-				switch (static_cast<op_codes>(code)) {
-					case op_codes::text: 
-						this->close(close_codes::invalid_data_type);
-						goto close;
+				length = net::net_to_host_int16(reinterpret_cast<uint16*>(this->buffer_start)[1]);
+				header_end += 2;
+			}
+			else if (length == 127) {
+				this->close(close_codes::message_too_big);
+				goto close;
+			}
 
-					case op_codes::close:
-						this->close(close_codes::normal);
-						goto close;
+			uint8* mask_buffer = nullptr;
+			if (mask) {
+				mask_buffer = this->buffer_start + header_end;
+				header_end += 4;
+			}
 
-					case op_codes::pong:
-						this->received -= length + header_end;
+			auto payload_buffer = this->buffer_start + header_end;
 
-						continue;
+			if (this->received < header_end + length)
+				break;
 
-					case op_codes::ping: 
-						if (length > 125) {
-							this->close(close_codes::message_too_big);
-							goto close;
-						}
+			remaining = this->received - length - header_end;
 
-						this->buffer[0] = 128 | static_cast<uint8>(op_codes::pong);
+			switch (static_cast<op_codes>(code)) {
+				case op_codes::text: 
+					this->close(close_codes::invalid_data_type);
+					goto close;
 
-						if (!this->ensure_write(this->buffer_start, header_end + length)) {
-							tcp_connection::close();
-							goto close;
-						}
+				case op_codes::close:
+					this->close(close_codes::normal);
+					goto close;
 
-						this->received -= length + header_end;
+				case op_codes::pong:
+					if (mask)
+						websocket_connection::apply_mask(payload_buffer, length, mask_buffer);
 
-						continue;
+					if (this->awaiting_pong && length == sizeof(this->ping_sequence) && memcmp(payload_buffer, &this->ping_sequence, length) == 0) {
+						this->rtt = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - this->ping_sent);
+						this->awaiting_pong = false;
+					}
 
-					case op_codes::continuation:
-					case op_codes::binary:					
-						for (word i = 0; i < length; i++)
-							payload_buffer[i] ^= mask_buffer[i % 4];
+					memmove(this->buffer_start, payload_buffer + length, remaining);
+					this->received = remaining;
 
-						if (FIN) {
-							messages.emplace_back(payload_buffer, length);
-							memcpy(this->buffer, payload_buffer + length, this->received - length - header_end);
-							this->buffer_start = this->buffer;
-						}
-						else {
-							memcpy(this->buffer_start, payload_buffer, length);
-							this->buffer_start += length;
-						}
+					continue;
 
-						this->received -= length + header_end;
+				case op_codes::ping: 
+					if (length > 125) {
+						this->close(close_codes::message_too_big);
+						goto close;
+					}
 
-						continue;
+					if (mask)
+						websocket_connection::apply_mask(payload_buffer, length, mask_buffer);
 
-					default:
-						this->close(close_codes::protocal_error);
+					if (!this->send(payload_buffer, length, op_codes::pong))
 						goto close;
-				}
+
+					memmove(this->buffer_start, payload_buffer + length, remaining);
+					this->received = remaining;
+
+					continue;
+
+				case op_codes::continuation:
+				case op_codes::binary:					
+					if (mask)
+						websocket_connection::apply_mask(payload_buffer, length, mask_buffer);
+
+					if (FIN) {
+						messages.emplace_back(payload_buffer, length);
+						memcpy(this->buffer, payload_buffer + length, this->received - length - header_end);
+						this->buffer_start = this->buffer;
+					}
+					else {
+						memcpy(this->buffer_start, payload_buffer, length);
+						this->buffer_start += length;
+					}
+
+					this->received -= length + header_end;
+
+					continue;
+
+				default:
+					this->close(close_codes::protocal_error);
+					goto close;
 			}
 		}
 	} while (messages.size() < wait_for);
@@ -213,78 +358,153 @@ bool websocket_connection::send(const uint8* data, word length, op_codes code) {
 	if (length > 0xFFFF)
 		throw tcp_connection::message_too_long_exception();
 
-	word send_length = 2;
-	uint8 bytes[4];
-	bytes[0] = 128 | static_cast<uint8>(code);
+	//Header and payload go out in one write so the frame is not split across segments.
+	uint8 header[tcp_connection::max_frame_header];
+	word header_length = this->write_header(header, length, code);
+
+	vector<uint8> frame(header, header + header_length);
+	frame.insert(frame.end(), data, data + length);
+	this->frame_payload(frame.data() + header_length, length);
+
+	if (!this->ensure_write(frame.data(), static_cast<word>(frame.size()))) {
+		tcp_connection::close();
+		return false;
+	}
+
+	return true;
+}
+
+word websocket_connection::write_header(uint8* header, word length, op_codes code) {
+	word header_length = 2;
+
+	header[0] = 128 | static_cast<uint8>(code);
 
 	if (length <= 125) {
-		bytes[1] = static_cast<uint8>(length);
+		header[1] = static_cast<uint8>(length);
 	}
 	else {
-		bytes[1] = 126;
-		send_length += 2;
-		reinterpret_cast<int16*>(bytes)[1] = net::host_to_net_int16(static_cast<int16>(length));
+		header[1] = 126;
+		reinterpret_cast<int16*>(header)[1] = net::host_to_net_int16(static_cast<int16>(length));
+		header_length += 2;
 	}
 
-	if (!this->ensure_write(bytes, send_length) || !this->ensure_write(data, length)) {
-		tcp_connection::close();
-		return false;
+	if (this->client) {
+		auto key = static_cast<uint32>(this->next_random() >> 32);
+		memcpy(this->mask_key, &key, sizeof(this->mask_key));
+		memcpy(header + header_length, this->mask_key, sizeof(this->mask_key));
+
+		header[1] |= 0x80;
+		header_length += sizeof(this->mask_key);
 	}
 
-	return true;
+	return header_length;
+}
+
+word websocket_connection::frame_header(uint8* header, word length) {
+	return this->write_header(header, length, op_codes::binary);
+}
+
+void websocket_connection::frame_payload(uint8* payload, word length) {
+	if (this->client)
+		websocket_connection::apply_mask(payload, length, this->mask_key);
+}
+
+bool websocket_connection::transforms_payload() const {
+	return this->client;
 }
 
 bool websocket_connection::send_queued() {
 	if (!this->connected)
 		throw tcp_connection::not_connected_exception();
 
-	uint8 bytes[4];
-	word send_length = 2;
 	word length = 0;
 	
 	for (auto& i : this->queued)
 		length += i.length;
 
-	bytes[0] = 128 | static_cast<uint8>(op_codes::binary);
-
-	if (length <= 125) {
-		bytes[1] = static_cast<uint8>(length);
-	}
-	else if (length <= 0xFFFF) {
-		bytes[1] = 126;
-		send_length += 2;
-		reinterpret_cast<int16*>(bytes)[1] = net::host_to_net_int16(static_cast<int16>(length));
-	}
-	else {
+	if (length > 0xFFFF)
 		throw tcp_connection::message_too_long_exception();
-	}
 
-	if (!this->ensure_write(bytes, send_length)) 
-		goto sendFailed;
-		
+	uint8 header[tcp_connection::max_frame_header];
+	word header_length = this->write_header(header, length, op_codes::binary);
+
+	vector<uint8> frame(header, header + header_length);
+	frame.reserve(header_length + length);
+
 	for (auto& i : this->queued)
-		if (!this->ensure_write(i.data, i.length))
-			goto sendFailed;
+		frame.insert(frame.end(), i.data, i.data + i.length);
 
+	this->frame_payload(frame.data() + header_length, length);
 	this->queued.clear();
 
+	if (!this->ensure_write(frame.data(), static_cast<word>(frame.size()))) {
+		tcp_connection::close();
+		return false;
+	}
+
 	return true;
+}
 
-sendFailed:
-	tcp_connection::close();
+void websocket_connection::apply_mask(uint8* data, word length, const uint8* key) {
+	uint64 wide_key;
+	uint8* wide_bytes = reinterpret_cast<uint8*>(&wide_key);
+	word i = 0;
 
-	return false;
+	for (; i < sizeof(wide_key); i++)
+		wide_bytes[i] = key[i % 4];
+
+	//Eight is a multiple of the key length, so every chunk lines up with the key the same way.
+	for (i = 0; i + sizeof(wide_key) <= length; i += sizeof(wide_key)) {
+		uint64 chunk;
+		memcpy(&chunk, data + i, sizeof(chunk));
+		chunk ^= wide_key;
+		memcpy(data + i, &chunk, sizeof(chunk));
+	}
+
+	for (; i < length; i++)
+		data[i] ^= key[i % 4];
+}
+
+bool websocket_connection::handshake_complete() const {
+	return this->ready;
+}
+
+bool websocket_connection::send_ping() {
+	if (!this->connected)
+		throw tcp_connection::not_connected_exception();
+
+	if (!this->ready)
+		return false;
+
+	this->ping_sequence++;
+	this->ping_sent = chrono::steady_clock::now();
+	this->awaiting_pong = true;
+
+	return this->send(reinterpret_cast<uint8*>(&this->ping_sequence), sizeof(this->ping_sequence), op_codes::ping);
+}
+
+bool websocket_connection::ping_outstanding() const {
+	return this->awaiting_pong;
+}
+
+chrono::microseconds websocket_connection::round_trip_time() const {
+	return this->rtt;
+}
+
+bool websocket_connection::is_client() const {
+	return this->client;
 }
 
 void websocket_connection::close(close_codes code) {
 	if (!this->connected)
 		throw tcp_connection::not_connected_exception();
 
-	this->send(reinterpret_cast<uint8*>(&code), sizeof(code), op_codes::close);
+	auto status = net::host_to_net_int16(static_cast<int16>(code));
+	this->send(reinterpret_cast<uint8*>(&status), sizeof(status), op_codes::close);
 	
 	tcp_connection::close();
 }
 
 void websocket_connection::close() {
-	this->close(close_codes::server_shutdown);
+	this->close(this->client ? close_codes::normal : close_codes::server_shutdown);
 }
\ No newline at end of file
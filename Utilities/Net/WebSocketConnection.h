@@ -1,6 +1,8 @@
 #pragma once
 
 #include <vector>
+#include <string>
+#include <chrono>
 
 #include "../Common.h"
 #include "Socket.h"
@@ -8,6 +10,9 @@
 
 namespace util {
 	namespace net {
+		///A tcp_connection that frames messages as binary WebSocket frames.
+		///Constructed from an accepted socket it is the server side and answers the upgrade request on its first reads.
+		///Constructed from an endpoint it is the client side: it performs the upgrade itself and masks every frame it sends.
 		class websocket_connection : public tcp_connection {
 				enum class op_codes {
 					continuation = 0x0,
@@ -28,13 +33,43 @@ namespace util {
 	
 				uint8* buffer_start;
 				bool ready;
+				bool client;
+				uint64 mask_state;
+				uint8 mask_key[4];
+				uint64 ping_sequence;
+				bool awaiting_pong;
+				std::chrono::steady_clock::time_point ping_sent;
+				std::chrono::microseconds rtt;
 
 				bool handshake();
+				void client_handshake(const std::string& host, const std::string& resource);
+				uint64 next_random();
+				word write_header(uint8* header, word length, op_codes code);
+				virtual word frame_header(uint8* header, word length) override;
+				virtual void frame_payload(uint8* payload, word length) override;
+				virtual bool transforms_payload() const override;
 				bool send(const uint8* data, word length, op_codes code);
 				void close(close_codes code);
 
 				public:
+					class handshake_failed_exception {};
+
+					///Accepts the server side of a connection. The upgrade request is answered as read is called.
 					exported websocket_connection(socket&& socket);
+
+					///Connects to a WebSocket server and completes the upgrade before returning.
+					///@param ep The endpoint. TLS is started first if it is set.
+					///@param resource The path to request.
+					///@throws handshake_failed_exception if the server does not accept the upgrade.
+					exported websocket_connection(endpoint ep, const std::string& resource = "/");
+
+					///Completes the client side upgrade over a socket that is already connected, for example one from resolver::connect.
+					///@param socket The connected socket.
+					///@param host The value of the Host header.
+					///@param resource The path to request.
+					///@throws handshake_failed_exception if the server does not accept the upgrade.
+					exported websocket_connection(socket&& socket, const std::string& host, const std::string& resource);
+
 					exported websocket_connection(websocket_connection&& other);
 					exported virtual ~websocket_connection() override;
 					exported websocket_connection& operator=(websocket_connection&& other);
@@ -44,6 +79,29 @@ namespace util {
 					exported virtual bool send_queued() override;
 					exported virtual void close() override;
 
+					///Gets whether or not the upgrade handshake has completed.
+					exported bool handshake_complete() const;
+
+					///Sends a ping. The round trip time is measured when read sees the matching pong.
+					///@return True if the ping was sent, false otherwise.
+					exported bool send_ping();
+
+					///Gets whether or not the last ping sent is still waiting for its pong.
+					exported bool ping_outstanding() const;
+
+					///Gets the round trip time measured by the last answered ping.
+					///@return The round trip time, zero if no ping has been answered.
+					exported std::chrono::microseconds round_trip_time() const;
+
+					///Gets whether or not this is the client side of the connection.
+					exported bool is_client() const;
+
+					///XORs data with a four byte masking key, eight bytes at a time.
+					///@param data The bytes to mask or unmask in place.
+					///@param length The number of bytes.
+					///@param key The masking key. Byte zero applies to data[0].
+					exported static void apply_mask(uint8* data, word length, const uint8* key);
+
 					websocket_connection(const websocket_connection& other) = delete;
 					websocket_connection& operator=(const websocket_connection& other) = delete;
 		};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <type_traits>
+
+#include "Common.h"
+
+namespace util {
+	///Holds objects of one type in fixed size blocks of contiguous slots, addressed by the index of their slot.
+	///Released slots are reused most recent first, so churn stays in memory that is already warm and rarely reaches the allocator.
+	///Blocks are allocated as needed and never move, so references stay valid until their own slot is released.
+	///Allocating and releasing are thread safe. Reading a slot needs no lock, but it must not race with its own release.
+	template<typename T, word block_bits = 8> class slab {
+		public:
+			typedef word handle;
+
+			static const handle invalid = static_cast<handle>(-1);
+			static const word block_size = 1 << block_bits;
+
+			class full_exception {};
+
+			///Constructs an empty slab. No blocks are allocated until they are needed.
+			///@param max_objects The most objects that may be held at once. Rounded up to a whole block.
+			slab(word max_objects = 1 << 20) : max_blocks((max_objects + slab::block_size - 1) / slab::block_size), block_count(0), high_water(0), count(0) {
+				this->blocks.reset(new std::unique_ptr<storage[]>[this->max_blocks]);
+			}
+
+			~slab() {
+				for (handle i = 0; i < this->high_water; i++)
+					if (this->live[i])
+						this->at(i).~T();
+			}
+
+			///Constructs an object in a free slot.
+			///@param args The arguments to construct it with.
+			///@return The slot.
+			///@throws full_exception if max_objects are already held.
+			template<typename... Args> handle emplace(Args&&... args) {
+				std::unique_lock<std::mutex> lck(this->lock);
+				handle slot;
+
+				if (!this->free_slots.empty()) {
+					slot = this->free_slots.back();
+					this->free_slots.pop_back();
+				}
+				else {
+					if (this->high_water == this->max_blocks * slab::block_size)
+						throw full_exception();
+
+					slot = this->high_water++;
+
+					if ((slot >> block_bits) == this->block_count)
+						this->blocks[this->block_count++].reset(new storage[slab::block_size]);
+
+					this->live.push_back(false);
+				}
+
+				try {
+					new (&this->at(slot)) T(std::forward<Args>(args)...);
+				}
+				catch (...) {
+					this->free_slots.push_back(slot);
+					throw;
+				}
+
+				this->live[slot] = true;
+				this->count++;
+
+				return slot;
+			}
+
+			///Destroys the object in a slot and frees the slot. Invalid or free slots are ignored.
+			void release(handle slot) {
+				std::unique_lock<std::mutex> lck(this->lock);
+
+				if (slot >= this->high_water || !this->live[slot])
+					return;
+
+				this->at(slot).~T();
+				this->live[slot] = false;
+				this->free_slots.push_back(slot);
+				this->count--;
+			}
+
+			T& operator[](handle slot) {
+				return this->at(slot);
+			}
+
+			const T& operator[](handle slot) const {
+				return const_cast<slab*>(this)->at(slot);
+			}
+
+			///Gets the number of objects held.
+			word size() {
+				std::unique_lock<std::mutex> lck(this->lock);
+
+				return this->count;
+			}
+
+			slab(const slab& other) = delete;
+			slab& operator=(const slab& other) = delete;
+
+		private:
+			typedef typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+
+			//Sized up front so that readers never see the directory move while a block is added.
+			std::unique_ptr<std::unique_ptr<storage[]>[]> blocks;
+			word max_blocks;
+			word block_count;
+			handle high_water;
+			word count;
+			std::vector<handle> free_slots;
+			std::vector<bool> live;
+			std::mutex lock;
+
+			T& at(handle slot) {
+				return *reinterpret_cast<T*>(&this->blocks[slot >> block_bits][slot & (slab::block_size - 1)]);
+			}
+	};
+}
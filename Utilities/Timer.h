@@ -73,6 +73,11 @@ namespace util {
 				this->worker.join();
 			}
 
+			///Gets the handle of the thread the timer fires on. Only valid while the timer is running.
+			exported std::thread::native_handle_type native_handle() {
+				return this->worker.native_handle();
+			}
+
 			exported void run() {
 				while (this->running) {
 					if (this->interval.count() == 0)
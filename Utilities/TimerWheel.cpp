@@ -0,0 +1,165 @@
+#include "TimerWheel.h"
+
+#include <utility>
+
+using namespace std;
+using namespace util;
+
+const word timer_wheel::npos;
+
+timer_wheel::timer_wheel(chrono::milliseconds resolution) : origin(chrono::steady_clock::now()), resolution(resolution) {
+	if (this->resolution.count() <= 0)
+		this->resolution = chrono::milliseconds(1);
+
+	this->current = 0;
+	this->count = 0;
+	this->heads.fill(timer_wheel::npos);
+}
+
+timer_wheel::id timer_wheel::schedule(chrono::milliseconds delay, callback action) {
+	static const uint64 max_ticks = (1ULL << (timer_wheel::slot_bits * timer_wheel::levels)) - 1;
+
+	uint64 ticks = delay.count() <= 0 ? 1 : static_cast<uint64>((delay.count() + this->resolution.count() - 1) / this->resolution.count());
+	if (ticks > max_ticks)
+		ticks = max_ticks;
+
+	word index;
+	if (!this->free_nodes.empty()) {
+		index = this->free_nodes.back();
+		this->free_nodes.pop_back();
+	}
+	else {
+		index = static_cast<word>(this->nodes.size());
+		this->nodes.emplace_back();
+		this->nodes.back().generation = 1;
+	}
+
+	auto& n = this->nodes[index];
+	n.expires = this->current + ticks;
+	n.action = move(action);
+
+	this->link(index);
+	this->count++;
+
+	return static_cast<id>(n.generation) << 32 | (index + 1);
+}
+
+bool timer_wheel::cancel(id timer) {
+	if (timer == timer_wheel::invalid)
+		return false;
+
+	word index = static_cast<word>((timer & 0xFFFFFFFF) - 1);
+	uint32 generation = static_cast<uint32>(timer >> 32);
+
+	if (index >= this->nodes.size() || this->nodes[index].generation != generation || this->nodes[index].slot == timer_wheel::npos)
+		return false;
+
+	this->release(index);
+
+	return true;
+}
+
+word timer_wheel::advance() {
+	return this->advance(chrono::steady_clock::now());
+}
+
+word timer_wheel::advance(chrono::steady_clock::time_point now) {
+	if (now < this->origin)
+		return 0;
+
+	uint64 target = static_cast<uint64>(chrono::duration_cast<chrono::milliseconds>(now - this->origin).count() / this->resolution.count());
+	word fired = 0;
+
+	while (this->current < target) {
+		//Nothing can fire in between, so skip straight to the end instead of walking every tick.
+		if (this->count == 0) {
+			this->current = target;
+			break;
+		}
+
+		this->current++;
+
+		word highest = 0;
+		for (word level = 1; level < timer_wheel::levels; level++) {
+			if ((this->current & ((1ULL << (timer_wheel::slot_bits * level)) - 1)) != 0)
+				break;
+
+			highest = level;
+		}
+
+		for (word level = highest; level > 0; level--)
+			this->cascade(level);
+
+		auto& head = this->heads[this->current & (timer_wheel::slots - 1)];
+		while (head != timer_wheel::npos) {
+			word index = head;
+			auto action = move(this->nodes[index].action);
+
+			//Released before running so the callback can reuse the slot or cancel its own, now stale, id.
+			this->release(index);
+			fired++;
+
+			action();
+		}
+	}
+
+	return fired;
+}
+
+word timer_wheel::size() const {
+	return this->count;
+}
+
+void timer_wheel::link(word index) {
+	auto& n = this->nodes[index];
+	uint64 delta = n.expires - this->current;
+	word level = 0;
+
+	while (level < timer_wheel::levels - 1 && delta >= (1ULL << (timer_wheel::slot_bits * (level + 1))))
+		level++;
+
+	n.slot = static_cast<word>(level * timer_wheel::slots + ((n.expires >> (timer_wheel::slot_bits * level)) & (timer_wheel::slots - 1)));
+	n.previous = timer_wheel::npos;
+	n.next = this->heads[n.slot];
+
+	if (n.next != timer_wheel::npos)
+		this->nodes[n.next].previous = index;
+
+	this->heads[n.slot] = index;
+}
+
+void timer_wheel::unlink(word index) {
+	auto& n = this->nodes[index];
+
+	if (n.previous != timer_wheel::npos)
+		this->nodes[n.previous].next = n.next;
+	else
+		this->heads[n.slot] = n.next;
+
+	if (n.next != timer_wheel::npos)
+		this->nodes[n.next].previous = n.previous;
+
+	n.slot = timer_wheel::npos;
+}
+
+void timer_wheel::release(word index) {
+	this->unlink(index);
+
+	auto& n = this->nodes[index];
+	n.generation++;
+	n.action = nullptr;
+
+	this->free_nodes.push_back(index);
+	this->count--;
+}
+
+void timer_wheel::cascade(word level) {
+	auto& head = this->heads[level * timer_wheel::slots + ((this->current >> (timer_wheel::slot_bits * level)) & (timer_wheel::slots - 1))];
+
+	while (head != timer_wheel::npos) {
+		word index = head;
+
+		this->unlink(index);
+		this->link(index);
+	}
+}
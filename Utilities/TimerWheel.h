@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <chrono>
+#include <functional>
+
+#include "Common.h"
+
+namespace util {
+	///A hierarchical timer wheel for large numbers of timers that are mostly cancelled or pushed back before they fire.
+	///Scheduling and cancelling are O(1). Timers fire from advance, on the thread that calls it,
+	///and are late by at most one resolution. The wheel is not thread safe, it is meant to be owned by an I/O loop.
+	class timer_wheel {
+		public:
+			///Identifies a scheduled timer. Stays unique after the timer fires or is cancelled, so stale ids are harmless.
+			typedef uint64 id;
+			typedef std::function<void()> callback;
+
+			///An id that never refers to a timer.
+			static const id invalid = 0;
+
+			///Each level of the wheel covers this many slots.
+			static const word slot_bits = 6;
+			static const word levels = 4;
+
+			///Constructs a new wheel whose time starts now.
+			///@param resolution The length of one tick. Delays are rounded up to a whole number of ticks.
+			exported timer_wheel(std::chrono::milliseconds resolution = std::chrono::milliseconds(10));
+
+			///Schedules a callback to run once.
+			///@param delay How long after the most recent advance the callback should run.
+			///Delays longer than the wheel covers are clamped to the longest it can represent.
+			///@param action The callback. It may schedule and cancel timers, including itself.
+			///@return The id of the timer.
+			exported id schedule(std::chrono::milliseconds delay, callback action);
+
+			///Cancels a timer that has not yet fired.
+			///@return True if the timer was cancelled, false if it already fired, was already cancelled, or is invalid.
+			exported bool cancel(id timer);
+
+			///Runs every timer that is due at the current time.
+			///@return The number of timers that ran.
+			exported word advance();
+
+			///Runs every timer that is due at the given time.
+			///@param now The current time. Times before the last call are ignored.
+			///@return The number of timers that ran.
+			exported word advance(std::chrono::steady_clock::time_point now);
+
+			///Gets the number of scheduled timers.
+			exported word size() const;
+
+			timer_wheel(const timer_wheel& other) = delete;
+			timer_wheel& operator=(const timer_wheel& other) = delete;
+
+		private:
+			static const word slots = 1 << slot_bits;
+			static const word npos = static_cast<word>(-1);
+
+			struct node {
+				uint64 expires;
+				uint32 generation;
+				word slot;
+				word previous;
+				word next;
+				callback action;
+			};
+
+			std::vector<node> nodes;
+			std::vector<word> free_nodes;
+			std::array<word, slots * levels> heads;
+
+			std::chrono::steady_clock::time_point origin;
+			std::chrono::milliseconds resolution;
+			uint64 current;
+			word count;
+
+			void link(word index);
+			void unlink(word index);
+			void release(word index);
+			void cascade(word level);
+	};
+}
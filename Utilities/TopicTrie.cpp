@@ -0,0 +1,135 @@
+#include "TopicTrie.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace util;
+
+topic_trie::topic_trie() {
+	this->count = 0;
+}
+
+vector<string> topic_trie::split(const string& topic) {
+	vector<string> levels;
+	string::size_type start = 0;
+
+	while (true) {
+		auto end = topic.find('/', start);
+
+		if (end == string::npos) {
+			levels.push_back(topic.substr(start));
+			break;
+		}
+
+		levels.push_back(topic.substr(start, end - start));
+		start = end + 1;
+	}
+
+	return levels;
+}
+
+bool topic_trie::is_valid(const string& pattern) {
+	auto levels = topic_trie::split(pattern);
+
+	for (word i = 0; i < levels.size(); i++) {
+		auto& level = levels[i];
+
+		if (level.size() > 1 && level.find_first_of("+#") != string::npos)
+			return false;
+
+		if (level == "#" && i != levels.size() - 1)
+			return false;
+	}
+
+	return true;
+}
+
+bool topic_trie::insert(const string& pattern, id subscriber) {
+	if (!topic_trie::is_valid(pattern))
+		throw invalid_pattern_exception();
+
+	auto current = &this->root;
+
+	for (auto& i : topic_trie::split(pattern)) {
+		auto& child = current->children[i];
+		if (!child)
+			child = make_unique<node>();
+
+		current = child.get();
+	}
+
+	if (find(current->subscribers.begin(), current->subscribers.end(), subscriber) != current->subscribers.end())
+		return false;
+
+	current->subscribers.push_back(subscriber);
+	this->count++;
+
+	return true;
+}
+
+bool topic_trie::erase(const string& pattern, id subscriber) {
+	auto levels = topic_trie::split(pattern);
+	vector<node*> path;
+	auto current = &this->root;
+
+	for (auto& i : levels) {
+		auto child = current->children.find(i);
+		if (child == current->children.end())
+			return false;
+
+		path.push_back(current);
+		current = child->second.get();
+	}
+
+	auto found = find(current->subscribers.begin(), current->subscribers.end(), subscriber);
+	if (found == current->subscribers.end())
+		return false;
+
+	*found = current->subscribers.back();
+	current->subscribers.pop_back();
+	this->count--;
+
+	//Prune the branch back up to the first node still in use so that churning topics don't leave the trie growing.
+	for (word i = static_cast<word>(path.size()); i > 0; i--) {
+		auto parent = path[i - 1];
+		auto child = parent->children.find(levels[i - 1]);
+
+		if (!child->second->subscribers.empty() || !child->second->children.empty())
+			break;
+
+		parent->children.erase(child);
+	}
+
+	return true;
+}
+
+void topic_trie::match(const string& topic, const callback& action) const {
+	topic_trie::match(this->root, topic_trie::split(topic), 0, action);
+}
+
+void topic_trie::match(const node& current, const vector<string>& levels, word level, const callback& action) {
+	auto rest = current.children.find("#");
+	if (rest != current.children.end())
+		for (auto i : rest->second->subscribers)
+			action(i);
+
+	if (level == levels.size()) {
+		for (auto i : current.subscribers)
+			action(i);
+
+		return;
+	}
+
+	auto exact = current.children.find(levels[level]);
+	if (exact != current.children.end())
+		topic_trie::match(*exact->second, levels, level + 1, action);
+
+	//A topic level that is literally "+" already matched above.
+	auto any = current.children.find("+");
+	if (any != current.children.end() && levels[level] != "+")
+		topic_trie::match(*any->second, levels, level + 1, action);
+}
+
+word topic_trie::size() const {
+	return this->count;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+
+#include "Common.h"
+
+namespace util {
+	///Maps topic patterns to the subscribers of each, and finds every subscriber whose pattern matches a topic.
+	///Topics are levels separated by '/'. In a pattern a '+' level matches any one level and a final '#' level matches
+	///any number of remaining levels, including none, so "prices/+/bid" matches "prices/ABC/bid" and "prices/#" matches "prices".
+	///Matching walks only the branches the topic can reach, so its cost depends on the depth of the topic rather than the number of patterns.
+	///The trie is not thread safe.
+	class topic_trie {
+		public:
+			///Identifies a subscriber.
+			typedef uint64 id;
+			typedef std::function<void(id)> callback;
+
+			class invalid_pattern_exception {};
+
+			exported topic_trie();
+
+			///Subscribes to a pattern.
+			///@param pattern The pattern. A '#' anywhere but the last level, or a wildcard sharing a level with other characters, is invalid.
+			///@param subscriber The subscriber.
+			///@return True if the subscriber was added, false if it was already subscribed to the pattern.
+			///@throws invalid_pattern_exception if the pattern is invalid.
+			exported bool insert(const std::string& pattern, id subscriber);
+
+			///Unsubscribes from a pattern.
+			///@param pattern The pattern exactly as it was subscribed to.
+			///@param subscriber The subscriber.
+			///@return True if the subscriber was removed, false if it was not subscribed to the pattern.
+			exported bool erase(const std::string& pattern, id subscriber);
+
+			///Calls back once for each pattern that matches a topic and each subscriber to it.
+			///A subscriber to several matching patterns is called back for each of them.
+			///@param topic The topic. Wildcards in it are matched literally.
+			///@param action The callback.
+			exported void match(const std::string& topic, const callback& action) const;
+
+			///Gets the number of pattern and subscriber pairs.
+			exported word size() const;
+
+			///Checks whether a pattern is valid.
+			exported static bool is_valid(const std::string& pattern);
+
+			topic_trie(const topic_trie& other) = delete;
+			topic_trie& operator=(const topic_trie& other) = delete;
+
+		private:
+			struct node {
+				std::unordered_map<std::string, std::unique_ptr<node>> children;
+				std::vector<id> subscribers;
+			};
+
+			node root;
+			word count;
+
+			static std::vector<std::string> split(const std::string& topic);
+			static void match(const node& current, const std::vector<std::string>& levels, word level, const callback& action);
+	};
+}
@@ -10,25 +10,27 @@
 #include "Event.h"
 #include "WorkQueue.h"
 #include "Timer.h"
+#include "Misc.h"
 
 namespace util {
-	template<typename T> class work_processor {
+	template<typename T, typename Q = work_queue<T>> class work_processor {
 		static_assert(std::is_move_constructible<T>::value, "typename T must be move constructible.");
 
 		public:
 			event_single<void, word, T&> on_item;
 
 		private:
-			work_queue<T> queue;
+			Q queue;
 			std::atomic<bool> running;
 			std::vector<timer<word>> workers;
+			std::vector<sword> affinity;
 
 			void tick(word worker) {
 				try {
 					T item(std::move(this->queue.dequeue()));
 					this->on_item(worker, item);
 				}
-				catch (typename work_queue<T>::waiter_killed_exception) {
+				catch (typename Q::waiter_killed_exception) {
 					return;
 				}
 			}
@@ -65,6 +67,7 @@ namespace util {
 				this->queue = std::move(other.queue);
 				this->on_item = std::move(other.on_item);
 				this->workers = std::move(other.workers);
+				this->affinity = std::move(other.affinity);
 
 				if (was_running)
 					this->start();
@@ -76,14 +79,28 @@ namespace util {
 				this->queue.enqueue(std::move(item));
 			}
 
+			///Pins each worker to a core, applied on start.
+			///@param cores The core for each worker in order. Workers past the end or given a negative core are not pinned.
+			exported void set_affinity(std::vector<sword> cores) {
+				this->affinity = std::move(cores);
+			}
+
+			exported Q& backlog() {
+				return this->queue;
+			}
+
 			exported void start() {
 				if (this->running)
 					return;
 
 				this->running = true;
 
-				for (auto& i : this->workers)
-					i.start();
+				for (word i = 0; i < this->workers.size(); i++) {
+					this->workers[i].start();
+
+					if (i < this->affinity.size() && this->affinity[i] >= 0)
+						misc::pin_thread(this->workers[i].native_handle(), static_cast<word>(this->affinity[i]));
+				}
 			}
 
 			exported void stop() {